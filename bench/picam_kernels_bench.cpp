@@ -0,0 +1,740 @@
+// Microbenchmarks for the per-frame pixel kernels and message packing
+// JSON output for diffing between releases:
+//   picam_kernels_bench --benchmark_format=json --benchmark_out=kernels.json
+// Chessboard detection runs on a recorded calibration set:
+//   PICAM_CALIBRATION_SET=/path/to/images PICAM_CALIBRATION_PATTERN=9x6 picam_kernels_bench --benchmark_filter=Chessboard
+// The feature frontend replays a recorded sequence of mono .png frames, or a synthetic one:
+//   PICAM_FEATURE_SEQUENCE=/path/to/frames picam_kernels_bench --benchmark_filter=FeatureFrontend
+// Lossless and JPEG sizes depend on the content, a real frame can be used instead of the synthetic one:
+//   PICAM_LOSSLESS_IMAGE=/path/to/frame.png picam_kernels_bench --benchmark_filter='Lossless|Jpeg'
+// The encoded size of noisy frames with and without temporal denoise (needs a dma heap):
+//   picam_kernels_bench --benchmark_filter=DenoiseBitrate
+
+#include <algorithm>
+#include <benchmark/benchmark.h>
+#include <cmath>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <random>
+#include <string>
+#include <sys/mman.h>
+#include <vector>
+
+#include "picam_ros2/const.hpp"
+#include "picam_ros2/calibration.hpp"
+#include "picam_ros2/dma_heaps.hpp"
+#include "picam_ros2/encoder_libav.hpp"
+#include "picam_ros2/feature_frontend.hpp"
+#include "picam_ros2/image_output.hpp"
+#include "picam_ros2/jpeg_encoder.hpp"
+#include "picam_ros2/lossless_codec.hpp"
+#include "picam_ros2/motion_detector.hpp"
+#include "picam_ros2/phase_lock.hpp"
+#include "picam_ros2/raw_unpack.hpp"
+#include "picam_ros2/rectify.hpp"
+#include "picam_ros2/tensor_packer.hpp"
+#include "picam_ros2/temporal_denoise.hpp"
+
+// Capture buffer layout as libcamera hands it out: 64B aligned strides, contiguous planes
+struct TestFrame {
+    uint width, height;
+    std::vector<uint8_t> memory;
+    std::vector<uint8_t *> planes;
+    std::vector<uint> strides;
+
+    TestFrame(uint width, uint height) : width(width), height(height) {
+        uint y_stride = (width + 63) & ~63u;
+        uint c_stride = y_stride / 2;
+        this->strides = { y_stride, c_stride, c_stride };
+        this->memory.resize(y_stride * height + c_stride * height);
+        for (size_t i = 0; i < this->memory.size(); i++)
+            this->memory[i] = static_cast<uint8_t>(i * 7 + (i >> 9));
+        uint8_t *p = this->memory.data();
+        this->planes = { p, p + y_stride * height, p + y_stride * height + c_stride * (height / 2) };
+    }
+};
+
+static void sizeArgs(benchmark::internal::Benchmark *b) {
+    b->Args({ 640, 480 })
+     ->Args({ 1280, 720 })
+     ->Args({ 1920, 1080 })
+     ->Args({ 4056, 3040 })
+     ->Unit(benchmark::kMicrosecond);
+}
+
+static void setPixelCounters(benchmark::State &state, const TestFrame &frame) {
+    state.SetItemsProcessed(state.iterations() * frame.width * frame.height);
+    state.SetBytesProcessed(state.iterations() * frame.width * frame.height * 3 / 2);
+}
+
+static void BM_Yuv420ToRgbCopy(benchmark::State &state) {
+    TestFrame frame(state.range(0), state.range(1));
+    for (auto _ : state) {
+        cv::Mat rgb = yuv420ToRgbCopy(frame.planes, frame.strides, frame.width, frame.height);
+        benchmark::DoNotOptimize(rgb.data);
+    }
+    setPixelCounters(state, frame);
+}
+BENCHMARK(BM_Yuv420ToRgbCopy)->Apply(sizeArgs);
+
+static void BM_Yuv420ToMonoCopy(benchmark::State &state) {
+    TestFrame frame(state.range(0), state.range(1));
+    for (auto _ : state) {
+        cv::Mat mono = yuv420ToMonoCopy(frame.planes, frame.strides, frame.width, frame.height);
+        benchmark::DoNotOptimize(mono.data);
+    }
+    setPixelCounters(state, frame);
+}
+BENCHMARK(BM_Yuv420ToMonoCopy)->Apply(sizeArgs);
+
+// single image outputs
+static void BM_PackImage(benchmark::State &state, uint format) {
+    TestFrame frame(state.range(0), state.range(1));
+    sensor_msgs::msg::Image msg;
+    for (auto _ : state) {
+        packImage(format, COLOR_MATRIX::BT709_LIMITED, frame.planes, frame.strides, frame.width, frame.height, msg);
+        benchmark::DoNotOptimize(msg.data.data());
+        benchmark::ClobberMemory();
+    }
+    setPixelCounters(state, frame);
+}
+BENCHMARK_CAPTURE(BM_PackImage, bgr8, IMAGE_OUTPUT_FORMAT::BGR8)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_PackImage, mono8, IMAGE_OUTPUT_FORMAT::MONO8)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_PackImage, yuv420, IMAGE_OUTPUT_FORMAT::YUV420)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_PackImage, rgb8, IMAGE_OUTPUT_FORMAT::RGB8)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_PackImage, rgba8, IMAGE_OUTPUT_FORMAT::RGBA8)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_PackImage, bgra8, IMAGE_OUTPUT_FORMAT::BGRA8)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_PackImage, nv12, IMAGE_OUTPUT_FORMAT::NV12)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_PackImage, yuv422_yuy2, IMAGE_OUTPUT_FORMAT::YUV422_YUY2)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_PackImage, mono16, IMAGE_OUTPUT_FORMAT::MONO16)->Apply(sizeArgs);
+
+// viewer + tracker outputs of one camera, the RGB family shares one conversion pass
+static void BM_ImageGraph(benchmark::State &state) {
+    TestFrame frame(state.range(0), state.range(1));
+    ImageConversionGraph graph;
+    std::vector<ImageOutput> outputs(3);
+    outputs[0].format = IMAGE_OUTPUT_FORMAT::BGR8;
+    outputs[1].format = IMAGE_OUTPUT_FORMAT::RGBA8;
+    outputs[2].format = IMAGE_OUTPUT_FORMAT::MONO8;
+    std::vector<ImageOutput *> due = { &outputs[0], &outputs[1], &outputs[2] };
+    for (auto _ : state) {
+        graph.pack(due, COLOR_MATRIX::BT709_LIMITED, frame.planes, frame.strides, frame.width, frame.height);
+        benchmark::ClobberMemory();
+    }
+    setPixelCounters(state, frame);
+}
+BENCHMARK(BM_ImageGraph)->Apply(sizeArgs);
+
+// CSI-2 packed sensor rows, NEON vs scalar reference
+typedef void (*RawRow16Fn)(const uint8_t *src, uint16_t *dst, uint width);
+typedef void (*RawRow8Fn)(const uint8_t *src, uint8_t *dst, uint width);
+
+static void BM_UnpackRaw16(benchmark::State &state, RawRow16Fn fn, uint bits) {
+    uint width = state.range(0), height = state.range(1);
+    uint stride = ((width * bits / 8) + 31) & ~31u;
+    std::vector<uint8_t> src((size_t) stride * height, 0xa5);
+    std::vector<uint16_t> dst((size_t) width * height);
+    for (auto _ : state) {
+        for (uint y = 0; y < height; y++)
+            fn(src.data() + (size_t) y * stride, dst.data() + (size_t) y * width, width);
+        benchmark::DoNotOptimize(dst.data());
+    }
+    state.SetItemsProcessed(state.iterations() * width * height);
+}
+
+static void BM_UnpackRaw8(benchmark::State &state, RawRow8Fn fn, uint bits) {
+    uint width = state.range(0), height = state.range(1);
+    uint stride = ((width * bits / 8) + 31) & ~31u;
+    std::vector<uint8_t> src((size_t) stride * height, 0xa5);
+    std::vector<uint8_t> dst((size_t) width * height);
+    for (auto _ : state) {
+        for (uint y = 0; y < height; y++)
+            fn(src.data() + (size_t) y * stride, dst.data() + (size_t) y * width, width);
+        benchmark::DoNotOptimize(dst.data());
+    }
+    state.SetItemsProcessed(state.iterations() * width * height);
+}
+
+BENCHMARK_CAPTURE(BM_UnpackRaw16, raw10, &unpackRaw10Row16, 10)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_UnpackRaw16, raw10_reference, &raw_reference::unpackRaw10Row16, 10)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_UnpackRaw16, raw12, &unpackRaw12Row16, 12)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_UnpackRaw16, raw12_reference, &raw_reference::unpackRaw12Row16, 12)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_UnpackRaw8, raw10, &unpackRaw10Row8, 10)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_UnpackRaw8, raw10_reference, &raw_reference::unpackRaw10Row8, 10)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_UnpackRaw8, raw12, &unpackRaw12Row8, 12)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_UnpackRaw8, raw12_reference, &raw_reference::unpackRaw12Row8, 12)->Apply(sizeArgs);
+
+// temporal denoise over a whole frame, history seeded by the first call
+static void BM_TemporalDenoise(benchmark::State &state) {
+    TestFrame frame(state.range(0), state.range(1));
+    TemporalDenoiser denoiser;
+    denoiser.configure(0.5f, 10);
+    denoiser.process(frame.planes, frame.strides, frame.width, frame.height);
+    for (auto _ : state) {
+        denoiser.process(frame.planes, frame.strides, frame.width, frame.height);
+        benchmark::ClobberMemory();
+    }
+    setPixelCounters(state, frame);
+}
+BENCHMARK(BM_TemporalDenoise)->Apply(sizeArgs);
+
+static void BM_DenoiseRow(benchmark::State &state, void (*fn)(uint8_t *, uint8_t *, uint, uint8_t, uint8_t)) {
+    std::vector<uint8_t> cur(1920), prev(1920);
+    for (uint x = 0; x < 1920; x++) {
+        cur[x] = (uint8_t) (x * 7);
+        prev[x] = (uint8_t) (x * 7 + (x % 5));
+    }
+    for (auto _ : state) {
+        fn(cur.data(), prev.data(), 1920, 8, 10);
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * 1920);
+}
+BENCHMARK_CAPTURE(BM_DenoiseRow, simd, &denoiseRow);
+BENCHMARK_CAPTURE(BM_DenoiseRow, reference, &denoise_reference::denoiseRow);
+
+// Bytes x264 spends on a static scene with sensor noise and a block moving across it, raw and
+// denoised at the given strength; 90 frames from a dma-buf, the way capture frames are encoded
+static void BM_DenoiseBitrate(benchmark::State &state, float strength) {
+    const uint width = state.range(0), height = state.range(1), frames = 90;
+    DmaHeap heap;
+    if (!heap.isValid()) {
+        state.SkipWithError("no dma heap to allocate the frame from");
+        return;
+    }
+    TestFrame layout(width, height);
+    libcamera::UniqueFD fd = heap.alloc("denoise-bitrate", layout.memory.size());
+    if (!fd.isValid()) {
+        state.SkipWithError("dma heap allocation failed");
+        return;
+    }
+    libcamera::FrameBuffer::Plane plane;
+    plane.fd = libcamera::SharedFD(std::move(fd));
+    plane.length = layout.memory.size();
+    libcamera::FrameBuffer buffer({ plane });
+    void *memory = mmap(NULL, layout.memory.size(), PROT_READ | PROT_WRITE, MAP_SHARED, plane.fd.get(), 0);
+    if (memory == MAP_FAILED) {
+        state.SkipWithError("failed to map the dma buffer");
+        return;
+    }
+    MappedBuffer mapped;
+    mapped.memory = static_cast<uint8_t *>(memory);
+    mapped.size = layout.memory.size();
+    for (uint j = 0; j < 3; j++) {
+        mapped.planes.push_back(mapped.memory + (layout.planes[j] - layout.memory.data()));
+        mapped.strides.push_back(layout.strides[j]);
+        mapped.plane_sizes.push_back(layout.strides[j] * (j ? height / 2 : height));
+    }
+
+    EncoderOptions options;
+    options.fps = 30;
+    options.compression = 23;
+    uint64_t bytes = 0;
+    auto on_output = [&bytes](unsigned char *, int size, bool, uint64_t, long, bool) { bytes += size; };
+    auto on_log = [](bool, const std::string &) {};
+    std::mt19937 rng(1);
+    std::normal_distribution<float> noise(0.0f, 3.0f);
+
+    for (auto _ : state) {
+        bytes = 0;
+        EncoderLibAV encoder(options, on_output, on_log, width, height);
+        TemporalDenoiser denoiser;
+        denoiser.configure(strength, 10);
+        int64_t frame_idx = 1;
+        for (uint n = 0; n < frames; n++) {
+            auto frame = std::make_shared<FrameHandle>(nullptr, &buffer, &mapped, (long) n * 33333333, nullptr);
+            {
+                FrameHandle::CpuAccess access(*frame, true);
+                state.PauseTiming();
+                uint block_x = n * 8 % (width - 64);
+                for (uint j = 0; j < 3; j++) {
+                    uint shift = j ? 1 : 0;
+                    for (uint y = 0; y < height >> shift; y++) {
+                        uint8_t *row = mapped.planes[j] + (size_t) y * mapped.strides[j];
+                        for (uint x = 0; x < width >> shift; x++) {
+                            bool block = (x << shift) - block_x < 64 && (y << shift) - height / 3 < 64;
+                            int value = j ? 128 : block ? 220 : 40 + ((x + y) >> 3) % 160;
+                            row[x] = (uint8_t) std::clamp((int) std::lround(value + noise(rng)), 0, 255);
+                        }
+                    }
+                }
+                state.ResumeTiming();
+                denoiser.process(mapped.planes, mapped.strides, width, height);
+            }
+            encoder.encode(frame, &frame_idx, frame->timestamp_ns, false);
+        }
+    }
+    state.counters["bytes_per_frame"] = (double) bytes / frames;
+    state.counters["kbit_per_s"] = bytes * 8.0 / frames * options.fps / 1000.0;
+    munmap(memory, mapped.size);
+}
+BENCHMARK_CAPTURE(BM_DenoiseBitrate, raw, 0.0f)->Args({ 1280, 720 })->Iterations(1)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_DenoiseBitrate, denoised, 0.5f)->Args({ 1280, 720 })->Iterations(1)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_DenoiseBitrate, denoised_strong, 0.8f)->Args({ 1280, 720 })->Iterations(1)->Unit(benchmark::kMillisecond);
+
+// motion detection per frame, against a background seeded by the first call; the
+// item counters are in frame pixels, though only every 8th row is read
+static void BM_MotionDetect(benchmark::State &state) {
+    TestFrame frame(state.range(0), state.range(1));
+    MotionDetector detector;
+    detector.configure(64, 6.0f, 1, 0.6f, 150);
+    detector.process(frame.planes[0], frame.strides[0], frame.width, frame.height);
+    for (auto _ : state) {
+        MotionResult result = detector.process(frame.planes[0], frame.strides[0], frame.width, frame.height);
+        benchmark::DoNotOptimize(result);
+    }
+    state.SetItemsProcessed(state.iterations() * frame.width * frame.height);
+}
+BENCHMARK(BM_MotionDetect)->Apply(sizeArgs);
+
+static void BM_DownsampleRow8(benchmark::State &state, void (*fn)(const uint8_t *, uint8_t *, uint)) {
+    std::vector<uint8_t> src(1920), dst(1920 / 8);
+    for (uint x = 0; x < 1920; x++)
+        src[x] = (uint8_t) (x * 7);
+    for (auto _ : state) {
+        fn(src.data(), dst.data(), 1920 / 8);
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * 1920);
+}
+BENCHMARK_CAPTURE(BM_DownsampleRow8, simd, &downsampleRow8);
+BENCHMARK_CAPTURE(BM_DownsampleRow8, reference, &motion_reference::downsampleRow8);
+
+// capture frame -> letterboxed 640x640 inference tensor in one pass, the item counters
+// are in tensor elements
+static void BM_TensorPack(benchmark::State &state, uint layout, uint dtype) {
+    TestFrame frame(state.range(0), state.range(1));
+    TensorSpec spec;
+    spec.layout = layout;
+    spec.dtype = dtype;
+    spec.quant_zero_point = dtype == TENSOR_DTYPE::INT8 ? -128 : 0;
+    TensorPacker packer;
+    packer.configure(spec, frame.width, frame.height, COLOR_MATRIX::BT601_LIMITED);
+    std::vector<uint8_t> tensor(packer.size());
+    packer.fillPadding(tensor.data());
+    picam_conv::YuvPlanes src = { frame.planes[0], frame.planes[1], frame.planes[2],
+                                  frame.strides[0], frame.strides[1], frame.strides[2], frame.width, frame.height };
+    for (auto _ : state) {
+        packer.pack(src, tensor.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * spec.width * spec.height * 3);
+    state.SetBytesProcessed(state.iterations() * tensor.size());
+}
+BENCHMARK_CAPTURE(BM_TensorPack, nchw_float32, TENSOR_LAYOUT::NCHW, TENSOR_DTYPE::FLOAT32)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_TensorPack, nchw_float16, TENSOR_LAYOUT::NCHW, TENSOR_DTYPE::FLOAT16)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_TensorPack, nhwc_int8, TENSOR_LAYOUT::NHWC, TENSOR_DTYPE::INT8)->Apply(sizeArgs);
+
+static void BM_FloatToHalfRow(benchmark::State &state, void (*fn)(const float *, uint16_t *, uint)) {
+    std::vector<float> src(640 * 3);
+    std::vector<uint16_t> dst(src.size());
+    for (size_t i = 0; i < src.size(); i++)
+        src[i] = (float) i / src.size() * 4.0f - 2.0f;
+    for (auto _ : state) {
+        fn(src.data(), dst.data(), (uint) src.size());
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * src.size());
+}
+BENCHMARK_CAPTURE(BM_FloatToHalfRow, simd, &floatToHalfRow);
+BENCHMARK_CAPTURE(BM_FloatToHalfRow, reference, &tensor_reference::floatToHalfRow);
+
+// BGR frame for the compression benchmarks: PICAM_LOSSLESS_IMAGE scaled to the size, or smooth
+// shading with sensor-like noise
+static cv::Mat losslessTestImage(uint width, uint height) {
+    cv::Mat image;
+    if (const char *file = getenv("PICAM_LOSSLESS_IMAGE"))
+        image = cv::imread(file, cv::IMREAD_COLOR);
+    if (!image.empty()) {
+        cv::resize(image, image, cv::Size(width, height), 0, 0, cv::INTER_AREA);
+        return image;
+    }
+    image.create(height, width, CV_8UC3);
+    for (uint y = 0; y < height; y++) {
+        cv::Vec3b *row = image.ptr<cv::Vec3b>(y);
+        for (uint x = 0; x < width; x++) {
+            double shade = 0.5 + 0.35 * sin(x * 0.006) * cos(y * 0.009);
+            row[x] = cv::Vec3b((uchar) (shade * 180), (uchar) (shade * 220), (uchar) (shade * 200 + (x / 64 + y / 64) % 2 * 30));
+        }
+    }
+    cv::Mat noise(image.size(), CV_16SC3);
+    cv::randn(noise, 0, 2.0);
+    image.convertTo(image, CV_16SC3);
+    image += noise;
+    image.convertTo(image, CV_8UC3);
+    return image;
+}
+
+// compression of one frame on all cores; compare bytes_per_second with BM_PackImage, the
+// uncompressed Image path, and ratio with the link budget
+static void BM_LosslessEncode(benchmark::State &state, const std::string &source) {
+    uint width = state.range(0), height = state.range(1);
+    cv::Mat bgr = losslessTestImage(width, height);
+    cv::Mat data;
+    std::vector<picam_lossless::PlaneView> planes;
+    if (source == "mono8") {
+        cv::cvtColor(bgr, data, cv::COLOR_BGR2GRAY);
+        planes = { { data.data, (uint) data.step, width, height } };
+    } else if (source == "yuv420") {
+        cv::cvtColor(bgr, data, cv::COLOR_BGR2YUV_I420);
+        uint8_t *p = data.data;
+        planes = { { p, width, width, height },
+                   { p + width * height, width / 2, width / 2, height / 2 },
+                   { p + width * height * 5 / 4, width / 2, width / 2, height / 2 } };
+    } else {
+        // RGGB mosaic of 12-bit samples, MSB aligned like the raw output
+        data.create(height, width, CV_16UC1);
+        for (uint y = 0; y < height; y++) {
+            for (uint x = 0; x < width; x++) {
+                uint channel = (y % 2 == 0) ? (x % 2 == 0 ? 2 : 1) : (x % 2 == 0 ? 1 : 0);
+                data.at<uint16_t>(y, x) = (uint16_t) ((bgr.at<cv::Vec3b>(y, x)[channel] * 16 + (x * 7 + y * 13) % 16) << 4);
+            }
+        }
+        planes = { { data.data, (uint) data.step, width, height, 2, 4, 2 } };
+    }
+
+    size_t raw_size = 0;
+    for (auto &plane : planes)
+        raw_size += (size_t) plane.width * plane.height * plane.bytes_per_sample;
+
+    picam_lossless::Encoder encoder(0, 1);
+    std::vector<uint8_t> out;
+    for (auto _ : state) {
+        if (!encoder.encode(planes, out)) {
+            state.SkipWithError("zstd error");
+            return;
+        }
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * raw_size);
+    state.counters["ratio"] = (double) raw_size / out.size();
+    state.counters["threads"] = encoder.threadCount();
+}
+BENCHMARK_CAPTURE(BM_LosslessEncode, mono8, std::string("mono8"))->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_LosslessEncode, yuv420, std::string("yuv420"))->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_LosslessEncode, bayer16, std::string("bayer16"))->Apply(sizeArgs);
+
+static void BM_LosslessDecode(benchmark::State &state) {
+    uint width = state.range(0), height = state.range(1);
+    cv::Mat mono;
+    cv::cvtColor(losslessTestImage(width, height), mono, cv::COLOR_BGR2GRAY);
+    picam_lossless::Encoder encoder(1, 1);
+    std::vector<uint8_t> stream;
+    encoder.encode({ { mono.data, (uint) mono.step, width, height } }, stream);
+    std::vector<picam_lossless::DecodedPlane> planes;
+    for (auto _ : state) {
+        picam_lossless::decode(stream.data(), stream.size(), planes);
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * width * height);
+}
+BENCHMARK(BM_LosslessDecode)->Apply(sizeArgs);
+
+static void BM_LosslessResidualRow(benchmark::State &state, void (*fn)(const uint8_t *, const uint8_t *, uint8_t *, uint, uint)) {
+    std::vector<uint8_t> row(1920), prev_row(1920), dst(1920);
+    for (uint x = 0; x < 1920; x++) {
+        row[x] = (uint8_t) (x / 3 + (x * 7) % 5);
+        prev_row[x] = (uint8_t) (x / 3 + (x * 11) % 3);
+    }
+    for (auto _ : state) {
+        fn(row.data(), prev_row.data(), dst.data(), 1920, 1);
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * 1920);
+}
+BENCHMARK_CAPTURE(BM_LosslessResidualRow, simd, &picam_lossless::residualRow8);
+BENCHMARK_CAPTURE(BM_LosslessResidualRow, reference, &picam_lossless::reference::residualRow8);
+
+// JPEG straight from the capture planes vs the bgr8 path: packImage, then the
+// cv::imencode a compressed_image_transport republisher runs on the Image
+static void BM_JpegEncode(benchmark::State &state, bool from_bgr8, uint threads) {
+    uint width = state.range(0), height = state.range(1);
+    cv::Mat yuv;
+    cv::cvtColor(losslessTestImage(width, height), yuv, cv::COLOR_BGR2YUV_I420);
+    std::vector<uint8_t *> planes = { yuv.data, yuv.data + width * height, yuv.data + width * height * 5 / 4 };
+    std::vector<uint> strides = { width, width / 2, width / 2 };
+
+    JpegEncoder encoder(threads, 80);
+    picam_conv::YuvPlanes src = { planes[0], planes[1], planes[2], strides[0], strides[1], strides[2], width, height };
+    sensor_msgs::msg::Image msg;
+    std::vector<uint8_t> out;
+    for (auto _ : state) {
+        if (from_bgr8) {
+            packImage(IMAGE_OUTPUT_FORMAT::BGR8, COLOR_MATRIX::BT601_LIMITED, planes, strides, width, height, msg);
+            cv::imencode(".jpg", cv::Mat(height, width, CV_8UC3, msg.data.data(), msg.step), out, { cv::IMWRITE_JPEG_QUALITY, 80 });
+        } else if (!encoder.encode(src, JpegRowCoeffs::from<picam_conv::BT601Limited>(), out)) {
+            state.SkipWithError("libjpeg error");
+            return;
+        }
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * width * height);
+    state.counters["bytes"] = out.size();
+    state.counters["threads"] = from_bgr8 ? 1 : encoder.threadCount();
+}
+BENCHMARK_CAPTURE(BM_JpegEncode, yuv420_1_thread, false, 1u)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_JpegEncode, yuv420_all_cores, false, 0u)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_JpegEncode, bgr8_imencode, true, 1u)->Apply(sizeArgs);
+
+// BT.709 limited -> JFIF of one 1080p luma row
+static void BM_JpegLumaRow(benchmark::State &state, void (*fn)(const uint8_t *, const uint8_t *, const uint8_t *, uint8_t *, uint, const JpegRowCoeffs &)) {
+    std::vector<uint8_t> src(1920), cb(960), cr(960), dst(1920);
+    for (uint x = 0; x < 1920; x++)
+        src[x] = (uint8_t) (16 + (x * 7) % 220);
+    for (uint x = 0; x < 960; x++) {
+        cb[x] = (uint8_t) (16 + (x * 5) % 225);
+        cr[x] = (uint8_t) (16 + (x * 3) % 225);
+    }
+    const JpegRowCoeffs k = JpegRowCoeffs::from<picam_conv::BT709Limited>();
+    for (auto _ : state) {
+        fn(src.data(), cb.data(), cr.data(), dst.data(), 1920, k);
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * 1920);
+}
+BENCHMARK_CAPTURE(BM_JpegLumaRow, simd, &jpegLumaRow);
+BENCHMARK_CAPTURE(BM_JpegLumaRow, reference, &jpeg_reference::jpegLumaRow);
+
+// detection time per frame and the reprojection error of the resulting calibration
+static void BM_ChessboardDetect(benchmark::State &state, bool coarse_to_fine, bool use_sb) {
+    const char *set_dir = getenv("PICAM_CALIBRATION_SET");
+    if (!set_dir) {
+        state.SkipWithError("PICAM_CALIBRATION_SET not set");
+        return;
+    }
+    cv::Size pattern_size(9, 6);
+    if (const char *pattern = getenv("PICAM_CALIBRATION_PATTERN"))
+        sscanf(pattern, "%dx%d", &pattern_size.width, &pattern_size.height);
+
+    std::vector<cv::String> files;
+    cv::glob(std::string(set_dir) + "/*.png", files);
+    std::vector<cv::Mat> images;
+    for (auto &file : files)
+        images.push_back(cv::imread(file, cv::IMREAD_GRAYSCALE));
+    if (images.empty()) {
+        state.SkipWithError("No .png images in PICAM_CALIBRATION_SET");
+        return;
+    }
+
+    ChessboardDetectOptions options;
+    options.coarse_to_fine = coarse_to_fine;
+    options.use_sb = use_sb;
+
+    std::vector<std::vector<cv::Point2f>> corner_sets;
+    for (auto _ : state) {
+        corner_sets.clear();
+        for (auto &image : images) {
+            std::vector<cv::Point2f> corners;
+            if (findCalibrationCorners(image, pattern_size, corners, options))
+                corner_sets.push_back(corners);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * images.size());
+    state.counters["found"] = corner_sets.size();
+    state.counters["frames"] = images.size();
+    if (corner_sets.size() >= 3) {
+        cv::Mat camera_matrix, dist_coeffs;
+        state.counters["rms_px"] = calibrateFromCorners(corner_sets, pattern_size, 1.0f, images[0].size(), camera_matrix, dist_coeffs);
+    }
+}
+BENCHMARK_CAPTURE(BM_ChessboardDetect, full_resolution, false, false)->Unit(benchmark::kMillisecond)->Iterations(1);
+BENCHMARK_CAPTURE(BM_ChessboardDetect, coarse_to_fine, true, false)->Unit(benchmark::kMillisecond)->Iterations(1);
+BENCHMARK_CAPTURE(BM_ChessboardDetect, coarse_to_fine_sb, true, true)->Unit(benchmark::kMillisecond)->Iterations(1);
+
+// Recorded frames in name order, or a blurred noise texture panning and rotating about
+// the frame centre by a known step per frame (motion set, for the track error)
+static std::vector<cv::Mat> featureSequence(cv::Mat &motion) {
+    std::vector<cv::Mat> frames;
+    if (const char *sequence_dir = getenv("PICAM_FEATURE_SEQUENCE")) {
+        std::vector<cv::String> files;
+        cv::glob(std::string(sequence_dir) + "/*.png", files);
+        for (auto &file : files)
+            frames.push_back(cv::imread(file, cv::IMREAD_GRAYSCALE));
+        return frames;
+    }
+
+    cv::Mat texture(960, 1280, CV_8UC1);
+    cv::randu(texture, 0, 256);
+    cv::GaussianBlur(texture, texture, cv::Size(0, 0), 2.0);
+    cv::normalize(texture, texture, 0, 255, cv::NORM_MINMAX);
+
+    cv::Mat step = cv::Mat::eye(3, 3, CV_64F);
+    cv::getRotationMatrix2D(cv::Point2f(320.0f, 240.0f), 0.2, 1.0).copyTo(step.rowRange(0, 2));
+    step.at<double>(0, 2) += 1.5;
+    step.at<double>(1, 2) += 0.7;
+    motion = step;
+
+    cv::Mat pose = (cv::Mat_<double>(3, 3) << 1, 0, -320, 0, 1, -240, 0, 0, 1);
+    for (int i = 0; i < 60; i++) {
+        cv::Mat frame;
+        cv::warpAffine(texture, frame, pose.rowRange(0, 2), cv::Size(640, 480));
+        frames.push_back(frame);
+        pose = step * pose;
+    }
+    return frames;
+}
+
+// ms per frame and track quality: share of features carried over to the next frame,
+// mean track age, and on the synthetic sequence the mean tracking error
+static void BM_FeatureFrontend(benchmark::State &state, bool descriptors) {
+    cv::Mat motion;
+    std::vector<cv::Mat> frames = featureSequence(motion);
+    if (frames.size() < 2) {
+        state.SkipWithError("Fewer than 2 .png frames in PICAM_FEATURE_SEQUENCE");
+        return;
+    }
+
+    FeatureOptions options;
+    options.descriptors = descriptors;
+    FeatureFrontend frontend(options);
+
+    double carried = 0.0, offered = 0.0, ages = 0.0, features_total = 0.0, error_sum = 0.0, errors = 0.0;
+    std::map<uint64_t, cv::Point2f> previous;
+    for (auto _ : state) {
+        frontend.reset();
+        previous.clear();
+        for (auto &frame : frames) {
+            auto &features = frontend.process(frame);
+            if (!previous.empty()) {
+                carried += frontend.tracked();
+                offered += previous.size();
+            }
+            std::map<uint64_t, cv::Point2f> current;
+            for (auto &feature : features) {
+                ages += feature.age;
+                current[feature.id] = feature.point;
+                auto before = previous.find(feature.id);
+                if (!motion.empty() && feature.age > 0 && before != previous.end()) {
+                    cv::Mat expected = motion * (cv::Mat_<double>(3, 1) << before->second.x, before->second.y, 1.0);
+                    error_sum += cv::norm(cv::Point2d(expected.at<double>(0), expected.at<double>(1)) - cv::Point2d(feature.point));
+                    errors++;
+                }
+            }
+            features_total += features.size();
+            previous.swap(current);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * frames.size());
+    state.counters["frame_time"] = benchmark::Counter(state.iterations() * frames.size(), benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+    state.counters["features"] = features_total / (state.iterations() * frames.size());
+    state.counters["tracked_ratio"] = offered > 0.0 ? carried / offered : 0.0;
+    state.counters["mean_age"] = features_total > 0.0 ? ages / features_total : 0.0;
+    if (errors > 0.0)
+        state.counters["track_error_px"] = error_sum / errors;
+}
+BENCHMARK_CAPTURE(BM_FeatureFrontend, klt, false)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_FeatureFrontend, klt_orb, true)->Unit(benchmark::kMillisecond);
+
+// rectified outputs, calibration of a typical wide lens
+static void testLens(const TestFrame &frame, cv::Mat &camera_matrix, cv::Mat &dist_coeffs) {
+    double f = frame.width * 0.6;
+    camera_matrix = (cv::Mat_<double>(3, 3) << f, 0, frame.width / 2.0, 0, f, frame.height / 2.0, 0, 0, 1);
+    dist_coeffs = (cv::Mat_<double>(1, 5) << -0.3, 0.1, 0.0, 0.0, -0.02);
+}
+
+static std::shared_ptr<RectifyMaps> testRectifyMaps(const TestFrame &frame) {
+    cv::Mat camera_matrix, dist_coeffs;
+    testLens(frame, camera_matrix, dist_coeffs);
+    return RectifyMaps::build(camera_matrix, dist_coeffs, cv::Size(frame.width, frame.height));
+}
+
+static void BM_Rectify(benchmark::State &state) {
+    TestFrame frame(state.range(0), state.range(1)), rectified(state.range(0), state.range(1));
+    auto maps = testRectifyMaps(frame);
+    for (auto _ : state) {
+        maps->remap(frame.planes, frame.strides, rectified.planes, rectified.strides);
+        benchmark::DoNotOptimize(rectified.memory.data());
+        benchmark::ClobberMemory();
+    }
+    setPixelCounters(state, frame);
+}
+BENCHMARK(BM_Rectify)->Apply(sizeArgs);
+
+// what each consumer pays without the in-node output: float maps + remap of a bgr8 copy
+static void BM_RectifyConsumer(benchmark::State &state) {
+    TestFrame frame(state.range(0), state.range(1));
+    sensor_msgs::msg::Image msg;
+    packImage(IMAGE_OUTPUT_FORMAT::BGR8, COLOR_MATRIX::BT709_LIMITED, frame.planes, frame.strides, frame.width, frame.height, msg);
+    cv::Mat bgr(frame.height, frame.width, CV_8UC3, msg.data.data(), msg.step), rectified;
+    cv::Mat camera_matrix, dist_coeffs, map_x, map_y;
+    testLens(frame, camera_matrix, dist_coeffs);
+    cv::initUndistortRectifyMap(camera_matrix, dist_coeffs, cv::Mat(), camera_matrix, bgr.size(), CV_32FC1, map_x, map_y);
+    for (auto _ : state) {
+        cv::remap(bgr, rectified, map_x, map_y, cv::INTER_LINEAR);
+        benchmark::DoNotOptimize(rectified.data);
+    }
+    setPixelCounters(state, frame);
+}
+BENCHMARK(BM_RectifyConsumer)->Apply(sizeArgs);
+
+static void BM_RectifyMapsBuild(benchmark::State &state) {
+    TestFrame frame(state.range(0), state.range(1));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(testRectifyMaps(frame).get());
+}
+BENCHMARK(BM_RectifyMapsBuild)->Apply(sizeArgs)->Unit(benchmark::kMillisecond);
+
+// Free running sensor on a simulated clock: a requested frame duration takes effect
+// `delay` frames later, the sensor clock runs `skew` off the nominal one
+struct SimulatedSensor {
+    double timestamp_ns, skew;
+    std::deque<double> durations; // requested, not applied yet
+
+    SimulatedSensor(double start_ns, double period_ns, double skew, uint delay)
+        : timestamp_ns(start_ns), skew(skew), durations(delay, period_ns) {}
+
+    uint64_t frame(double requested_duration_ns) {
+        uint64_t timestamp = (uint64_t) this->timestamp_ns;
+        this->durations.push_back(requested_duration_ns);
+        this->timestamp_ns += this->durations.front() * (1.0 + this->skew);
+        this->durations.pop_front();
+        return timestamp;
+    }
+};
+
+// convergence of the phase lock loop from half a frame apart at 30 fps; time is the
+// controller cost, frames_to_lock & residual_us the loop quality
+static void BM_PhaseLock(benchmark::State &state) {
+    const double period_ns = 1e9 / 30.0;
+    const uint delay = state.range(0);
+    double frames_to_lock = 0.0, residual_us = 0.0;
+    for (auto _ : state) {
+        SimulatedSensor leader(0.0, period_ns, 0.0, delay), follower(period_ns / 2, period_ns, 50e-6, delay);
+        PhaseLockOptions options;
+        options.control_delay = delay;
+        PhaseLockController controller(options);
+        PhaseLockGroup group;
+        int64_t duration = (int64_t) period_ns;
+        int locked_at = -1;
+        for (int n = 0; n < 600; n++) {
+            group.leaderFrame(leader.frame(period_ns));
+            uint64_t follower_timestamp = follower.frame(duration);
+            uint64_t leader_timestamp;
+            int64_t leader_period;
+            if (group.leaderReference(leader_timestamp, leader_period))
+                duration = controller.update(follower_timestamp, leader_timestamp, leader_period);
+            if (controller.locked() && locked_at < 0)
+                locked_at = n;
+        }
+        frames_to_lock = locked_at;
+        residual_us = std::abs(controller.phaseError()) / 1000.0;
+    }
+    state.counters["frames_to_lock"] = frames_to_lock;
+    state.counters["residual_us"] = residual_us;
+}
+BENCHMARK(BM_PhaseLock)->Arg(2)->Arg(6);
+
+static void BM_CameraInfoStamp(benchmark::State &state) {
+    sensor_msgs::msg::CameraInfo info;
+    uint64_t timestamp_ns = 1700000000123456789ull;
+    for (auto _ : state) {
+        setCurrentStamp(&info.header.stamp, timestamp_ns);
+        timestamp_ns += 33333333;
+        benchmark::DoNotOptimize(info.header.stamp);
+    }
+}
+BENCHMARK(BM_CameraInfoStamp);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,50 @@
+// Reads frames published by picam_ros2 into shared memory (publish_shm: True)
+// Usage: picam_shm_reader_example <camera_location>
+
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include "picam_ros2/shm_frame_ring.hpp"
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <camera_location>" << std::endl;
+        return 1;
+    }
+
+    picam_shm::FrameReader reader(picam_shm::ringName(std::stoi(argv[1])));
+    if (!reader.isOpen()) {
+        std::cerr << "Shared memory ring not found, is publish_shm enabled?" << std::endl;
+        return 1;
+    }
+    std::cout << "Reading " << reader.ringHeader()->width << "x" << reader.ringHeader()->height << " "
+              << reader.ringHeader()->format << " frames" << std::endl;
+
+    uint64_t last_frame = 0;
+    uint64_t skipped = 0;
+    while (true) {
+        uint64_t mean = 0;
+        picam_shm::FrameView frame;
+        bool ok = reader.readLatest(last_frame, [&](const picam_shm::FrameView &view) {
+            // zero-copy: average luma straight from the ring
+            uint64_t sum = 0;
+            for (uint32_t y = 0; y < view.height; y += 8)
+                for (uint32_t x = 0; x < view.width; x += 8)
+                    sum += view.planes[0][y * view.strides[0] + x];
+            mean = sum / ((view.height / 8) * (view.width / 8));
+            frame = view;
+        });
+
+        if (!ok) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            continue;
+        }
+        if (last_frame != 0)
+            skipped += frame.frame_number - last_frame - 1;
+        last_frame = frame.frame_number;
+        std::cout << "Frame " << frame.frame_number << " seq=" << frame.sequence << " ts=" << frame.sensor_timestamp_ns
+                  << " mean luma=" << mean << " skipped=" << skipped << std::endl;
+    }
+    return 0;
+}
@@ -11,9 +11,32 @@ extern "C" {
 #include <opencv2/opencv.hpp>
 #include "sensor_msgs/msg/camera_info.hpp"
 
-cv::Mat yuv420ToRgbCopy(const std::vector<AVBufferRef *>& planes, const std::vector<unsigned int>& strides, uint width, uint height);
-void calibrateCamera(const std::vector<cv::Mat>& images, cv::Size pattern_size, float square_size, sensor_msgs::msg::CameraInfo& camera_info);
-cv::Mat yuv420ToMonoCopy(const std::vector<AVBufferRef *>& planes, const std::vector<unsigned int>& strides, uint width, uint height);
+cv::Mat yuv420ToRgbCopy(const std::vector<uint8_t *>& planes, const std::vector<unsigned int>& strides, uint width, uint height);
+// Chessboard search on a downscaled pyramid level, corners refined at full resolution
+struct ChessboardDetectOptions {
+    bool use_sb = false; // findChessboardCornersSB instead of the classic detector
+    uint max_detect_width = 1280; // pyramid level the board is searched on
+    double min_sharpness = 0.0; // Laplacian variance on the detection level, blurrier frames are rejected
+    bool coarse_to_fine = true; // false = classic full resolution search (reference)
+};
+
+// false if the frame is too blurry or no board was found; sharpness reported if not null
+bool findCalibrationCorners(const cv::Mat& mono, cv::Size pattern_size, std::vector<cv::Point2f>& corners,
+                            const ChessboardDetectOptions& options = ChessboardDetectOptions(), double *sharpness = nullptr);
+double calibrateFromCorners(const std::vector<std::vector<cv::Point2f>>& image_points, cv::Size pattern_size, float square_size,
+                            cv::Size image_size, cv::Mat& camera_matrix, cv::Mat& dist_coeffs); // returns RMS reprojection error
+void applyCalibration(const cv::Mat& camera_matrix, const cv::Mat& dist_coeffs, sensor_msgs::msg::CameraInfo& camera_info);
+cv::Mat yuv420ToMonoCopy(const std::vector<uint8_t *>& planes, const std::vector<unsigned int>& strides, uint width, uint height);
 
 bool readCalibration(std::string file_name, sensor_msgs::msg::CameraInfo& camera_info, std::string camera_model, int width, int height);
-bool writeCalibration(sensor_msgs::msg::CameraInfo& camera_info, std::string camera_model, int width, int height, std::string file_name);
\ No newline at end of file
+bool writeCalibration(sensor_msgs::msg::CameraInfo& camera_info, std::string camera_model, int width, int height, std::string file_name);
+
+// Intrinsics of both cameras of a stereo pair plus the pose of the right camera in the left one's frame (as from cv::stereoCalibrate)
+struct StereoCalibration {
+    cv::Size size;
+    cv::Mat left_camera_matrix, left_dist_coeffs;
+    cv::Mat right_camera_matrix, right_dist_coeffs;
+    cv::Mat rotation, translation; // 3x3, 3x1 in metres
+};
+
+bool readStereoCalibration(std::string file_name, StereoCalibration& calibration);
\ No newline at end of file
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "calibration.hpp"
+
+// Camera calibration off the capture thread. Sampled frames are queued, a small
+// thread pool finds the chessboard corners in each one as it arrives and keeps only
+// the corner sets; once enough boards were found the solve runs on a worker too.
+class CalibrationWorker {
+    public:
+        struct Result {
+            cv::Mat camera_matrix;
+            cv::Mat dist_coeffs;
+            double rms;
+        };
+
+        CalibrationWorker(cv::Size image_size, cv::Size pattern_size, float square_size, uint boards_needed,
+                          const ChessboardDetectOptions &detect_options, uint num_threads,
+                          std::function<void(const Result &)> on_result, std::function<void(const std::string &)> on_progress);
+        ~CalibrationWorker();
+
+        // Takes ownership of a mono frame, false when the workers are still busy (frame skipped)
+        bool submit(cv::Mat mono);
+
+        uint boardsFound();
+        bool done() const { return this->finished; }
+
+    private:
+        void workerLoop();
+        void detect(const cv::Mat &mono);
+        void solve();
+        std::string progressReport(bool found, bool blurry, double sharpness);
+
+        cv::Size image_size;
+        cv::Size pattern_size;
+        float square_size;
+        uint boards_needed;
+        ChessboardDetectOptions detect_options;
+
+        std::function<void(const Result &)> on_result;
+        std::function<void(const std::string &)> on_progress;
+
+        std::vector<std::thread> threads;
+        std::mutex queue_mutex;
+        std::condition_variable queue_cond;
+        std::deque<cv::Mat> queue;
+        uint max_queued;
+        bool stopping = false;
+
+        std::mutex corners_mutex;
+        std::vector<std::vector<cv::Point2f>> corner_sets;
+        uint frames_rejected = 0;
+        uint frames_blurry = 0;
+        static constexpr int COVERAGE_GRID = 4;
+        std::vector<bool> coverage; // image cells touched by any board corner
+        float min_board_area = 1.0f, max_board_area = 0.0f; // fraction of the frame
+        bool solving = false;
+        std::atomic<bool> finished { false };
+};
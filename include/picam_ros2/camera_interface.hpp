@@ -1,8 +1,10 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
 #include <future>
 #include <memory>
+#include <optional>
 #include <string>
 #include <fmt/core.h>
 
@@ -16,14 +18,37 @@
 
 #include "encoder_libav.hpp"
 #include "encoder_hw.hpp"
+#include "frame_handle.hpp"
+#include "shm_frame_writer.hpp"
+#include "jpeg_encoder.hpp"
+#include "lossless_codec.hpp"
 
 #include "dma_heaps.hpp"
+#include "dma_buffer_pool.hpp"
+#include "image_output.hpp"
+#include "rectify.hpp"
+#include "raw_unpack.hpp"
+#include "temporal_denoise.hpp"
+#include "motion_detector.hpp"
+#include "fiducial_detector.hpp"
+#include "feature_worker.hpp"
+#include "tensor_packer.hpp"
+#include "calibration_worker.hpp"
+#include "stereo_pipeline.hpp"
+#include "composite_mixer.hpp"
+#include "phase_lock.hpp"
 #include <linux/dma-buf.h>
 
 #include "rclcpp/rclcpp.hpp"
 #include "ffmpeg_image_transport_msgs/msg/ffmpeg_packet.hpp"
+#include "std_msgs/msg/string.hpp"
 #include "sensor_msgs/msg/image.hpp"
+#include "sensor_msgs/msg/compressed_image.hpp"
 #include "sensor_msgs/msg/camera_info.hpp"
+#include "sensor_msgs/msg/region_of_interest.hpp"
+#include "picam_ros2/msg/fiducial_marker_array.hpp"
+#include "picam_ros2/msg/feature_array.hpp"
+#include "picam_ros2/msg/tensor.hpp"
 
 #include "std_srvs/srv/set_bool.hpp"
 #include "std_srvs/srv/trigger.hpp"
@@ -37,9 +62,21 @@ class CameraInterface {
         CameraInterface(std::shared_ptr<Camera> camera, int location, int rotation, std::string model, std::shared_ptr<PicamROS2> node);
         void start();
         void stop();
+        template<typename T>
+        void declareParameter(const std::string &name, const T &default_value) {
+            if (!this->node->has_parameter(name)) // declared already when restarting
+                this->node->declare_parameter(name, default_value);
+        }
         void publishH264(unsigned char *data, int size, bool keyframe, uint64_t pts, long timestamp_ns, bool log);
-        void publishImage(const std::vector<AVBufferRef *>& planes, const std::vector<unsigned int>& strides, uint buffer_size, long timestamp_ns, bool log);
+        void publishImages(FrameHandle &frame, uint64_t tick, long timestamp_ns, bool log);
+        void publishRaw(Request *request, FrameBuffer *buffer, long timestamp_ns, bool log);
         void publishCameraInfo(long timestamp_ns, bool log);
+        void publishTensor(FrameHandle &frame, long timestamp_ns, bool log);
+        void publishLossless(FrameHandle &frame, long timestamp_ns, bool log);
+        void publishJpeg(FrameHandle &frame, long timestamp_ns, bool log);
+        void attachStereo(std::shared_ptr<StereoPipeline> pipeline, StereoPipeline::Side side); // before start()
+        void attachComposite(std::shared_ptr<CompositeMixer> mixer, uint tile); // before start()
+        int getLocation() const { return this->location; }
 
         ~CameraInterface();
 
@@ -49,7 +86,10 @@ class CameraInterface {
         uint bit_rate;
         uint compression;
         uint buffer_count;
-        int bytes_per_pixel;
+        bool buffer_count_auto = false;
+        bool roi_enabled = false;
+        std::string hw_encoder_device; // "" = first M2M encoder of hw_encoder_codec found
+        std::string hw_encoder_codec; // h264, hevc or fwht, see V4L2_CODECS
 
         template<typename... Args>
         void log(const Args&... args) {
@@ -78,15 +118,118 @@ class CameraInterface {
 
         bool publish_h264;
         bool publish_image;
-        uint image_output_format;
+        std::vector<ImageOutput> image_outputs;
+        ImageConversionGraph image_graph;
+        std::shared_ptr<RectifyMaps> rectify_maps; // swapped atomically by the calibration workers
+        std::string rectify_cache_file;
+        std::vector<uint8_t> rectified_frame; // remapped YUV420 planes for the rectified outputs
+        std::vector<uint8_t *> rectified_planes;
+        std::vector<uint> rectified_strides;
+        bool hasRectifiedOutputs() const;
+        void updateRectifyMaps(bool use_cache);
+        uint color_matrix;
+        bool denoise;
+        double denoise_min_gain;
+        TemporalDenoiser denoiser;
+        bool motion_detection;
+        uint motion_cell_size;
+        double motion_threshold;
+        uint motion_min_cells;
+        double motion_scene_change;
+        double motion_background_sec;
+        long motion_hold_ns; // outputs stay open this long after the last motion
+        double h264_keepalive_rate; // Hz while static, 0 = not gated
+        OutputSchedule h264_keepalive_schedule;
+        bool publish_motion;
+        std::string motion_topic;
+        rclcpp::Publisher<sensor_msgs::msg::Image>::SharedPtr motion_publisher;
+        sensor_msgs::msg::Image out_motion_msg;
+        MotionDetector motion_detector;
+        bool motion_active = true; // moving within motion_hold_ns
+        bool motion_changed = true; // motion started or scene change, this frame
+        long last_motion_ns = 0;
+        bool motion_mask_dirty = false; // last published mask had moving cells
+        void updateMotion(const MappedBuffer &mapped, long ns_since_epoch, long timestamp_ns, bool log);
+        bool outputDue(const OutputSchedule &schedule, uint gate, uint64_t tick) const;
+        bool imageOutputDue(const ImageOutput &output, uint64_t tick) const;
+        bool h264Due(uint64_t tick) const;
+        bool publish_fiducials;
+        FiducialOptions fiducial_options;
+        std::string fiducial_topic;
+        std::unique_ptr<FiducialWorker> fiducial_worker;
+        rclcpp::Publisher<picam_ros2::msg::FiducialMarkerArray>::SharedPtr fiducial_publisher;
+        void fiducialResult(const std::vector<FiducialDetection> &detections, long timestamp_ns, bool full_search);
+        void updateFiducialCameraModel();
+        bool publish_features;
+        FeatureOptions feature_options;
+        std::string features_topic;
+        std::unique_ptr<FeatureWorker> feature_worker;
+        rclcpp::Publisher<picam_ros2::msg::FeatureArray>::SharedPtr features_publisher;
+        void featuresResult(const FeatureFrontend &frontend, const std::vector<Feature> &features, long timestamp_ns, uint64_t sensor_timestamp_ns);
+        bool publish_tensor;
+        TensorSpec tensor_spec;
+        double tensor_rate; // Hz, 0 = every frame
+        uint tensor_gate = OUTPUT_GATE::ALWAYS;
+        OutputSchedule tensor_schedule;
+        TensorPacker tensor_packer;
+        std::string tensor_topic;
+        rclcpp::Publisher<picam_ros2::msg::Tensor>::SharedPtr tensor_publisher;
+        picam_ros2::msg::Tensor out_tensor_msg;
+        uint parseTensorOption(const std::map<uint, std::string> &names, const std::string &param, const std::string &value);
+        bool publish_raw;
+        bool raw_output_16bit;
+        double raw_rate; // Hz, 0 = every frame
+        uint raw_width, raw_height;
+        RawFormat raw_format;
+        Stream *raw_stream = nullptr;
+        OutputSchedule raw_schedule;
+        bool raw_lossless; // CompressedImage instead of Image
+        bool publish_lossless;
+        uint lossless_format; // mono8 or yuv420
+        double lossless_rate; // Hz, 0 = every frame
+        uint lossless_gate = OUTPUT_GATE::ALWAYS;
+        OutputSchedule lossless_schedule;
+        int lossless_level;
+        uint lossless_threads; // 0 = one per core
+        std::unique_ptr<picam_lossless::Encoder> lossless_encoder; // shared by the capture and raw outputs
+        bool encodeLossless(const std::vector<picam_lossless::PlaneView> &planes, sensor_msgs::msg::CompressedImage &msg, bool log);
+        bool publish_jpeg;
+        int jpeg_quality;
+        double jpeg_rate; // Hz, 0 = every frame
+        uint jpeg_gate = OUTPUT_GATE::ALWAYS;
+        OutputSchedule jpeg_schedule;
+        uint jpeg_threads; // 0 = one per core
+        std::unique_ptr<JpegEncoder> jpeg_encoder;
+        JpegRowCoeffs jpeg_coeffs; // capture colour matrix -> JFIF
         bool publish_info;
+        double info_rate; // Hz, 0 = every frame
+        OutputSchedule info_schedule;
+        bool publish_shm;
+        uint shm_slots;
+        std::unique_ptr<ShmFrameWriter> shm_writer;
+        std::shared_ptr<StereoPipeline> stereo;
+        StereoPipeline::Side stereo_side;
+        std::shared_ptr<CompositeMixer> composite;
+        uint composite_tile; // 0 hosts the composite's encoder
+        void encodeComposite(FramePtr frame, long timestamp_ns);
+        std::string phase_lock_group_name; // "" = free running
+        bool phase_lock_leader;
+        double phase_lock_tolerance_us;
+        std::shared_ptr<PhaseLockGroup> phase_lock_group;
+        PhaseLockController phase_lock;
+        std::atomic<int64_t> phase_lock_duration_ns { 0 }; // follower's next frame duration, 0 = unchanged
+        bool phase_lock_reported = false;
+        void updatePhaseLock(uint64_t sensor_timestamp_ns);
 
         std::string h264_topic;
         std::string info_topic;
-        std::string image_topic;
+        std::string raw_topic;
+        std::string lossless_topic;
+        std::string jpeg_topic;
 
-        bool running = false;
-        Encoder *encoder;
+        std::atomic<bool> running { false }; // read from the encoder threads when frames are released
+        Encoder *encoder = nullptr;
+        std::mutex encoder_mutex; // a composite host's encoder is fed from the mixer thread
 
         std::vector<std::unique_ptr<Request>> capture_requests;
         
@@ -94,12 +237,19 @@ class CameraInterface {
         int64_t frame_idx = 0;
         
         rclcpp::Publisher<ffmpeg_image_transport_msgs::msg::FFMPEGPacket>::SharedPtr h264_publisher;
-        rclcpp::Publisher<sensor_msgs::msg::Image>::SharedPtr image_publisher;
         rclcpp::Publisher<sensor_msgs::msg::CameraInfo>::SharedPtr info_publisher;
         
         ffmpeg_image_transport_msgs::msg::FFMPEGPacket out_h264_msg;
-        sensor_msgs::msg::Image out_image_msg;
         sensor_msgs::msg::CameraInfo out_info_msg;
+        std::mutex info_mutex; // out_info_msg is replaced by the calibration workers
+        rclcpp::Publisher<sensor_msgs::msg::Image>::SharedPtr raw_publisher;
+        sensor_msgs::msg::Image out_raw_msg;
+        rclcpp::Publisher<sensor_msgs::msg::CompressedImage>::SharedPtr lossless_publisher;
+        sensor_msgs::msg::CompressedImage out_lossless_msg;
+        rclcpp::Publisher<sensor_msgs::msg::CompressedImage>::SharedPtr raw_lossless_publisher;
+        sensor_msgs::msg::CompressedImage out_raw_lossless_msg;
+        rclcpp::Publisher<sensor_msgs::msg::CompressedImage>::SharedPtr jpeg_publisher;
+        sensor_msgs::msg::CompressedImage out_jpeg_msg;
 
         // uint out_buffer_count;
 
@@ -140,18 +290,27 @@ class CameraInterface {
         // AVPacket *packet;
 
 
-        DmaHeap dma_heap;
+        DmaBufferPool buffer_pool;
+        DmaBufferPool raw_buffer_pool; // separate, so restarts don't trade raw and processed buffers
+        static constexpr uint MIN_AUTO_BUFFER_COUNT = 3;
+        static constexpr uint MAX_AUTO_BUFFER_COUNT = 12;
+        DmaSyncStats dma_sync_stats;
+        std::atomic<uint> frames_in_flight { 0 }; // completed requests not yet re-queued
+        int64_t last_sequence = -1;
+        OutputClock output_clock; // decimated outputs are due on its ticks
         // std::map<Stream *, std::vector<std::unique_ptr<FrameBuffer>>> frame_buffers;
         // std::map<FrameBuffer *, std::vector<AVBufferRef *>> mapped_buffers;
         // std::map<FrameBuffer *, std::vector<uint>> mapped_buffer_strides;
         std::map<Stream *, std::vector<std::unique_ptr<FrameBuffer>>> capture_frame_buffers;
-        std::map<FrameBuffer *, std::vector<AVBufferRef *>> mapped_capture_buffers;
-        std::map<FrameBuffer *, std::vector<uint>> mapped_capture_buffer_strides;
+        std::map<FrameBuffer *, MappedBuffer> mapped_capture_buffers;
 
-        bool enable_calibration, calibration_running = false;
+        bool enable_calibration;
+        std::atomic<bool> calibration_running { false }; // cleared by the calibration workers
         void calibration_toggle(const std::shared_ptr<std_srvs::srv::SetBool::Request> request, std::shared_ptr<std_srvs::srv::SetBool::Response> response);
         void calibration_sample_frame(const std::shared_ptr<std_srvs::srv::Trigger::Request> request, std::shared_ptr<std_srvs::srv::Trigger::Response> response);
         void calibration_save(const std::shared_ptr<std_srvs::srv::Trigger::Request> request, std::shared_ptr<std_srvs::srv::Trigger::Response> response);
+        void restart(const std::shared_ptr<std_srvs::srv::Trigger::Request> request, std::shared_ptr<std_srvs::srv::Trigger::Response> response);
+        std::shared_ptr<rclcpp::Service<std_srvs::srv::Trigger>> srv_restart;
         std::shared_ptr<rclcpp::Service<std_srvs::srv::SetBool>> srv_calibration_toggle;
         std::shared_ptr<rclcpp::Service<std_srvs::srv::Trigger>> srv_calibration_sample_frame;
         std::shared_ptr<rclcpp::Service<std_srvs::srv::Trigger>> srv_calibration_save;
@@ -159,18 +318,40 @@ class CameraInterface {
         uint calibration_frames_needed;
         long last_calibration_frame_taken_ns = 0;
         const uint calibration_min_frame_delay_ns = 1000;
-        std::vector<cv::Mat> calibration_frames;
+        uint calibration_frames_taken = 0;
+        uint calibration_threads;
+        ChessboardDetectOptions calibration_detect_options;
+        std::shared_ptr<CalibrationWorker> calibration_worker; // std::atomic_load/store only, the capture thread holds a copy while submitting
+        std::string calibration_progress_topic;
+        rclcpp::Publisher<std_msgs::msg::String>::SharedPtr calibration_progress_publisher;
+        void calibrationProgress(const std::string &message);
+        void calibrationResult(const CalibrationWorker::Result &result);
+        void retireCalibrationWorker(std::shared_ptr<CalibrationWorker> worker);
         cv::Size calibration_pattern_size;
         float calibration_square_size;
         std::string calibration_files_base_path;
         std::string calibration_file;
 
+        std::vector<EncoderROI> roi_static; // from config, in pixels
+        std::mutex roi_dynamic_mutex;
+        std::vector<std::pair<EncoderROI, long>> roi_dynamic; // received via roi_topic, with receive time
+        float roi_qoffset;
+        float roi_background_qoffset;
+        long roi_timeout_ns;
+        std::string roi_topic;
+        rclcpp::Subscription<sensor_msgs::msg::RegionOfInterest>::SharedPtr roi_subscription;
+        void roiCallback(const sensor_msgs::msg::RegionOfInterest::SharedPtr msg);
+        void updateEncoderROIs(long now_ns);
+
         StreamConfiguration *streamConfig;
         void readConfig();
+        uint parseImageFormat(const std::string &name);
+        uint parseOutputGate(const std::string &name);
         // void eventLoop();
         // bool initializeSWEncoder();
         // bool initializeHWEncoder();
         // void frameRequestComplete(Request *request);
         void captureRequestComplete(Request *request);
+        void releaseRequest(Request *request);
         // int resetEncoder(const char* device_path);
 };
\ No newline at end of file
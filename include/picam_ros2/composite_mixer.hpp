@@ -0,0 +1,117 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fmt/core.h>
+
+#include <libcamera/libcamera.h>
+
+#include "rclcpp/rclcpp.hpp"
+#include "picam_ros2/msg/composite_layout.hpp"
+
+#include "picam_ros2.hpp"
+#include "frame_handle.hpp"
+#include "dma_buffer_pool.hpp"
+#include "spsc_ring.hpp"
+
+struct CompositeConfig {
+    std::string name;
+    std::vector<int> locations; // tile order, the first camera hosts the encoder and paces the stream
+    bool grid; // 2x2 style grid, otherwise side by side
+    uint tile_width, tile_height; // frames are scaled to fit, letterboxed
+    long sync_tolerance_ns; // max sensor timestamp difference to the first camera's frame
+    long max_wait_ns; // how long a frame of the first camera waits for the others
+    uint buffer_count; // composite frames, shared by the mixer and the encoder
+    std::string frame_id;
+    std::string h264_topic;
+    std::string layout_topic;
+};
+
+// Tiles the frames of several cameras into one YUV420 frame for a single encoder. Each
+// camera hands its frames over through a lock-free ring; a mixer thread matches them by
+// sensor timestamp to the first camera's frame, copies (or scales) them into a pooled
+// dma buffer and passes it to the encode callback, then publishes the tile layout.
+class CompositeMixer {
+    public:
+        static std::string GetConfigPrefix(const std::string &name) {
+            return fmt::format("/composite_{}.", name);
+        }
+        static CompositeConfig readConfig(std::shared_ptr<PicamROS2> node, const std::string &name);
+
+        // throws std::runtime_error when the dma buffers can't be allocated
+        CompositeMixer(std::shared_ptr<PicamROS2> node, const CompositeConfig &config);
+        ~CompositeMixer();
+
+        uint width() const { return this->composite_width; }
+        uint height() const { return this->composite_height; }
+        const CompositeConfig &getConfig() const { return this->config; }
+
+        // called by the first camera when it (re)starts its encoder
+        void setEncodeCallback(std::function<void(FramePtr frame, long timestamp_ns)> encode);
+        void setTileFrameId(uint tile, const std::string &frame_id);
+
+        // A stopping camera detaches its tile, which blocks until the mixer has let go of all
+        // of its frames; the tile shows black until the camera attaches it again
+        void attachTile(uint tile);
+        void detachTile(uint tile);
+
+        // Capture thread side, never blocks; the frame is dropped when the mixer falls behind
+        void pushFrame(uint tile, FramePtr frame, uint width, uint height, uint64_t sensor_timestamp_ns);
+
+    private:
+        struct TileFrame {
+            FramePtr frame; // keeps the capture request until the tile is copied
+            uint width, height;
+            uint64_t sensor_timestamp_ns;
+            std::chrono::steady_clock::time_point arrival;
+        };
+        struct Slot {
+            PooledBuffer *pooled;
+            std::unique_ptr<libcamera::FrameBuffer> buffer;
+            MappedBuffer mapped;
+        };
+
+        void mixLoop();
+        void dropFrames(uint tile, std::chrono::steady_clock::time_point arrived_before);
+        void notifyDetached();
+        bool tryCompose();
+        void compose(std::vector<TileFrame *> &tiles);
+        void copyTile(uint tile, const TileFrame *source, const MappedBuffer &dst, sensor_msgs::msg::RegionOfInterest &roi);
+        void fillTile(uint tile, const MappedBuffer &dst);
+        void releaseSlot(uint index);
+
+        CompositeConfig config;
+        std::shared_ptr<PicamROS2> node;
+        uint cols, rows;
+        uint composite_width, composite_height;
+
+        static constexpr size_t RING_CAPACITY = 4;
+        std::vector<std::unique_ptr<SpscRing<TileFrame>>> rings;
+        std::unique_ptr<std::atomic<bool>[]> detached;
+
+        DmaBufferPool buffer_pool;
+        std::vector<Slot> slots;
+        std::mutex free_slots_mutex;
+        std::vector<uint> free_slots;
+
+        std::mutex callbacks_mutex;
+        std::function<void(FramePtr, long)> encode;
+        std::vector<std::string> frame_ids;
+
+        std::mutex wake_mutex;
+        std::condition_variable wake_cond;
+        std::mutex detach_mutex;
+        std::condition_variable detach_cond; // detached tiles' frames dropped
+        std::atomic<bool> stopping { false };
+        std::thread mix_thread;
+        std::atomic<uint64_t> frames_composed { 0 }, frames_dropped { 0 }, tiles_missing { 0 };
+
+        rclcpp::Publisher<picam_ros2::msg::CompositeLayout>::SharedPtr layout_publisher;
+};
@@ -17,11 +17,78 @@ const int NS_TO_SEC = 1000000000;
 enum IMAGE_OUTPUT_FORMAT : uint {
   BGR8,
   YUV420,
-  MONO8
+  MONO8,
+  RGB8,
+  RGBA8,
+  BGRA8,
+  NV12,
+  YUV422_YUY2,
+  MONO16
 };
 
 const std::map<uint, std::string> IMAGE_OUTPUT_FORMAT_NAMES = {
   { IMAGE_OUTPUT_FORMAT::BGR8, "bgr8" },
   { IMAGE_OUTPUT_FORMAT::YUV420, "yuv420" },
   { IMAGE_OUTPUT_FORMAT::MONO8, "mono8" },
-};
\ No newline at end of file
+  { IMAGE_OUTPUT_FORMAT::RGB8, "rgb8" },
+  { IMAGE_OUTPUT_FORMAT::RGBA8, "rgba8" },
+  { IMAGE_OUTPUT_FORMAT::BGRA8, "bgra8" },
+  { IMAGE_OUTPUT_FORMAT::NV12, "nv12" },
+  { IMAGE_OUTPUT_FORMAT::YUV422_YUY2, "yuv422_yuy2" },
+  { IMAGE_OUTPUT_FORMAT::MONO16, "mono16" },
+};
+
+// YUV -> RGB matrix, picked from the stream's libcamera colour space
+enum COLOR_MATRIX : uint {
+  BT601_LIMITED,
+  BT601_FULL,
+  BT709_LIMITED,
+  BT709_FULL,
+  COLOR_MATRIX_COUNT
+};
+
+const std::map<uint, std::string> COLOR_MATRIX_NAMES = {
+  { COLOR_MATRIX::BT601_LIMITED, "BT.601 limited" },
+  { COLOR_MATRIX::BT601_FULL, "BT.601 full" },
+  { COLOR_MATRIX::BT709_LIMITED, "BT.709 limited" },
+  { COLOR_MATRIX::BT709_FULL, "BT.709 full" },
+};
+
+// When a gated output publishes, driven by the motion detector
+enum OUTPUT_GATE : uint {
+  ALWAYS, // at the output's rate
+  MOTION, // at the output's rate while there is motion
+  CHANGE // once when motion starts and on scene changes
+};
+
+const std::map<uint, std::string> OUTPUT_GATE_NAMES = {
+  { OUTPUT_GATE::ALWAYS, "always" },
+  { OUTPUT_GATE::MOTION, "motion" },
+  { OUTPUT_GATE::CHANGE, "change" },
+};
+
+// Tensor output memory layout, batch of 1
+enum TENSOR_LAYOUT : uint {
+  NCHW, // channel planes
+  NHWC // interleaved channels
+};
+
+const std::map<uint, std::string> TENSOR_LAYOUT_NAMES = {
+  { TENSOR_LAYOUT::NCHW, "nchw" },
+  { TENSOR_LAYOUT::NHWC, "nhwc" },
+};
+
+// Tensor output element type, little endian
+enum TENSOR_DTYPE : uint {
+  FLOAT32,
+  FLOAT16,
+  INT8, // quantized
+  UINT8 // quantized
+};
+
+const std::map<uint, std::string> TENSOR_DTYPE_NAMES = {
+  { TENSOR_DTYPE::FLOAT32, "float32" },
+  { TENSOR_DTYPE::FLOAT16, "float16" },
+  { TENSOR_DTYPE::INT8, "int8" },
+  { TENSOR_DTYPE::UINT8, "uint8" },
+};
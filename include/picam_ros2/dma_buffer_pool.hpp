@@ -0,0 +1,60 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <libcamera/base/shared_fd.h>
+
+#include "dma_heaps.hpp"
+
+// A named dma-buf with a read/write mapping, both kept for the pool's lifetime
+struct PooledBuffer {
+    std::string name;
+    libcamera::SharedFD fd;
+    uint8_t *memory = nullptr;
+    size_t size = 0;
+    bool in_use = false;
+};
+
+// Keeps dma-heap allocations and their mappings alive across camera restarts
+// and reconfigurations, and learns how many capture buffers the pipeline needs.
+class DmaBufferPool {
+    public:
+        DmaBufferPool(std::string name_prefix);
+        ~DmaBufferPool();
+        bool isValid() const { return this->dma_heap.isValid(); }
+
+        // Hands out count buffers of at least size bytes, reusing free pooled ones.
+        // Free buffers too small (or far too big) for the request are returned to the heap.
+        std::vector<PooledBuffer *> acquire(uint count, size_t size);
+        void release(PooledBuffer *buffer);
+        void releaseAll();
+
+        // Buffer count autotuning, fed once per completed frame. Covers the current and the
+        // previous window of WINDOW_FRAMES frames, so a one-off burst ages out.
+        void recordFrame(uint frames_in_flight, uint frames_dropped);
+        uint recommendedCount(uint min_count, uint max_count) const;
+        uint maxFramesInFlight() const;
+        uint framesDropped() const;
+
+        static constexpr uint WINDOW_FRAMES = 900; // 30 s at 30 fps
+
+    private:
+        DmaHeap dma_heap;
+        std::string name_prefix;
+        uint allocated_total = 0;
+        mutable std::mutex mutex;
+        std::vector<std::unique_ptr<PooledBuffer>> buffers;
+
+        struct DepthWindow {
+            uint max_in_flight = 0; // deepest pipeline seen
+            uint frames_dropped = 0; // sequence gaps seen
+            uint frames_recorded = 0;
+        };
+        DepthWindow window, last_window;
+
+        PooledBuffer *allocate(size_t size);
+        static void unmap(PooledBuffer *buffer);
+};
@@ -1,7 +1,12 @@
 #pragma once
 
 #include "const.hpp"
-#include <libcamera/libcamera.h>
+#include "frame_handle.hpp"
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
 // #include <libcamera/pixel_format.h>
 // #include <linux/videodev2.h>
 // #include <fmt/core.h>
@@ -12,16 +17,56 @@ extern "C" {
     #include <libavutil/buffer.h>
 }
 
-class CameraInterface;
+// region of the frame encoded at different quality, coords are in pixels
+struct EncoderROI {
+    uint left, top, right, bottom;
+    float qoffset; // [-1.0; 1.0], negative = better quality
+};
+
+// Everything an encoder needs from the camera (or composite) it encodes for
+struct EncoderOptions {
+    uint fps = 30;
+    uint bit_rate = 4000000;
+    uint compression = 30; // x264 crf
+    uint buffer_count = 4; // frames that may be queued to the encoder at once
+    bool roi_enabled = false;
+    std::string hw_encoder_device; // "" = first M2M encoder of hw_encoder_codec found
+    std::string hw_encoder_codec = "h264"; // see V4L2_CODECS
+};
 
 class Encoder {
     public:
-        Encoder(CameraInterface *interface, std::shared_ptr<libcamera::Camera> camera);
+        // Called for every encoded packet, in order, from the encoding thread; data is only valid during the call
+        typedef std::function<void(unsigned char *data, int size, bool keyframe, uint64_t pts, long timestamp_ns, bool log)> OutputCallback;
+        typedef std::function<void(bool error, const std::string &message)> LogCallback;
+
+        Encoder(const EncoderOptions &options, OutputCallback on_output, LogCallback on_log, uint width, uint height);
         virtual ~Encoder();
-        virtual void encode(std::vector<AVBufferRef *> plane_buffers, std::vector<uint> plane_strides, int base_fd, uint size, int64_t *frameIdx, long timestamp_ns, bool log) = 0;
+        virtual void encode(FramePtr frame, int64_t *frameIdx, long timestamp_ns, bool log) = 0;
+        virtual bool supportsROI() { return false; }
+        virtual bool readsFromCpu() { return true; } // false when a DMA device reads the frame
+        virtual std::string encoding() { return "h.264"; } // of the published packets
+        void setRegionsOfInterest(const std::vector<EncoderROI> &rois);
 
     protected:
-        CameraInterface * interface;
-        std::shared_ptr<libcamera::Camera> camera;
+        EncoderOptions options;
+        OutputCallback on_output;
+        LogCallback on_log;
+        uint width, height; // of the encoded frames, the camera's or a composite of several
+
+        std::mutex rois_mutex;
+        std::vector<EncoderROI> rois; // first region wins where regions overlap
 
-};
\ No newline at end of file
+        template<typename... Args>
+        void log(const Args&... args) {
+            std::ostringstream oss;
+            (oss << ... << args);
+            this->on_log(false, oss.str());
+        }
+        template<typename... Args>
+        void err(const Args&... args) {
+            std::ostringstream oss;
+            (oss << ... << args);
+            this->on_log(true, oss.str());
+        }
+};
@@ -1,16 +1,25 @@
 #pragma once
 
 #include <libavutil/rational.h>
+#include <sys/time.h>
+#include <atomic>
+#include <map>
 #include <queue>
+#include <string>
+#include <vector>
 #include <thread>
 #include <mutex>
 #include "encoder_base.hpp"
+#include "v4l2_m2m.hpp"
 
 class EncoderHW : public Encoder {
     public:
-        EncoderHW(CameraInterface *interface, std::shared_ptr<libcamera::Camera> camera);
+        EncoderHW(const EncoderOptions &options, OutputCallback on_output, LogCallback on_log, uint width, uint height);
         ~EncoderHW();
-        void encode(std::vector<AVBufferRef *> plane_buffers, std::vector<uint> plane_strides, int base_fd, uint size, int64_t *frameIdx, long timestamp_ns, bool log);
+        void encode(FramePtr frame, int64_t *frameIdx, long timestamp_ns, bool log);
+        bool readsFromCpu() { return false; }
+        std::string encoding() { return this->codec->encoding; }
+        bool supportsROI() { return false; } // nothing to apply them with, see findRoiControls()
         
     private:
     	// We want at least as many output buffers as there are in the camera queue
@@ -20,7 +29,14 @@ class EncoderHW : public Encoder {
         // static constexpr int NUM_OUTPUT_BUFFERS = 6;
         static constexpr int NUM_CAPTURE_BUFFERS = 12;
 
+        const V4L2Codec *codec = nullptr; // hw_encoder_codec
         int encoder_fd;
+        std::string device_name;
+        uint num_capture_buffers = 0;
+        bool setControl(uint32_t id, int32_t value, bool required);
+        bool setMenuControl(uint32_t id, const std::vector<int32_t> &preferred_values);
+        uint captureBufferSize();
+        std::vector<std::string> findRoiControls();
         struct BufferDescription
         {
             void *mem;
@@ -32,12 +48,21 @@ class EncoderHW : public Encoder {
             long timestamp_ns;
             bool log;
         };
-        BufferMeta *buffer_meta;
+        std::mutex buffer_meta_mutex;
+        std::map<int64_t, BufferMeta> buffer_meta; // by input timestamp in us
+        static int64_t timevalToUs(const timeval &tv);
         std::mutex input_buffers_available_mutex;
         std::queue<int> input_buffers_available;
+        std::vector<FramePtr> queued_frames; // by output buffer index, held until the encoder is done reading
         void pollThread();
+        void dequeueEvents();
+        void dequeueOutputBuffers();
+        void dequeueCaptureBuffers();
         std::thread poll_thread;
-
-        bool abort_poll = false;
+        int epoll_fd = -1;
+        int event_fd = -1; // wakes up the poll thread on shutdown
+        std::atomic<bool> drain_requested { false };
+        bool end_of_stream = false;
+        std::atomic<bool> failed { false }; // EPOLLERR / EPOLLHUP, the poll thread is gone
         // AVRational time_base;
 };
\ No newline at end of file
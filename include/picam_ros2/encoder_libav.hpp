@@ -9,11 +9,6 @@
 #include <libcamera/pixel_format.h>
 
 #include "encoder_base.hpp"
-#include "picam_ros2.hpp"
-#include "dma_heaps.hpp"
-
-#include "rclcpp/rclcpp.hpp"
-#include "ffmpeg_image_transport_msgs/msg/ffmpeg_packet.hpp"
 
 extern "C" {
     #include <libavcodec/avcodec.h>
@@ -27,9 +22,10 @@ using namespace libcamera;
 
 class EncoderLibAV : public Encoder {
     public:
-        EncoderLibAV(CameraInterface *interface, std::shared_ptr<libcamera::Camera> camera);
+        EncoderLibAV(const EncoderOptions &options, OutputCallback on_output, LogCallback on_log, uint width, uint height);
         ~EncoderLibAV();
-        void encode(std::vector<AVBufferRef *> plane_buffers, std::vector<uint> plane_strides, int base_fd, uint size, int64_t *frameIdx, long timestamp_ns, bool log);
+        void encode(FramePtr frame, int64_t *frameIdx, long timestamp_ns, bool log);
+        bool supportsROI() { return true; }
 
     private:
         AVCodec *codec;
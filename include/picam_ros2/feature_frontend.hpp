@@ -0,0 +1,63 @@
+#pragma once
+
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+struct FeatureOptions {
+    uint max_features = 300;
+    uint grid_cols = 8, grid_rows = 6; // buckets, each gets an even share of max_features
+    int fast_threshold = 20;
+    float min_distance = 12.0f; // px between features
+    uint pyramid_levels = 3;
+    uint window_size = 21; // LK window, px
+    float fb_threshold = 1.0f; // forward-backward tracking error in px, 0 = no check
+    bool descriptors = true; // ORB, 32 bytes per feature
+};
+
+struct Feature {
+    uint64_t id;
+    cv::Point2f point;
+    uint age; // frames tracked, 0 = detected in this frame
+    float response;
+};
+
+// Visual odometry frontend on the luma plane: features are tracked from the previous
+// frame with pyramidal LK, then the grid buckets left short are topped up with FAST
+// corners. The pyramids are built into two sets of buffers that are swapped every
+// frame, so nothing is allocated once the first frames went through.
+class FeatureFrontend {
+    public:
+        FeatureFrontend(const FeatureOptions &options);
+        void reset();
+
+        // y is a view of the frame's luma plane, only read during the call
+        const std::vector<Feature> &process(const cv::Mat &y);
+        const cv::Mat &descriptors() const { return this->descriptor_rows; } // row per feature, empty when off
+        uint tracked() const { return this->last_tracked; } // carried over by the last process()
+
+    private:
+        void track();
+        void detect(const cv::Mat &y);
+        void describe(const cv::Mat &y);
+
+        FeatureOptions options;
+        cv::Ptr<cv::ORB> orb;
+        int border; // features closer to the edge are dropped (the ORB patch must fit)
+
+        std::vector<cv::Mat> pyramid, previous_pyramid;
+        bool has_previous = false;
+
+        std::vector<Feature> features;
+        uint64_t next_id = 0;
+        uint last_tracked = 0;
+
+        // scratch, kept for the capacity
+        std::vector<cv::Point2f> previous_points, points, back_points;
+        std::vector<uchar> status, back_status;
+        std::vector<float> errors;
+        std::vector<cv::KeyPoint> keypoints;
+        std::vector<uint> bucket_counts;
+        std::vector<uint8_t> occupancy; // min_distance cells taken by a feature
+        cv::Mat descriptor_rows, computed_rows;
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "feature_frontend.hpp"
+#include "frame_handle.hpp"
+
+// Runs a FeatureFrontend off the capture thread on the latest frame; frames arriving
+// while it is busy are skipped and LK tracks across the gap.
+class FeatureWorker {
+    public:
+        typedef std::function<void(const FeatureFrontend &frontend, const std::vector<Feature> &features,
+                                   long timestamp_ns, uint64_t sensor_timestamp_ns)> ResultCallback;
+
+        FeatureWorker(const FeatureOptions &options, ResultCallback on_result);
+        ~FeatureWorker();
+
+        // false when busy (frame skipped)
+        bool submit(FramePtr frame, uint width, uint height, long timestamp_ns, uint64_t sensor_timestamp_ns);
+
+    private:
+        void workerLoop();
+
+        FeatureFrontend frontend;
+        ResultCallback on_result;
+
+        std::mutex mutex;
+        std::condition_variable cond;
+        FramePtr frame;
+        uint width = 0, height = 0;
+        long timestamp_ns = 0;
+        uint64_t sensor_timestamp_ns = 0;
+        bool stopping = false;
+        std::thread thread;
+};
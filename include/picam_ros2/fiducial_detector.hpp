@@ -0,0 +1,100 @@
+#pragma once
+
+#include <array>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/aruco.hpp>
+
+#include "frame_handle.hpp"
+
+struct FiducialDetection {
+    int id;
+    std::array<cv::Point2f, 4> corners; // clockwise from the marker's top left, frame pixels
+    bool pose_valid = false;
+    cv::Vec3d rvec, tvec; // marker pose in the camera's optical frame, Rodrigues vector and metres
+};
+
+struct FiducialOptions {
+    std::string dictionary = "apriltag_36h11";
+    double marker_size = 0.05; // m, edge of the black square
+    uint full_search_interval = 10; // detector frames between whole frame searches, 1 = always
+    double roi_margin = 0.5; // search window grown by this fraction of the marker size on each side
+    uint max_misses = 3; // detector frames a track is searched for after it was last seen
+};
+
+// ArUco / AprilTag detection with tracking. Markers found in one frame are searched for
+// only within windows around their predicted position in the next; the whole frame is
+// searched every full_search_interval frames and as long as nothing is tracked.
+class FiducialDetector {
+    public:
+        static int dictionaryId(const std::string &name); // -1 when unknown
+
+        // throws std::runtime_error for an unknown dictionary
+        FiducialDetector(const FiducialOptions &options);
+
+        void setCameraModel(const cv::Mat &camera_matrix, const cv::Mat &dist_coeffs); // empty = no poses
+
+        // y is a view of the frame's luma plane, searched in place
+        const std::vector<FiducialDetection> &detect(const cv::Mat &y, bool &full_search);
+        uint tracked() const { return this->tracks.size(); }
+
+    private:
+        struct Track {
+            FiducialDetection last;
+            cv::Point2f velocity; // per detector frame
+            uint misses = 0;
+        };
+
+        std::vector<cv::Rect> searchWindows(cv::Size size) const;
+        void search(const cv::Mat &image, cv::Point offset);
+        void updateTracks();
+        void estimatePoses();
+
+        FiducialOptions options;
+        cv::Ptr<cv::aruco::Dictionary> dictionary;
+        cv::Ptr<cv::aruco::DetectorParameters> parameters;
+        cv::Mat camera_matrix, dist_coeffs;
+
+        std::vector<Track> tracks;
+        uint frames_since_full_search = 0;
+        std::vector<FiducialDetection> detections;
+
+        std::vector<int> found_ids; // scratch, per search window
+        std::vector<std::vector<cv::Point2f>> found_corners, rejected;
+};
+
+// Runs a FiducialDetector off the capture thread on the latest frame; frames arriving
+// while it is busy are skipped. The frame (and its capture buffer) is held until done.
+class FiducialWorker {
+    public:
+        typedef std::function<void(const std::vector<FiducialDetection> &, long timestamp_ns, bool full_search)> ResultCallback;
+
+        FiducialWorker(const FiducialOptions &options, ResultCallback on_result);
+        ~FiducialWorker();
+
+        // false when busy (frame skipped)
+        bool submit(FramePtr frame, uint width, uint height, long timestamp_ns);
+        void setCameraModel(const cv::Mat &camera_matrix, const cv::Mat &dist_coeffs);
+
+    private:
+        void workerLoop();
+
+        FiducialDetector detector;
+        ResultCallback on_result;
+
+        std::mutex mutex;
+        std::condition_variable cond;
+        FramePtr frame;
+        uint width = 0, height = 0;
+        long timestamp_ns = 0;
+        bool camera_model_changed = false;
+        cv::Mat camera_matrix, dist_coeffs;
+        bool stopping = false;
+        std::thread thread;
+};
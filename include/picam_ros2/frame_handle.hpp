@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <libcamera/libcamera.h>
+
+// CPU mapping of a capture dma-buf, lives as long as the buffer itself
+struct MappedBuffer {
+    uint8_t *memory = nullptr;
+    size_t size = 0; // whole buffer aligned to 4096
+    std::vector<uint8_t *> planes; // Y, U, V
+    std::vector<uint> strides;
+    std::vector<uint> plane_sizes;
+};
+
+// Cache maintenance counters, per camera
+struct DmaSyncStats {
+    std::atomic<uint64_t> syncs { 0 }; // START/END pairs issued
+    std::atomic<uint64_t> skipped { 0 }; // frames no CPU consumer touched
+    std::atomic<uint64_t> failed { 0 }; // sync ioctls that failed
+};
+
+// A captured frame shared by all of its consumers (encoders, publishers, calibration).
+// The capture request goes back to the camera once the last reference is dropped,
+// so an encoder still reading the dma-buf keeps it from being overwritten.
+class FrameHandle {
+    public:
+        FrameHandle(libcamera::Request *request, libcamera::FrameBuffer *buffer, const MappedBuffer *mapped,
+                    long timestamp_ns, std::function<void(libcamera::Request *)> release, DmaSyncStats *sync_stats = nullptr);
+        ~FrameHandle();
+        FrameHandle(const FrameHandle &) = delete;
+        FrameHandle &operator=(const FrameHandle &) = delete;
+
+        int fd() const { return this->buffer->planes()[0].fd.get(); }
+
+        // Brackets CPU access to the planes with dma-buf cache maintenance. Nested
+        // windows share one START/END pair; frames only DMA devices read never sync.
+        void beginCpuAccess(bool write = false);
+        void endCpuAccess();
+
+        class CpuAccess {
+            public:
+                CpuAccess(FrameHandle &frame, bool write = false) : frame(frame) { frame.beginCpuAccess(write); }
+                ~CpuAccess() { frame.endCpuAccess(); }
+            private:
+                FrameHandle &frame;
+        };
+
+        libcamera::Request *request;
+        libcamera::FrameBuffer *buffer;
+        const MappedBuffer *mapped;
+        long timestamp_ns;
+
+    private:
+        std::function<void(libcamera::Request *)> release;
+        DmaSyncStats *sync_stats;
+        std::mutex cpu_access_mutex;
+        uint cpu_access_depth = 0;
+        uint64_t cpu_access_flags = 0;
+        bool cpu_accessed = false;
+        bool sync(uint64_t flags); // false (and counted) on failure
+};
+
+typedef std::shared_ptr<FrameHandle> FramePtr;
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+// Compile time specialized YUV -> output encoding conversions
+// Every (source layout, destination layout, colour matrix) combination gets its own tight loop,
+// picked at runtime from the encoding registry in image_output.cpp
+
+namespace picam_conv {
+
+// Source frame as captured, planes point into the mapped buffer
+struct YuvPlanes {
+    const uint8_t *y, *u, *v;
+    uint y_stride, u_stride, v_stride;
+    uint width, height;
+};
+
+// Y'CbCr -> R'G'B' in 16.16 fixed point, from Kr/Kb (x10000) and range
+template <int Kr10k, int Kb10k, bool FullRange>
+struct YuvMatrix {
+    static constexpr double kr = Kr10k / 10000.0;
+    static constexpr double kb = Kb10k / 10000.0;
+    static constexpr double kg = 1.0 - kr - kb;
+    static constexpr double y_scale = FullRange ? 1.0 : 255.0 / 219.0;
+    static constexpr double c_scale = FullRange ? 1.0 : 255.0 / 224.0;
+
+    static constexpr int32_t fix(double v) { return static_cast<int32_t>(v * 65536.0 + (v < 0 ? -0.5 : 0.5)); }
+
+    static constexpr int y_offset = FullRange ? 0 : 16;
+    static constexpr int32_t y_mul = fix(y_scale);
+    static constexpr int32_t r_v = fix(2.0 * (1.0 - kr) * c_scale);
+    static constexpr int32_t g_u = fix(-2.0 * (1.0 - kb) * kb / kg * c_scale);
+    static constexpr int32_t g_v = fix(-2.0 * (1.0 - kr) * kr / kg * c_scale);
+    static constexpr int32_t b_u = fix(2.0 * (1.0 - kb) * c_scale);
+};
+
+using BT601Limited = YuvMatrix<2990, 1140, false>;
+using BT601Full = YuvMatrix<2990, 1140, true>;
+using BT709Limited = YuvMatrix<2126, 722, false>;
+using BT709Full = YuvMatrix<2126, 722, true>;
+
+static inline uint8_t clamp8(int32_t v) {
+    return static_cast<uint8_t>(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+// Source layouts
+
+// Planar 4:2:0, separate U and V planes (libcamera YUV420)
+struct SrcI420 {
+    static constexpr uint chroma_step = 1;
+    static inline const uint8_t *uRow(const YuvPlanes &src, uint y) { return src.u + (y / 2) * src.u_stride; }
+    static inline const uint8_t *vRow(const YuvPlanes &src, uint y) { return src.v + (y / 2) * src.v_stride; }
+};
+
+// Semi-planar 4:2:0, interleaved UV plane passed as u (libcamera NV12)
+struct SrcNV12 {
+    static constexpr uint chroma_step = 2;
+    static inline const uint8_t *uRow(const YuvPlanes &src, uint y) { return src.u + (y / 2) * src.u_stride; }
+    static inline const uint8_t *vRow(const YuvPlanes &src, uint y) { return src.u + (y / 2) * src.u_stride + 1; }
+};
+
+// Destination layouts, each provides convert<Src, Matrix>(src, dst, dst_step)
+
+// Packed 8-bit RGB family, channel offsets within a pixel (A < 0 for none)
+template <int R, int G, int B, int A, int Channels>
+struct DstPackedRgb {
+    static constexpr int r = R, g = G, b = B, a = A;
+    static constexpr uint channels = Channels;
+
+    template <class Src, class M>
+    static void convert(const YuvPlanes &src, uint8_t *dst, uint dst_step) {
+        for (uint y = 0; y < src.height; y += 2) {
+            const uint rows = std::min(2u, src.height - y);
+            const uint8_t *u_row = Src::uRow(src, y);
+            const uint8_t *v_row = Src::vRow(src, y);
+            const uint8_t *y_rows[2] = { src.y + y * src.y_stride, src.y + (y + rows - 1) * src.y_stride };
+            uint8_t *d_rows[2] = { dst + y * dst_step, dst + (y + rows - 1) * dst_step };
+
+            for (uint x = 0; x < src.width; x += 2) {
+                // chroma terms shared by the 2x2 block
+                const int32_t u = u_row[(x / 2) * Src::chroma_step] - 128;
+                const int32_t v = v_row[(x / 2) * Src::chroma_step] - 128;
+                const int32_t r_c = M::r_v * v + 32768;
+                const int32_t g_c = M::g_u * u + M::g_v * v + 32768;
+                const int32_t b_c = M::b_u * u + 32768;
+                const uint cols = std::min(2u, src.width - x);
+
+                for (uint r = 0; r < rows; r++) {
+                    for (uint c = 0; c < cols; c++) {
+                        const int32_t luma = (y_rows[r][x + c] - M::y_offset) * M::y_mul;
+                        uint8_t *px = d_rows[r] + (x + c) * Channels;
+                        px[R] = clamp8((luma + r_c) >> 16);
+                        px[G] = clamp8((luma + g_c) >> 16);
+                        px[B] = clamp8((luma + b_c) >> 16);
+                        if constexpr (A >= 0)
+                            px[A] = 255;
+                    }
+                }
+            }
+        }
+    }
+};
+
+using DstRGB8 = DstPackedRgb<0, 1, 2, -1, 3>;
+using DstBGR8 = DstPackedRgb<2, 1, 0, -1, 3>;
+using DstRGBA8 = DstPackedRgb<0, 1, 2, 3, 4>;
+using DstBGRA8 = DstPackedRgb<2, 1, 0, 3, 4>;
+
+// Luma only, copied as is
+struct DstMono8 {
+    template <class Src, class M>
+    static void convert(const YuvPlanes &src, uint8_t *dst, uint dst_step) {
+        for (uint y = 0; y < src.height; y++)
+            memcpy(dst + y * dst_step, src.y + y * src.y_stride, src.width);
+    }
+};
+
+// Luma expanded to full range and scaled to 16 bits, little endian
+struct DstMono16 {
+    template <class Src, class M>
+    static void convert(const YuvPlanes &src, uint8_t *dst, uint dst_step) {
+        for (uint y = 0; y < src.height; y++) {
+            const uint8_t *y_row = src.y + y * src.y_stride;
+            uint16_t *d = reinterpret_cast<uint16_t *>(dst + y * dst_step);
+            for (uint x = 0; x < src.width; x++) {
+                const int32_t luma = ((y_row[x] - M::y_offset) * M::y_mul + 32768) >> 16;
+                d[x] = static_cast<uint16_t>(clamp8(luma) * 257);
+            }
+        }
+    }
+};
+
+// Semi-planar 4:2:0, tightly packed Y plane followed by interleaved UV
+struct DstNV12 {
+    template <class Src, class M>
+    static void convert(const YuvPlanes &src, uint8_t *dst, uint dst_step) {
+        for (uint y = 0; y < src.height; y++)
+            memcpy(dst + y * dst_step, src.y + y * src.y_stride, src.width);
+        uint8_t *uv = dst + src.height * dst_step;
+        for (uint y = 0; y < src.height; y += 2) {
+            const uint8_t *u_row = Src::uRow(src, y);
+            const uint8_t *v_row = Src::vRow(src, y);
+            uint8_t *d = uv + (y / 2) * dst_step;
+            for (uint x = 0; x < src.width / 2; x++) {
+                d[x * 2] = u_row[x * Src::chroma_step];
+                d[x * 2 + 1] = v_row[x * Src::chroma_step];
+            }
+        }
+    }
+};
+
+// Packed 4:2:2 YUYV, chroma rows repeated vertically
+struct DstYUYV {
+    template <class Src, class M>
+    static void convert(const YuvPlanes &src, uint8_t *dst, uint dst_step) {
+        for (uint y = 0; y < src.height; y++) {
+            const uint8_t *y_row = src.y + y * src.y_stride;
+            const uint8_t *u_row = Src::uRow(src, y);
+            const uint8_t *v_row = Src::vRow(src, y);
+            uint8_t *d = dst + y * dst_step;
+            for (uint x = 0; x < src.width / 2; x++) {
+                d[x * 4] = y_row[x * 2];
+                d[x * 4 + 1] = u_row[x * Src::chroma_step];
+                d[x * 4 + 2] = y_row[x * 2 + 1];
+                d[x * 4 + 3] = v_row[x * Src::chroma_step];
+            }
+        }
+    }
+};
+
+// Reorders / expands between packed RGB family layouts
+template <class From, class To>
+void shuffleRgb(const uint8_t *src, uint src_step, uint8_t *dst, uint dst_step, uint width, uint height) {
+    for (uint y = 0; y < height; y++) {
+        const uint8_t *s = src + y * src_step;
+        uint8_t *d = dst + y * dst_step;
+        for (uint x = 0; x < width; x++, s += From::channels, d += To::channels) {
+            d[To::r] = s[From::r];
+            d[To::g] = s[From::g];
+            d[To::b] = s[From::b];
+            if constexpr (To::a >= 0 && From::a >= 0)
+                d[To::a] = s[From::a];
+            else if constexpr (To::a >= 0)
+                d[To::a] = 255;
+        }
+    }
+}
+
+template <class Src, class Dst, class M>
+void convert(const YuvPlanes &src, uint8_t *dst, uint dst_step) {
+    Dst::template convert<Src, M>(src, dst, dst_step);
+}
+
+typedef void (*ConvertFn)(const YuvPlanes &src, uint8_t *dst, uint dst_step);
+typedef void (*ShuffleFn)(const uint8_t *src, uint src_step, uint8_t *dst, uint dst_step, uint width, uint height);
+
+} // namespace picam_conv
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "rclcpp/rclcpp.hpp"
+#include "builtin_interfaces/msg/time.hpp"
+#include "sensor_msgs/msg/image.hpp"
+
+#include "const.hpp"
+#include "image_conversion.hpp"
+#include "output_schedule.hpp"
+
+void setCurrentStamp(builtin_interfaces::msg::Time *stamp, uint64_t timestamp_ns);
+
+// Registry entry for one output encoding
+struct ImageEncoding {
+    uint format;
+    uint bytes_per_pixel; // of the first plane, gives the row step
+    uint rows_num, rows_den; // total rows incl. chroma planes as a fraction of height
+    picam_conv::ConvertFn convert[COLOR_MATRIX::COLOR_MATRIX_COUNT]; // nullptr = source buffer copied as is
+    picam_conv::ShuffleFn from_rgb; // from the shared rgb8 intermediate, RGB family only
+};
+
+// nullptr if the encoding is not supported
+const ImageEncoding *findImageEncoding(const std::string &name);
+const ImageEncoding *findImageEncoding(uint format);
+
+// Fills msg data & step from YUV420 planes in the given output format, false if not supported
+bool packImage(uint format, uint color_matrix, const std::vector<uint8_t *>& planes, const std::vector<uint>& strides,
+               uint width, uint height, sensor_msgs::msg::Image &msg);
+
+// One Image topic of a camera
+struct ImageOutput {
+    std::string name;
+    uint format;
+    std::string topic;
+    double rate; // Hz, 0 = every frame
+    bool rectified = false; // undistorted with the camera calibration, not published while uncalibrated
+    uint gate = OUTPUT_GATE::ALWAYS; // only with motion_detection
+    OutputSchedule schedule;
+    rclcpp::Publisher<sensor_msgs::msg::Image>::SharedPtr publisher;
+    sensor_msgs::msg::Image msg;
+};
+
+// Packs all outputs due for a frame, intermediates shared between them are computed once:
+// mono comes straight from the Y plane, the RGB family shares one YUV -> RGB pass
+class ImageConversionGraph {
+    public:
+        void pack(const std::vector<ImageOutput *> &outputs, uint color_matrix, const std::vector<uint8_t *>& planes,
+                  const std::vector<uint>& strides, uint width, uint height);
+
+    private:
+        std::vector<uint8_t> rgb; // rgb8 intermediate when no output is rgb8 itself
+};
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+#include "image_conversion.hpp"
+
+// Baseline JPEG straight from YUV420 planes through libjpeg-turbo's raw data API: no RGB pass
+// and no downsampling, the capture planes are the JPEG's 4:2:0 Y'CbCr components.
+// Large frames are cut into strips of MCU rows that encode in parallel with the same tables
+// and are stitched into one JPEG with a restart marker between strips (DRI = one strip),
+// which resets the DC predictors exactly like a single encoder would.
+//
+// JFIF decoders assume full range BT.601. Other matrices and ranges are converted on the
+// way in: chroma from chroma alone, luma with the chroma sample of its 2x2 block (the
+// BT.709 -> BT.601 luma term is about 0.1 Cb + 0.2 Cr, so only sharp colour edges see it).
+
+// Q14 from the source Y'CbCr (offsets removed) to full range BT.601
+struct JpegRowCoeffs {
+    int16_t y_offset; // black
+    int16_t y_y, y_cb, y_cr;
+    int16_t cb_cb, cb_cr, cr_cb, cr_cr;
+    bool identity; // already full range BT.601
+
+    template <class M> // a picam_conv::YuvMatrix
+    static JpegRowCoeffs from();
+};
+
+class JpegEncoder {
+    public:
+        // num_threads 0 = one per core, quality 1..100
+        JpegEncoder(uint num_threads, int quality);
+        ~JpegEncoder();
+
+        // Replaces out with the JPEG, false on a libjpeg error
+        bool encode(const picam_conv::YuvPlanes &src, const JpegRowCoeffs &coeffs, std::vector<uint8_t> &out);
+
+        uint threadCount() const { return (uint) this->threads.size() + 1; }
+
+    private:
+        struct Context; // libjpeg state & row scratch of one thread
+        struct Strip {
+            uint first_mcu_row, mcu_rows;
+            std::vector<uint8_t> data; // a complete JPEG of the strip, grown as needed
+            size_t size = 0; // 0 = error
+        };
+
+        void workerLoop(uint index);
+        void runStrips(Context &ctx);
+        bool encodeStrip(Context &ctx, Strip &strip);
+
+        int quality;
+        std::vector<std::unique_ptr<Context>> contexts; // per worker, the caller's last
+        std::vector<std::thread> threads;
+        std::mutex mutex;
+        std::condition_variable start_cond, done_cond;
+        uint64_t generation = 0;
+        uint workers_busy = 0;
+        bool stopping = false;
+
+        const picam_conv::YuvPlanes *src = nullptr;
+        JpegRowCoeffs coeffs;
+        uint restart_interval = 0; // MCUs
+        std::vector<Strip> strips;
+        std::atomic<uint> next_strip { 0 };
+};
+
+// One row into full range BT.601, NEON on aarch64. cb / cr of the luma row are at half
+// resolution, chroma rows convert count samples of each plane.
+void jpegLumaRow(const uint8_t *y, const uint8_t *cb, const uint8_t *cr, uint8_t *dst, uint count, const JpegRowCoeffs &k);
+void jpegChromaRow(const uint8_t *cb, const uint8_t *cr, uint8_t *dst_cb, uint8_t *dst_cr, uint count, const JpegRowCoeffs &k);
+
+namespace jpeg_reference {
+    void jpegLumaRow(const uint8_t *y, const uint8_t *cb, const uint8_t *cr, uint8_t *dst, uint count, const JpegRowCoeffs &k);
+    void jpegChromaRow(const uint8_t *cb, const uint8_t *cr, uint8_t *dst_cb, uint8_t *dst_cr, uint count, const JpegRowCoeffs &k);
+}
+
+// Through R'G'B', linear in (Y' - black, Cb - 128, Cr - 128)
+template <class M>
+JpegRowCoeffs JpegRowCoeffs::from() {
+    using J = picam_conv::BT601Full;
+    auto ycc = [](double y, double cb, double cr, double out[3]) {
+        double luma = y * M::y_scale;
+        double r = luma + 2.0 * (1.0 - M::kr) * M::c_scale * cr;
+        double b = luma + 2.0 * (1.0 - M::kb) * M::c_scale * cb;
+        double g = (luma - M::kr * r - M::kb * b) / M::kg;
+        out[0] = J::kr * r + J::kg * g + J::kb * b;
+        out[1] = (b - out[0]) / (2.0 * (1.0 - J::kb));
+        out[2] = (r - out[0]) / (2.0 * (1.0 - J::kr));
+    };
+    auto q14 = [](double v) { return (int16_t) std::lround(v * 16384.0); };
+    double from_y[3], from_cb[3], from_cr[3];
+    ycc(1.0, 0.0, 0.0, from_y);
+    ycc(0.0, 1.0, 0.0, from_cb);
+    ycc(0.0, 0.0, 1.0, from_cr);
+
+    JpegRowCoeffs k;
+    k.y_offset = (int16_t) M::y_offset;
+    k.y_y = q14(from_y[0]);
+    k.y_cb = q14(from_cb[0]);
+    k.y_cr = q14(from_cr[0]);
+    k.cb_cb = q14(from_cb[1]);
+    k.cb_cr = q14(from_cr[1]);
+    k.cr_cb = q14(from_cb[2]);
+    k.cr_cr = q14(from_cr[2]);
+    k.identity = k.y_offset == 0 && k.y_y == 16384 && !k.y_cb && !k.y_cr && k.cb_cb == 16384 && !k.cb_cr && !k.cr_cb && k.cr_cr == 16384;
+    return k;
+}
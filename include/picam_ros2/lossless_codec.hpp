@@ -0,0 +1,125 @@
+#pragma once
+
+// Lossless frame codec for the CompressedImage outputs: a LOCO-I (median edge) predictor
+// followed by zstd, over horizontal strips that compress independently and in parallel.
+// This header has no ROS dependencies so it can be used on its own.
+//
+// Stream layout, little endian:
+//   [ StreamHeader ][ PlaneHeader x plane_count ][ StripHeader x strip_count ][ strip payloads ]
+// Each payload is one zstd frame holding the zigzagged prediction residuals of its rows,
+// 16-bit samples as a plane of low bytes followed by a plane of high bytes. The first rows
+// of a strip (and the first columns of a row) are predicted from whatever neighbours exist
+// within the strip, so strips decode on their own.
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+namespace picam_lossless {
+
+constexpr uint32_t STREAM_MAGIC = 0x5a4c4350; // "PCLZ"
+constexpr uint16_t STREAM_VERSION = 1;
+constexpr uint MAX_PLANES = 3;
+const std::string FORMAT_SUFFIX = "; picam_zstd"; // CompressedImage.format, e.g. "mono8; picam_zstd"
+
+struct StreamHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t plane_count;
+    uint32_t strip_count;
+};
+
+struct PlaneHeader {
+    uint32_t width; // samples
+    uint32_t height;
+    uint8_t bytes_per_sample; // 1 or 2
+    uint8_t shift; // 16-bit: low bits that are always zero (MSB aligned samples), not stored
+    uint8_t step; // distance of the predictor's neighbours, 2 for Bayer mosaics
+    uint8_t reserved;
+};
+
+struct StripHeader {
+    uint16_t plane;
+    uint16_t reserved;
+    uint32_t first_row;
+    uint32_t rows;
+    uint32_t size; // compressed bytes
+};
+
+static_assert(sizeof(StreamHeader) == 12, "StreamHeader not packed");
+static_assert(sizeof(PlaneHeader) == 12, "PlaneHeader not packed");
+static_assert(sizeof(StripHeader) == 16, "StripHeader not packed");
+
+// One plane of the frame to encode
+struct PlaneView {
+    const uint8_t *data;
+    uint stride; // bytes
+    uint width, height;
+    uint bytes_per_sample = 1;
+    uint shift = 0;
+    uint step = 1;
+};
+
+// Decoded plane, rows packed
+struct DecodedPlane {
+    uint width, height;
+    uint bytes_per_sample;
+    std::vector<uint8_t> data;
+};
+
+// Encodes frames on a pool of worker threads, the calling thread works on strips too.
+// Not thread safe, one frame at a time.
+class Encoder {
+    public:
+        // num_threads 0 = one per core, level is the zstd level (negative levels are faster)
+        Encoder(uint num_threads, int level);
+        ~Encoder();
+
+        // Replaces out with the encoded stream, false on a zstd error
+        bool encode(const std::vector<PlaneView> &planes, std::vector<uint8_t> &out);
+
+        uint threadCount() const { return (uint) this->threads.size() + 1; }
+
+    private:
+        struct Strip {
+            uint plane, first_row, rows;
+            std::vector<uint8_t> residuals;
+            std::vector<uint8_t> compressed;
+            size_t size = 0; // 0 = error
+        };
+
+        void workerLoop();
+        void runStrips(void *cctx);
+
+        int level;
+        std::vector<std::thread> threads;
+        std::mutex mutex;
+        std::condition_variable start_cond, done_cond;
+        uint64_t generation = 0;
+        uint workers_busy = 0;
+        bool stopping = false;
+
+        const std::vector<PlaneView> *planes = nullptr;
+        std::vector<Strip> strips;
+        std::atomic<uint> next_strip { 0 };
+        void *main_cctx = nullptr;
+};
+
+// Decodes a whole stream, false if it's malformed
+bool decode(const uint8_t *data, size_t size, std::vector<DecodedPlane> &planes);
+
+// Prediction residuals of one row, prev_row = the row step rows up or nullptr
+void residualRow8(const uint8_t *row, const uint8_t *prev_row, uint8_t *dst, uint width, uint step);
+void residualRow16(const uint16_t *row, const uint16_t *prev_row, uint8_t *dst_lo, uint8_t *dst_hi, uint width, uint step, uint shift);
+
+namespace reference {
+    void residualRow8(const uint8_t *row, const uint8_t *prev_row, uint8_t *dst, uint width, uint step);
+}
+
+} // namespace picam_lossless
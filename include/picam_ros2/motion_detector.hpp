@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <sys/types.h>
+#include <vector>
+
+struct MotionResult {
+    uint moving_cells = 0;
+    bool motion = false; // at least min_cells moving
+    bool scene_change = false; // most of the frame changed at once, the background was reseeded
+};
+
+// Cheap motion / scene change detection on the Y plane. Every 8th row is averaged down
+// 8x horizontally into a thumbnail (1/64 of the pixels read), which is compared with a
+// slowly decaying background by a sum of absolute differences per grid cell. Cells whose
+// mean difference exceeds the threshold count as moving.
+class MotionDetector {
+    public:
+        static constexpr uint SCALE = 8;
+
+        // cell_size in frame pixels (rounded to a multiple of 8), threshold in mean Y levels,
+        // the background follows the frames with a time constant of background_frames
+        void configure(uint cell_size, float threshold, uint min_cells, float scene_change_fraction, uint background_frames);
+        void reset() { this->background_valid = false; }
+
+        // the first frame after a reset seeds the background and reports a scene change
+        MotionResult process(const uint8_t *y, uint stride, uint width, uint height);
+
+        // 255 for moving cells, row major, from the last process()
+        const std::vector<uint8_t> &cellMask() const { return this->mask; }
+        uint gridWidth() const { return this->grid_width; }
+        uint gridHeight() const { return this->grid_height; }
+
+    private:
+        uint configured_cell_thumbs = 8; // thumbnail pixels per cell side, as configured
+        uint cell_thumbs = 8; // the same, limited to the current frame size
+        float threshold = 6.0f;
+        uint min_cells = 1;
+        float scene_change_fraction = 0.6f;
+        uint32_t decay = 65536 / 150; // 16.16 per frame
+
+        uint width = 0, height = 0;
+        uint thumb_width = 0, thumb_height = 0;
+        uint grid_width = 0, grid_height = 0;
+        std::vector<uint8_t> thumb;
+        std::vector<uint16_t> background; // 8.8 fixed point
+        std::vector<uint8_t> background8; // integer part, for the SIMD difference
+        std::vector<uint8_t> diff_row;
+        std::vector<uint32_t> cell_sad;
+        std::vector<uint8_t> mask;
+        bool background_valid = false;
+};
+
+// Row kernels, NEON on aarch64
+void downsampleRow8(const uint8_t *src, uint8_t *dst, uint dst_width); // mean of every 8 pixels
+void absDiffRow(const uint8_t *a, const uint8_t *b, uint8_t *dst, uint width);
+
+namespace motion_reference {
+    void downsampleRow8(const uint8_t *src, uint8_t *dst, uint dst_width);
+    void absDiffRow(const uint8_t *a, const uint8_t *b, uint8_t *dst, uint width);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Publishes an output on every divisor-th frame tick, offset by phase
+struct OutputSchedule {
+    uint divisor = 1;
+    uint phase = 0;
+
+    bool due(uint64_t tick) const { return tick % this->divisor == this->phase; }
+
+    // divisor for the requested rate, 0 = every frame
+    static uint divisorFor(double rate, uint fps);
+};
+
+// Frame ticks on the sensor clock, so that the phases below mean the same moment on every
+// camera at the same framerate; sequence numbers start whenever each camera did. Counts with
+// the sequence between frames and re-anchors when it drifts too far from the clock
+class OutputClock {
+    public:
+        void reset(uint fps);
+        uint64_t tick(uint sequence, uint64_t sensor_timestamp_ns);
+
+    private:
+        static constexpr double MAX_DRIFT = 0.75; // of a frame, above sensor timestamp jitter
+
+        double period_ns = 0.0;
+        int64_t offset = 0; // tick - sequence
+        bool anchored = false;
+};
+
+// Picks phases for decimated outputs of all cameras in the process so that the
+// expensive conversions don't land on the same OutputClock tick. Outputs of one group
+// (camera) with the same divisor share a phase, so they can share intermediates.
+class OutputPhaseAllocator {
+    public:
+        static OutputPhaseAllocator &instance();
+
+        uint allocate(int group, uint divisor, uint64_t weight);
+        void release(int group);
+
+    private:
+        static constexpr uint PERIOD = 120; // ticks tracked, multiple of the common divisors
+
+        struct Allocation {
+            int group;
+            uint divisor;
+            uint phase;
+            uint64_t weight;
+        };
+
+        void addLoad(uint divisor, uint phase, int64_t weight);
+
+        std::mutex mutex;
+        std::array<uint64_t, PERIOD> load {};
+        std::vector<Allocation> allocations;
+};
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// Aligns the frame starts of a free running follower sensor with a leader by stretching or
+// shortening the follower's frame duration a little per request. No libcamera types, so
+// the loop can be driven by a simulated clock.
+struct PhaseLockOptions {
+    int64_t tolerance_ns = 100000; // locked while the phase error stays within this
+    double gain = 0.5; // fraction of the predicted phase error corrected per frame
+    double max_step = 0.02; // max correction per frame, fraction of the frame period
+    uint control_delay = 2; // frames before a requested duration shows in the timestamps
+    uint lock_frames = 10; // consecutive frames within tolerance to report lock
+    int64_t quantum_ns = 1000; // FrameDurationLimits granularity (us)
+};
+
+class PhaseLockController {
+    public:
+        explicit PhaseLockController(const PhaseLockOptions &options = PhaseLockOptions()) : options(options) {}
+
+        void reset();
+
+        // Follower frame against the leader's latest frame and period,
+        // returns the frame duration to request next (ns)
+        int64_t update(uint64_t timestamp_ns, uint64_t leader_timestamp_ns, int64_t period_ns);
+
+        bool locked() const { return this->is_locked; }
+        int64_t phaseError() const { return this->phase_error; } // follower start after the nearest leader start
+
+    private:
+        PhaseLockOptions options;
+        std::deque<int64_t> pending; // corrections requested, not visible in the timestamps yet
+        int64_t phase_error = 0;
+        uint frames_in_tolerance = 0;
+        bool is_locked = false;
+};
+
+// Cameras locked together; the leader reports its frames, followers read them
+class PhaseLockGroup {
+    public:
+        static std::shared_ptr<PhaseLockGroup> get(const std::string &name);
+
+        void leaderFrame(uint64_t timestamp_ns);
+        // false until the leader delivered two frames
+        bool leaderReference(uint64_t &timestamp_ns, int64_t &period_ns);
+
+    private:
+        std::mutex mutex;
+        uint64_t last_timestamp_ns = 0;
+        int64_t period_ns = 0; // smoothed
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Sensor raw (Bayer) layout, parsed from the libcamera pixel format name,
+// e.g. SRGGB10_CSI2P, SBGGR12_CSI2P, SGRBG16 or RGGB_PISP_COMP1
+struct RawFormat {
+    std::string order; // RGGB, BGGR, GRBG or GBRG
+    uint bits = 0; // bits per sample
+    bool csi2_packed = false; // MIPI CSI-2 packing, 4 samples in 5 bytes (10-bit) or 2 in 3 (12-bit)
+    bool compressed = false; // PiSP compressed, not documented so not supported
+
+    bool supported() const;
+    std::string encoding(bool out16) const; // ROS image encoding, e.g. bayer_rggb16
+};
+
+RawFormat parseRawFormat(const std::string &pixel_format);
+
+// Unpacks a whole frame into 8-bit (most significant bits) or MSB aligned 16-bit samples,
+// false if the format is not supported
+bool unpackRawFrame(const RawFormat &format, bool out16, const uint8_t *src, uint src_stride,
+                    uint width, uint height, uint8_t *dst, uint dst_step);
+
+// Row unpackers, NEON on aarch64
+void unpackRaw10Row16(const uint8_t *src, uint16_t *dst, uint width);
+void unpackRaw12Row16(const uint8_t *src, uint16_t *dst, uint width);
+void unpackRaw10Row8(const uint8_t *src, uint8_t *dst, uint width);
+void unpackRaw12Row8(const uint8_t *src, uint8_t *dst, uint width);
+
+// Scalar reference versions of the above
+namespace raw_reference {
+    void unpackRaw10Row16(const uint8_t *src, uint16_t *dst, uint width);
+    void unpackRaw12Row16(const uint8_t *src, uint16_t *dst, uint width);
+    void unpackRaw10Row8(const uint8_t *src, uint8_t *dst, uint width);
+    void unpackRaw12Row8(const uint8_t *src, uint8_t *dst, uint width);
+}
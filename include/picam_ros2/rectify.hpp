@@ -0,0 +1,37 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+// Undistortion maps for YUV420 frames in fixed point (CV_16SC2 + CV_16UC1), for the
+// Y plane and the half size chroma planes. Built once per calibration, cached in a file
+// next to the calibration JSON and memory-mapped from there on the next start.
+class RectifyMaps {
+    public:
+        ~RectifyMaps();
+
+        static std::shared_ptr<RectifyMaps> build(const cv::Mat &camera_matrix, const cv::Mat &dist_coeffs, cv::Size size);
+        // maps from the cache if it was built for the same calibration & size, nullptr otherwise
+        static std::shared_ptr<RectifyMaps> load(const std::string &cache_file, const cv::Mat &camera_matrix, const cv::Mat &dist_coeffs, cv::Size size);
+        bool save(const std::string &cache_file) const;
+
+        // Remaps the Y, U and V planes into dst in row tiles spread over the OpenCV thread pool
+        void remap(const std::vector<uint8_t *> &planes, const std::vector<uint> &strides,
+                   const std::vector<uint8_t *> &dst_planes, const std::vector<uint> &dst_strides) const;
+
+        const cv::Mat &newCameraMatrix() const { return this->new_camera_matrix; } // of the rectified image
+
+    private:
+        static uint64_t calibrationHash(const cv::Mat &camera_matrix, const cv::Mat &dist_coeffs, cv::Size size);
+
+        uint64_t calibration_hash = 0;
+        cv::Size size;
+        cv::Mat y_map1, y_map2, uv_map1, uv_map2;
+        cv::Mat new_camera_matrix;
+
+        void *mapping = nullptr; // cache file mapping the maps point into
+        size_t mapping_size = 0;
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+// Shared-memory frame ring, written by the picam node, read by co-located processes.
+// This header has no ROS or libcamera dependencies so it can be used on its own.
+//
+// Layout of /dev/shm/<name>:
+//   [ RingHeader, padded to RING_HEADER_SIZE ][ slot 0 ][ slot 1 ] ... [ slot N-1 ]
+// each slot is [ SlotHeader, padded to SLOT_HEADER_SIZE ][ plane data, stride-aware ].
+// Slots are guarded by a seqlock: the writer never waits for readers, a reader
+// that was overtaken sees a changed sequence and skips the frame.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace picam_shm {
+
+constexpr uint32_t RING_MAGIC = 0x4d414350; // "PCAM"
+constexpr uint32_t RING_VERSION = 1;
+constexpr uint32_t MAX_PLANES = 3;
+constexpr size_t RING_HEADER_SIZE = 4096;
+constexpr size_t SLOT_HEADER_SIZE = 128;
+
+struct RingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t width;
+    uint32_t height;
+    uint32_t plane_count;
+    uint64_t slot_size; // including the slot header
+    uint32_t strides[MAX_PLANES];
+    uint32_t plane_offsets[MAX_PLANES]; // from the start of slot data
+    uint32_t plane_sizes[MAX_PLANES];
+    char format[16]; // ROS image encoding, e.g. "yuv420"
+    char frame_id[64];
+    std::atomic<uint64_t> frames_written; // latest frame is in slot (frames_written - 1) % slot_count
+};
+
+struct SlotHeader {
+    std::atomic<uint64_t> seqlock; // odd while the writer is in the slot
+    uint64_t frame_number; // 1-based, matches frames_written after the write
+    int64_t timestamp_ns; // as stamped on the ROS messages
+    int64_t sensor_timestamp_ns; // libcamera sensor timestamp (CLOCK_BOOTTIME)
+    uint32_t sequence; // camera frame sequence
+};
+
+static_assert(sizeof(RingHeader) <= RING_HEADER_SIZE, "RingHeader too big");
+static_assert(sizeof(SlotHeader) <= SLOT_HEADER_SIZE, "SlotHeader too big");
+
+inline std::string ringName(int location) {
+    return "/picam_ros2_camera_" + std::to_string(location);
+}
+
+// Frame as seen in the ring, valid only while the slot isn't overwritten
+struct FrameView {
+    uint64_t frame_number;
+    int64_t timestamp_ns;
+    int64_t sensor_timestamp_ns;
+    uint32_t sequence;
+    uint32_t width;
+    uint32_t height;
+    std::string format;
+    const uint8_t *planes[MAX_PLANES];
+    uint32_t strides[MAX_PLANES];
+    uint32_t plane_sizes[MAX_PLANES];
+    uint32_t plane_count;
+};
+
+class FrameReader {
+    public:
+        FrameReader(const std::string &name);
+        ~FrameReader();
+        bool isOpen() const { return this->header != nullptr; }
+        const RingHeader *ringHeader() const { return this->header; }
+
+        // Number of the latest complete frame, 0 if none yet
+        uint64_t latestFrameNumber() const;
+
+        // Zero-copy read of the latest frame newer than after_frame_number. The view
+        // is passed to the callback and the function returns false if the writer
+        // touched the slot meanwhile, in which case whatever the callback computed
+        // must be discarded.
+        template<typename F>
+        bool readLatest(uint64_t after_frame_number, F &&callback) const {
+            FrameView view;
+            uint64_t seq;
+            if (!this->beginRead(after_frame_number, view, seq))
+                return false;
+            callback(static_cast<const FrameView &>(view));
+            return this->endRead(view, seq);
+        }
+
+        // Copies the latest frame newer than after_frame_number, planes back to back
+        bool copyLatest(uint64_t after_frame_number, FrameView &meta, std::vector<uint8_t> &data) const;
+
+    private:
+        int fd = -1;
+        size_t mapped_size = 0;
+        uint8_t *memory = nullptr;
+        const RingHeader *header = nullptr;
+
+        bool beginRead(uint64_t after_frame_number, FrameView &view, uint64_t &seq) const;
+        bool endRead(const FrameView &view, uint64_t seq) const;
+};
+
+} // namespace picam_shm
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+
+#include "shm_frame_ring.hpp"
+#include "frame_handle.hpp"
+
+// Writes captured frames into a POSIX shared-memory ring (see shm_frame_ring.hpp)
+class ShmFrameWriter {
+    public:
+        ShmFrameWriter(const std::string &name, const MappedBuffer &layout, uint width, uint height,
+                       const std::string &format, const std::string &frame_id, uint slot_count);
+        ~ShmFrameWriter();
+        void write(const FrameHandle &frame, int64_t sensor_timestamp_ns, uint32_t sequence);
+
+    private:
+        std::string name;
+        int fd = -1;
+        size_t mapped_size = 0;
+        uint8_t *memory = nullptr;
+        picam_shm::RingHeader *header = nullptr;
+};
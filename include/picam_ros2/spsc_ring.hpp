@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Bounded single producer / single consumer ring without locks. The slots are
+// preallocated and reused: the producer fills the slot returned by beginWrite() and
+// publishes it with endWrite(), the consumer reads front() and releases it with pop().
+template <class T>
+class SpscRing {
+    public:
+        explicit SpscRing(size_t capacity) : slots(capacity + 1) {}
+
+        // nullptr when full
+        T *beginWrite() {
+            size_t head = this->head.load(std::memory_order_relaxed);
+            if ((head + 1) % this->slots.size() == this->tail.load(std::memory_order_acquire))
+                return nullptr;
+            return &this->slots[head];
+        }
+        void endWrite() {
+            size_t head = this->head.load(std::memory_order_relaxed);
+            this->head.store((head + 1) % this->slots.size(), std::memory_order_release);
+        }
+
+        // nullptr when empty
+        T *front() {
+            size_t tail = this->tail.load(std::memory_order_relaxed);
+            if (tail == this->head.load(std::memory_order_acquire))
+                return nullptr;
+            return &this->slots[tail];
+        }
+        void pop() {
+            size_t tail = this->tail.load(std::memory_order_relaxed);
+            this->tail.store((tail + 1) % this->slots.size(), std::memory_order_release);
+        }
+
+        // safe from either side, may be stale by the time it returns
+        bool empty() const {
+            return this->tail.load(std::memory_order_acquire) == this->head.load(std::memory_order_acquire);
+        }
+
+    private:
+        std::vector<T> slots;
+        alignas(64) std::atomic<size_t> head { 0 }; // written by the producer
+        alignas(64) std::atomic<size_t> tail { 0 }; // written by the consumer
+};
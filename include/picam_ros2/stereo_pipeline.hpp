@@ -0,0 +1,113 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fmt/core.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "rclcpp/rclcpp.hpp"
+#include "sensor_msgs/msg/image.hpp"
+#include "sensor_msgs/msg/camera_info.hpp"
+#include "stereo_msgs/msg/disparity_image.hpp"
+
+#include "picam_ros2.hpp"
+#include "calibration.hpp"
+#include "spsc_ring.hpp"
+
+struct StereoConfig {
+    std::string name;
+    int left_location, right_location;
+    long sync_tolerance_ns; // max sensor timestamp difference of a pair
+    bool use_sgbm; // StereoSGBM instead of StereoBM
+    int num_disparities; // multiple of 16
+    int block_size; // odd
+    uint threads; // disparity workers
+    std::string calibration_file;
+    std::string topic_prefix;
+    std::string left_frame_id, right_frame_id;
+};
+
+// Depth from two cameras of the node. The capture threads copy the Y plane of each frame
+// into a lock-free ring per side, a matcher thread pairs frames by sensor timestamp and
+// hands the pairs to workers that rectify both, compute the disparity and publish.
+class StereoPipeline {
+    public:
+        enum Side { LEFT = 0, RIGHT = 1 };
+
+        static std::string GetConfigPrefix(const std::string &name) {
+            return fmt::format("/stereo_{}.", name);
+        }
+        static StereoConfig readConfig(std::shared_ptr<PicamROS2> node, const std::string &name);
+
+        // throws std::runtime_error without a valid stereo calibration
+        StereoPipeline(std::shared_ptr<PicamROS2> node, const StereoConfig &config);
+        ~StereoPipeline();
+
+        // Capture thread side, never blocks; the frame is dropped when the matcher falls behind
+        void pushFrame(Side side, const uint8_t *y, uint stride, uint width, uint height, uint64_t sensor_timestamp_ns, long timestamp_ns);
+
+        const StereoConfig &getConfig() const { return this->config; }
+
+    private:
+        struct Frame {
+            std::vector<uint8_t> y; // tightly packed
+            uint64_t sensor_timestamp_ns;
+            long timestamp_ns;
+        };
+        struct Pair {
+            Frame left, right;
+        };
+        // Per worker, reused for every pair: the messages keep their buffers and only get new stamps
+        struct Worker {
+            cv::Ptr<cv::StereoMatcher> matcher; // keeps per instance buffers
+            cv::Mat disparity_fixed; // 1/16 px
+            sensor_msgs::msg::Image left_msg, right_msg; // rectified
+            stereo_msgs::msg::DisparityImage disparity_msg;
+            sensor_msgs::msg::CameraInfo left_info, right_info;
+        };
+
+        void matchLoop();
+        void workerLoop();
+        void initWorker(Worker &worker);
+        void process(Pair &pair, Worker &worker);
+        sensor_msgs::msg::CameraInfo rectifiedInfo(const cv::Mat &camera_matrix, const cv::Mat &dist_coeffs, const cv::Mat &rotation,
+                                                   const cv::Mat &projection, const std::string &frame_id);
+        std::vector<uint8_t> takeBuffer();
+        void returnBuffer(std::vector<uint8_t> &&buffer);
+
+        StereoConfig config;
+        std::shared_ptr<PicamROS2> node;
+        StereoCalibration calibration;
+        cv::Mat left_map1, left_map2, right_map1, right_map2;
+        cv::Rect valid_disparity; // where both rectified images have data
+        float focal_length, baseline;
+        sensor_msgs::msg::CameraInfo left_info_msg, right_info_msg; // of the rectified pair
+
+        static constexpr size_t RING_CAPACITY = 4;
+        std::unique_ptr<SpscRing<Frame>> rings[2];
+        std::atomic<bool> size_mismatch_logged { false };
+        std::mutex wake_mutex;
+        std::condition_variable wake_cond;
+        std::atomic<bool> stopping { false };
+        std::thread match_thread;
+        std::atomic<uint64_t> frames_unmatched { 0 }, pairs_dropped { 0 }, pairs_published { 0 };
+
+        std::vector<std::thread> workers;
+        std::mutex queue_mutex;
+        std::condition_variable queue_cond;
+        std::deque<Pair> queue;
+
+        std::mutex buffers_mutex;
+        std::vector<std::vector<uint8_t>> spare_buffers; // recycled frame copies
+
+        rclcpp::Publisher<sensor_msgs::msg::Image>::SharedPtr left_publisher, right_publisher;
+        rclcpp::Publisher<sensor_msgs::msg::CameraInfo>::SharedPtr left_info_publisher, right_info_publisher;
+        rclcpp::Publisher<stereo_msgs::msg::DisparityImage>::SharedPtr disparity_publisher;
+};
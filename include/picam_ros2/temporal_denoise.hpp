@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <sys/types.h>
+#include <vector>
+
+// Motion-adaptive recursive temporal filter for YUV420 frames, applied in place.
+// Each output pixel blends the previous output with the current frame by a weight
+// w/16; w starts at the base weight for static pixels and ramps up to 16 (no filtering)
+// as the frame difference exceeds the motion threshold, so moving edges don't smear.
+// One pass over the frame, one frame of history.
+class TemporalDenoiser {
+    public:
+        // strength 0..1 (0 = off), threshold in pixel levels
+        void configure(float strength, uint threshold);
+        void reset() { this->history_valid = false; }
+
+        void process(const std::vector<uint8_t *> &planes, const std::vector<uint> &strides, uint width, uint height);
+
+    private:
+        uint8_t base_weight = 16;
+        uint8_t threshold = 10;
+        std::vector<uint8_t> history; // tightly packed Y, U, V
+        bool history_valid = false;
+        uint history_width = 0, history_height = 0;
+};
+
+// One row, the filtered pixels are written to both cur and prev; NEON on aarch64
+void denoiseRow(uint8_t *cur, uint8_t *prev, uint width, uint8_t base_weight, uint8_t threshold);
+
+namespace denoise_reference {
+    void denoiseRow(uint8_t *cur, uint8_t *prev, uint width, uint8_t base_weight, uint8_t threshold);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <sys/types.h>
+#include <vector>
+
+#include "const.hpp"
+#include "image_conversion.hpp"
+
+// Inference input geometry and normalization
+struct TensorSpec {
+    uint width = 640, height = 640;
+    uint layout = TENSOR_LAYOUT::NCHW;
+    uint dtype = TENSOR_DTYPE::FLOAT32;
+    bool bgr = false; // channel order
+    bool letterbox = true; // keep the aspect ratio and pad, otherwise stretch
+    uint8_t pad = 114; // letterbox fill, per RGB channel before normalization
+    float mean[3] = { 0.0f, 0.0f, 0.0f }; // RGB, in 0..1 pixel units
+    float std[3] = { 1.0f, 1.0f, 1.0f };
+    float quant_scale = 1.0f / 255.0f; // int8 / uint8: q = round(v / quant_scale) + quant_zero_point
+    int quant_zero_point = 0;
+};
+
+// Per output channel (in tensor channel order): YUV -> R, G or B (0..255), clamped, then
+// an affine map that folds in normalization and quantization
+struct TensorRowCoeffs {
+    float y_offset, y_scale;
+    float u[3], v[3]; // chroma weights
+    float gain[3], bias[3];
+};
+
+// Converts YUV420 capture planes into an inference tensor in one pass per output row:
+// bilinear resampling of Y, U and V into the letterboxed content area, YUV -> RGB,
+// normalization, quantization and the layout conversion. Per row scratch stays in L1.
+// Letterbox bars don't change between frames, fillPadding() writes them once.
+class TensorPacker {
+    public:
+        void configure(const TensorSpec &spec, uint src_width, uint src_height, uint color_matrix);
+
+        size_t size() const; // bytes
+        void fillPadding(uint8_t *dst) const;
+        void pack(const picam_conv::YuvPlanes &src, uint8_t *dst);
+
+        // tensor px = image px * scale + offset
+        float scaleX() const { return (float) this->content_width / this->src_width; }
+        float scaleY() const { return (float) this->content_height / this->src_height; }
+        uint offsetX() const { return this->content_x; }
+        uint offsetY() const { return this->content_y; }
+        const TensorSpec &getSpec() const { return this->spec; }
+
+        static uint elementSize(uint dtype);
+
+    private:
+        TensorSpec spec;
+        TensorRowCoeffs coeffs;
+        uint src_width = 0, src_height = 0;
+        uint content_x = 0, content_y = 0, content_width = 0, content_height = 0;
+
+        // bilinear taps per content column / row, luma and chroma
+        std::vector<uint32_t> x0, x1, cx0, cx1;
+        std::vector<float> fx, cfx;
+        std::vector<uint32_t> y0, y1, cy0, cy1;
+        std::vector<float> fy, cfy;
+
+        std::vector<float> row_y, row_u, row_v; // sampled planes
+        std::vector<float> row_c[3]; // normalized channels
+        std::vector<float> row_interleaved; // NHWC
+
+        void sampleRow(const picam_conv::YuvPlanes &src, uint row);
+        void store(const float *src, uint8_t *dst, size_t count) const;
+};
+
+// Row kernels, NEON on aarch64
+void tensorNormalizeRow(const float *y, const float *u, const float *v, uint width, const TensorRowCoeffs &k,
+                        float *c0, float *c1, float *c2);
+void interleave3Row(const float *c0, const float *c1, const float *c2, float *dst, uint width);
+void floatToHalfRow(const float *src, uint16_t *dst, uint count);
+void saturateRowS8(const float *src, int8_t *dst, uint count); // round to nearest even
+void saturateRowU8(const float *src, uint8_t *dst, uint count);
+
+namespace tensor_reference {
+    uint16_t floatToHalf(float value);
+    void tensorNormalizeRow(const float *y, const float *u, const float *v, uint width, const TensorRowCoeffs &k,
+                            float *c0, float *c1, float *c2);
+    void interleave3Row(const float *c0, const float *c1, const float *c2, float *dst, uint width);
+    void floatToHalfRow(const float *src, uint16_t *dst, uint count);
+    void saturateRowS8(const float *src, int8_t *dst, uint count);
+    void saturateRowU8(const float *src, uint8_t *dst, uint count);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// V4L2 memory-to-memory encoder discovery, shared by EncoderHW and its vicodec test.
+// No ROS or libcamera dependencies.
+
+// A coded format the hardware encoder can negotiate
+struct V4L2Codec {
+    std::string name; // hw_encoder_codec
+    uint32_t pixel_format; // of the capture (bitstream) queue
+    std::string encoding; // FFMPEGPacket.encoding
+    bool inline_headers; // parameter sets to repeat before keyframes so viewers can join
+};
+
+extern const std::vector<V4L2Codec> V4L2_CODECS; // h264, hevc, fwht (vicodec)
+const V4L2Codec *findV4L2Codec(const std::string &name); // nullptr if unknown
+
+int xioctl(int fd, unsigned long ctl, void *arg);
+
+// Checks that a V4L2 device is a streaming multi-planar M2M encoder from YUV420 to pixel_format
+bool isM2MEncoder(int fd, uint32_t pixel_format);
+
+// Opens the configured device, or the first matching encoder in /dev/video*; -1 if none
+int openEncoderDevice(const std::string &device_path, uint32_t pixel_format, std::string &opened_path);
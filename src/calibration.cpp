@@ -5,18 +5,19 @@
 #include <json/json.h>
 #include <filesystem>
 #include <fstream>
+#include <cfloat>
 #include "rclcpp/rclcpp.hpp"
 
 namespace fs = std::filesystem;
 
-cv::Mat yuv420ToRgbCopy(const std::vector<AVBufferRef *>& planes, const std::vector<unsigned int>& strides, uint width, uint height) {
+cv::Mat yuv420ToRgbCopy(const std::vector<uint8_t *>& planes, const std::vector<unsigned int>& strides, uint width, uint height) {
 
     // Create Y plane Mat with stride
-    cv::Mat y_full(height, strides[0], CV_8UC1, planes[0]->data);
+    cv::Mat y_full(height, strides[0], CV_8UC1, planes[0]);
 
     // Create U and V plane Mats with stride, but only every other row
-    cv::Mat u_full(height / 2, strides[1], CV_8UC1, planes[1]->data);
-    cv::Mat v_full(height / 2, strides[2], CV_8UC1, planes[2]->data);
+    cv::Mat u_full(height / 2, strides[1], CV_8UC1, planes[1]);
+    cv::Mat v_full(height / 2, strides[2], CV_8UC1, planes[2]);
 
     // Resize U and V to match the full image dimensions
     cv::Mat u_resized, v_resized;
@@ -35,9 +36,9 @@ cv::Mat yuv420ToRgbCopy(const std::vector<AVBufferRef *>& planes, const std::vec
     return rgb;
 }
 
-cv::Mat yuv420ToMonoCopy(const std::vector<AVBufferRef *>& planes, const std::vector<unsigned int>& strides, uint width, uint height) {
+cv::Mat yuv420ToMonoCopy(const std::vector<uint8_t *>& planes, const std::vector<unsigned int>& strides, uint width, uint height) {
 
-    cv::Mat y_full(height, strides[0], CV_8UC1, planes[0]->data);
+    cv::Mat y_full(height, strides[0], CV_8UC1, planes[0]);
     cv::Mat mono = y_full(cv::Rect(0, 0, width, height)).clone();
     return mono;
 }
@@ -55,38 +56,75 @@ std::vector<cv::Point3f> createObjectPoints(cv::Size pattern_size, float square_
     return objectPoints;
 }
 
-void calibrateCamera(const std::vector<cv::Mat>& images, cv::Size pattern_size, float square_size, sensor_msgs::msg::CameraInfo& camera_info) {
-    std::vector<std::vector<cv::Point3f>> objectPoints;
-    std::vector<std::vector<cv::Point2f>> imagePoints;
-    
-    // Find chessboard corners in all images
-    int i = 0;
-    for (const auto& image : images) {
-        std::vector<cv::Point2f> corners;
-        bool found = cv::findChessboardCorners(image, pattern_size, corners);
-        if (found) {
-            std::cout << GREEN << "Chessboard found in frame #" << i << CLR << std::endl;
-            cv::cornerSubPix(image, corners, cv::Size(11, 11), cv::Size(-1, -1),
-                             cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::MAX_ITER, 30, 0.001));
-            imagePoints.push_back(corners);
-            objectPoints.push_back(createObjectPoints(pattern_size, square_size));
-        } else {
-            std::cout << RED << "Chessboard not found in frame #" << i << CLR << std::endl;
-        }
-        ++i;
+bool findCalibrationCorners(const cv::Mat& mono, cv::Size pattern_size, std::vector<cv::Point2f>& corners,
+                            const ChessboardDetectOptions& options, double *sharpness) {
+
+    const cv::TermCriteria subpix_criteria(cv::TermCriteria::EPS + cv::TermCriteria::MAX_ITER, 30, 0.001);
+
+    if (!options.coarse_to_fine) {
+        if (!cv::findChessboardCorners(mono, pattern_size, corners))
+            return false;
+        cv::cornerSubPix(mono, corners, cv::Size(11, 11), cv::Size(-1, -1), subpix_criteria);
+        return true;
     }
-    
-    // Calibrate camera
-    std::cout << YELLOW << "Calibrating..." << CLR << std::endl;
-    cv::Mat cameraMatrix, distCoeffs, R, T;
+
+    // halve until the detection width is reached
+    cv::Mat level = mono;
+    int scale = 1;
+    while ((uint) level.cols > options.max_detect_width && level.cols >= 2 * pattern_size.width) {
+        cv::Mat down;
+        cv::pyrDown(level, down);
+        level = down;
+        scale *= 2;
+    }
+
+    // blur gate, variance of the Laplacian
+    if (sharpness || options.min_sharpness > 0.0) {
+        cv::Mat laplacian;
+        cv::Laplacian(level, laplacian, CV_16S);
+        cv::Scalar mean, stddev;
+        cv::meanStdDev(laplacian, mean, stddev);
+        double variance = stddev[0] * stddev[0];
+        if (sharpness)
+            *sharpness = variance;
+        if (variance < options.min_sharpness)
+            return false;
+    }
+
+    bool found = options.use_sb
+        ? cv::findChessboardCornersSB(level, pattern_size, corners, cv::CALIB_CB_NORMALIZE_IMAGE)
+        : cv::findChessboardCorners(level, pattern_size, corners,
+                                    cv::CALIB_CB_ADAPTIVE_THRESH | cv::CALIB_CB_NORMALIZE_IMAGE | cv::CALIB_CB_FAST_CHECK);
+    if (!found)
+        return false;
+
+    // back to full resolution pixel centres
+    float min_spacing = FLT_MAX;
+    for (size_t i = 0; i < corners.size(); i++) {
+        if (i % pattern_size.width != 0)
+            min_spacing = std::min(min_spacing, (float) cv::norm(corners[i] - corners[i - 1]));
+        corners[i] = (corners[i] + cv::Point2f(0.5f, 0.5f)) * (float) scale - cv::Point2f(0.5f, 0.5f);
+    }
+    min_spacing *= scale;
+
+    // the search window covers the coarse error but stays inside one square
+    int half_window = std::clamp(scale * 2 + 1, 5, std::max(5, (int) (min_spacing / 2) - 1));
+    cv::cornerSubPix(mono, corners, cv::Size(half_window, half_window), cv::Size(-1, -1), subpix_criteria);
+    return true;
+}
+
+double calibrateFromCorners(const std::vector<std::vector<cv::Point2f>>& image_points, cv::Size pattern_size, float square_size,
+                            cv::Size image_size, cv::Mat& camera_matrix, cv::Mat& dist_coeffs) {
+    std::vector<std::vector<cv::Point3f>> object_points(image_points.size(), createObjectPoints(pattern_size, square_size));
     std::vector<cv::Mat> rvecs, tvecs;
-    cv::calibrateCamera(objectPoints, imagePoints, images[0].size(), cameraMatrix, distCoeffs, rvecs, tvecs);
-    
-    // Create CameraInfo structure
+    return cv::calibrateCamera(object_points, image_points, image_size, camera_matrix, dist_coeffs, rvecs, tvecs);
+}
+
+void applyCalibration(const cv::Mat& camera_matrix, const cv::Mat& dist_coeffs, sensor_msgs::msg::CameraInfo& camera_info) {
     camera_info.distortion_model = "plumb_bob";
-    cv::Mat_<double> K = cameraMatrix;
+    cv::Mat_<double> K = camera_matrix;
     std::copy_n(K.begin(), 9, camera_info.k.begin());
-    camera_info.d = std::vector<double>(distCoeffs.begin<double>(), distCoeffs.end<double>());
+    camera_info.d = std::vector<double>(dist_coeffs.begin<double>(), dist_coeffs.end<double>());
 }
 
 bool readCalibration(std::string file_name, sensor_msgs::msg::CameraInfo& camera_info, std::string camera_model, int width, int height) {
@@ -197,4 +235,34 @@ bool writeCalibration(sensor_msgs::msg::CameraInfo& camera_info, std::string cam
         outFile.close();
         return false;
     }
-}
\ No newline at end of file
+}
+static bool readJsonMat(const Json::Value& value, int rows, int cols, cv::Mat& mat) {
+    if (!value.isArray() || (cols > 0 && (int) value.size() != rows * cols) || value.size() == 0)
+        return false;
+    if (cols <= 0)
+        cols = value.size();
+    mat = cv::Mat(rows, cols, CV_64F);
+    for (uint i = 0; i < value.size(); ++i)
+        mat.at<double>(i / cols, i % cols) = value[i].asDouble();
+    return true;
+}
+
+bool readStereoCalibration(std::string file_name, StereoCalibration& calibration) {
+    Json::Value c;
+    std::ifstream file(file_name);
+    Json::Reader reader;
+    if (!reader.parse(file, c))
+        return false;
+
+    calibration.size = cv::Size(c["calibrated_width"].asInt(), c["calibrated_height"].asInt());
+    bool valid = calibration.size.area() > 0
+        && readJsonMat(c["left"]["k"], 3, 3, calibration.left_camera_matrix)
+        && readJsonMat(c["left"]["d"], 1, 0, calibration.left_dist_coeffs)
+        && readJsonMat(c["right"]["k"], 3, 3, calibration.right_camera_matrix)
+        && readJsonMat(c["right"]["d"], 1, 0, calibration.right_dist_coeffs)
+        && readJsonMat(c["r"], 3, 3, calibration.rotation)
+        && readJsonMat(c["t"], 3, 1, calibration.translation);
+    if (!valid)
+        RCLCPP_ERROR(rclcpp::get_logger("rclcpp"), "Stereo calibration %s needs calibrated_width, calibrated_height, left.k, left.d, right.k, right.d, r and t", file_name.c_str());
+    return valid;
+}
@@ -0,0 +1,130 @@
+#include <fmt/core.h>
+
+#include "picam_ros2/calibration.hpp"
+#include "picam_ros2/calibration_worker.hpp"
+
+CalibrationWorker::CalibrationWorker(cv::Size image_size, cv::Size pattern_size, float square_size, uint boards_needed,
+                                     const ChessboardDetectOptions &detect_options, uint num_threads,
+                                     std::function<void(const Result &)> on_result, std::function<void(const std::string &)> on_progress) {
+    this->image_size = image_size;
+    this->pattern_size = pattern_size;
+    this->square_size = square_size;
+    this->boards_needed = boards_needed;
+    this->detect_options = detect_options;
+    this->on_result = on_result;
+    this->on_progress = on_progress;
+    this->coverage.assign(COVERAGE_GRID * COVERAGE_GRID, false);
+
+    num_threads = std::max(1u, num_threads);
+    this->max_queued = num_threads;
+    for (uint i = 0; i < num_threads; i++)
+        this->threads.emplace_back(&CalibrationWorker::workerLoop, this);
+}
+
+CalibrationWorker::~CalibrationWorker() {
+    {
+        std::lock_guard<std::mutex> lock(this->queue_mutex);
+        this->stopping = true;
+        this->queue.clear();
+    }
+    this->queue_cond.notify_all();
+    for (auto &thread : this->threads)
+        thread.join();
+}
+
+bool CalibrationWorker::submit(cv::Mat mono) {
+    {
+        std::lock_guard<std::mutex> lock(this->queue_mutex);
+        if (this->stopping || this->finished || this->queue.size() >= this->max_queued)
+            return false;
+        this->queue.push_back(std::move(mono));
+    }
+    this->queue_cond.notify_one();
+    return true;
+}
+
+uint CalibrationWorker::boardsFound() {
+    std::lock_guard<std::mutex> lock(this->corners_mutex);
+    return this->corner_sets.size();
+}
+
+void CalibrationWorker::workerLoop() {
+    while (true) {
+        cv::Mat mono;
+        {
+            std::unique_lock<std::mutex> lock(this->queue_mutex);
+            this->queue_cond.wait(lock, [this] { return this->stopping || !this->queue.empty(); });
+            if (this->stopping)
+                return;
+            mono = std::move(this->queue.front());
+            this->queue.pop_front();
+        }
+        this->detect(mono);
+    }
+}
+
+void CalibrationWorker::detect(const cv::Mat &mono) {
+    std::vector<cv::Point2f> corners;
+    double sharpness = 0.0;
+    bool found = findCalibrationCorners(mono, this->pattern_size, corners, this->detect_options, &sharpness);
+    bool blurry = !found && sharpness < this->detect_options.min_sharpness;
+
+    bool solve_now = false;
+    std::string report;
+    {
+        std::lock_guard<std::mutex> lock(this->corners_mutex);
+        if (this->solving || this->finished)
+            return; // enough boards already, late frames are dropped
+        if (found) {
+            this->corner_sets.push_back(corners);
+            for (auto &corner : corners) {
+                int cx = std::clamp((int) (corner.x * COVERAGE_GRID / this->image_size.width), 0, COVERAGE_GRID - 1);
+                int cy = std::clamp((int) (corner.y * COVERAGE_GRID / this->image_size.height), 0, COVERAGE_GRID - 1);
+                this->coverage[cy * COVERAGE_GRID + cx] = true;
+            }
+            float area = (float) cv::contourArea(std::vector<cv::Point2f> { corners.front(), corners[this->pattern_size.width - 1],
+                                                                            corners.back(), corners[corners.size() - this->pattern_size.width] })
+                         / (this->image_size.area());
+            this->min_board_area = std::min(this->min_board_area, area);
+            this->max_board_area = std::max(this->max_board_area, area);
+        } else if (blurry) {
+            this->frames_blurry++;
+        } else {
+            this->frames_rejected++;
+        }
+        report = this->progressReport(found, blurry, sharpness);
+        if (this->corner_sets.size() >= this->boards_needed) {
+            this->solving = true;
+            solve_now = true;
+        }
+    }
+
+    this->on_progress(report);
+    if (solve_now)
+        this->solve();
+}
+
+std::string CalibrationWorker::progressReport(bool found, bool blurry, double sharpness) {
+    uint cells = std::count(this->coverage.begin(), this->coverage.end(), true);
+    return fmt::format("{} (sharpness {:.0f}) board {}/{}, {} frames without board, {} too blurry, coverage {}/{} cells, board size {:.0f}-{:.0f}% of frame",
+                       found ? "found" : (blurry ? "too blurry" : "not found"), sharpness, this->corner_sets.size(), this->boards_needed,
+                       this->frames_rejected, this->frames_blurry,
+                       cells, this->coverage.size(), this->min_board_area <= this->max_board_area ? this->min_board_area * 100.0f : 0.0f,
+                       this->max_board_area * 100.0f);
+}
+
+void CalibrationWorker::solve() {
+    std::vector<std::vector<cv::Point2f>> corner_sets;
+    {
+        std::lock_guard<std::mutex> lock(this->corners_mutex);
+        corner_sets = this->corner_sets;
+    }
+
+    this->on_progress(fmt::format("solving with {} boards", corner_sets.size()));
+    Result result;
+    result.rms = calibrateFromCorners(corner_sets, this->pattern_size, this->square_size, this->image_size,
+                                      result.camera_matrix, result.dist_coeffs);
+    this->finished = true;
+    this->on_progress(fmt::format("done, reprojection error {:.3f} px", result.rms));
+    this->on_result(result);
+}
@@ -1,5 +1,6 @@
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <algorithm>
 
 #include "picam_ros2/const.hpp"
 #include "picam_ros2/camera_interface.hpp"
@@ -7,21 +8,23 @@
 
 using namespace libcamera;
 
-void freeBuffer(void* opaque, uint8_t* data) {
-    munmap(data, static_cast<size_t>(reinterpret_cast<uintptr_t>(opaque)));
-}
-
 uint32_t roundUp4096(uint32_t x) {
     constexpr uint32_t mask = 4096 - 1; // 0xFFF
     return (x + mask) & ~mask;
 }
 
-CameraInterface::CameraInterface(std::shared_ptr<Camera> camera, int location, int rotation, std::string model, std::shared_ptr<PicamROS2> node) {
+CameraInterface::CameraInterface(std::shared_ptr<Camera> camera, int location, int rotation, std::string model, std::shared_ptr<PicamROS2> node)
+    : buffer_pool(fmt::format("picam-ros2-{}", location)),
+      raw_buffer_pool(fmt::format("picam-ros2-raw-{}", location)) {
     this->camera = camera;
     this->node = node;
     this->location = location;
     this->rotation = rotation;
     this->model = model;
+
+    // stop & start again with the current parameters, keeping the dma buffers
+    this->srv_restart = this->node->create_service<std_srvs::srv::Trigger>(fmt::format("camera_{}/restart", this->location),
+                                                                           std::bind(&CameraInterface::restart, this, std::placeholders::_1, std::placeholders::_2));
 }
 
 void CameraInterface::start() {
@@ -46,29 +49,99 @@ void CameraInterface::start() {
 		transform = Transform::VFlip * transform;
     
     // configure camera
-    std::unique_ptr<CameraConfiguration> config = this->camera->generateConfiguration( { StreamRole::VideoRecording } );
+    std::vector<StreamRole> roles = { StreamRole::VideoRecording };
+    if (this->publish_raw)
+        roles.push_back(StreamRole::Raw);
+    std::unique_ptr<CameraConfiguration> config = this->camera->generateConfiguration(roles);
     
     this->streamConfig = &config->at(0);
     // this->streamConfig->controls.set(libcamera::controls::AeEnable, false);
     this->streamConfig->size.width = this->width;
     this->streamConfig->size.height = this->height;
+    if (this->buffer_count_auto) {
+        this->buffer_count = this->buffer_pool.recommendedCount(MIN_AUTO_BUFFER_COUNT, MAX_AUTO_BUFFER_COUNT);
+    }
     this->streamConfig->bufferCount = this->buffer_count;
     config->orientation = config->orientation * transform;
     // this->streamConfig.stride = (uint)this->width;
 
+    StreamConfiguration *raw_config = nullptr;
+    if (this->publish_raw) {
+        raw_config = &config->at(1);
+        if (this->raw_width > 0 && this->raw_height > 0) {
+            raw_config->size.width = this->raw_width;
+            raw_config->size.height = this->raw_height;
+        }
+        raw_config->bufferCount = this->buffer_count; // one raw buffer per request
+    }
+
     if (config->validate() == CameraConfiguration::Invalid)
 	    throw std::runtime_error("Failed to validate stream configurations");
 
+    if (raw_config) {
+        this->raw_format = parseRawFormat(raw_config->pixelFormat.toString());
+        if (this->raw_format.compressed) {
+            // PiSP compression is undocumented, ask the frontend for plain 16-bit samples instead
+            raw_config->pixelFormat = PixelFormat::fromString("S" + this->raw_format.order + "16");
+            if (config->validate() == CameraConfiguration::Invalid)
+                throw std::runtime_error("Failed to validate stream configurations");
+            this->raw_format = parseRawFormat(raw_config->pixelFormat.toString());
+        }
+        if (!this->raw_format.supported())
+            throw std::runtime_error("Unsupported raw pixel format " + raw_config->pixelFormat.toString());
+        this->raw_width = raw_config->size.width;
+        this->raw_height = raw_config->size.height;
+        this->log(YELLOW, "Raw stream config: ", raw_config->toString(), ", stride ", raw_config->stride);
+    }
+
     this->stride = this->streamConfig->stride;
+    this->buffer_count = this->streamConfig->bufferCount;
+
+    // followers correct their frame duration on requeue, corrections show after the queued requests
+    this->phase_lock_group = nullptr;
+    this->phase_lock_duration_ns = 0;
+    this->phase_lock_reported = false;
+    if (!this->phase_lock_group_name.empty()) {
+        PhaseLockOptions options;
+        options.tolerance_ns = (int64_t) (this->phase_lock_tolerance_us * 1000.0);
+        options.control_delay = this->buffer_count + 2;
+        this->phase_lock = PhaseLockController(options);
+        this->phase_lock_group = PhaseLockGroup::get(this->phase_lock_group_name);
+    }
+
+    // YUV -> RGB conversions follow the colour space the pipeline settled on
+    this->color_matrix = COLOR_MATRIX::BT601_LIMITED;
+    if (this->streamConfig->colorSpace) {
+        bool full_range = this->streamConfig->colorSpace->range == ColorSpace::Range::Full;
+        if (this->streamConfig->colorSpace->ycbcrEncoding == ColorSpace::YcbcrEncoding::Rec709)
+            this->color_matrix = full_range ? COLOR_MATRIX::BT709_FULL : COLOR_MATRIX::BT709_LIMITED;
+        else
+            this->color_matrix = full_range ? COLOR_MATRIX::BT601_FULL : COLOR_MATRIX::BT601_LIMITED;
+    }
+
+    // in a composite only the first camera's encoder runs, on the tiled frames of all
+    if (this->composite) {
+        this->publish_h264 = this->composite_tile == 0;
+        if (this->publish_h264)
+            this->h264_topic = this->composite->getConfig().h264_topic;
+        if (this->roi_enabled)
+            this->log(YELLOW, "ROI encoding not supported in composites, disabled");
+        this->roi_enabled = false;
+        this->composite->setTileFrameId(this->composite_tile, this->frame_id);
+    }
+    uint encoder_width = this->composite ? this->composite->width() : this->width;
+    uint encoder_height = this->composite ? this->composite->height() : this->height;
 
     if (this->publish_h264)
         this->log(GREEN, "Publishing as H.264 topic: ", this->h264_topic); 
     else
         this->log(BLUE, "Not publishing as H.264 topic"); 
     
-    if (this->publish_image)
-        this->log(GREEN, "Publishing as Image topic (", IMAGE_OUTPUT_FORMAT_NAMES.at(this->image_output_format), "): ", this->image_topic); 
-    else
+    if (this->publish_image) {
+        for (auto &output : this->image_outputs)
+            this->log(GREEN, "Publishing as Image topic (", IMAGE_OUTPUT_FORMAT_NAMES.at(output.format), ", ", COLOR_MATRIX_NAMES.at(this->color_matrix),
+                      output.schedule.divisor > 1 ? fmt::format(", every {} frames, phase {}", output.schedule.divisor, output.schedule.phase) : "", "): ", output.topic); 
+    } else
         this->log(BLUE, "Not publishing as Image topic"); 
 
     if (this->publish_info)
@@ -81,7 +154,7 @@ void CameraInterface::start() {
     this->log(YELLOW, "Stride: ", this->streamConfig->stride); 
     this->log(YELLOW, "Bit rate: ", this->bit_rate); 
     this->log(YELLOW, "Compression rate: ", this->compression); 
-    this->log(YELLOW, "Buffer count: ", this->streamConfig->bufferCount); 
+    this->log(YELLOW, "Buffer count: ", this->streamConfig->bufferCount, this->buffer_count_auto ? " (auto)" : ""); 
     this->log(YELLOW, "Auto exposure enabled: ", this->ae_enable); 
     this->log(YELLOW, "Exposure time: ", this->exposure_time, " ns"); 
     this->log(YELLOW, "Analogue gain: ", this->analog_gain); 
@@ -96,42 +169,57 @@ void CameraInterface::start() {
     // FrameBufferAllocator *allocator = new FrameBufferAllocator(this->camera);
 
     this->log("Allocating...");
+    this->raw_stream = raw_config ? raw_config->stream() : nullptr;
     for (StreamConfiguration &cfg : *config) {
         auto stream = cfg.stream();
+        bool raw = stream == this->raw_stream;
 
         std::vector<std::unique_ptr<FrameBuffer>> buffers;
-        this->buffer_size = roundUp4096(cfg.frameSize);
+        size_t buffer_size = roundUp4096(cfg.frameSize);
+        if (!raw)
+            this->buffer_size = buffer_size;
+
+        // pooled buffers stay allocated & mapped across restarts
+        DmaBufferPool &pool = raw ? this->raw_buffer_pool : this->buffer_pool;
+        std::vector<PooledBuffer *> pooled;
+        try {
+            pooled = pool.acquire(cfg.bufferCount, buffer_size);
+        } catch (...) {
+            // the other stream's buffers aren't queued anywhere yet, the restart may be retried
+            this->buffer_pool.releaseAll();
+            this->raw_buffer_pool.releaseAll();
+            throw;
+        }
 
-		for (uint i = 0; i < cfg.bufferCount; i++)
+		for (PooledBuffer *pooled_buffer : pooled)
 		{
-			std::string name("pica-ros2-" + std::to_string(i));
-			libcamera::UniqueFD fd = this->dma_heap.alloc(name.c_str(), this->buffer_size);
-
-			if (!fd.isValid())
-				throw std::runtime_error("Failed to allocate capture buffers for stream");
-
 			std::vector<FrameBuffer::Plane> plane(1);
-			plane[0].fd = libcamera::SharedFD(std::move(fd));
+			plane[0].fd = pooled_buffer->fd;
 			plane[0].offset = 0;
-			plane[0].length = this->buffer_size;
+			plane[0].length = buffer_size;
 
 			buffers.push_back(std::make_unique<FrameBuffer>(plane));
-			void *memory = mmap(NULL, this->buffer_size, PROT_READ , MAP_SHARED, plane[0].fd.get(), 0);
 
+            // the planes point into the buffer's mapping
+            MappedBuffer &mapped = this->mapped_capture_buffers[buffers.back().get()];
+            mapped.memory = pooled_buffer->memory;
+            mapped.size = buffer_size;
+            if (raw) {
+                // single Bayer plane
+                mapped.planes.push_back(mapped.memory);
+                mapped.strides.push_back(cfg.stride);
+                mapped.plane_sizes.push_back(cfg.stride * cfg.size.height);
+                continue;
+            }
             uint plane_offset = 0;
             for (uint j = 0; j < 3; j++) {
                 
                 uint plane_stride = (j == 0) ? this->stride : this->stride / 2;
                 uint plane_length = plane_stride * (j == 0 ? this->height : this->height / 2);
                 
-                this->mapped_capture_buffers[buffers.back().get()].push_back(av_buffer_create(
-                    static_cast<uint8_t*>(memory) + plane_offset,
-                    plane_length,
-                    freeBuffer,
-                    reinterpret_cast<void*>(this->buffer_size),
-                    0
-                ));
-                this->mapped_capture_buffer_strides[buffers.back().get()].push_back(plane_stride);
+                mapped.planes.push_back(mapped.memory + plane_offset);
+                mapped.strides.push_back(plane_stride);
+                mapped.plane_sizes.push_back(plane_length);
                 plane_offset += plane_length;
             }
             
@@ -141,8 +229,11 @@ void CameraInterface::start() {
         this->capture_frame_buffers[stream] = std::move(buffers);
 
         this->log("Allocated ", this->capture_frame_buffers[stream].size(), " capture dma buffers for stream pixel format: ", cfg.pixelFormat.toString());
+    }
 
-        // make requests
+    // make requests, the raw buffers ride along with the processed ones
+    {
+        auto stream = this->streamConfig->stream();
         for (unsigned int i = 0; i < this->capture_frame_buffers[stream].size(); ++i) {
             std::unique_ptr<Request> request = camera->createRequest();
             if (!request)
@@ -165,6 +256,12 @@ void CameraInterface::start() {
                 request->controls().set(libcamera::controls::ExposureTime, this->exposure_time);
             }
             
+            // locked cameras run at a fixed frame duration, AE can't stretch it
+            if (this->phase_lock_group) {
+                int64_t frameDuration = 1000000 / this->fps;
+                request->controls().set(libcamera::controls::FrameDurationLimits, {frameDuration, frameDuration});
+            }
+
             request->controls().set(libcamera::controls::AnalogueGain, this->analog_gain);
                 
             request->controls().set(libcamera::controls::AwbEnable, this->awb_enable);
@@ -180,6 +277,8 @@ void CameraInterface::start() {
 
             const std::unique_ptr<FrameBuffer> &buffer = this->capture_frame_buffers[stream][i];
             int ret = request->addBuffer(stream, buffer.get());
+            if (ret == 0 && this->raw_stream && i < this->capture_frame_buffers[this->raw_stream].size())
+                ret = request->addBuffer(this->raw_stream, this->capture_frame_buffers[this->raw_stream][i].get());
             if (ret < 0)
             {
                 std::cerr << "Can't set buffer for request" << std::endl;
@@ -191,6 +290,14 @@ void CameraInterface::start() {
         this->lines_printed = 0;
     }
 
+    if (this->publish_shm) {
+        std::string shm_name = picam_shm::ringName(this->location);
+        const MappedBuffer &layout = this->mapped_capture_buffers.at(this->capture_frame_buffers[this->streamConfig->stream()].front().get());
+        this->shm_writer = std::make_unique<ShmFrameWriter>(shm_name, layout, this->width, this->height,
+                                                            IMAGE_OUTPUT_FORMAT_NAMES.at(IMAGE_OUTPUT_FORMAT::YUV420), this->frame_id, this->shm_slots);
+        this->log(GREEN, "Writing frames to shared memory ", shm_name, " (", this->shm_slots, " slots)");
+    }
+
     // init ros frame publisher
     
     if (this->publish_h264) {
@@ -200,53 +307,232 @@ void CameraInterface::start() {
         h264_qos.durability_volatile();
         this->h264_publisher = this->node->create_publisher<ffmpeg_image_transport_msgs::msg::FFMPEGPacket>(this->h264_topic, h264_qos);
         
-        this->out_h264_msg.header.frame_id = this->frame_id;
-        this->out_h264_msg.width = this->width;
-        this->out_h264_msg.height = this->height;
+        this->out_h264_msg.header.frame_id = this->composite ? this->composite->getConfig().frame_id : this->frame_id;
+        this->out_h264_msg.width = encoder_width;
+        this->out_h264_msg.height = encoder_height;
         this->out_h264_msg.encoding = "h.264";
         this->out_h264_msg.is_bigendian = false;
     }
 
+    // phases count in ticks of the sensor clock, anchored again on the first frame
+    this->output_clock.reset(this->fps);
+
     if (this->publish_image) {
 
-        this->log("Creating Image publisher for ", this->image_topic);
-        auto image_qos = rclcpp::QoS(1);
-        image_qos.reliable();
-        image_qos.durability_volatile();
-        this->image_publisher = this->node->create_publisher<sensor_msgs::msg::Image>(this->image_topic, image_qos);
-        
-        this->out_image_msg.header.frame_id = this->frame_id;
-        this->out_image_msg.width = this->width;
-        this->out_image_msg.height = this->height;
-        this->out_image_msg.encoding = IMAGE_OUTPUT_FORMAT_NAMES.at(this->image_output_format);
-        this->out_image_msg.is_bigendian = false;
+        // decimated outputs get phases staggered against all other cameras' outputs
+        for (auto &output : this->image_outputs) {
+            const ImageEncoding *encoding = findImageEncoding(output.format);
+            uint64_t weight = (uint64_t) this->width * this->height * encoding->bytes_per_pixel;
+            output.schedule.divisor = OutputSchedule::divisorFor(output.rate, this->fps);
+            output.schedule.phase = OutputPhaseAllocator::instance().allocate(this->location, output.schedule.divisor, weight);
+        }
+
+        for (auto &output : this->image_outputs) {
+            this->log("Creating Image publisher for ", output.topic);
+            auto image_qos = rclcpp::QoS(1);
+            image_qos.reliable();
+            image_qos.durability_volatile();
+            output.publisher = this->node->create_publisher<sensor_msgs::msg::Image>(output.topic, image_qos);
+
+            output.msg.header.frame_id = this->frame_id;
+            output.msg.width = this->width;
+            output.msg.height = this->height;
+            output.msg.encoding = IMAGE_OUTPUT_FORMAT_NAMES.at(output.format);
+            output.msg.is_bigendian = false;
+        }
+    }
+
+    if (this->publish_tensor) {
+        this->tensor_schedule.divisor = OutputSchedule::divisorFor(this->tensor_rate, this->fps);
+        this->tensor_schedule.phase = OutputPhaseAllocator::instance().allocate(this->location, this->tensor_schedule.divisor,
+                                                                                (uint64_t) this->width * this->height * 3);
+        this->tensor_packer.configure(this->tensor_spec, this->width, this->height, this->color_matrix);
+
+        this->log("Creating tensor publisher for ", this->tensor_topic);
+        auto tensor_qos = rclcpp::QoS(1);
+        tensor_qos.reliable();
+        tensor_qos.durability_volatile();
+        this->tensor_publisher = this->node->create_publisher<picam_ros2::msg::Tensor>(this->tensor_topic, tensor_qos);
+
+        auto &msg = this->out_tensor_msg;
+        msg.header.frame_id = this->frame_id;
+        msg.layout = TENSOR_LAYOUT_NAMES.at(this->tensor_spec.layout);
+        msg.dtype = TENSOR_DTYPE_NAMES.at(this->tensor_spec.dtype);
+        if (this->tensor_spec.layout == TENSOR_LAYOUT::NCHW)
+            msg.shape = { 1, 3, this->tensor_spec.height, this->tensor_spec.width };
+        else
+            msg.shape = { 1, this->tensor_spec.height, this->tensor_spec.width, 3 };
+        msg.channels = this->tensor_spec.bgr ? "bgr" : "rgb";
+        msg.quant_scale = this->tensor_spec.quant_scale;
+        msg.quant_zero_point = this->tensor_spec.quant_zero_point;
+        msg.image_width = this->width;
+        msg.image_height = this->height;
+        msg.scale_x = this->tensor_packer.scaleX();
+        msg.scale_y = this->tensor_packer.scaleY();
+        msg.offset_x = this->tensor_packer.offsetX();
+        msg.offset_y = this->tensor_packer.offsetY();
+        msg.data.resize(this->tensor_packer.size());
+        this->tensor_packer.fillPadding(msg.data.data()); // only the content area is packed per frame
+        this->log(GREEN, "Publishing tensor (", this->tensor_spec.width, "x", this->tensor_spec.height, " ", msg.layout, " ", msg.dtype, ", ", COLOR_MATRIX_NAMES.at(this->color_matrix),
+                  this->tensor_schedule.divisor > 1 ? fmt::format(", every {} frames, phase {}", this->tensor_schedule.divisor, this->tensor_schedule.phase) : "", "): ", this->tensor_topic);
+    }
+
+    if (this->publish_raw) {
+        this->raw_schedule.divisor = OutputSchedule::divisorFor(this->raw_rate, this->fps);
+        this->raw_schedule.phase = OutputPhaseAllocator::instance().allocate(this->location, this->raw_schedule.divisor,
+                                                                             (uint64_t) this->raw_width * this->raw_height * (this->raw_output_16bit ? 2 : 1));
+
+        auto raw_qos = rclcpp::QoS(1);
+        raw_qos.reliable();
+        raw_qos.durability_volatile();
+        if (this->raw_lossless) {
+            this->log("Creating lossless raw CompressedImage publisher for ", this->raw_topic, "/lossless");
+            this->raw_lossless_publisher = this->node->create_publisher<sensor_msgs::msg::CompressedImage>(this->raw_topic + "/lossless", raw_qos);
+            this->out_raw_lossless_msg.header.frame_id = this->frame_id;
+            this->out_raw_lossless_msg.format = this->raw_format.encoding(this->raw_output_16bit) + picam_lossless::FORMAT_SUFFIX;
+        } else {
+            this->log("Creating raw Image publisher for ", this->raw_topic);
+            this->raw_publisher = this->node->create_publisher<sensor_msgs::msg::Image>(this->raw_topic, raw_qos);
+        }
+
+        this->out_raw_msg.header.frame_id = this->frame_id;
+        this->out_raw_msg.width = this->raw_width;
+        this->out_raw_msg.height = this->raw_height;
+        this->out_raw_msg.encoding = this->raw_format.encoding(this->raw_output_16bit);
+        this->out_raw_msg.is_bigendian = false;
+        this->out_raw_msg.step = this->raw_width * (this->raw_output_16bit ? 2 : 1);
+        this->out_raw_msg.data.resize((size_t) this->out_raw_msg.step * this->raw_height);
+    }
+
+    if (this->publish_lossless) {
+        this->lossless_schedule.divisor = OutputSchedule::divisorFor(this->lossless_rate, this->fps);
+        this->lossless_schedule.phase = OutputPhaseAllocator::instance().allocate(this->location, this->lossless_schedule.divisor,
+                                                                                  (uint64_t) this->width * this->height * (this->lossless_format == IMAGE_OUTPUT_FORMAT::YUV420 ? 3 : 2) / 2);
+
+        this->log("Creating lossless CompressedImage publisher for ", this->lossless_topic);
+        auto lossless_qos = rclcpp::QoS(1);
+        lossless_qos.reliable();
+        lossless_qos.durability_volatile();
+        this->lossless_publisher = this->node->create_publisher<sensor_msgs::msg::CompressedImage>(this->lossless_topic, lossless_qos);
+        this->out_lossless_msg.header.frame_id = this->frame_id;
+        this->out_lossless_msg.format = IMAGE_OUTPUT_FORMAT_NAMES.at(this->lossless_format) + picam_lossless::FORMAT_SUFFIX;
+    }
+
+    if (this->publish_lossless || (this->publish_raw && this->raw_lossless)) {
+        this->lossless_encoder = std::make_unique<picam_lossless::Encoder>(this->lossless_threads, this->lossless_level);
+        this->log(GREEN, "Lossless zstd level ", this->lossless_level, " on ", this->lossless_encoder->threadCount(), " threads");
+    }
+
+    if (this->publish_jpeg) {
+        this->jpeg_schedule.divisor = OutputSchedule::divisorFor(this->jpeg_rate, this->fps);
+        this->jpeg_schedule.phase = OutputPhaseAllocator::instance().allocate(this->location, this->jpeg_schedule.divisor,
+                                                                              (uint64_t) this->width * this->height * 3 / 2);
+
+        auto jpeg_qos = rclcpp::QoS(1);
+        jpeg_qos.reliable();
+        jpeg_qos.durability_volatile();
+        this->jpeg_publisher = this->node->create_publisher<sensor_msgs::msg::CompressedImage>(this->jpeg_topic, jpeg_qos);
+        this->out_jpeg_msg.header.frame_id = this->frame_id;
+        this->out_jpeg_msg.format = "bgr8; jpeg compressed bgr8"; // as compressed_image_transport, decodes to bgr8
+        this->jpeg_encoder = std::make_unique<JpegEncoder>(this->jpeg_threads, this->jpeg_quality);
+        switch (this->color_matrix) { // into the full range BT.601 JFIF assumes
+            case COLOR_MATRIX::BT601_FULL: this->jpeg_coeffs = JpegRowCoeffs::from<picam_conv::BT601Full>(); break;
+            case COLOR_MATRIX::BT709_LIMITED: this->jpeg_coeffs = JpegRowCoeffs::from<picam_conv::BT709Limited>(); break;
+            case COLOR_MATRIX::BT709_FULL: this->jpeg_coeffs = JpegRowCoeffs::from<picam_conv::BT709Full>(); break;
+            default: this->jpeg_coeffs = JpegRowCoeffs::from<picam_conv::BT601Limited>(); break;
+        }
+        this->log(GREEN, "Publishing JPEG (quality ", this->jpeg_quality, ", ", this->jpeg_encoder->threadCount(), " threads",
+                  this->jpeg_schedule.divisor > 1 ? fmt::format(", every {} frames, phase {}", this->jpeg_schedule.divisor, this->jpeg_schedule.phase) : "", "): ", this->jpeg_topic);
+    }
+
+    if (this->motion_detection) {
+        this->motion_detector.configure(this->motion_cell_size, (float) this->motion_threshold, this->motion_min_cells,
+                                        (float) this->motion_scene_change, (uint) std::max(1.0, this->motion_background_sec * this->fps));
+        this->motion_active = true;
+        this->motion_changed = true;
+        this->last_motion_ns = 0;
+        this->motion_mask_dirty = false;
+        this->h264_keepalive_schedule.divisor = OutputSchedule::divisorFor(this->h264_keepalive_rate, this->fps);
+        this->h264_keepalive_schedule.phase = 0;
+        this->log(GREEN, "Motion detection in ", this->motion_cell_size, "px cells",
+                  this->h264_keepalive_rate > 0.0 ? fmt::format(", H.264 at {} Hz while static", this->h264_keepalive_rate) : "");
+
+        if (this->publish_motion) {
+            this->log("Creating motion mask publisher for ", this->motion_topic);
+            auto motion_qos = rclcpp::QoS(1);
+            motion_qos.reliable();
+            motion_qos.durability_volatile();
+            this->motion_publisher = this->node->create_publisher<sensor_msgs::msg::Image>(this->motion_topic, motion_qos);
+
+            this->out_motion_msg.header.frame_id = this->frame_id;
+            this->out_motion_msg.encoding = "mono8";
+            this->out_motion_msg.is_bigendian = false;
+        }
+    }
+
+    if (this->publish_fiducials) {
+        this->log("Creating fiducial publisher for ", this->fiducial_topic);
+        auto fiducial_qos = rclcpp::QoS(10);
+        fiducial_qos.reliable();
+        fiducial_qos.durability_volatile();
+        this->fiducial_publisher = this->node->create_publisher<picam_ros2::msg::FiducialMarkerArray>(this->fiducial_topic, fiducial_qos);
+        this->fiducial_worker = std::make_unique<FiducialWorker>(this->fiducial_options,
+                                                                 std::bind(&CameraInterface::fiducialResult, this, std::placeholders::_1,
+                                                                           std::placeholders::_2, std::placeholders::_3));
+        if (!this->publish_info)
+            this->log(YELLOW, "Fiducial poses need publish_info for the calibration; publishing corners only");
+    }
+
+    if (this->publish_features) {
+        this->log("Creating features publisher for ", this->features_topic);
+        auto features_qos = rclcpp::QoS(10);
+        features_qos.reliable();
+        features_qos.durability_volatile();
+        this->features_publisher = this->node->create_publisher<picam_ros2::msg::FeatureArray>(this->features_topic, features_qos);
+        this->feature_worker = std::make_unique<FeatureWorker>(this->feature_options,
+                                                               std::bind(&CameraInterface::featuresResult, this, std::placeholders::_1,
+                                                                         std::placeholders::_2, std::placeholders::_3, std::placeholders::_4));
     }
 
     if (this->publish_info) {
+        this->info_schedule.divisor = OutputSchedule::divisorFor(this->info_rate, this->fps);
+        this->info_schedule.phase = 0;
         this->log("Creating CameraInfo publisher for ", this->info_topic);
         auto info_qos = rclcpp::QoS(1);
         info_qos.reliable();
         info_qos.durability_volatile();
         this->info_publisher = this->node->create_publisher<sensor_msgs::msg::CameraInfo>(this->info_topic, info_qos);
 
-        this->out_info_msg.header.frame_id = this->frame_id;
-        this->out_info_msg.width = this->width;
-        this->out_info_msg.height = this->height;
+        bool calibrated;
+        {
+            std::lock_guard<std::mutex> lock(this->info_mutex);
+            this->out_info_msg.header.frame_id = this->frame_id;
+            this->out_info_msg.width = this->width;
+            this->out_info_msg.height = this->height;
+            calibrated = readCalibration(this->calibration_file, this->out_info_msg, this->model, this->width, this->height);
+        }
 
-        if (readCalibration(this->calibration_file, this->out_info_msg, this->model, this->width, this->height)) {
+        if (calibrated) {
             RCLCPP_INFO(rclcpp::get_logger("rclcpp"), "Loaded calibration file %s", this->calibration_file.c_str());
+            if (this->fiducial_worker)
+                this->updateFiducialCameraModel();
+            if (this->publish_image && this->hasRectifiedOutputs())
+                this->updateRectifyMaps(true);
         } else {
             RCLCPP_ERROR(rclcpp::get_logger("rclcpp"), "Failed to load calibration file %s; camera uncalibrated", this->calibration_file.c_str());
         }
+    } else if (this->publish_image && this->hasRectifiedOutputs()) {
+        RCLCPP_WARN(rclcpp::get_logger("rclcpp"), "Rectified image outputs need publish_info for the calibration; not publishing them");
     }
 
-    if (this->enable_calibration) {
+    if (this->enable_calibration && !this->srv_calibration_toggle) {
         this->srv_calibration_toggle = this->node->create_service<std_srvs::srv::SetBool>(fmt::format("camera_{}/calibrate", this->location),
                                                                                           std::bind(&CameraInterface::calibration_toggle, this, std::placeholders::_1, std::placeholders::_2));
         this->srv_calibration_sample_frame = this->node->create_service<std_srvs::srv::Trigger>(fmt::format("camera_{}/sample_frame", this->location),
                                                                                                 std::bind(&CameraInterface::calibration_sample_frame, this, std::placeholders::_1, std::placeholders::_2));
         this->srv_calibration_save = this->node->create_service<std_srvs::srv::Trigger>(fmt::format("camera_{}/save_calibration", this->location),
                                                                                         std::bind(&CameraInterface::calibration_save, this, std::placeholders::_1, std::placeholders::_2));
+        this->calibration_progress_publisher = this->node->create_publisher<std_msgs::msg::String>(this->calibration_progress_topic, rclcpp::QoS(10));
     }
 
     // std::shared_ptr<CameraInterface> sharedPtr(this, [](CameraInterface* ptr) {
@@ -255,18 +541,53 @@ void CameraInterface::start() {
 
     // create the encoder
     if (this->publish_h264) {
+        EncoderOptions options;
+        options.fps = this->fps;
+        options.bit_rate = this->bit_rate;
+        options.compression = this->compression;
+        options.buffer_count = this->buffer_count;
+        options.roi_enabled = this->roi_enabled;
+        options.hw_encoder_device = this->hw_encoder_device;
+        options.hw_encoder_codec = this->hw_encoder_codec;
+        auto on_output = std::bind(&CameraInterface::publishH264, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3,
+                                   std::placeholders::_4, std::placeholders::_5, std::placeholders::_6);
+        auto on_log = [this](bool error, const std::string &message) {
+            if (error)
+                this->err(message);
+            else
+                this->log(message);
+        };
+
         if (this->hw_encoder) {
             try {
-                this->encoder = (Encoder *) new EncoderHW(this, this->camera);
+                this->encoder = (Encoder *) new EncoderHW(options, on_output, on_log, encoder_width, encoder_height);
             } catch (...) {
                 std::cout << RED << "HW encoder failed, defaulting to CPU..." << CLR << std::endl;
-                this->encoder = (Encoder *) new EncoderLibAV(this, this->camera);
+                this->encoder = (Encoder *) new EncoderLibAV(options, on_output, on_log, encoder_width, encoder_height);
             }
         } else {
-            this->encoder = (Encoder *) new EncoderLibAV(this, this->camera);
+            this->encoder = (Encoder *) new EncoderLibAV(options, on_output, on_log, encoder_width, encoder_height);
+        }
+        if (this->roi_enabled && !this->encoder->supportsROI()) {
+            // V4L2 has no standard per-region QP control, EncoderHW lists what its device offers
+            std::cout << YELLOW << "Encoder doesn't support ROI encoding, defaulting to CPU..." << CLR << std::endl;
+            delete this->encoder;
+            this->encoder = (Encoder *) new EncoderLibAV(options, on_output, on_log, encoder_width, encoder_height);
         }
+        this->out_h264_msg.encoding = this->encoder->encoding();
+        if (this->composite)
+            this->composite->setEncodeCallback(std::bind(&CameraInterface::encodeComposite, this, std::placeholders::_1, std::placeholders::_2));
     }
 
+    if (this->publish_h264 && !this->composite && !this->roi_topic.empty()) {
+        this->log("Subscribing to ROI topic ", this->roi_topic);
+        this->roi_subscription = this->node->create_subscription<sensor_msgs::msg::RegionOfInterest>(this->roi_topic, rclcpp::QoS(10),
+                                                                                                      std::bind(&CameraInterface::roiCallback, this, std::placeholders::_1));
+    }
+
+    if (this->composite)
+        this->composite->attachTile(this->composite_tile);
+
     this->camera->requestCompleted.connect(this, &CameraInterface::captureRequestComplete);
     this->camera->start();
 
@@ -282,21 +603,13 @@ void CameraInterface::captureRequestComplete(Request *request) {
 
     const std::map<const Stream *, FrameBuffer *> &request_buffers = request->buffers();
 
-    struct dma_buf_sync dma_sync_start {};
-    dma_sync_start.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
-    struct dma_buf_sync dma_sync_end {};
-    dma_sync_end.flags = DMA_BUF_SYNC_END| DMA_BUF_SYNC_READ;
-
     for (auto p : request_buffers) {
+        if (p.first == this->raw_stream)
+            continue; // handled with the processed frame below
+
         FrameBuffer *request_buffer = p.second;
         const FrameMetadata &metadata = request_buffer->metadata();
 
-        auto base_fd = p.second->planes()[0].fd.get(); //base plane
-
-        int ret_start = ::ioctl(base_fd, DMA_BUF_IOCTL_SYNC, &dma_sync_start);
-		if (ret_start)
-		    throw std::runtime_error("Failed to sync/start dma buf on queue request");
-        
         bool log = false;
         auto now = std::chrono::high_resolution_clock::now();
         auto ns_since_epoch = std::chrono::duration_cast<std::chrono::nanoseconds>(
@@ -334,13 +647,8 @@ void CameraInterface::captureRequestComplete(Request *request) {
         }
 
         // int plane_offset = 0;
-        auto &plane_buffers = this->mapped_capture_buffers[p.second];
-        auto &plane_strides = this->mapped_capture_buffer_strides[p.second];
+        const MappedBuffer &mapped = this->mapped_capture_buffers[p.second];
 
-        int ret_end = ::ioctl(base_fd, DMA_BUF_IOCTL_SYNC, &dma_sync_end);
-        if (ret_end)
-            throw std::runtime_error("Failed to sync/end dma buf on queue request");
-        
         // long timestamp_ns = metadata.timestamp;
         long timestamp_ns = ns_since_epoch;
         if (this->timestamp_ns_base == 0) {
@@ -353,55 +661,230 @@ void CameraInterface::captureRequestComplete(Request *request) {
             this->lines_printed++;
         }
 
-        // encode and publish h.264
-        if (this->publish_h264) {
-            this->encoder->encode(plane_buffers, plane_strides, base_fd, this->buffer_size, &this->frame_idx, timestamp_ns, log);
+        if (this->phase_lock_group)
+            this->updatePhaseLock(metadata.timestamp);
+
+        uint frames_dropped = 0;
+        if (this->last_sequence >= 0 && metadata.sequence > this->last_sequence + 1)
+            frames_dropped = metadata.sequence - this->last_sequence - 1;
+        this->last_sequence = metadata.sequence;
+        this->buffer_pool.recordFrame(++this->frames_in_flight, frames_dropped);
+
+        if (log && this->buffer_count_auto) {
+            uint recommended = this->buffer_pool.recommendedCount(MIN_AUTO_BUFFER_COUNT, MAX_AUTO_BUFFER_COUNT);
+            if (recommended != this->buffer_count)
+                this->log(YELLOW, "Pipeline depth ", this->buffer_pool.maxFramesInFlight(), ", ", this->buffer_pool.framesDropped(), " frames dropped; ",
+                          recommended, " buffers recommended, applied on restart");
+        }
+
+        // shared by all consumers, the request is re-queued when the last one lets go
+        FramePtr frame = std::make_shared<FrameHandle>(request, request_buffer, &mapped, timestamp_ns,
+                                                       std::bind(&CameraInterface::releaseRequest, this, std::placeholders::_1),
+                                                       &this->dma_sync_stats);
+
+        // the service thread may swap the worker out meanwhile, this copy keeps it alive
+        std::shared_ptr<CalibrationWorker> calibration_worker = std::atomic_load(&this->calibration_worker);
+        bool calibration_frame_due = this->calibration_running && calibration_worker
+            && this->calibration_frames_taken < this->calibration_frames_requested
+            && ns_since_epoch-last_calibration_frame_taken_ns > calibration_min_frame_delay_ns;
+
+        // temporal denoise in place, before the encoder and publishers see the frame; its write
+        // window closes (flushing the caches) before a DMA encoder gets the buffer
+        if (this->denoise) {
+            auto gain = request->metadata().get(libcamera::controls::AnalogueGain);
+            if (!gain || *gain >= this->denoise_min_gain) {
+                FrameHandle::CpuAccess denoise_access(*frame, true);
+                this->denoiser.process(mapped.planes, mapped.strides, this->width, this->height);
+            } else {
+                this->denoiser.reset(); // stale history once it kicks in again
+            }
+        }
+
+        // one cache maintenance window around all CPU consumers of this frame (the consumers
+        // open nested ones); none at all when only DMA devices read it
+        std::optional<FrameHandle::CpuAccess> cpu_access;
+
+        // motion first, it gates the outputs below
+        if (this->motion_detection) {
+            cpu_access.emplace(*frame);
+            this->updateMotion(mapped, ns_since_epoch, timestamp_ns, log);
+        }
+
+        // decimated outputs are due on ticks of the sensor clock, staggered across cameras
+        uint64_t tick = this->output_clock.tick(metadata.sequence, metadata.timestamp);
+        bool images_due = this->publish_image && std::any_of(this->image_outputs.begin(), this->image_outputs.end(),
+                                                             [&](const ImageOutput &output) { return this->imageOutputDue(output, tick); });
+        bool h264_due = this->publish_h264 && this->h264Due(tick);
+        bool tensor_due = this->publish_tensor && this->outputDue(this->tensor_schedule, this->tensor_gate, tick);
+        bool lossless_due = this->publish_lossless && this->outputDue(this->lossless_schedule, this->lossless_gate, tick);
+        bool jpeg_due = this->publish_jpeg && this->outputDue(this->jpeg_schedule, this->jpeg_gate, tick);
+        bool cpu_consumers = (h264_due && !this->composite && this->encoder->readsFromCpu())
+            || images_due
+            || tensor_due
+            || lossless_due
+            || jpeg_due
+            || this->publish_shm
+            || this->stereo
+            || calibration_frame_due;
+        if (cpu_consumers && !cpu_access)
+            cpu_access.emplace(*frame);
+
+        if (log) {
+            this->log("DMA syncs: ", this->dma_sync_stats.syncs.load(), ", skipped: ", this->dma_sync_stats.skipped.load(), ", failed: ", this->dma_sync_stats.failed.load());
+        }
+
+        // encode and publish h.264, or hand the frame to the composite mixer (which maps it itself)
+        if (this->composite) {
+            this->composite->pushFrame(this->composite_tile, frame, this->width, this->height, metadata.timestamp);
+        } else if (h264_due) {
+            if (this->roi_enabled)
+                this->updateEncoderROIs(ns_since_epoch);
+            this->encoder->encode(frame, &this->frame_idx, timestamp_ns, log);
+        }
+
+        // publish images
+        if (images_due) {
+            this->publishImages(*frame, tick, timestamp_ns, log);
+        }
+
+        // publish the inference tensor
+        if (tensor_due) {
+            this->publishTensor(*frame, timestamp_ns, log);
+        }
+
+        // publish the lossless compressed frame
+        if (lossless_due) {
+            this->publishLossless(*frame, timestamp_ns, log);
+        }
+
+        // publish the JPEG, encoded from the capture planes as they are
+        if (jpeg_due) {
+            this->publishJpeg(*frame, timestamp_ns, log);
         }
 
-        // publish image
-        if (this->publish_image) {
-            this->publishImage(plane_buffers, plane_strides, this->buffer_size, timestamp_ns, log);
+        // write to the shared memory ring
+        if (this->shm_writer) {
+            this->shm_writer->write(*frame, metadata.timestamp, metadata.sequence);
+        }
+
+        // Y plane to the fiducial detector, skipped while it's busy with an earlier frame
+        if (this->fiducial_worker) {
+            this->fiducial_worker->submit(frame, this->width, this->height, timestamp_ns);
+        }
+
+        // Y plane to the feature frontend, tracked across the frames skipped while it's busy
+        if (this->feature_worker) {
+            this->feature_worker->submit(frame, this->width, this->height, timestamp_ns, metadata.timestamp);
+        }
+
+        // Y plane to the stereo matcher, paired with the other camera by sensor timestamp
+        if (this->stereo) {
+            this->stereo->pushFrame(this->stereo_side, mapped.planes[0], mapped.strides[0], this->width, this->height,
+                                    metadata.timestamp, timestamp_ns);
+        }
+
+        // publish unpacked sensor data
+        if (this->raw_stream && this->raw_schedule.due(tick)) {
+            auto raw_buffer = request_buffers.find(this->raw_stream);
+            if (raw_buffer != request_buffers.end())
+                this->publishRaw(request, raw_buffer->second, timestamp_ns, log);
         }
 
         // publish camera info
-        if (this->publish_info) {
+        if (this->publish_info && this->info_schedule.due(tick)) {
             this->publishCameraInfo(timestamp_ns, log);
         }
 
-        // calibration frame capture & handling
-        if (this->calibration_running
-            && this->calibration_frames.size() < this->calibration_frames_requested
-            && ns_since_epoch-last_calibration_frame_taken_ns > calibration_min_frame_delay_ns)
+        // calibration frame sampling, corner detection & solving run on the calibration workers
+        if (calibration_frame_due)
         {
-            last_calibration_frame_taken_ns = ns_since_epoch;
-            RCLCPP_INFO(rclcpp::get_logger("rclcpp"), "%sCapturing frame #%lu from %s at location %d%s", GREEN.c_str(), this->calibration_frames.size(), this->model.c_str(), this->location, CLR.c_str());
-            this->lines_printed = -1;
-            this->calibration_frames.push_back(yuv420ToMonoCopy(plane_buffers, plane_strides, this->width, this->height));
-            //cv::imwrite(fmt::format("/ros2_ws/img_snaps/frame_mono_{}.png", ns_since_epoch), this->calibration_frames.back());
-
-            if (this->calibration_frames.size() == this->calibration_frames_needed) {
-                RCLCPP_INFO(rclcpp::get_logger("rclcpp"), "%sProcessing calibration  for %s at location %d%s", MAGENTA.c_str(), this->model.c_str(), this->location, CLR.c_str());
-                calibrateCamera(this->calibration_frames, this->calibration_pattern_size, this->calibration_square_size, this->out_info_msg);
-                this->calibration_running = false;
-                this->calibration_frames.clear();
-                RCLCPP_INFO(rclcpp::get_logger("rclcpp"), "%sCalibration complete for %s at location %d%s", MAGENTA.c_str(), this->model.c_str(), this->location, CLR.c_str());
+            cv::Mat mono;
+            {
+                FrameHandle::CpuAccess calibration_access(*frame);
+                mono = yuv420ToMonoCopy(mapped.planes, mapped.strides, this->width, this->height);
+            }
+            cpu_access.reset(); // done reading the frame
+
+            // workers still busy with the previous sample, try again with the next frame
+            if (calibration_worker->submit(std::move(mono))) {
+                last_calibration_frame_taken_ns = ns_since_epoch;
+                this->calibration_frames_taken++;
+                RCLCPP_INFO(rclcpp::get_logger("rclcpp"), "%sCapturing frame #%u from %s at location %d%s", GREEN.c_str(), this->calibration_frames_taken, this->model.c_str(), this->location, CLR.c_str());
                 this->lines_printed = -1;
             }
         }
     }
+}
+
+void CameraInterface::updatePhaseLock(uint64_t sensor_timestamp_ns) {
+    if (this->phase_lock_leader) {
+        this->phase_lock_group->leaderFrame(sensor_timestamp_ns);
+        return;
+    }
 
+    uint64_t leader_timestamp_ns;
+    int64_t period_ns;
+    if (!this->phase_lock_group->leaderReference(leader_timestamp_ns, period_ns))
+        return; // no leader frames yet
+
+    this->phase_lock_duration_ns = this->phase_lock.update(sensor_timestamp_ns, leader_timestamp_ns, period_ns);
+    if (this->phase_lock.locked() != this->phase_lock_reported) {
+        this->phase_lock_reported = this->phase_lock.locked();
+        if (this->phase_lock_reported)
+            this->log(GREEN, "Phase locked to ", this->phase_lock_group_name, " leader, error ", this->phase_lock.phaseError() / 1000, " us");
+        else
+            this->log(YELLOW, "Phase lock to ", this->phase_lock_group_name, " lost, error ", this->phase_lock.phaseError() / 1000, " us");
+    }
+}
+
+void CameraInterface::releaseRequest(Request *request) {
+    this->frames_in_flight--;
     if (!this->running)
         return;
 
     request->reuse(Request::ReuseBuffers);
+    int64_t phase_lock_duration_us = this->phase_lock_duration_ns / 1000;
+    if (phase_lock_duration_us > 0)
+        request->controls().set(libcamera::controls::FrameDurationLimits, {phase_lock_duration_us, phase_lock_duration_us});
     this->camera->queueRequest(request);
 }
 
 
-void setCurrentStamp(builtin_interfaces::msg::Time *stamp, uint64_t timestamp_ns) {
-    // Split into seconds and nanoseconds
-    stamp->sec = static_cast<int32_t>(timestamp_ns / NS_TO_SEC);
-    stamp->nanosec = static_cast<uint32_t>(timestamp_ns % NS_TO_SEC);;
+void CameraInterface::roiCallback(const sensor_msgs::msg::RegionOfInterest::SharedPtr msg) {
+    if (msg->width == 0 || msg->height == 0)
+        return;
+
+    EncoderROI roi;
+    // clamped term by term, offset + size can overflow uint32
+    roi.left = std::min(msg->x_offset, this->width);
+    roi.top = std::min(msg->y_offset, this->height);
+    roi.right = roi.left + std::min(msg->width, this->width - roi.left);
+    roi.bottom = roi.top + std::min(msg->height, this->height - roi.top);
+    roi.qoffset = this->roi_qoffset;
+
+    auto now = std::chrono::high_resolution_clock::now();
+    long ns_since_epoch = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+
+    std::lock_guard<std::mutex> lock(this->roi_dynamic_mutex);
+    this->roi_dynamic.push_back({ roi, ns_since_epoch });
+}
+
+void CameraInterface::updateEncoderROIs(long now_ns) {
+    std::vector<EncoderROI> rois;
+    {
+        std::lock_guard<std::mutex> lock(this->roi_dynamic_mutex);
+        auto expired = [&](const std::pair<EncoderROI, long> &r) { return now_ns - r.second > this->roi_timeout_ns; };
+        this->roi_dynamic.erase(std::remove_if(this->roi_dynamic.begin(), this->roi_dynamic.end(), expired), this->roi_dynamic.end());
+        for (auto &r : this->roi_dynamic)
+            rois.push_back(r.first);
+    }
+    rois.insert(rois.end(), this->roi_static.begin(), this->roi_static.end());
+
+    // whole frame as the last region, so the background gets coarser where no ROI overlaps
+    if (!rois.empty() && this->roi_background_qoffset != 0.0f)
+        rois.push_back({ 0, 0, this->width, this->height, this->roi_background_qoffset });
+
+    this->encoder->setRegionsOfInterest(rois);
 }
 
 void CameraInterface::publishH264(unsigned char *data, int size, bool keyframe, uint64_t pts, long timestamp_ns, bool log) {
@@ -421,61 +904,239 @@ void CameraInterface::publishH264(unsigned char *data, int size, bool keyframe,
     }
 }
 
-void CameraInterface::publishImage(const std::vector<AVBufferRef *>& planes, const std::vector<unsigned int>& strides, uint buffer_size, long timestamp_ns, bool log) {
+void CameraInterface::updateMotion(const MappedBuffer &mapped, long ns_since_epoch, long timestamp_ns, bool log) {
+    MotionResult result = this->motion_detector.process(mapped.planes[0], mapped.strides[0], this->width, this->height);
 
-    setCurrentStamp(&this->out_image_msg.header.stamp, timestamp_ns);
-    
-    switch (this->image_output_format) {
-    
-        case IMAGE_OUTPUT_FORMAT::BGR8: 
-        {
-            // Allocate memory for YUV420p format
-            cv::Mat yuv(height * 3 / 2, width, CV_8UC1);
-        
-            // Copy Y plane
-            memcpy(yuv.data, planes[0]->data, height * strides[0]);
-        
-            // Copy UV planes correctly
-            unsigned char *uv_ptr = yuv.data + height * width;
-            memcpy(uv_ptr, planes[1]->data, (height / 2) * strides[1]);
-            memcpy(uv_ptr + (height / 2) * width / 2, planes[2]->data, (height / 2) * strides[2]);
-        
-            // Convert YUV420 to BGR
-            cv::Mat bgr;
-            cv::cvtColor(yuv, bgr, cv::COLOR_YUV2BGR_I420);
-        
-            // Assign data to ROS2 Image message
-            this->out_image_msg.data.assign(bgr.data, bgr.data + (bgr.rows * bgr.cols * 3));
-            this->out_image_msg.step = this->width * 3; 
-        }
-        break;
+    bool was_active = this->motion_active;
+    if (result.motion)
+        this->last_motion_ns = ns_since_epoch;
+    this->motion_active = ns_since_epoch - this->last_motion_ns < this->motion_hold_ns;
+    this->motion_changed = result.scene_change || (result.motion && !was_active);
 
-        case IMAGE_OUTPUT_FORMAT::MONO8:
-            {
-                this->out_image_msg.data.assign(planes[0]->data, planes[0]->data + (this->width*this->height));
-                this->out_image_msg.step=this->width*1;
-            }
-            break;
-        case IMAGE_OUTPUT_FORMAT::YUV420:
-            {
-                this->out_image_msg.data.assign(planes[0]->data, planes[0]->data + buffer_size);
+    if (log) {
+        this->log("Motion: ", result.moving_cells, " cells", result.scene_change ? ", scene change" : "",
+                  this->motion_active ? "" : ", static");
+    }
+
+    // every mask with motion, then one empty one
+    if (this->publish_motion && (result.moving_cells > 0 || this->motion_mask_dirty)) {
+        this->motion_mask_dirty = result.moving_cells > 0;
+        this->out_motion_msg.width = this->motion_detector.gridWidth();
+        this->out_motion_msg.height = this->motion_detector.gridHeight();
+        this->out_motion_msg.step = this->out_motion_msg.width;
+        this->out_motion_msg.data = this->motion_detector.cellMask();
+        setCurrentStamp(&this->out_motion_msg.header.stamp, timestamp_ns);
+        if (rclcpp::ok())
+            this->motion_publisher->publish(this->out_motion_msg);
+    }
+}
+
+// Change gated outputs skip the rate, the change frames would rarely line up with it
+bool CameraInterface::outputDue(const OutputSchedule &schedule, uint gate, uint64_t tick) const {
+    if (!this->motion_detection || gate == OUTPUT_GATE::ALWAYS)
+        return schedule.due(tick);
+    if (gate == OUTPUT_GATE::MOTION)
+        return this->motion_active && schedule.due(tick);
+    return this->motion_changed;
+}
+
+bool CameraInterface::imageOutputDue(const ImageOutput &output, uint64_t tick) const {
+    return this->outputDue(output.schedule, output.gate, tick);
+}
+
+bool CameraInterface::h264Due(uint64_t tick) const {
+    if (!this->motion_detection || this->h264_keepalive_rate <= 0.0 || this->motion_active)
+        return true;
+    return this->h264_keepalive_schedule.due(tick);
+}
+
+void CameraInterface::publishImages(FrameHandle &frame, uint64_t tick, long timestamp_ns, bool log) {
+
+    std::vector<ImageOutput *> due, due_rectified;
+    for (auto &output : this->image_outputs) {
+        if (this->imageOutputDue(output, tick))
+            (output.rectified ? due_rectified : due).push_back(&output);
+    }
+    auto maps = std::atomic_load(&this->rectify_maps);
+    if (!maps)
+        due_rectified.clear(); // uncalibrated
+    if (due.empty() && due_rectified.empty())
+        return;
+
+    {
+        FrameHandle::CpuAccess cpu_access(frame);
+        if (!due.empty())
+            this->image_graph.pack(due, this->color_matrix, frame.mapped->planes, frame.mapped->strides, this->width, this->height);
+
+        // remapped once, then packed like the source frame
+        if (!due_rectified.empty()) {
+            if (this->rectified_frame.empty()) {
+                size_t y_size = (size_t) this->width * this->height;
+                this->rectified_frame.resize(y_size + y_size / 2);
+                uint8_t *p = this->rectified_frame.data();
+                this->rectified_planes = { p, p + y_size, p + y_size + y_size / 4 };
+                this->rectified_strides = { this->width, this->width / 2, this->width / 2 };
             }
-            break;
-        default:
+            maps->remap(frame.mapped->planes, frame.mapped->strides, this->rectified_planes, this->rectified_strides);
+            this->image_graph.pack(due_rectified, this->color_matrix, this->rectified_planes, this->rectified_strides, this->width, this->height);
+        }
+    }
+    due.insert(due.end(), due_rectified.begin(), due_rectified.end());
+
+    for (auto *output : due) {
+        setCurrentStamp(&output->msg.header.stamp, timestamp_ns);
+
+        if (log) {
+            this->log(GREEN, " >> Sending Image ", output->name, " ", output->msg.data.size(), "B", CLR, " sec: ", output->msg.header.stamp.sec, " nsec: ", output->msg.header.stamp.nanosec);
+        }
+
+        if (rclcpp::ok()) {
+            output->publisher->publish(output->msg);
+        }
+    }
+}
+
+void CameraInterface::publishTensor(FrameHandle &frame, long timestamp_ns, bool log) {
+
+    {
+        FrameHandle::CpuAccess cpu_access(frame);
+        const MappedBuffer &mapped = *frame.mapped;
+        picam_conv::YuvPlanes src = { mapped.planes[0], mapped.planes[1], mapped.planes[2],
+                                      mapped.strides[0], mapped.strides[1], mapped.strides[2], this->width, this->height };
+        this->tensor_packer.pack(src, this->out_tensor_msg.data.data());
+    }
+
+    setCurrentStamp(&this->out_tensor_msg.header.stamp, timestamp_ns);
+
+    if (log) {
+        this->log(GREEN, " >> Sending Tensor ", this->out_tensor_msg.data.size(), "B", CLR, " sec: ", this->out_tensor_msg.header.stamp.sec, " nsec: ", this->out_tensor_msg.header.stamp.nanosec);
+    }
+
+    if (rclcpp::ok()) {
+        this->tensor_publisher->publish(this->out_tensor_msg);
+    }
+}
+
+void CameraInterface::publishRaw(Request *request, FrameBuffer *buffer, long timestamp_ns, bool log) {
+
+    const MappedBuffer &mapped = this->mapped_capture_buffers[buffer];
+
+    // the request goes back with the processed frame, which outlives this call
+    {
+        FrameHandle raw_frame(request, buffer, &mapped, timestamp_ns, nullptr);
+        FrameHandle::CpuAccess cpu_access(raw_frame);
+        unpackRawFrame(this->raw_format, this->raw_output_16bit, mapped.planes[0], mapped.strides[0],
+                       this->raw_width, this->raw_height, this->out_raw_msg.data.data(), this->out_raw_msg.step);
+    }
+
+    // unpacked samples are MSB aligned, the always zero low bits aren't stored; the
+    // predictor looks 2 samples away, at the same colour of the mosaic
+    if (this->raw_lossless) {
+        picam_lossless::PlaneView plane = { this->out_raw_msg.data.data(), this->out_raw_msg.step, this->raw_width, this->raw_height,
+                                            this->raw_output_16bit ? 2u : 1u, this->raw_output_16bit ? 16 - std::min(16u, this->raw_format.bits) : 0u, 2 };
+        if (!this->encodeLossless({ plane }, this->out_raw_lossless_msg, log))
             return;
+        setCurrentStamp(&this->out_raw_lossless_msg.header.stamp, timestamp_ns);
+        if (rclcpp::ok())
+            this->raw_lossless_publisher->publish(this->out_raw_lossless_msg);
+        return;
     }
 
+    setCurrentStamp(&this->out_raw_msg.header.stamp, timestamp_ns);
+
     if (log) {
-        this->log(GREEN, " >> Sending Image ", this->out_image_msg.data.size(), "B", CLR, " sec: ", this->out_image_msg.header.stamp.sec, " nsec: ", out_image_msg.header.stamp.nanosec);
+        this->log(GREEN, " >> Sending Raw ", this->out_raw_msg.encoding, " ", this->out_raw_msg.data.size(), "B", CLR, " sec: ", this->out_raw_msg.header.stamp.sec, " nsec: ", this->out_raw_msg.header.stamp.nanosec);
     }
 
     if (rclcpp::ok()) {
-        this->image_publisher->publish(this->out_image_msg);
+        this->raw_publisher->publish(this->out_raw_msg);
     }
 }
 
+bool CameraInterface::encodeLossless(const std::vector<picam_lossless::PlaneView> &planes, sensor_msgs::msg::CompressedImage &msg, bool log) {
+    auto t_start = std::chrono::steady_clock::now();
+    if (!this->lossless_encoder->encode(planes, msg.data)) {
+        this->err("Lossless encoding failed");
+        return false;
+    }
+
+    if (log) {
+        size_t raw_size = 0;
+        for (auto &plane : planes)
+            raw_size += (size_t) plane.width * plane.height * plane.bytes_per_sample;
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t_start).count();
+        this->log(GREEN, " >> Sending ", msg.format, " ", msg.data.size(), "B", CLR, fmt::format(" ratio {:.2f}, {} us, {:.0f} MB/s",
+                  (double) raw_size / msg.data.size(), us, us > 0 ? (double) raw_size / us : 0.0));
+    }
+    return true;
+}
+
+void CameraInterface::publishLossless(FrameHandle &frame, long timestamp_ns, bool log) {
+    {
+        FrameHandle::CpuAccess cpu_access(frame);
+        const MappedBuffer &mapped = *frame.mapped;
+        std::vector<picam_lossless::PlaneView> planes = { { mapped.planes[0], mapped.strides[0], this->width, this->height } };
+        if (this->lossless_format == IMAGE_OUTPUT_FORMAT::YUV420) {
+            planes.push_back({ mapped.planes[1], mapped.strides[1], this->width / 2, this->height / 2 });
+            planes.push_back({ mapped.planes[2], mapped.strides[2], this->width / 2, this->height / 2 });
+        }
+        if (!this->encodeLossless(planes, this->out_lossless_msg, log))
+            return;
+    }
+
+    setCurrentStamp(&this->out_lossless_msg.header.stamp, timestamp_ns);
+
+    if (rclcpp::ok()) {
+        this->lossless_publisher->publish(this->out_lossless_msg);
+    }
+}
+
+void CameraInterface::publishJpeg(FrameHandle &frame, long timestamp_ns, bool log) {
+    {
+        FrameHandle::CpuAccess cpu_access(frame);
+        const MappedBuffer &mapped = *frame.mapped;
+        picam_conv::YuvPlanes src = { mapped.planes[0], mapped.planes[1], mapped.planes[2],
+                                      mapped.strides[0], mapped.strides[1], mapped.strides[2], this->width, this->height };
+        auto t_start = std::chrono::steady_clock::now();
+        if (!this->jpeg_encoder->encode(src, this->jpeg_coeffs, this->out_jpeg_msg.data)) {
+            this->err("JPEG encoding failed");
+            return;
+        }
+        if (log) {
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t_start).count();
+            this->log(GREEN, " >> Sending JPEG ", this->out_jpeg_msg.data.size(), "B", CLR, fmt::format(" {} us", us));
+        }
+    }
+
+    setCurrentStamp(&this->out_jpeg_msg.header.stamp, timestamp_ns);
+
+    if (rclcpp::ok()) {
+        this->jpeg_publisher->publish(this->out_jpeg_msg);
+    }
+}
+
+void CameraInterface::attachStereo(std::shared_ptr<StereoPipeline> pipeline, StereoPipeline::Side side) {
+    this->stereo = pipeline;
+    this->stereo_side = side;
+}
+
+void CameraInterface::attachComposite(std::shared_ptr<CompositeMixer> mixer, uint tile) {
+    this->composite = mixer;
+    this->composite_tile = tile;
+}
+
+// Mixer thread
+void CameraInterface::encodeComposite(FramePtr frame, long timestamp_ns) {
+    std::lock_guard<std::mutex> lock(this->encoder_mutex);
+    if (!this->running || !this->encoder)
+        return;
+    this->encoder->encode(frame, &this->frame_idx, timestamp_ns, false);
+}
+
 void CameraInterface::publishCameraInfo(long timestamp_ns, bool log) {
 
+    std::lock_guard<std::mutex> lock(this->info_mutex); // swapped by the calibration workers
+
     setCurrentStamp(&this->out_info_msg.header.stamp, timestamp_ns);
 
     if (log) {
@@ -491,39 +1152,311 @@ void CameraInterface::stop() {
     if (!this->running)
         return;
     this->running = false;
+
+    this->log(BLUE, "Stopping ", this->camera->id());
+
+    this->camera->stop();
+    this->camera->requestCompleted.disconnect(this, &CameraInterface::captureRequestComplete);
+
+    // the mixer lets go of this camera's frames (and stops calling the encoder)
+    if (this->composite) {
+        this->composite->detachTile(this->composite_tile);
+        if (this->composite_tile == 0)
+            this->composite->setEncodeCallback(nullptr);
+    }
+
+    // encoder lets go of the frames it still holds before the buffers go back to the pool
+    {
+        std::lock_guard<std::mutex> lock(this->encoder_mutex);
+        delete this->encoder;
+        this->encoder = nullptr;
+    }
+    this->fiducial_worker.reset(); // holds a frame while detecting
+    this->feature_worker.reset();
+
+    this->shm_writer.reset();
+    this->lossless_encoder.reset();
+    this->jpeg_encoder.reset();
+    this->capture_requests.clear();
+    this->mapped_capture_buffers.clear();
+    this->capture_frame_buffers.clear();
+    this->buffer_pool.releaseAll();
+    this->raw_buffer_pool.releaseAll();
+    this->raw_stream = nullptr;
+    this->last_sequence = -1;
+    OutputPhaseAllocator::instance().release(this->location);
+
+    this->camera->release();
+}
+
+void CameraInterface::restart(const std::shared_ptr<std_srvs::srv::Trigger::Request>,
+                              std::shared_ptr<std_srvs::srv::Trigger::Response> response) {
+    auto t_start = std::chrono::steady_clock::now();
+    try {
+        this->stop();
+        this->start();
+    } catch (const std::exception &e) {
+        response->success = false;
+        response->message = fmt::format("Restart failed: {}", e.what());
+        this->err(response->message);
+        return;
+    }
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t_start).count();
+    response->success = true;
+    response->message = fmt::format("Restarted in {} ms with {} buffers", ms, this->buffer_count);
+    this->log(GREEN, response->message);
+}
+
+uint CameraInterface::parseImageFormat(const std::string &name) {
+    auto image_encoding = findImageEncoding(name);
+    if (!image_encoding) {
+        throw std::runtime_error("Invalid image output format '" + name + "', use 'yuv420', 'nv12', 'yuv422_yuy2', 'mono8', 'mono16', 'bgr8', 'rgb8', 'bgra8' or 'rgba8'");
+    }
+    return image_encoding->format;
+}
+
+uint CameraInterface::parseOutputGate(const std::string &name) {
+    for (auto &gate : OUTPUT_GATE_NAMES) {
+        if (gate.second == name)
+            return gate.first;
+    }
+    throw std::runtime_error("Invalid output gate '" + name + "', use 'always', 'motion' or 'change'");
+}
+
+uint CameraInterface::parseTensorOption(const std::map<uint, std::string> &names, const std::string &param, const std::string &value) {
+    std::string valid;
+    for (auto &name : names) {
+        if (name.second == value)
+            return name.first;
+        valid += (valid.empty() ? "'" : ", '") + name.second + "'";
+    }
+    throw std::runtime_error("Invalid " + param + " '" + value + "', use " + valid);
 }
 
 void CameraInterface::readConfig() {
     
     auto config_prefix = CameraInterface::GetConfigPrefix(this->location);
 
-    this->node->declare_parameter(config_prefix + "publish_h264", true);
+    this->declareParameter(config_prefix + "publish_h264", true);
     this->publish_h264 = this->node->get_parameter(config_prefix + "publish_h264").as_bool();
 
-    this->node->declare_parameter(config_prefix + "publish_image", false);
+    this->declareParameter(config_prefix + "publish_image", false);
     this->publish_image = this->node->get_parameter(config_prefix + "publish_image").as_bool();
 
-    this->node->declare_parameter(config_prefix + "image_output_format", "yuv420");
-    auto image_output_format = this->node->get_parameter(config_prefix + "image_output_format").as_string();
-    if (image_output_format == IMAGE_OUTPUT_FORMAT_NAMES.at(IMAGE_OUTPUT_FORMAT::BGR8)) {
-        this->image_output_format = IMAGE_OUTPUT_FORMAT::BGR8;
-    } else
-    if (image_output_format == IMAGE_OUTPUT_FORMAT_NAMES.at(IMAGE_OUTPUT_FORMAT::YUV420)) {
-        this->image_output_format = IMAGE_OUTPUT_FORMAT::YUV420;
-    } else if (image_output_format == IMAGE_OUTPUT_FORMAT_NAMES.at(IMAGE_OUTPUT_FORMAT::MONO8)) {
-        this->image_output_format = IMAGE_OUTPUT_FORMAT::MONO8;
-    } else {
-        throw std::runtime_error("Invalid image output format, use 'yuv420', 'mono8' or 'bgr8'");
-    }
 
-    this->node->declare_parameter(config_prefix + "publish_info", true);
+    this->declareParameter(config_prefix + "denoise", false); // temporal denoise of the YUV frames
+    this->denoise = this->node->get_parameter(config_prefix + "denoise").as_bool();
+    this->declareParameter(config_prefix + "denoise_min_gain", 4.0); // only above this analogue gain, 0 = always
+    this->denoise_min_gain = this->node->get_parameter(config_prefix + "denoise_min_gain").as_double();
+    this->declareParameter(config_prefix + "denoise_strength", 0.5);
+    this->declareParameter(config_prefix + "denoise_threshold", 10);
+    this->denoiser.configure((float) this->node->get_parameter(config_prefix + "denoise_strength").as_double(),
+                             (uint) std::max<int64_t>(0, this->node->get_parameter(config_prefix + "denoise_threshold").as_int()));
+    this->denoiser.reset();
+
+    this->declareParameter(config_prefix + "motion_detection", false); // gates outputs while the scene is static
+    this->motion_detection = this->node->get_parameter(config_prefix + "motion_detection").as_bool();
+    this->declareParameter(config_prefix + "motion_cell_size", 64); // grid cell in pixels, multiple of 8
+    this->motion_cell_size = (uint) std::max<int64_t>(8, this->node->get_parameter(config_prefix + "motion_cell_size").as_int());
+    this->declareParameter(config_prefix + "motion_threshold", 6.0); // mean Y difference of a moving cell, in levels
+    this->motion_threshold = this->node->get_parameter(config_prefix + "motion_threshold").as_double();
+    this->declareParameter(config_prefix + "motion_min_cells", 2);
+    this->motion_min_cells = (uint) std::max<int64_t>(1, this->node->get_parameter(config_prefix + "motion_min_cells").as_int());
+    this->declareParameter(config_prefix + "motion_scene_change", 0.6); // fraction of cells changing at once
+    this->motion_scene_change = this->node->get_parameter(config_prefix + "motion_scene_change").as_double();
+    this->declareParameter(config_prefix + "motion_background_sec", 5.0); // how fast stopped objects fade into the background
+    this->motion_background_sec = this->node->get_parameter(config_prefix + "motion_background_sec").as_double();
+    this->declareParameter(config_prefix + "motion_hold_sec", 2.0);
+    this->motion_hold_ns = (long) (this->node->get_parameter(config_prefix + "motion_hold_sec").as_double() * NS_TO_SEC);
+    this->declareParameter(config_prefix + "h264_keepalive_rate", 1.0); // H.264 rate while static, 0 = full rate
+    this->h264_keepalive_rate = this->node->get_parameter(config_prefix + "h264_keepalive_rate").as_double();
+    this->declareParameter(config_prefix + "publish_motion", false); // moving cells as a mono8 mask
+    this->publish_motion = this->node->get_parameter(config_prefix + "publish_motion").as_bool();
+
+    this->declareParameter(config_prefix + "publish_fiducials", false); // ArUco / AprilTag markers found in the Y plane
+    this->publish_fiducials = this->node->get_parameter(config_prefix + "publish_fiducials").as_bool();
+    this->declareParameter(config_prefix + "fiducial_dictionary", "apriltag_36h11");
+    this->fiducial_options.dictionary = this->node->get_parameter(config_prefix + "fiducial_dictionary").as_string();
+    if (this->publish_fiducials && FiducialDetector::dictionaryId(this->fiducial_options.dictionary) < 0)
+        throw std::runtime_error("Invalid fiducial dictionary '" + this->fiducial_options.dictionary + "', use e.g. '4x4_50', '6x6_250', 'aruco_original' or 'apriltag_36h11'");
+    this->declareParameter(config_prefix + "fiducial_marker_size_m", 0.05);
+    this->fiducial_options.marker_size = this->node->get_parameter(config_prefix + "fiducial_marker_size_m").as_double();
+    this->declareParameter(config_prefix + "fiducial_full_search_interval", 10); // searched frames, 1 = whole frame every time
+    this->fiducial_options.full_search_interval = (uint) std::max<int64_t>(1, this->node->get_parameter(config_prefix + "fiducial_full_search_interval").as_int());
+    this->declareParameter(config_prefix + "fiducial_roi_margin", 0.5); // tracking window margin, fraction of the marker size
+    this->fiducial_options.roi_margin = this->node->get_parameter(config_prefix + "fiducial_roi_margin").as_double();
+    this->declareParameter(config_prefix + "fiducial_max_misses", 3);
+    this->fiducial_options.max_misses = (uint) std::max<int64_t>(0, this->node->get_parameter(config_prefix + "fiducial_max_misses").as_int());
+
+    this->declareParameter(config_prefix + "publish_features", false); // tracked corners for visual odometry
+    this->publish_features = this->node->get_parameter(config_prefix + "publish_features").as_bool();
+    this->declareParameter(config_prefix + "feature_max", 300);
+    this->feature_options.max_features = (uint) std::max<int64_t>(1, this->node->get_parameter(config_prefix + "feature_max").as_int());
+    this->declareParameter(config_prefix + "feature_grid", std::vector<int64_t>{ 8, 6 }); // bucketing columns, rows
+    auto feature_grid = this->node->get_parameter(config_prefix + "feature_grid").as_integer_array();
+    if (feature_grid.size() != 2 || feature_grid[0] < 1 || feature_grid[1] < 1)
+        throw std::runtime_error("feature_grid must be [ columns, rows ]");
+    this->feature_options.grid_cols = (uint) feature_grid[0];
+    this->feature_options.grid_rows = (uint) feature_grid[1];
+    this->declareParameter(config_prefix + "feature_fast_threshold", 20);
+    this->feature_options.fast_threshold = (int) this->node->get_parameter(config_prefix + "feature_fast_threshold").as_int();
+    this->declareParameter(config_prefix + "feature_min_distance", 12.0); // px
+    this->feature_options.min_distance = (float) this->node->get_parameter(config_prefix + "feature_min_distance").as_double();
+    this->declareParameter(config_prefix + "feature_pyramid_levels", 3);
+    this->feature_options.pyramid_levels = (uint) std::max<int64_t>(1, this->node->get_parameter(config_prefix + "feature_pyramid_levels").as_int());
+    this->declareParameter(config_prefix + "feature_window", 21); // LK window, px
+    this->feature_options.window_size = (uint) std::max<int64_t>(5, this->node->get_parameter(config_prefix + "feature_window").as_int());
+    this->declareParameter(config_prefix + "feature_fb_threshold", 1.0); // forward-backward check in px, 0 = off
+    this->feature_options.fb_threshold = (float) this->node->get_parameter(config_prefix + "feature_fb_threshold").as_double();
+    this->declareParameter(config_prefix + "feature_descriptors", true); // ORB
+    this->feature_options.descriptors = this->node->get_parameter(config_prefix + "feature_descriptors").as_bool();
+
+    this->declareParameter(config_prefix + "publish_tensor", false); // inference input packed from the capture planes
+    this->publish_tensor = this->node->get_parameter(config_prefix + "publish_tensor").as_bool();
+    this->declareParameter(config_prefix + "tensor_size", std::vector<int64_t>{ 640, 640 }); // width, height
+    auto tensor_size = this->node->get_parameter(config_prefix + "tensor_size").as_integer_array();
+    if (tensor_size.size() != 2 || tensor_size[0] < 1 || tensor_size[1] < 1)
+        throw std::runtime_error("tensor_size must be [ width, height ]");
+    this->tensor_spec.width = (uint) tensor_size[0];
+    this->tensor_spec.height = (uint) tensor_size[1];
+    this->declareParameter(config_prefix + "tensor_layout", "nchw");
+    this->tensor_spec.layout = this->parseTensorOption(TENSOR_LAYOUT_NAMES, "tensor_layout", this->node->get_parameter(config_prefix + "tensor_layout").as_string());
+    this->declareParameter(config_prefix + "tensor_dtype", "float32");
+    this->tensor_spec.dtype = this->parseTensorOption(TENSOR_DTYPE_NAMES, "tensor_dtype", this->node->get_parameter(config_prefix + "tensor_dtype").as_string());
+    this->declareParameter(config_prefix + "tensor_bgr", false); // channel order
+    this->tensor_spec.bgr = this->node->get_parameter(config_prefix + "tensor_bgr").as_bool();
+    this->declareParameter(config_prefix + "tensor_letterbox", true); // keep the aspect ratio, otherwise stretch
+    this->tensor_spec.letterbox = this->node->get_parameter(config_prefix + "tensor_letterbox").as_bool();
+    this->declareParameter(config_prefix + "tensor_pad", 114); // letterbox fill, 0-255
+    this->tensor_spec.pad = (uint8_t) std::clamp<int64_t>(this->node->get_parameter(config_prefix + "tensor_pad").as_int(), 0, 255);
+    this->declareParameter(config_prefix + "tensor_mean", std::vector<double>{ 0.0, 0.0, 0.0 }); // RGB, in 0-1 pixel units
+    auto tensor_mean = this->node->get_parameter(config_prefix + "tensor_mean").as_double_array();
+    this->declareParameter(config_prefix + "tensor_std", std::vector<double>{ 1.0, 1.0, 1.0 });
+    auto tensor_std = this->node->get_parameter(config_prefix + "tensor_std").as_double_array();
+    if (tensor_mean.size() != 3 || tensor_std.size() != 3)
+        throw std::runtime_error("tensor_mean and tensor_std must be [ r, g, b ]");
+    for (uint c = 0; c < 3; c++) {
+        if (tensor_std[c] == 0.0)
+            throw std::runtime_error("tensor_std can't be 0");
+        this->tensor_spec.mean[c] = (float) tensor_mean[c];
+        this->tensor_spec.std[c] = (float) tensor_std[c];
+    }
+    this->declareParameter(config_prefix + "tensor_quant_scale", 1.0 / 255.0); // int8 / uint8 only
+    this->tensor_spec.quant_scale = (float) this->node->get_parameter(config_prefix + "tensor_quant_scale").as_double();
+    if (this->tensor_spec.quant_scale <= 0.0f)
+        throw std::runtime_error("tensor_quant_scale must be > 0");
+    this->declareParameter(config_prefix + "tensor_zero_point", 0);
+    this->tensor_spec.quant_zero_point = (int) this->node->get_parameter(config_prefix + "tensor_zero_point").as_int();
+    this->declareParameter(config_prefix + "tensor_rate", 0.0); // Hz, 0 = every frame
+    this->tensor_rate = this->node->get_parameter(config_prefix + "tensor_rate").as_double();
+    this->declareParameter(config_prefix + "tensor_gate", "always");
+    this->tensor_gate = this->parseOutputGate(this->node->get_parameter(config_prefix + "tensor_gate").as_string());
+
+    this->declareParameter(config_prefix + "publish_raw", false); // unprocessed Bayer frames from a second, raw stream
+    this->publish_raw = this->node->get_parameter(config_prefix + "publish_raw").as_bool();
+    this->declareParameter(config_prefix + "raw_output_format", "bayer16");
+    auto raw_output_format = this->node->get_parameter(config_prefix + "raw_output_format").as_string();
+    if (raw_output_format != "bayer16" && raw_output_format != "bayer8") {
+        throw std::runtime_error("Invalid raw output format, use 'bayer16' or 'bayer8'");
+    }
+    this->raw_output_16bit = raw_output_format == "bayer16";
+    this->declareParameter(config_prefix + "raw_rate", 0.0);
+    this->raw_rate = this->node->get_parameter(config_prefix + "raw_rate").as_double();
+    this->declareParameter(config_prefix + "raw_width", 0); // sensor mode, 0 = picked by the pipeline
+    this->raw_width = (uint) this->node->get_parameter(config_prefix + "raw_width").as_int();
+    this->declareParameter(config_prefix + "raw_height", 0);
+    this->raw_height = (uint) this->node->get_parameter(config_prefix + "raw_height").as_int();
+    this->declareParameter(config_prefix + "raw_lossless", false); // zstd compressed CompressedImage on <raw topic>/lossless instead
+    this->raw_lossless = this->node->get_parameter(config_prefix + "raw_lossless").as_bool();
+
+    this->declareParameter(config_prefix + "publish_lossless", false); // zstd compressed CompressedImage from the capture planes
+    this->publish_lossless = this->node->get_parameter(config_prefix + "publish_lossless").as_bool();
+    this->declareParameter(config_prefix + "lossless_format", "mono8");
+    auto lossless_format = this->node->get_parameter(config_prefix + "lossless_format").as_string();
+    if (lossless_format != "mono8" && lossless_format != "yuv420") {
+        throw std::runtime_error("Invalid lossless format '" + lossless_format + "', use 'mono8' or 'yuv420'");
+    }
+    this->lossless_format = lossless_format == "mono8" ? IMAGE_OUTPUT_FORMAT::MONO8 : IMAGE_OUTPUT_FORMAT::YUV420;
+    this->declareParameter(config_prefix + "lossless_rate", 0.0); // Hz, 0 = every frame
+    this->lossless_rate = this->node->get_parameter(config_prefix + "lossless_rate").as_double();
+    this->declareParameter(config_prefix + "lossless_gate", "always");
+    this->lossless_gate = this->parseOutputGate(this->node->get_parameter(config_prefix + "lossless_gate").as_string());
+    this->declareParameter(config_prefix + "lossless_level", 1); // zstd, negative levels are faster
+    this->lossless_level = (int) this->node->get_parameter(config_prefix + "lossless_level").as_int();
+    this->declareParameter(config_prefix + "lossless_threads", 0); // 0 = one per core
+    this->lossless_threads = (uint) std::max<int64_t>(0, this->node->get_parameter(config_prefix + "lossless_threads").as_int());
+
+    this->declareParameter(config_prefix + "publish_jpeg", false); // CompressedImage encoded from the YUV420 planes, no BGR pass
+    this->publish_jpeg = this->node->get_parameter(config_prefix + "publish_jpeg").as_bool();
+    this->declareParameter(config_prefix + "jpeg_quality", 80);
+    this->jpeg_quality = (int) this->node->get_parameter(config_prefix + "jpeg_quality").as_int();
+    if (this->jpeg_quality < 1 || this->jpeg_quality > 100) {
+        throw std::runtime_error("Invalid JPEG quality " + std::to_string(this->jpeg_quality) + ", use 1 to 100");
+    }
+    this->declareParameter(config_prefix + "jpeg_rate", 0.0); // Hz, 0 = every frame
+    this->jpeg_rate = this->node->get_parameter(config_prefix + "jpeg_rate").as_double();
+    this->declareParameter(config_prefix + "jpeg_gate", "always");
+    this->jpeg_gate = this->parseOutputGate(this->node->get_parameter(config_prefix + "jpeg_gate").as_string());
+    this->declareParameter(config_prefix + "jpeg_threads", 0); // 0 = one per core
+    this->jpeg_threads = (uint) std::max<int64_t>(0, this->node->get_parameter(config_prefix + "jpeg_threads").as_int());
+
+    this->declareParameter(config_prefix + "publish_shm", false); // raw frames to a POSIX shared memory ring for local processes
+    this->publish_shm = this->node->get_parameter(config_prefix + "publish_shm").as_bool();
+    this->declareParameter(config_prefix + "shm_slots", 4);
+    this->shm_slots = (uint) std::max<int64_t>(2, this->node->get_parameter(config_prefix + "shm_slots").as_int());
+
+    this->declareParameter(config_prefix + "publish_info", true);
     this->publish_info = this->node->get_parameter(config_prefix + "publish_info").as_bool();
+    this->declareParameter(config_prefix + "info_rate", 0.0);
+    this->info_rate = this->node->get_parameter(config_prefix + "info_rate").as_double();
 
     this->h264_topic = fmt::format(this->node->get_parameter("topic_prefix").as_string() + "{}/{}_h264", this->location, this->model);
-    this->image_topic = fmt::format(this->node->get_parameter("topic_prefix").as_string() + "{}/{}", this->location, this->model);
     this->info_topic = fmt::format(this->node->get_parameter("topic_prefix").as_string() + "{}/{}_camera_info", this->location, this->model);
+    this->raw_topic = fmt::format(this->node->get_parameter("topic_prefix").as_string() + "{}/{}_raw", this->location, this->model);
+    this->lossless_topic = fmt::format(this->node->get_parameter("topic_prefix").as_string() + "{}/{}_lossless", this->location, this->model);
+    this->jpeg_topic = fmt::format(this->node->get_parameter("topic_prefix").as_string() + "{}/{}/compressed", this->location, this->model); // image_transport's compressed name
+    this->tensor_topic = fmt::format(this->node->get_parameter("topic_prefix").as_string() + "{}/{}_tensor", this->location, this->model);
+    this->features_topic = fmt::format(this->node->get_parameter("topic_prefix").as_string() + "{}/{}_features", this->location, this->model);
+    this->fiducial_topic = fmt::format(this->node->get_parameter("topic_prefix").as_string() + "{}/{}_fiducials", this->location, this->model);
+    this->motion_topic = fmt::format(this->node->get_parameter("topic_prefix").as_string() + "{}/{}_motion", this->location, this->model);
+
+    // image outputs, either the single image_output_format on the default topic,
+    // or a list of named outputs with their own format, topic and rate
+    this->image_outputs.clear();
+    this->declareParameter(config_prefix + "image_output_format", "yuv420");
+    this->declareParameter(config_prefix + "image_outputs", std::vector<std::string>{});
+    auto image_output_names = this->node->get_parameter(config_prefix + "image_outputs").as_string_array();
+    if (image_output_names.empty()) {
+        ImageOutput output;
+        output.name = "image";
+        output.format = this->parseImageFormat(this->node->get_parameter(config_prefix + "image_output_format").as_string());
+        output.topic = fmt::format(this->node->get_parameter("topic_prefix").as_string() + "{}/{}", this->location, this->model);
+        this->declareParameter(config_prefix + "image_rate", 0.0);
+        output.rate = this->node->get_parameter(config_prefix + "image_rate").as_double();
+        this->declareParameter(config_prefix + "image_rectified", false);
+        output.rectified = this->node->get_parameter(config_prefix + "image_rectified").as_bool();
+        this->declareParameter(config_prefix + "image_gate", "always");
+        output.gate = this->parseOutputGate(this->node->get_parameter(config_prefix + "image_gate").as_string());
+        this->image_outputs.push_back(output);
+    }
+    for (auto &name : image_output_names) {
+        auto output_prefix = config_prefix + "image_output." + name + ".";
+        this->declareParameter(output_prefix + "format", "bgr8");
+        this->declareParameter(output_prefix + "topic", fmt::format(this->node->get_parameter("topic_prefix").as_string() + "{}/{}_{}", this->location, this->model, name));
+        this->declareParameter(output_prefix + "rate", 0.0);
+        this->declareParameter(output_prefix + "rectified", false);
+        this->declareParameter(output_prefix + "gate", "always");
+        ImageOutput output;
+        output.name = name;
+        output.format = this->parseImageFormat(this->node->get_parameter(output_prefix + "format").as_string());
+        output.topic = this->node->get_parameter(output_prefix + "topic").as_string();
+        output.rate = this->node->get_parameter(output_prefix + "rate").as_double();
+        output.rectified = this->node->get_parameter(output_prefix + "rectified").as_bool();
+        output.gate = this->parseOutputGate(this->node->get_parameter(output_prefix + "gate").as_string());
+        this->image_outputs.push_back(output);
+    }
 
-    this->node->declare_parameter(config_prefix + "enable_calibration", true);
+    this->declareParameter(config_prefix + "enable_calibration", true);
     this->enable_calibration = this->node->get_parameter(config_prefix + "enable_calibration").as_bool();
 
 
@@ -537,58 +1470,70 @@ void CameraInterface::readConfig() {
         this->calibration_files_base_path += '/';
     }
     this->calibration_file = fmt::format("{}{}-{}.json", this->calibration_files_base_path, this->model, this->location);
-
-    this->node->declare_parameter(config_prefix + "hflip", false);
-    this->node->declare_parameter(config_prefix + "vflip", false);
+    this->rectify_cache_file = fmt::format("{}{}-{}.rectify", this->calibration_files_base_path, this->model, this->location);
+    this->calibration_threads = (uint) std::max<int64_t>(1, this->node->get_parameter("calibration_threads").as_int());
+    this->calibration_detect_options.use_sb = this->node->get_parameter("calibration_detector").as_string() == "sb";
+    this->calibration_detect_options.max_detect_width = (uint) std::max<int64_t>(320, this->node->get_parameter("calibration_detect_width").as_int());
+    this->calibration_detect_options.min_sharpness = this->node->get_parameter("calibration_min_sharpness").as_double();
+    this->calibration_progress_topic = fmt::format(this->node->get_parameter("topic_prefix").as_string() + "{}/{}_calibration", this->location, this->model);
+
+    this->declareParameter(config_prefix + "hflip", false);
+    this->declareParameter(config_prefix + "vflip", false);
     this->hflip = this->node->get_parameter(config_prefix + "hflip").as_bool();
     this->vflip = this->node->get_parameter(config_prefix + "vflip").as_bool();
 
-    this->node->declare_parameter(config_prefix + "hw_encoder", true);
+    this->declareParameter(config_prefix + "hw_encoder", true);
     this->hw_encoder = this->node->get_parameter(config_prefix + "hw_encoder").as_bool();
-
-    this->node->declare_parameter(config_prefix + "width", 1920);
+    this->declareParameter(config_prefix + "hw_encoder_device", ""); // e.g. /dev/video11, "" = autodetect
+    this->hw_encoder_device = this->node->get_parameter(config_prefix + "hw_encoder_device").as_string();
+    this->declareParameter(config_prefix + "hw_encoder_codec", "h264");
+    this->hw_encoder_codec = this->node->get_parameter(config_prefix + "hw_encoder_codec").as_string();
+    if (!findV4L2Codec(this->hw_encoder_codec))
+        throw std::runtime_error("Invalid hw_encoder_codec '" + this->hw_encoder_codec + "', use 'h264', 'hevc' or 'fwht'");
+
+    this->declareParameter(config_prefix + "width", 1920);
     this->width = (uint) this->node->get_parameter(config_prefix + "width").as_int();
-    this->node->declare_parameter(config_prefix + "height", 1080);
+    this->declareParameter(config_prefix + "height", 1080);
     this->height = (uint) this->node->get_parameter(config_prefix + "height").as_int();
 
-    this->node->declare_parameter(config_prefix + "bitrate", 4000000);
+    this->declareParameter(config_prefix + "bitrate", 4000000);
     this->bit_rate = this->node->get_parameter(config_prefix + "bitrate").as_int();
 
-    this->node->declare_parameter(config_prefix + "ae_enable", true);
+    this->declareParameter(config_prefix + "ae_enable", true);
     this->ae_enable = this->node->get_parameter(config_prefix + "ae_enable").as_bool();
-    this->node->declare_parameter(config_prefix + "exposure_time_ns", 30000); // 10 ms, -1 = off
+    this->declareParameter(config_prefix + "exposure_time_ns", 30000); // 10 ms, -1 = off
     this->exposure_time = (uint) this->node->get_parameter(config_prefix + "exposure_time_ns").as_int();
-    this->node->declare_parameter(config_prefix + "ae_metering_mode", 0);
+    this->declareParameter(config_prefix + "ae_metering_mode", 0);
     this->ae_metering_mode = (uint) this->node->get_parameter(config_prefix + "ae_metering_mode").as_int();
     // MeteringCentreWeighted = 0,
 	// MeteringSpot = 1,
 	// MeteringMatrix = 2,
 	// MeteringCustom = 3,
 
-    this->node->declare_parameter(config_prefix + "ae_exposure_mode", 0);
+    this->declareParameter(config_prefix + "ae_exposure_mode", 0);
     this->ae_exposure_mode = (uint) this->node->get_parameter(config_prefix + "ae_exposure_mode").as_int();
     // ExposureNormal = 0,
 	// ExposureShort = 1,
 	// ExposureLong = 2,
 	// ExposureCustom = 3,
 
-    this->node->declare_parameter(config_prefix + "ae_constraint_mode", 0);
+    this->declareParameter(config_prefix + "ae_constraint_mode", 0);
     this->ae_constraint_mode = (uint) this->node->get_parameter(config_prefix + "ae_constraint_mode").as_int();
     // ConstraintNormal = 0,
 	// ConstraintHighlight = 1,
 	// ConstraintShadows = 2,
 	// ConstraintCustom = 3,
 
-    // this->node->declare_parameter(config_prefix + "ae_constraint_mode_values", std::vector<double>{ 2.0f, 1.8f });
+    // this->declareParameter(config_prefix + "ae_constraint_mode_values", std::vector<double>{ 2.0f, 1.8f });
     // this->ae_constraint_mode_values = this->node->get_parameter(config_prefix + "ae_constraint_mode_values").as_double_array();
 
-    this->node->declare_parameter(config_prefix + "analog_gain", 1.0); // sensor gain
+    this->declareParameter(config_prefix + "analog_gain", 1.0); // sensor gain
     this->analog_gain = this->node->get_parameter(config_prefix + "analog_gain").as_double();
-    this->node->declare_parameter(config_prefix + "awb_enable", true);
+    this->declareParameter(config_prefix + "awb_enable", true);
     this->awb_enable = this->node->get_parameter(config_prefix + "awb_enable").as_bool();
-    // this->node->declare_parameter(config_prefix + "awb_locked", false);
+    // this->declareParameter(config_prefix + "awb_locked", false);
     // this->awb_locked = this->node->get_parameter(config_prefix + "awb_locked").as_bool();
-    this->node->declare_parameter(config_prefix + "awb_mode", 0);
+    this->declareParameter(config_prefix + "awb_mode", 0);
     this->awb_mode = (uint) this->node->get_parameter(config_prefix + "awb_mode").as_int();
     // AwbAuto = 0,
 	// AwbIncandescent = 1,
@@ -599,24 +1544,59 @@ void CameraInterface::readConfig() {
 	// AwbCloudy = 6,
 	// AwbCustom = 7,
 
-    // this->node->declare_parameter(config_prefix + "color_gains", std::vector<double>{ 2.0f, 1.8f });
+    // this->declareParameter(config_prefix + "color_gains", std::vector<double>{ 2.0f, 1.8f });
     // this->color_gains = this->node->get_parameter(config_prefix + "color_gains").as_double_array();
     
-    this->node->declare_parameter(config_prefix + "brightness", 0.2f);
+    this->declareParameter(config_prefix + "brightness", 0.2f);
     this->brightness = this->node->get_parameter(config_prefix + "brightness").as_double();
-    this->node->declare_parameter(config_prefix + "contrast", 1.2f);
+    this->declareParameter(config_prefix + "contrast", 1.2f);
     this->contrast = this->node->get_parameter(config_prefix + "contrast").as_double();
 
-    this->node->declare_parameter(config_prefix + "compression", 35);
+    this->declareParameter(config_prefix + "compression", 35);
     this->compression = (uint) this->node->get_parameter(config_prefix + "compression").as_int();
 
-    this->node->declare_parameter(config_prefix + "framerate", 30);
+    this->declareParameter(config_prefix + "framerate", 30);
     this->fps = (uint) this->node->get_parameter(config_prefix + "framerate").as_int();
 
-    this->node->declare_parameter(config_prefix + "buffer_count", 4);
+    // frame starts aligned with the leader of the group, e.g. for stereo pairs
+    this->declareParameter(config_prefix + "phase_lock_group", "");
+    this->phase_lock_group_name = this->node->get_parameter(config_prefix + "phase_lock_group").as_string();
+    this->declareParameter(config_prefix + "phase_lock_leader", false);
+    this->phase_lock_leader = this->node->get_parameter(config_prefix + "phase_lock_leader").as_bool();
+    this->declareParameter(config_prefix + "phase_lock_tolerance_us", 100.0);
+    this->phase_lock_tolerance_us = this->node->get_parameter(config_prefix + "phase_lock_tolerance_us").as_double();
+
+    this->declareParameter(config_prefix + "buffer_count", 4); // 0 = auto, tuned from the measured pipeline depth & drops
     this->buffer_count = (uint) this->node->get_parameter(config_prefix + "buffer_count").as_int();
+    this->buffer_count_auto = this->buffer_count == 0;
+
+    // regions of interest as normalized [ x, y, width, height, ... ]
+    this->declareParameter(config_prefix + "roi_regions", std::vector<double>{});
+    auto roi_regions = this->node->get_parameter(config_prefix + "roi_regions").as_double_array();
+    if (roi_regions.size() % 4 != 0)
+        throw std::runtime_error("Invalid roi_regions, use [ x, y, width, height, ... ] in 0.0-1.0 range");
+    this->declareParameter(config_prefix + "roi_qoffset", -0.5); // [-1.0; 1.0], negative = better quality
+    this->roi_qoffset = this->node->get_parameter(config_prefix + "roi_qoffset").as_double();
+    this->declareParameter(config_prefix + "roi_background_qoffset", 0.3);
+    this->roi_background_qoffset = this->node->get_parameter(config_prefix + "roi_background_qoffset").as_double();
+    this->declareParameter(config_prefix + "roi_topic", ""); // sensor_msgs/RegionOfInterest in pixels, "" = off
+    this->roi_topic = this->node->get_parameter(config_prefix + "roi_topic").as_string();
+    this->declareParameter(config_prefix + "roi_timeout_sec", 1.0); // how long a received ROI stays active
+    this->roi_timeout_ns = (long) (this->node->get_parameter(config_prefix + "roi_timeout_sec").as_double() * NS_TO_SEC);
+
+    this->roi_static.clear();
+    for (size_t i = 0; i + 3 < roi_regions.size(); i += 4) {
+        EncoderROI roi;
+        roi.left = (uint) (std::clamp(roi_regions[i], 0.0, 1.0) * this->width);
+        roi.top = (uint) (std::clamp(roi_regions[i+1], 0.0, 1.0) * this->height);
+        roi.right = (uint) (std::clamp(roi_regions[i] + roi_regions[i+2], 0.0, 1.0) * this->width);
+        roi.bottom = (uint) (std::clamp(roi_regions[i+1] + roi_regions[i+3], 0.0, 1.0) * this->height);
+        roi.qoffset = this->roi_qoffset;
+        this->roi_static.push_back(roi);
+    }
+    this->roi_enabled = !this->roi_static.empty() || !this->roi_topic.empty();
 
-    this->node->declare_parameter(config_prefix + "frame_id", "picam");
+    this->declareParameter(config_prefix + "frame_id", "picam");
     this->frame_id = this->node->get_parameter(config_prefix + "frame_id").as_string();
 
     this->log_scrolls = this->node->get_parameter("log_scroll").as_bool();
@@ -635,22 +1615,41 @@ void CameraInterface::calibration_toggle(const std::shared_ptr<std_srvs::srv::Se
         response->message = "Calibration not running";
         return;
     }
-    this->calibration_running = request->data;
 
     response->success = true;
-    if (this->calibration_running) {
+    if (request->data) {
         this->calibration_frames_requested = 0;
-        this->calibration_frames.clear();
+        this->calibration_frames_taken = 0;
         this->last_calibration_frame_taken_ns = 0;
+        auto worker = std::make_shared<CalibrationWorker>(cv::Size(this->width, this->height), this->calibration_pattern_size,
+                                                          this->calibration_square_size, this->calibration_frames_needed,
+                                                          this->calibration_detect_options, this->calibration_threads,
+                                                          std::bind(&CameraInterface::calibrationResult, this, std::placeholders::_1),
+                                                          std::bind(&CameraInterface::calibrationProgress, this, std::placeholders::_1));
+        this->retireCalibrationWorker(std::atomic_exchange(&this->calibration_worker, worker)); // a finished one
+        this->calibration_running = true; // the capture thread sees the worker first
         response->message = "Calibration started";
         RCLCPP_INFO(rclcpp::get_logger("rclcpp"), "%sCalibration started for %s at location %d%s", CYAN.c_str(), this->model.c_str(), this->location, CLR.c_str());
     } else {
+        this->calibration_running = false; // no new submissions, then the swap
+        this->retireCalibrationWorker(std::atomic_exchange(&this->calibration_worker, std::shared_ptr<CalibrationWorker>()));
         response->message = "Calibration stopped";
         RCLCPP_INFO(rclcpp::get_logger("rclcpp"), "%sCalibration stopped for %s at location %d%s", RED.c_str(), this->model.c_str(), this->location, CLR.c_str());
     }
     this->lines_printed = -1;
 }
 
+// Frees a worker swapped out by a service call. The capture thread may still hold a copy
+// for the frame it's on; it lets go within that frame, and the pool threads (possibly
+// mid solve) are joined here instead of on the capture thread.
+void CameraInterface::retireCalibrationWorker(std::shared_ptr<CalibrationWorker> worker) {
+    if (!worker)
+        return;
+    while (worker.use_count() > 1)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    worker.reset();
+}
+
 void CameraInterface::calibration_sample_frame(const std::shared_ptr<std_srvs::srv::Trigger::Request>,
                                                std::shared_ptr<std_srvs::srv::Trigger::Response> response) {
     if (!this->calibration_running) {
@@ -658,7 +1657,9 @@ void CameraInterface::calibration_sample_frame(const std::shared_ptr<std_srvs::s
         response->message = "Calibration not running";
         return;
     }
-    if (this->calibration_frames_requested >= this->calibration_frames_needed) {
+    auto calibration_worker = std::atomic_load(&this->calibration_worker);
+    uint boards_found = calibration_worker ? calibration_worker->boardsFound() : 0;
+    if (boards_found >= this->calibration_frames_needed) {
         response->success = false;
         response->message = "Enough frames collected";
         return;
@@ -666,21 +1667,160 @@ void CameraInterface::calibration_sample_frame(const std::shared_ptr<std_srvs::s
 
     this->calibration_frames_requested++;
     
+    // frames without a detected board don't count, keep sampling until enough were found
     response->success = true;
-    response->message = fmt::format("Capturing frame {} of {}", this->calibration_frames_requested, this->calibration_frames_needed);
+    response->message = fmt::format("Capturing frame {}, {} of {} boards found so far", this->calibration_frames_requested, boards_found, this->calibration_frames_needed);
     RCLCPP_INFO(rclcpp::get_logger("rclcpp"), "%sFrame #%d sampled for %s at location %d%s", CYAN.c_str(), this->calibration_frames_requested, this->model.c_str(), this->location, CLR.c_str());
     this->lines_printed = -1;
     
-    if (this->calibration_frames_requested == this->calibration_frames_needed) {
-        response->message = fmt::format("Captured {} frames, processing calibration...", this->calibration_frames_requested);
+}
+
+void CameraInterface::calibrationProgress(const std::string &message) {
+    RCLCPP_INFO(rclcpp::get_logger("rclcpp"), "%sCalibration of %s at location %d: %s%s", MAGENTA.c_str(), this->model.c_str(), this->location, message.c_str(), CLR.c_str());
+    this->lines_printed = -1;
+
+    std_msgs::msg::String msg;
+    msg.data = message;
+    this->calibration_progress_publisher->publish(msg);
+}
+
+void CameraInterface::calibrationResult(const CalibrationWorker::Result &result) {
+    {
+        std::lock_guard<std::mutex> lock(this->info_mutex);
+        applyCalibration(result.camera_matrix, result.dist_coeffs, this->out_info_msg);
+    }
+    if (this->publish_image && this->hasRectifiedOutputs())
+        this->updateRectifyMaps(false); // cached on calibration_save
+    if (this->fiducial_worker)
+        this->updateFiducialCameraModel();
+    this->calibration_running = false;
+    RCLCPP_INFO(rclcpp::get_logger("rclcpp"), "%sCalibration complete for %s at location %d%s", MAGENTA.c_str(), this->model.c_str(), this->location, CLR.c_str());
+    this->lines_printed = -1;
+}
+
+void CameraInterface::updateFiducialCameraModel() {
+    cv::Mat camera_matrix, dist_coeffs;
+    {
+        std::lock_guard<std::mutex> lock(this->info_mutex);
+        camera_matrix = cv::Mat(3, 3, CV_64F, this->out_info_msg.k.data()).clone();
+        if (!this->out_info_msg.d.empty())
+            dist_coeffs = cv::Mat(this->out_info_msg.d, true).reshape(1, 1);
+    }
+    this->fiducial_worker->setCameraModel(camera_matrix, dist_coeffs);
+}
+
+// Fiducial worker thread
+void CameraInterface::fiducialResult(const std::vector<FiducialDetection> &detections, long timestamp_ns, bool full_search) {
+    picam_ros2::msg::FiducialMarkerArray msg;
+    msg.header.frame_id = this->frame_id;
+    setCurrentStamp(&msg.header.stamp, timestamp_ns);
+    msg.image_width = this->width;
+    msg.image_height = this->height;
+    msg.full_search = full_search;
+    msg.markers.resize(detections.size());
+    for (size_t i = 0; i < detections.size(); i++) {
+        auto &detection = detections[i];
+        auto &marker = msg.markers[i];
+        marker.id = detection.id;
+        for (uint c = 0; c < 4; c++) {
+            marker.corners[c * 2] = detection.corners[c].x;
+            marker.corners[c * 2 + 1] = detection.corners[c].y;
+        }
+        marker.pose_valid = detection.pose_valid;
+        if (!detection.pose_valid)
+            continue;
+        marker.pose.position.x = detection.tvec[0];
+        marker.pose.position.y = detection.tvec[1];
+        marker.pose.position.z = detection.tvec[2];
+        // Rodrigues vector to quaternion
+        double angle = cv::norm(detection.rvec);
+        cv::Vec3d axis = angle > 1e-12 ? detection.rvec / angle : cv::Vec3d(1.0, 0.0, 0.0);
+        double s = std::sin(angle / 2.0);
+        marker.pose.orientation.x = axis[0] * s;
+        marker.pose.orientation.y = axis[1] * s;
+        marker.pose.orientation.z = axis[2] * s;
+        marker.pose.orientation.w = std::cos(angle / 2.0);
+    }
+
+    if (rclcpp::ok())
+        this->fiducial_publisher->publish(msg);
+}
+
+// Feature worker thread
+void CameraInterface::featuresResult(const FeatureFrontend &frontend, const std::vector<Feature> &features, long timestamp_ns, uint64_t sensor_timestamp_ns) {
+    picam_ros2::msg::FeatureArray msg;
+    msg.header.frame_id = this->frame_id;
+    setCurrentStamp(&msg.header.stamp, timestamp_ns);
+    msg.sensor_timestamp_ns = sensor_timestamp_ns;
+    msg.image_width = this->width;
+    msg.image_height = this->height;
+    msg.tracked = frontend.tracked();
+    msg.features.resize(features.size());
+    for (size_t i = 0; i < features.size(); i++) {
+        msg.features[i].id = features[i].id;
+        msg.features[i].x = features[i].point.x;
+        msg.features[i].y = features[i].point.y;
+        msg.features[i].age = features[i].age;
+        msg.features[i].response = features[i].response;
+    }
+    const cv::Mat &descriptors = frontend.descriptors();
+    if (!descriptors.empty()) {
+        msg.descriptor_size = descriptors.cols;
+        msg.descriptors.assign(descriptors.data, descriptors.data + descriptors.total()); // continuous, allocated by the frontend
     }
+
+    if (rclcpp::ok())
+        this->features_publisher->publish(msg);
+}
+
+bool CameraInterface::hasRectifiedOutputs() const {
+    return std::any_of(this->image_outputs.begin(), this->image_outputs.end(), [](const ImageOutput &output) { return output.rectified; });
+}
+
+// Maps for the current calibration, from the cache file when it matches,
+// the rectified images then follow the projection matrix of CameraInfo
+void CameraInterface::updateRectifyMaps(bool use_cache) {
+    cv::Mat camera_matrix, dist_coeffs;
+    {
+        std::lock_guard<std::mutex> lock(this->info_mutex);
+        camera_matrix = cv::Mat(3, 3, CV_64F, this->out_info_msg.k.data()).clone();
+        if (!this->out_info_msg.d.empty())
+            dist_coeffs = cv::Mat(this->out_info_msg.d, true).reshape(1, 1);
+    }
+    cv::Size size(this->width, this->height);
+
+    std::shared_ptr<RectifyMaps> maps;
+    if (use_cache)
+        maps = RectifyMaps::load(this->rectify_cache_file, camera_matrix, dist_coeffs, size);
+    if (maps) {
+        RCLCPP_INFO(rclcpp::get_logger("rclcpp"), "Mapped rectification maps from %s", this->rectify_cache_file.c_str());
+    } else {
+        maps = RectifyMaps::build(camera_matrix, dist_coeffs, size);
+        if (use_cache && !maps->save(this->rectify_cache_file))
+            RCLCPP_WARN(rclcpp::get_logger("rclcpp"), "Failed to cache rectification maps in %s", this->rectify_cache_file.c_str());
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(this->info_mutex);
+        const cv::Mat &new_camera_matrix = maps->newCameraMatrix();
+        this->out_info_msg.r = { 1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0 };
+        this->out_info_msg.p.fill(0.0);
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                this->out_info_msg.p[i * 4 + j] = new_camera_matrix.at<double>(i, j);
+    }
+    std::atomic_store(&this->rectify_maps, maps);
 }
 
 void CameraInterface::calibration_save(const std::shared_ptr<std_srvs::srv::Trigger::Request>,
                                              std::shared_ptr<std_srvs::srv::Trigger::Response> response) {
 
+    std::lock_guard<std::mutex> lock(this->info_mutex);
     if (writeCalibration(this->out_info_msg, this->model, this->width, this->height, this->calibration_file)) {
         RCLCPP_INFO(rclcpp::get_logger("rclcpp"), "Saved calibration file %s", this->calibration_file.c_str());
+        auto maps = std::atomic_load(&this->rectify_maps);
+        if (maps && !maps->save(this->rectify_cache_file))
+            RCLCPP_WARN(rclcpp::get_logger("rclcpp"), "Failed to cache rectification maps in %s", this->rectify_cache_file.c_str());
         response->success = true;
         response->message = "Calibration saved";
     } else {
@@ -694,30 +1834,17 @@ void CameraInterface::calibration_save(const std::shared_ptr<std_srvs::srv::Trig
 
 CameraInterface::~CameraInterface() {
     std::cout << BLUE << "Cleaning up " << this->model << " interface" << CLR << std::endl;
-    this->running = false;
     this->calibration_running = false;
 
     try {
-        this->camera->stop();
-        this->camera->release();
-        this->camera->requestCompleted.disconnect(this, &CameraInterface::captureRequestComplete);
+        this->stop(); // clears running itself, returns early when it's already clear
         this->camera.reset();
-
-        // for (auto &iter : this->mapped_capture_buffers)
-        // {
-        // 	assert(iter.first->planes().size() == iter.second.size());
-        // 	for (unsigned i = 0; i < iter.first->planes().size(); i++)
-        // 	for (auto &span : iter.second)
-        // 		munmap(span.data(), span.size());
-        // }
-        this->mapped_capture_buffers.clear();
-        this->capture_frame_buffers.clear();
     } catch (...) {
         std::cout << "Error cleaning up interface" << std::endl;
     }
+    this->running = false;
+    this->retireCalibrationWorker(std::atomic_exchange(&this->calibration_worker, std::shared_ptr<CalibrationWorker>())); // its callbacks use this interface, no more frames come in
     
-    delete this->encoder;
-    this->calibration_frames.clear();
     this->camera = NULL;
     this->node = NULL;
 }
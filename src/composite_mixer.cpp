@@ -0,0 +1,381 @@
+#include <algorithm>
+#include <cstring>
+
+#include <opencv2/opencv.hpp>
+
+#include "picam_ros2/composite_mixer.hpp"
+#include "picam_ros2/image_output.hpp"
+
+using namespace std::chrono_literals;
+
+static const uint8_t BLACK_Y = 16, BLACK_UV = 128;
+
+template<typename T>
+static void declareParameter(std::shared_ptr<PicamROS2> node, const std::string &name, const T &default_value) {
+    if (!node->has_parameter(name))
+        node->declare_parameter(name, default_value);
+}
+
+CompositeConfig CompositeMixer::readConfig(std::shared_ptr<PicamROS2> node, const std::string &name) {
+    auto prefix = GetConfigPrefix(name);
+    CompositeConfig config;
+    config.name = name;
+
+    declareParameter(node, prefix + "cameras", std::vector<int64_t>{});
+    for (auto location : node->get_parameter(prefix + "cameras").as_integer_array())
+        config.locations.push_back((int) location);
+    if (config.locations.size() < 2 || config.locations.size() > 4)
+        throw std::runtime_error(fmt::format("Composite {} needs 2 to 4 camera locations in cameras", name));
+
+    declareParameter(node, prefix + "layout", "grid");
+    auto layout = node->get_parameter(prefix + "layout").as_string();
+    if (layout != "grid" && layout != "side_by_side")
+        throw std::runtime_error(fmt::format("Invalid layout '{}' for composite {}, use grid or side_by_side", layout, name));
+    config.grid = layout == "grid";
+
+    // 2x2 of 960x540 is 1080p, the most the Pi's H.264 encoder takes
+    declareParameter(node, prefix + "tile_width", 960);
+    declareParameter(node, prefix + "tile_height", 540);
+    config.tile_width = (uint) node->get_parameter(prefix + "tile_width").as_int();
+    config.tile_height = (uint) node->get_parameter(prefix + "tile_height").as_int();
+    if (config.tile_width == 0 || config.tile_width % 32 != 0 || config.tile_height == 0 || config.tile_height % 2 != 0)
+        throw std::runtime_error(fmt::format("tile_width of composite {} must be a multiple of 32, tile_height even", name));
+
+    declareParameter(node, prefix + "sync_tolerance_ms", 5.0);
+    config.sync_tolerance_ns = (long) (node->get_parameter(prefix + "sync_tolerance_ms").as_double() * 1e6);
+    declareParameter(node, prefix + "max_wait_ms", 50.0);
+    config.max_wait_ns = (long) (node->get_parameter(prefix + "max_wait_ms").as_double() * 1e6);
+
+    declareParameter(node, prefix + "buffer_count", 4);
+    config.buffer_count = (uint) std::max<int64_t>(2, node->get_parameter(prefix + "buffer_count").as_int());
+
+    declareParameter(node, prefix + "frame_id", fmt::format("composite_{}", name));
+    config.frame_id = node->get_parameter(prefix + "frame_id").as_string();
+    declareParameter(node, prefix + "topic_prefix", fmt::format("/picam_ros2/composite_{}/", name));
+    auto topic_prefix = node->get_parameter(prefix + "topic_prefix").as_string();
+    config.h264_topic = topic_prefix + "h264";
+    config.layout_topic = topic_prefix + "layout";
+
+    return config;
+}
+
+CompositeMixer::CompositeMixer(std::shared_ptr<PicamROS2> node, const CompositeConfig &config)
+    : buffer_pool(fmt::format("picam-ros2-composite-{}", config.name)) {
+    this->node = node;
+    this->config = config;
+
+    uint tiles = config.locations.size();
+    this->cols = config.grid ? 2 : tiles;
+    this->rows = (tiles + this->cols - 1) / this->cols;
+    this->composite_width = this->cols * config.tile_width;
+    this->composite_height = this->rows * config.tile_height;
+
+    this->detached = std::make_unique<std::atomic<bool>[]>(tiles);
+    for (uint i = 0; i < tiles; i++) {
+        this->rings.push_back(std::make_unique<SpscRing<TileFrame>>(RING_CAPACITY));
+        this->detached[i] = true; // until its camera starts
+    }
+    this->frame_ids.resize(tiles);
+
+    // tightly packed YUV420, as the encoders expect it
+    if (!this->buffer_pool.isValid())
+        throw std::runtime_error("No dma heap for composite buffers");
+    size_t y_size = (size_t) this->composite_width * this->composite_height;
+    size_t size = (y_size * 3 / 2 + 4095) & ~(size_t) 4095;
+    auto pooled = this->buffer_pool.acquire(config.buffer_count, size);
+    if (pooled.size() < config.buffer_count)
+        throw std::runtime_error(fmt::format("Failed to allocate composite buffers for {}", config.name));
+    this->slots.resize(pooled.size());
+    for (uint i = 0; i < pooled.size(); i++) {
+        Slot &slot = this->slots[i];
+        slot.pooled = pooled[i];
+        std::vector<libcamera::FrameBuffer::Plane> plane(1);
+        plane[0].fd = pooled[i]->fd;
+        plane[0].offset = 0;
+        plane[0].length = size;
+        slot.buffer = std::make_unique<libcamera::FrameBuffer>(plane);
+
+        slot.mapped.memory = pooled[i]->memory;
+        slot.mapped.size = size;
+        slot.mapped.planes = { slot.mapped.memory, slot.mapped.memory + y_size, slot.mapped.memory + y_size + y_size / 4 };
+        slot.mapped.strides = { this->composite_width, this->composite_width / 2, this->composite_width / 2 };
+        slot.mapped.plane_sizes = { (uint) y_size, (uint) y_size / 4, (uint) y_size / 4 };
+
+        // letterbox bars and unused tiles stay black
+        memset(slot.mapped.planes[0], BLACK_Y, y_size);
+        memset(slot.mapped.planes[1], BLACK_UV, y_size / 2);
+        this->free_slots.push_back(i);
+    }
+
+    auto qos = rclcpp::QoS(1);
+    qos.reliable();
+    qos.durability_volatile();
+    this->layout_publisher = node->create_publisher<picam_ros2::msg::CompositeLayout>(config.layout_topic, qos);
+
+    this->mix_thread = std::thread(&CompositeMixer::mixLoop, this);
+
+    RCLCPP_INFO(rclcpp::get_logger("rclcpp"), "Composite %s: %u cameras in %ux%u tiles of %ux%u, publishing on %s",
+                config.name.c_str(), tiles, this->cols, this->rows, config.tile_width, config.tile_height, config.h264_topic.c_str());
+}
+
+CompositeMixer::~CompositeMixer() {
+    this->stopping = true;
+    this->wake_cond.notify_all();
+    if (this->mix_thread.joinable())
+        this->mix_thread.join();
+
+    for (uint i = 0; i < this->rings.size(); i++)
+        this->dropFrames(i, std::chrono::steady_clock::time_point::max());
+    for (auto &slot : this->slots)
+        this->buffer_pool.release(slot.pooled);
+
+    RCLCPP_INFO(rclcpp::get_logger("rclcpp"), "Composite %s: %lu frames composed, %lu dropped, %lu tiles missing",
+                this->config.name.c_str(), (unsigned long) this->frames_composed, (unsigned long) this->frames_dropped,
+                (unsigned long) this->tiles_missing);
+}
+
+void CompositeMixer::setEncodeCallback(std::function<void(FramePtr frame, long timestamp_ns)> encode) {
+    std::lock_guard<std::mutex> lock(this->callbacks_mutex);
+    this->encode = encode;
+}
+
+void CompositeMixer::setTileFrameId(uint tile, const std::string &frame_id) {
+    std::lock_guard<std::mutex> lock(this->callbacks_mutex);
+    if (tile < this->frame_ids.size())
+        this->frame_ids[tile] = frame_id;
+}
+
+void CompositeMixer::attachTile(uint tile) {
+    if (tile < this->rings.size())
+        this->detached[tile] = false;
+}
+
+void CompositeMixer::detachTile(uint tile) {
+    if (tile >= this->rings.size())
+        return;
+    this->detached[tile] = true;
+    this->wake_cond.notify_one();
+    // the mixer thread drops the frames, only the consumer may pop them
+    std::unique_lock<std::mutex> lock(this->detach_mutex);
+    this->detach_cond.wait(lock, [&] { return this->rings[tile]->empty() || !this->mix_thread.joinable() || this->stopping; });
+}
+
+void CompositeMixer::pushFrame(uint tile, FramePtr frame, uint width, uint height, uint64_t sensor_timestamp_ns) {
+    if (tile >= this->rings.size() || this->detached[tile])
+        return;
+
+    TileFrame *slot = this->rings[tile]->beginWrite();
+    if (!slot) {
+        this->frames_dropped++; // mixer behind
+        return;
+    }
+    slot->frame = std::move(frame);
+    slot->width = width;
+    slot->height = height;
+    slot->sensor_timestamp_ns = sensor_timestamp_ns;
+    slot->arrival = std::chrono::steady_clock::now();
+    this->rings[tile]->endWrite();
+    this->wake_cond.notify_one();
+}
+
+void CompositeMixer::mixLoop() {
+    while (!this->stopping) {
+        {
+            // short timeout, frames waiting for a missing camera expire on their own
+            std::unique_lock<std::mutex> lock(this->wake_mutex);
+            this->wake_cond.wait_for(lock, 2ms);
+        }
+        while (!this->stopping && this->tryCompose())
+            ;
+    }
+    this->notifyDetached(); // nobody drops frames from here on
+}
+
+// wakes detachTile(), under the mutex so a waiter can't miss it between check and wait
+void CompositeMixer::notifyDetached() {
+    {
+        std::lock_guard<std::mutex> lock(this->detach_mutex);
+    }
+    this->detach_cond.notify_all();
+}
+
+void CompositeMixer::dropFrames(uint tile, std::chrono::steady_clock::time_point arrived_before) {
+    while (TileFrame *frame = this->rings[tile]->front()) {
+        if (frame->arrival >= arrived_before)
+            break;
+        frame->frame.reset();
+        this->rings[tile]->pop();
+    }
+}
+
+// Matches the other cameras' frames to the oldest frame of the first camera,
+// false while still waiting for one of them
+bool CompositeMixer::tryCompose() {
+    auto now = std::chrono::steady_clock::now();
+    auto max_wait = std::chrono::nanoseconds(this->config.max_wait_ns);
+    bool any_detached = false;
+    for (uint i = 0; i < this->rings.size(); i++) {
+        if (this->detached[i]) {
+            this->dropFrames(i, std::chrono::steady_clock::time_point::max());
+            any_detached = true;
+        }
+    }
+    if (any_detached)
+        this->notifyDetached();
+
+    TileFrame *first = this->rings[0]->front();
+    if (!first) {
+        // nothing to pace the stream, don't sit on the other cameras' buffers
+        for (uint i = 1; i < this->rings.size(); i++)
+            this->dropFrames(i, now - max_wait);
+        return false;
+    }
+
+    bool expired = now - first->arrival > max_wait;
+    std::vector<TileFrame *> tiles(this->rings.size(), nullptr);
+    tiles[0] = first;
+    for (uint i = 1; i < this->rings.size(); i++) {
+        bool decided = false;
+        while (TileFrame *tile = this->rings[i]->front()) {
+            int64_t dt = (int64_t) (tile->sensor_timestamp_ns - first->sensor_timestamp_ns);
+            if (dt < -this->config.sync_tolerance_ns) {
+                tile->frame.reset(); // too old to match anything
+                this->rings[i]->pop();
+                this->frames_dropped++;
+                continue;
+            }
+            if (dt <= this->config.sync_tolerance_ns)
+                tiles[i] = tile;
+            decided = true; // matched, or the camera skipped this one
+            break;
+        }
+        if (!decided && !expired && !this->detached[i])
+            return false;
+    }
+
+    try {
+        this->compose(tiles);
+    } catch (const std::exception &e) {
+        // a failed encoder queue or dma-buf sync costs this frame, not the mixer thread
+        this->frames_dropped++;
+        RCLCPP_ERROR_THROTTLE(rclcpp::get_logger("rclcpp"), *this->node->get_clock(), 1000,
+                              "Composite %s: frame dropped, %s", this->config.name.c_str(), e.what());
+    }
+
+    for (uint i = 0; i < tiles.size(); i++) {
+        if (tiles[i]) {
+            tiles[i]->frame.reset();
+            this->rings[i]->pop();
+        }
+    }
+    return true;
+}
+
+void CompositeMixer::compose(std::vector<TileFrame *> &tiles) {
+    uint index;
+    {
+        std::lock_guard<std::mutex> lock(this->free_slots_mutex);
+        if (this->free_slots.empty()) {
+            this->frames_dropped++; // encoder still holds all composite buffers
+            return;
+        }
+        index = this->free_slots.back();
+        this->free_slots.pop_back();
+    }
+    Slot &slot = this->slots[index];
+
+    long timestamp_ns = tiles[0]->frame->timestamp_ns;
+    auto frame = std::make_shared<FrameHandle>(nullptr, slot.buffer.get(), &slot.mapped, timestamp_ns,
+                                               [this, index](libcamera::Request *) { this->releaseSlot(index); });
+
+    picam_ros2::msg::CompositeLayout layout;
+    layout.header.frame_id = this->config.frame_id;
+    setCurrentStamp(&layout.header.stamp, timestamp_ns);
+    layout.width = this->composite_width;
+    layout.height = this->composite_height;
+    layout.tiles.resize(tiles.size());
+
+    std::function<void(FramePtr, long)> encode;
+    {
+        std::lock_guard<std::mutex> lock(this->callbacks_mutex);
+        encode = this->encode;
+        for (uint i = 0; i < tiles.size(); i++)
+            layout.tiles[i].frame_id = this->frame_ids[i];
+    }
+
+    {
+        FrameHandle::CpuAccess write_access(*frame, true);
+        for (uint i = 0; i < tiles.size(); i++) {
+            auto &tile = layout.tiles[i];
+            tile.location = this->config.locations[i];
+            if (tiles[i]) {
+                FrameHandle::CpuAccess read_access(*tiles[i]->frame);
+                this->copyTile(i, tiles[i], slot.mapped, tile.roi);
+                tile.present = true;
+                setCurrentStamp(&tile.stamp, tiles[i]->frame->timestamp_ns);
+                tile.source_width = tiles[i]->width;
+                tile.source_height = tiles[i]->height;
+            } else {
+                this->fillTile(i, slot.mapped);
+                tile.present = false;
+                tile.roi.x_offset = (i % this->cols) * this->config.tile_width;
+                tile.roi.y_offset = (i / this->cols) * this->config.tile_height;
+                tile.roi.width = this->config.tile_width;
+                tile.roi.height = this->config.tile_height;
+                this->tiles_missing++;
+            }
+        }
+    }
+
+    if (encode)
+        encode(frame, timestamp_ns);
+    frame.reset(); // back in the pool once the encoder lets go too
+    this->frames_composed++;
+
+    if (rclcpp::ok())
+        this->layout_publisher->publish(layout);
+}
+
+// Scaled to fit the tile keeping the aspect ratio, centred
+void CompositeMixer::copyTile(uint tile, const TileFrame *source, const MappedBuffer &dst, sensor_msgs::msg::RegionOfInterest &roi) {
+    uint tile_width = this->config.tile_width, tile_height = this->config.tile_height;
+    double scale = std::min((double) tile_width / source->width, (double) tile_height / source->height);
+    uint width = std::min(tile_width, (uint) (source->width * scale + 0.5)) & ~1u;
+    uint height = std::min(tile_height, (uint) (source->height * scale + 0.5)) & ~1u;
+    uint x = (tile % this->cols) * tile_width + (((tile_width - width) / 2) & ~1u);
+    uint y = (tile / this->cols) * tile_height + (((tile_height - height) / 2) & ~1u);
+
+    if (width != tile_width || height != tile_height)
+        this->fillTile(tile, dst); // bars
+
+    const MappedBuffer &src = *source->frame->mapped;
+    for (uint j = 0; j < 3; j++) {
+        uint sub = j == 0 ? 1 : 2;
+        cv::Mat src_plane(source->height / sub, source->width / sub, CV_8UC1, src.planes[j], src.strides[j]);
+        cv::Mat dst_plane(this->composite_height / sub, this->composite_width / sub, CV_8UC1, dst.planes[j], dst.strides[j]);
+        cv::Mat dst_rect = dst_plane(cv::Rect(x / sub, y / sub, width / sub, height / sub));
+        if (dst_rect.size() == src_plane.size())
+            src_plane.copyTo(dst_rect);
+        else
+            cv::resize(src_plane, dst_rect, dst_rect.size(), 0, 0, cv::INTER_AREA);
+    }
+
+    roi.x_offset = x;
+    roi.y_offset = y;
+    roi.width = width;
+    roi.height = height;
+}
+
+void CompositeMixer::fillTile(uint tile, const MappedBuffer &dst) {
+    uint x = (tile % this->cols) * this->config.tile_width, y = (tile / this->cols) * this->config.tile_height;
+    for (uint j = 0; j < 3; j++) {
+        uint sub = j == 0 ? 1 : 2;
+        for (uint row = y / sub; row < (y + this->config.tile_height) / sub; row++)
+            memset(dst.planes[j] + (size_t) row * dst.strides[j] + x / sub, j == 0 ? BLACK_Y : BLACK_UV, this->config.tile_width / sub);
+    }
+}
+
+void CompositeMixer::releaseSlot(uint index) {
+    std::lock_guard<std::mutex> lock(this->free_slots_mutex);
+    this->free_slots.push_back(index);
+}
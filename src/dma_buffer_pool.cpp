@@ -0,0 +1,132 @@
+#include <sys/mman.h>
+#include <algorithm>
+#include <iostream>
+#include <fmt/core.h>
+
+#include "picam_ros2/const.hpp"
+#include "picam_ros2/dma_buffer_pool.hpp"
+
+DmaBufferPool::DmaBufferPool(std::string name_prefix) {
+    this->name_prefix = name_prefix;
+}
+
+DmaBufferPool::~DmaBufferPool() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    for (auto &buffer : this->buffers)
+        unmap(buffer.get());
+    this->buffers.clear();
+}
+
+std::vector<PooledBuffer *> DmaBufferPool::acquire(uint count, size_t size) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    // give back free buffers that won't fit this configuration, so CMA doesn't fill up
+    // with stale sizes; a buffer more than twice the size is not worth keeping either
+    auto unfit = [size](const std::unique_ptr<PooledBuffer> &b) {
+        return !b->in_use && (b->size < size || b->size > size * 2);
+    };
+    for (auto &buffer : this->buffers) {
+        if (unfit(buffer))
+            unmap(buffer.get());
+    }
+    this->buffers.erase(std::remove_if(this->buffers.begin(), this->buffers.end(), unfit), this->buffers.end());
+
+    std::vector<PooledBuffer *> out;
+    for (auto &buffer : this->buffers) {
+        if (out.size() == count)
+            break;
+        if (!buffer->in_use) {
+            buffer->in_use = true;
+            out.push_back(buffer.get());
+        }
+    }
+    uint reused = out.size();
+
+    while (out.size() < count) {
+        PooledBuffer *buffer = this->allocate(size);
+        if (!buffer) {
+            // the caller gets nothing to release, so nothing stays taken; the buffers are
+            // kept free in the pool for the next attempt
+            for (auto *taken : out)
+                taken->in_use = false;
+            throw std::runtime_error("Failed to allocate dma buffer");
+        }
+        buffer->in_use = true;
+        out.push_back(buffer);
+    }
+
+    std::cout << "Dma buffer pool: reused " << reused << ", allocated " << (count - reused) << " buffers of " << size << " B" << std::endl;
+    return out;
+}
+
+void DmaBufferPool::release(PooledBuffer *buffer) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    buffer->in_use = false;
+}
+
+void DmaBufferPool::releaseAll() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    for (auto &buffer : this->buffers)
+        buffer->in_use = false;
+}
+
+PooledBuffer *DmaBufferPool::allocate(size_t size) {
+    auto buffer = std::make_unique<PooledBuffer>();
+    buffer->name = fmt::format("{}-{}", this->name_prefix, this->allocated_total++);
+
+    libcamera::UniqueFD fd = this->dma_heap.alloc(buffer->name.c_str(), size);
+    if (!fd.isValid())
+        return nullptr;
+    buffer->fd = libcamera::SharedFD(std::move(fd));
+
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, buffer->fd.get(), 0);
+    if (memory == MAP_FAILED) {
+        std::cerr << RED << "Failed to map dma buffer " << buffer->name << CLR << std::endl;
+        return nullptr;
+    }
+    buffer->memory = static_cast<uint8_t *>(memory);
+    buffer->size = size;
+
+    this->buffers.push_back(std::move(buffer));
+    return this->buffers.back().get();
+}
+
+void DmaBufferPool::unmap(PooledBuffer *buffer) {
+    if (buffer->memory && munmap(buffer->memory, buffer->size) < 0)
+        std::cerr << RED << "Failed to unmap dma buffer " << buffer->name << CLR << std::endl;
+    buffer->memory = nullptr;
+}
+
+void DmaBufferPool::recordFrame(uint frames_in_flight, uint frames_dropped) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->window.frames_recorded == WINDOW_FRAMES) {
+        this->last_window = this->window;
+        this->window = DepthWindow();
+    }
+    this->window.max_in_flight = std::max(this->window.max_in_flight, frames_in_flight);
+    this->window.frames_dropped += frames_dropped;
+    this->window.frames_recorded++;
+}
+
+uint DmaBufferPool::maxFramesInFlight() const {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return std::max(this->window.max_in_flight, this->last_window.max_in_flight);
+}
+
+uint DmaBufferPool::framesDropped() const {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->window.frames_dropped + this->last_window.frames_dropped;
+}
+
+uint DmaBufferPool::recommendedCount(uint min_count, uint max_count) const {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->window.frames_recorded == 0 && this->last_window.frames_recorded == 0)
+        return min_count;
+
+    // one buffer on top of the deepest recent pipeline for the camera to fill,
+    // another one when frames were dropped recently
+    uint count = std::max(this->window.max_in_flight, this->last_window.max_in_flight) + 1;
+    if (this->window.frames_dropped + this->last_window.frames_dropped > 0)
+        count++;
+    return std::clamp(count, min_count, max_count);
+}
@@ -1,14 +1,19 @@
 #include "picam_ros2/encoder_base.hpp"
 
-Encoder::Encoder(CameraInterface *interface, std::shared_ptr<libcamera::Camera> camera) {
-    this->interface = interface;
-    this->camera = camera;
+Encoder::Encoder(const EncoderOptions &options, OutputCallback on_output, LogCallback on_log, uint width, uint height) {
+    this->options = options;
+    this->on_output = on_output;
+    this->on_log = on_log;
+    this->width = width;
+    this->height = height;
+}
+
+void Encoder::setRegionsOfInterest(const std::vector<EncoderROI> &rois) {
+    std::lock_guard<std::mutex> lock(this->rois_mutex);
+    this->rois = rois;
 }
 
 Encoder::~Encoder() {
 
     // std::cout << BLUE << "Cleaning up base encoder" << CLR << std::endl;
-
-    this->interface = NULL;
-    this->camera = NULL;
 }
\ No newline at end of file
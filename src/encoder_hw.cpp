@@ -1,91 +1,85 @@
 #include <sys/ioctl.h>
 #include <fcntl.h>
+#include <cstring>
+#include <iostream>
 #include <linux/videodev2.h>
 #include <string>
 #include <sys/mman.h>
 
 #include "picam_ros2/encoder_hw.hpp"
-#include "picam_ros2/camera_interface.hpp"
+#include "picam_ros2/v4l2_m2m.hpp"
 
+#include <algorithm>
 #include <bitset>
-#include <poll.h>
+#include <cctype>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
-int xioctl(int fd, unsigned long ctl, void *arg)
-{
-	int ret, num_tries = 10;
-	do
-	{
-		ret = ioctl(fd, ctl, arg);
-	} while (ret == -1 && errno == EINTR && num_tries-- > 0);
-	return ret;
-}
-
-EncoderHW::EncoderHW(CameraInterface *interface, std::shared_ptr<libcamera::Camera> camera)
-	: Encoder (interface, camera) {
+EncoderHW::EncoderHW(const EncoderOptions &options, OutputCallback on_output, LogCallback on_log, uint width, uint height)
+	: Encoder (options, on_output, on_log, width, height) {
 
     std::cout << GREEN << "Using HW encoder" << CLR << std::endl;
     
 	// this->time_base.num = 1;
 	// this->time_base.den = NS_TO_SEC;
 
-    const char device_name[] = "/dev/video11";
-	this->encoder_fd = open(device_name, O_RDWR, 0);
+	this->codec = findV4L2Codec(this->options.hw_encoder_codec);
+	if (this->codec == nullptr)
+		throw std::runtime_error("unknown hw_encoder_codec " + this->options.hw_encoder_codec);
+	this->encoder_fd = openEncoderDevice(this->options.hw_encoder_device, this->codec->pixel_format, this->device_name);
 	if (this->encoder_fd < 0)
-		throw std::runtime_error("failed to open V4L2 H264 encoder");
-	std::cout << "Opened H264Encoder on " << device_name << " as fd " << this->encoder_fd << std::endl;
-
-	// Apply any options->
-
-	v4l2_control ctrl = {};	
-    ctrl.id = V4L2_CID_MPEG_VIDEO_BITRATE;
-    ctrl.value = this->interface->bit_rate;
-    if (xioctl(this->encoder_fd , VIDIOC_S_CTRL, &ctrl) < 0)
-        throw std::runtime_error("failed to set bitrate");
-	
-    // static const std::map<std::string, int> profile_map =
-    //     { { "baseline", V4L2_MPEG_VIDEO_H264_PROFILE_BASELINE },
-    //       { "main", V4L2_MPEG_VIDEO_H264_PROFILE_MAIN },
-    //       { "high", V4L2_MPEG_VIDEO_H264_PROFILE_HIGH } };
-    // auto it = profile_map.find(options->profile);
-    // if (it == profile_map.end())
-    //     throw std::runtime_error("no such profile " + options->profile);
-    ctrl.id = V4L2_CID_MPEG_VIDEO_H264_PROFILE;
-    ctrl.value = V4L2_MPEG_VIDEO_H264_PROFILE_HIGH;
-    if (xioctl(this->encoder_fd, VIDIOC_S_CTRL, &ctrl) < 0)
-        throw std::runtime_error("failed to set profile");
-	
-    // static const std::map<std::string, int> level_map =
-    // 	{ { "4", V4L2_MPEG_VIDEO_H264_LEVEL_4_0 },
-    // 	  { "4.1", V4L2_MPEG_VIDEO_H264_LEVEL_4_1 },
-    // 	  { "4.2", V4L2_MPEG_VIDEO_H264_LEVEL_4_2 } };
-    // auto it = level_map.find(options->level);
-    // if (it == level_map.end())
-    // 	throw std::runtime_error("no such level " + options->level);
-    ctrl.id = V4L2_CID_MPEG_VIDEO_H264_LEVEL;
-    ctrl.value = V4L2_MPEG_VIDEO_H264_LEVEL_4_2;
-    if (xioctl(this->encoder_fd, VIDIOC_S_CTRL, &ctrl) < 0)
-        throw std::runtime_error("failed to set level");
-	
-    ctrl.id = V4L2_CID_MPEG_VIDEO_H264_I_PERIOD; //keyframe generation period
-    ctrl.value = this->interface->fps;
-    if (xioctl(this->encoder_fd, VIDIOC_S_CTRL, &ctrl) < 0)
-        throw std::runtime_error("failed to set intra period");
-	
-    ctrl.id = V4L2_CID_MPEG_VIDEO_REPEAT_SEQ_HEADER;
-    ctrl.value = 1;
-    if (xioctl(this->encoder_fd, VIDIOC_S_CTRL, &ctrl) < 0)
-        throw std::runtime_error("failed to set inline headers");
-	
+		throw std::runtime_error("failed to find a V4L2 M2M " + this->codec->name + " encoder");
+	std::cout << "Opened " << this->codec->name << " encoder on " << this->device_name << " as fd " << this->encoder_fd << std::endl;
+
+	// Apply any options, skipping controls the device doesn't expose
+
+	// vicodec's FWHT is quantizer controlled, it has no bitrate
+	this->setControl(V4L2_CID_MPEG_VIDEO_BITRATE, this->options.bit_rate, this->codec->pixel_format != V4L2_PIX_FMT_FWHT);
+
+	if (this->codec->pixel_format == V4L2_PIX_FMT_H264) {
+		// Prefer High profile and level 4.2, falling back to what the device offers
+		this->setMenuControl(V4L2_CID_MPEG_VIDEO_H264_PROFILE, { V4L2_MPEG_VIDEO_H264_PROFILE_HIGH,
+																 V4L2_MPEG_VIDEO_H264_PROFILE_MAIN,
+																 V4L2_MPEG_VIDEO_H264_PROFILE_CONSTRAINED_BASELINE,
+																 V4L2_MPEG_VIDEO_H264_PROFILE_BASELINE });
+		this->setMenuControl(V4L2_CID_MPEG_VIDEO_H264_LEVEL, { V4L2_MPEG_VIDEO_H264_LEVEL_4_2,
+															   V4L2_MPEG_VIDEO_H264_LEVEL_4_1,
+															   V4L2_MPEG_VIDEO_H264_LEVEL_4_0 });
+		this->setControl(V4L2_CID_MPEG_VIDEO_H264_I_PERIOD, this->options.fps, false); //keyframe generation period
+	} else if (this->codec->pixel_format == V4L2_PIX_FMT_HEVC) {
+		this->setMenuControl(V4L2_CID_MPEG_VIDEO_HEVC_PROFILE, { V4L2_MPEG_VIDEO_HEVC_PROFILE_MAIN });
+		this->setMenuControl(V4L2_CID_MPEG_VIDEO_HEVC_LEVEL, { V4L2_MPEG_VIDEO_HEVC_LEVEL_4_1,
+															   V4L2_MPEG_VIDEO_HEVC_LEVEL_4 });
+		this->setControl(V4L2_CID_MPEG_VIDEO_GOP_SIZE, this->options.fps, false);
+	} else {
+		this->setControl(V4L2_CID_MPEG_VIDEO_GOP_SIZE, this->options.fps, false);
+	}
+	if (this->codec->inline_headers)
+		this->setControl(V4L2_CID_MPEG_VIDEO_REPEAT_SEQ_HEADER, 1, true); //inline headers
+
+	if (this->options.roi_enabled) {
+		auto roi_controls = this->findRoiControls();
+		if (roi_controls.empty()) {
+			std::cout << YELLOW << "Encoder " << this->device_name << " exposes no ROI or QP map controls" << CLR << std::endl;
+		} else {
+			std::cout << YELLOW << "Encoder " << this->device_name << " has driver specific ROI controls, not supported:";
+			for (auto &name : roi_controls)
+				std::cout << " '" << name << "'";
+			std::cout << CLR << std::endl;
+		}
+	}
+
 	// Set the output and capture formats. We know exactly what they will be.
 
     v4l2_format fmt = {};
 	fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-	fmt.fmt.pix_mp.width = this->interface->width;
-	fmt.fmt.pix_mp.height = this->interface->height;
+	fmt.fmt.pix_mp.width = this->width;
+	fmt.fmt.pix_mp.height = this->height;
 	// We assume YUV420 here, but it would be nice if we could do something
 	// like info.pixel_format.toV4L2Fourcc();
 	fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_YUV420;
-	fmt.fmt.pix_mp.plane_fmt[0].bytesperline = this->interface->width;
+	fmt.fmt.pix_mp.plane_fmt[0].bytesperline = this->width;
 	fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
 	fmt.fmt.pix_mp.colorspace = V4L2_COLORSPACE_SMPTE170M;
 	fmt.fmt.pix_mp.num_planes = 1;
@@ -94,20 +88,21 @@ EncoderHW::EncoderHW(CameraInterface *interface, std::shared_ptr<libcamera::Came
 
 	fmt = {};
 	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	fmt.fmt.pix_mp.width = this->interface->width;
-	fmt.fmt.pix_mp.height = this->interface->height;
-	fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_H264;
+	fmt.fmt.pix_mp.width = this->width;
+	fmt.fmt.pix_mp.height = this->height;
+	fmt.fmt.pix_mp.pixelformat = this->codec->pixel_format;
 	fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
 	fmt.fmt.pix_mp.colorspace = V4L2_COLORSPACE_DEFAULT;
 	fmt.fmt.pix_mp.num_planes = 1;
 	fmt.fmt.pix_mp.plane_fmt[0].bytesperline = 0;
-	fmt.fmt.pix_mp.plane_fmt[0].sizeimage = 512 << 10;
+	fmt.fmt.pix_mp.plane_fmt[0].sizeimage = this->captureBufferSize();
 	if (xioctl(this->encoder_fd, VIDIOC_S_FMT, &fmt) < 0)
 		throw std::runtime_error("failed to set capture format");
+	std::cout << "Capture buffer size " << fmt.fmt.pix_mp.plane_fmt[0].sizeimage << " B" << std::endl;
 
     struct v4l2_streamparm parm = {};
     parm.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-    parm.parm.output.timeperframe.numerator = 90000.0 / this->interface->fps;
+    parm.parm.output.timeperframe.numerator = 90000.0 / this->options.fps;
     parm.parm.output.timeperframe.denominator = 90000;
     if (xioctl(this->encoder_fd, VIDIOC_S_PARM, &parm) < 0)
         throw std::runtime_error("failed to set streamparm");
@@ -117,7 +112,7 @@ EncoderHW::EncoderHW(CameraInterface *interface, std::shared_ptr<libcamera::Came
 	// DMABUFs. Buffers for the encoded bitstream must be allocated and
 	// m-mapped.
     v4l2_requestbuffers reqbufs = {};
-	reqbufs.count = this->interface->buffer_count;
+	reqbufs.count = this->options.buffer_count;
 	reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
 	reqbufs.memory = V4L2_MEMORY_DMABUF;
 	if (xioctl(this->encoder_fd, VIDIOC_REQBUFS, &reqbufs) < 0)
@@ -128,6 +123,7 @@ EncoderHW::EncoderHW(CameraInterface *interface, std::shared_ptr<libcamera::Came
 	// us another frame to encode.
 	for (uint i = 0; i < reqbufs.count; i++)
 		this->input_buffers_available.push(i);
+	this->queued_frames.resize(reqbufs.count);
 
 	reqbufs = {};
 	reqbufs.count = NUM_CAPTURE_BUFFERS;
@@ -136,10 +132,9 @@ EncoderHW::EncoderHW(CameraInterface *interface, std::shared_ptr<libcamera::Came
 	if (xioctl(this->encoder_fd, VIDIOC_REQBUFS, &reqbufs) < 0)
 		throw std::runtime_error("request for capture buffers failed");
 	std::cout << "Got " << reqbufs.count << " capture buffers" << std::endl;
-	// num_capture_buffers_ = reqbufs.count;
+	this->num_capture_buffers = reqbufs.count;
 
     this->hw_buffers = new BufferDescription[reqbufs.count]; // CameraInterface::BufferDescription();
-	this->buffer_meta = new BufferMeta[reqbufs.count];
 	for (uint i = 0; i < reqbufs.count; i++)
 	{
 		v4l2_plane planes[VIDEO_MAX_PLANES];
@@ -162,6 +157,37 @@ EncoderHW::EncoderHW(CameraInterface *interface, std::shared_ptr<libcamera::Came
 			throw std::runtime_error("failed to queue capture buffer " + std::to_string(i));
 	}
 
+	// End of stream and source change are reported as V4L2 events (POLLPRI),
+	// not every encoder supports them
+	v4l2_event_subscription sub = {};
+	sub.type = V4L2_EVENT_EOS;
+	if (xioctl(this->encoder_fd, VIDIOC_SUBSCRIBE_EVENT, &sub) < 0)
+		std::cout << YELLOW << "Encoder doesn't support EOS events" << CLR << std::endl;
+	sub = {};
+	sub.type = V4L2_EVENT_SOURCE_CHANGE;
+	if (xioctl(this->encoder_fd, VIDIOC_SUBSCRIBE_EVENT, &sub) < 0)
+		std::cout << YELLOW << "Encoder doesn't support source change events" << CLR << std::endl;
+
+	// Both queues are drained until EAGAIN, from one epoll loop woken up
+	// by the encoder or by the eventfd on shutdown
+	int flags = fcntl(this->encoder_fd, F_GETFL, 0);
+	if (fcntl(this->encoder_fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		throw std::runtime_error("failed to set encoder non-blocking");
+	this->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	this->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (this->event_fd < 0 || this->epoll_fd < 0)
+		throw std::runtime_error("failed to create encoder epoll");
+	epoll_event ev = {};
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLPRI;
+	ev.data.fd = this->encoder_fd;
+	if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->encoder_fd, &ev) < 0)
+		throw std::runtime_error("failed to add encoder to epoll");
+	ev = {};
+	ev.events = EPOLLIN;
+	ev.data.fd = this->event_fd;
+	if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->event_fd, &ev) < 0)
+		throw std::runtime_error("failed to add eventfd to epoll");
+
 	// Enable streaming and we're done.
 
 	v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
@@ -177,11 +203,79 @@ EncoderHW::EncoderHW(CameraInterface *interface, std::shared_ptr<libcamera::Came
 
 	this->poll_thread = std::thread(&EncoderHW::pollThread, this);
 
-    std::cerr << CYAN << "Encoder initiated for " << this->interface->width << "x" << this->interface->height << " @ " << this->interface->fps << " fps" << "; BPP=" << this->interface->bytes_per_pixel << CLR << std::endl;
+    std::cerr << CYAN << "Encoder initiated for " << this->width << "x" << this->height << " @ " << this->options.fps << " fps" << " (" << this->codec->name << " on " << this->device_name << ")" << CLR << std::endl;
 }
 
 
-void EncoderHW::encode(std::vector<AVBufferRef *>, std::vector<uint>, int base_fd, uint size, int64_t *frameIdx, long timestamp_ns, bool log) {
+bool EncoderHW::setControl(uint32_t id, int32_t value, bool required)
+{
+	v4l2_queryctrl query = {};
+	query.id = id;
+	if (xioctl(this->encoder_fd, VIDIOC_QUERYCTRL, &query) < 0 || (query.flags & V4L2_CTRL_FLAG_DISABLED)) {
+		if (required)
+			throw std::runtime_error("encoder control " + std::to_string(id) + " not supported");
+		std::cout << YELLOW << "Encoder control " << id << " not supported, skipping" << CLR << std::endl;
+		return false;
+	}
+
+	v4l2_control ctrl = {};
+	ctrl.id = id;
+	ctrl.value = std::clamp(value, query.minimum, query.maximum);
+	if (xioctl(this->encoder_fd, VIDIOC_S_CTRL, &ctrl) < 0) {
+		if (required)
+			throw std::runtime_error(std::string("failed to set ") + (const char *) query.name);
+		std::cout << YELLOW << "Failed to set " << query.name << CLR << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool EncoderHW::setMenuControl(uint32_t id, const std::vector<int32_t> &preferred_values)
+{
+	for (int32_t value : preferred_values) {
+		v4l2_querymenu menu = {};
+		menu.id = id;
+		menu.index = value;
+		if (xioctl(this->encoder_fd, VIDIOC_QUERYMENU, &menu) == 0)
+			return this->setControl(id, value, false);
+	}
+	std::cout << YELLOW << "No preferred value supported for encoder control " << id << ", using default" << CLR << std::endl;
+	return false;
+}
+
+// Per-region QP has no standard V4L2 control, vendors expose their own; lists the
+// enabled controls that look like one by name
+std::vector<std::string> EncoderHW::findRoiControls()
+{
+	std::vector<std::string> found;
+	v4l2_queryctrl query = {};
+	query.id = V4L2_CTRL_FLAG_NEXT_CTRL;
+	while (xioctl(this->encoder_fd, VIDIOC_QUERYCTRL, &query) == 0) {
+		std::string name = (const char *) query.name;
+		std::string lower = name;
+		std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+		if (!(query.flags & V4L2_CTRL_FLAG_DISABLED) &&
+			(lower.find("roi") != std::string::npos || lower.find("qp map") != std::string::npos || lower.find("region") != std::string::npos))
+			found.push_back(name);
+		query.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+	}
+	return found;
+}
+
+uint EncoderHW::captureBufferSize()
+{
+	// Room for a keyframe of roughly 16 average frames at the target bitrate,
+	// but never more than a raw frame would take
+	uint raw_size = this->width * this->height * 3 / 2;
+	uint frame_size = this->options.bit_rate / 8 / std::max(this->options.fps, 1u);
+	uint size = std::clamp(frame_size * 16, std::min(128u << 10, raw_size), raw_size);
+	return (size + 4095) & ~4095u;
+}
+
+void EncoderHW::encode(FramePtr frame, int64_t *frameIdx, long timestamp_ns, bool log) {
+
+	if (this->failed)
+		return; // reported once by the poll thread
 
 	int index = 0;
 	{
@@ -189,12 +283,13 @@ void EncoderHW::encode(std::vector<AVBufferRef *>, std::vector<uint>, int base_f
 		// "wrap" the DMABUF.
 		std::lock_guard<std::mutex> lock(this->input_buffers_available_mutex);
 		if (this->input_buffers_available.empty()) {
-			this->interface->err("No buffers available to queue codec input");
+			this->err("No buffers available to queue codec input");
 			return;
 		}
 			
 		index = this->input_buffers_available.front();
 		this->input_buffers_available.pop();
+		this->queued_frames[index] = frame;
 	}
 
 	v4l2_buffer buf = {};
@@ -205,121 +300,211 @@ void EncoderHW::encode(std::vector<AVBufferRef *>, std::vector<uint>, int base_f
 	buf.memory = V4L2_MEMORY_DMABUF;
 	buf.length = 1;
 	buf.timestamp.tv_sec = timestamp_ns / NS_TO_SEC;
-	buf.timestamp.tv_usec = timestamp_ns % 1000;
+	buf.timestamp.tv_usec = (timestamp_ns % NS_TO_SEC) / 1000;
 	buf.m.planes = planes;
-	buf.m.planes[0].m.fd = base_fd;
-	buf.m.planes[0].bytesused = size;
-	buf.m.planes[0].length = size;
+	buf.m.planes[0].m.fd = frame->fd();
+	buf.m.planes[0].bytesused = frame->mapped->size;
+	buf.m.planes[0].length = frame->mapped->size;
 
-	this->buffer_meta[index].frame_idx = *frameIdx;
-	this->buffer_meta[index].timestamp_ns = timestamp_ns;
-	this->buffer_meta[index].log = log;
+	// The encoder copies the timestamp to the bitstream buffers, meta is matched by it
+	{
+		std::lock_guard<std::mutex> lock(this->buffer_meta_mutex);
+		this->buffer_meta[timevalToUs(buf.timestamp)] = { *frameIdx, timestamp_ns, log };
+	}
 
-	*frameIdx = ((*frameIdx) % this->interface->fps) + 1;
+	*frameIdx = ((*frameIdx) % this->options.fps) + 1;
 
-	if (xioctl(this->encoder_fd, VIDIOC_QBUF, &buf) < 0)
+	if (xioctl(this->encoder_fd, VIDIOC_QBUF, &buf) < 0) {
+		std::lock_guard<std::mutex> lock(this->input_buffers_available_mutex);
+		this->queued_frames[index].reset();
+		this->input_buffers_available.push(index);
 		throw std::runtime_error("failed to queue input to codec");
+	}
 
 	// std::cout << "Sending frame to be hw-encoded (buff " << index << ")" << std::endl;
 	// this->interface->lines_printed++;
 
 }
 
+int64_t EncoderHW::timevalToUs(const timeval &tv) {
+	return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 void EncoderHW::pollThread()
 {
+	static constexpr int MAX_EVENTS = 2;
+	static constexpr int DRAIN_TIMEOUT_MS = 500;
+	epoll_event events[MAX_EVENTS];
+	bool draining = false; // shutdown requested, waiting for the last buffer
+
 	while (true)
 	{
-		pollfd p = {this->encoder_fd, POLLIN, 0};
-		int ret = poll(&p, 1, 200);
-		{
-			std::lock_guard<std::mutex> lock(this->input_buffers_available_mutex);
-			if (this->abort_poll && this->input_buffers_available.size() == this->interface->buffer_count)
-				break;
-		}
-		if (ret == -1)
+		int n = epoll_wait(this->epoll_fd, events, MAX_EVENTS, draining ? DRAIN_TIMEOUT_MS : -1);
+		if (n == -1)
 		{
 			if (errno == EINTR)
 				continue;
-			throw std::runtime_error("unexpected errno " + std::to_string(errno) + " from poll");
+			throw std::runtime_error("unexpected errno " + std::to_string(errno) + " from epoll");
 		}
-		if (p.revents & POLLIN)
+		if (n == 0) // drain timed out
+			break;
+
+		for (int i = 0; i < n; i++)
 		{
-			v4l2_buffer buf = {};
-			v4l2_plane planes[VIDEO_MAX_PLANES] = {};
-			buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-			buf.memory = V4L2_MEMORY_DMABUF;
-			buf.length = 1;
-			buf.m.planes = planes;
-			int ret = xioctl(this->encoder_fd, VIDIOC_DQBUF, &buf);
-			BufferMeta meta;
-			uint output_index;
-			if (ret == 0)
+			if (events[i].data.fd == this->event_fd)
 			{
-				output_index = buf.index;
-				meta = this->buffer_meta[output_index];
-				// Return this to the caller, first noting that this buffer, identified
-				// by its index, is available for queueing up another frame.
-				{
-					std::lock_guard<std::mutex> lock(this->input_buffers_available_mutex);
-					this->input_buffers_available.push(buf.index);
-				}
-				// input_done_callback_(nullptr);
+				uint64_t value;
+				if (read(this->event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+					std::cerr << "Failed to read encoder eventfd" << std::endl;
+				if (!this->drain_requested)
+					return;
+				draining = true;
+				continue;
 			}
-
-			buf = {};
-			memset(planes, 0, sizeof(planes));
-			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-			buf.memory = V4L2_MEMORY_MMAP;
-			buf.length = 1;
-			buf.m.planes = planes;
-			ret = xioctl(this->encoder_fd, VIDIOC_DQBUF, &buf);
-			if (ret == 0)
+			if (events[i].events & EPOLLPRI)
+				this->dequeueEvents();
+			if (events[i].events & EPOLLOUT)
+				this->dequeueOutputBuffers();
+			if (events[i].events & EPOLLIN)
+				this->dequeueCaptureBuffers();
+			if (events[i].events & (EPOLLERR | EPOLLHUP))
 			{
-				// We push this encoded buffer to another thread so that our
-				// application can take its time with the data without blocking the
-				// encode process.
-				// int64_t timestamp_ns = (buf.timestamp.tv_sec * NS_TO_SEC) + buf.timestamp.tv_usec * 1000;
+				// a queue in error or the device gone: the condition stays raised, polling on would spin
+				if (draining)
+					return;
+				this->err("Encoder ", this->device_name, (events[i].events & EPOLLHUP) ? " hung up" : " reported an error",
+									 ", encoding stopped until the camera restarts");
+				this->failed = true;
+				return;
+			}
+		}
 
+		if (this->end_of_stream)
+			break;
+	}
+}
+
+void EncoderHW::dequeueEvents()
+{
+	v4l2_event event = {};
+	while (xioctl(this->encoder_fd, VIDIOC_DQEVENT, &event) == 0)
+	{
+		switch (event.type) {
+			case V4L2_EVENT_EOS:
+				std::cout << CYAN << "Encoder reached end of stream" << CLR << std::endl;
+				this->end_of_stream = true;
+				break;
+			case V4L2_EVENT_SOURCE_CHANGE:
+				this->err("Encoder source change not supported, changes: ", event.u.src_change.changes);
+				break;
+			default:
+				break;
+		}
+		event = {};
+	}
+}
+
+void EncoderHW::dequeueOutputBuffers()
+{
+	while (true)
+	{
+		v4l2_buffer buf = {};
+		v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+		buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+		buf.memory = V4L2_MEMORY_DMABUF;
+		buf.length = 1;
+		buf.m.planes = planes;
+		if (xioctl(this->encoder_fd, VIDIOC_DQBUF, &buf) < 0)
+		{
+			if (errno != EAGAIN && errno != EPIPE)
+				this->err("Failed to dequeue encoder output buffer, errno ", errno);
+			return;
+		}
+		// This buffer, identified by its index, is available for queueing up another frame,
+		// the camera buffer it wrapped can be released
+		FramePtr frame;
+		{
+			std::lock_guard<std::mutex> lock(this->input_buffers_available_mutex);
+			frame = std::move(this->queued_frames[buf.index]);
+			this->input_buffers_available.push(buf.index);
+		}
+	}
+}
+
+void EncoderHW::dequeueCaptureBuffers()
+{
+	while (true)
+	{
+		v4l2_buffer buf = {};
+		v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.length = 1;
+		buf.m.planes = planes;
+		if (xioctl(this->encoder_fd, VIDIOC_DQBUF, &buf) < 0)
+		{
+			if (errno != EAGAIN && errno != EPIPE)
+				this->err("Failed to dequeue encoder capture buffer, errno ", errno);
+			return;
+		}
+
+		// One input frame may produce several bitstream buffers, so the meta is
+		// kept until a newer frame comes out; older frames can't follow anymore
+		BufferMeta meta;
+		bool meta_found = false;
+		{
+			std::lock_guard<std::mutex> lock(this->buffer_meta_mutex);
+			auto it = this->buffer_meta.find(timevalToUs(buf.timestamp));
+			if (it != this->buffer_meta.end()) {
+				meta = it->second;
+				meta_found = true;
+				this->buffer_meta.erase(this->buffer_meta.begin(), it);
+			}
+		}
+
+		if (buf.m.planes[0].bytesused > 0)
+		{
+			if (meta_found)
+			{
 				bool log = meta.log;
 				bool keyframe = !!(buf.flags & V4L2_BUF_FLAG_KEYFRAME);
 
 				int64_t timestamp_ns = (int64_t) meta.timestamp_ns;
 				if (log) {
 					auto clr = keyframe ? MAGENTA : YELLOW;
-					this->interface->log(clr, "Frame encoded (buff ", output_index, "/", buf.index, "), ts=", timestamp_ns, "; flags=", std::bitset<4>(buf.flags));
+					this->log(clr, "Frame encoded (buff ", buf.index, "), ts=", timestamp_ns, "; flags=", std::bitset<4>(buf.flags));
 				}
 
-				uint64_t pts = av_rescale_q(meta.frame_idx, //this->encoded_packet->pts, //this->outFrameMsg.header.stamp.sec * NS_TO_SEC + this->outFrameMsg.header.stamp.nanosec, //this->packet->pts
-                                    		AVRational{1, (int)this->interface->fps},
-                                    		AVRational{1, 90000});
-				
-				this->interface->publishH264((unsigned char*) this->hw_buffers[buf.index].mem, buf.m.planes[0].bytesused, keyframe, pts, timestamp_ns, log);
-				
-				// OutputItem item = { buffers_[buf.index].mem,
-				// 					buf.m.planes[0].bytesused,
-				// 					buf.m.planes[0].length,
-				// 					buf.index,
-				// 					!!(buf.flags & V4L2_BUF_FLAG_KEYFRAME),
-				// 					timestamp_us };
-				// std::lock_guard<std::mutex> lock(output_mutex_);
-				// output_queue_.push(item);
-				// output_cond_var_.notify_one();
-				auto index = buf.index;
-				auto length = buf.length;
-
-				v4l2_buffer buf = {};
-				v4l2_plane planes[VIDEO_MAX_PLANES] = {};
-				buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-				buf.memory = V4L2_MEMORY_MMAP;
-				buf.index = index;
-				buf.length = 1;
-				buf.m.planes = planes;
-				buf.m.planes[0].bytesused = 0;
-				buf.m.planes[0].length = length;
-				if (xioctl(this->encoder_fd, VIDIOC_QBUF, &buf) < 0)
-					throw std::runtime_error("failed to re-queue encoded buffer");
+				uint64_t pts = av_rescale_q(meta.frame_idx,
+											AVRational{1, (int)this->options.fps},
+											AVRational{1, 90000});
+
+				this->on_output((unsigned char*) this->hw_buffers[buf.index].mem, buf.m.planes[0].bytesused, keyframe, pts, timestamp_ns, log);
+			}
+			else
+			{
+				this->err("No frame meta for encoded buffer ", buf.index, ", dropping");
 			}
 		}
+
+		if (buf.flags & V4L2_BUF_FLAG_LAST)
+		{
+			this->end_of_stream = true;
+			return;
+		}
+
+		auto index = buf.index;
+		buf = {};
+		memset(planes, 0, sizeof(planes));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = index;
+		buf.length = 1;
+		buf.m.planes = planes;
+		buf.m.planes[0].bytesused = 0;
+		buf.m.planes[0].length = this->hw_buffers[index].size;
+		if (xioctl(this->encoder_fd, VIDIOC_QBUF, &buf) < 0)
+			throw std::runtime_error("failed to re-queue encoded buffer");
 	}
 }
 
@@ -327,7 +512,14 @@ EncoderHW::~EncoderHW() {
 
 	std::cout << BLUE << "Cleaning up hw encoder" << CLR << std::endl;
 
-	this->abort_poll = true;
+	// Ask the encoder to flush what's queued and signal end of stream; if it
+	// can't, the poll thread exits right away
+	v4l2_encoder_cmd cmd = {};
+	cmd.cmd = V4L2_ENC_CMD_STOP;
+	this->drain_requested = xioctl(this->encoder_fd, VIDIOC_ENCODER_CMD, &cmd) == 0;
+	uint64_t value = 1;
+	if (write(this->event_fd, &value, sizeof(value)) < 0)
+		std::cerr << "Failed to signal encoder eventfd" << std::endl;
 	this->poll_thread.join();
 
 	// Turn off streaming on both the output and capture queues, and "free" the
@@ -336,6 +528,7 @@ EncoderHW::~EncoderHW() {
 	v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
 	if (xioctl(this->encoder_fd, VIDIOC_STREAMOFF, &type) < 0)
 		std::cerr << "Failed to stop output streaming" << std::endl;
+	this->queued_frames.clear(); // streamoff returned whatever was still queued
 	type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
 	if (xioctl(this->encoder_fd, VIDIOC_STREAMOFF, &type) < 0)
 		std::cerr << "Failed to stop capture streaming" << std::endl;
@@ -347,9 +540,10 @@ EncoderHW::~EncoderHW() {
 	if (xioctl(this->encoder_fd, VIDIOC_REQBUFS, &reqbufs) < 0)
 		std::cerr << "Request to free output buffers failed" << std::endl;
 
-	for (int i = 0; i < NUM_CAPTURE_BUFFERS; i++)
+	for (uint i = 0; i < this->num_capture_buffers; i++)
 		if (munmap(this->hw_buffers[i].mem, this->hw_buffers[i].size) < 0)
 			std::cerr << "Failed to unmap buffer" << std::endl;
+	delete[] this->hw_buffers;
 	reqbufs = {};
 	reqbufs.count = 0;
 	reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
@@ -357,6 +551,8 @@ EncoderHW::~EncoderHW() {
 	if (xioctl(this->encoder_fd, VIDIOC_REQBUFS, &reqbufs) < 0)
 		std::cerr << "Request to free capture buffers failed" << std::endl;
 
+	close(this->epoll_fd);
+	close(this->event_fd);
 	close(this->encoder_fd);
 	std::cout << "H264Encoder closed" << std::endl;
 }
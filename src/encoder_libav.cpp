@@ -17,9 +17,10 @@
 // #include "libcamera/property_ids.h"
 
 #include <bitset>
+#include <cstring>
+#include <iostream>
 
 #include "picam_ros2/encoder_libav.hpp"
-#include "picam_ros2/camera_interface.hpp"
 
 // #include "rclcpp/rclcpp.hpp"
 // #include "rclcpp/qos.hpp"
@@ -43,8 +44,8 @@ extern "C" {
 
 using namespace libcamera;
 
-EncoderLibAV::EncoderLibAV(CameraInterface *interface, std::shared_ptr<libcamera::Camera> camera)
-    : Encoder(interface, camera) {
+EncoderLibAV::EncoderLibAV(const EncoderOptions &options, OutputCallback on_output, LogCallback on_log, uint width, uint height)
+    : Encoder(options, on_output, on_log, width, height) {
 
     std::cout << BLUE << "Using SW encoder" << CLR << std::endl;
     this->codec = avcodec_find_encoder(AV_CODEC_ID_H264); //CPU
@@ -59,26 +60,26 @@ EncoderLibAV::EncoderLibAV(CameraInterface *interface, std::shared_ptr<libcamera
         return;
     }
 
-    assert(this->interface->width % 32 == 0 && "Width not aligned to 32");
+    assert(this->width % 32 == 0 && "Width not aligned to 32");
 
     // this->codec_context->profile = FF_PROFILE_H264_CONSTRAINED_BASELINE;
     this->codec_context->profile = FF_PROFILE_H264_HIGH;
-    this->codec_context->height = this->interface->height;
-    this->codec_context->width = this->interface->width;
+    this->codec_context->height = this->height;
+    this->codec_context->width = this->width;
 
     /// Frames per second
     this->codec_context->time_base.num = 1;
-    this->codec_context->time_base.den = this->interface->fps;
-    this->codec_context->framerate.num = this->interface->fps;
+    this->codec_context->time_base.den = this->options.fps;
+    this->codec_context->framerate.num = this->options.fps;
     this->codec_context->framerate.den = 1;
 
-    this->codec_context->bit_rate = this->interface->bit_rate;
+    this->codec_context->bit_rate = this->options.bit_rate;
 
     /// Only YUV420P for H264|5
     this->codec_context->pix_fmt = AV_PIX_FMT_YUV420P;
 
     /// Key(intra) frame rate
-    this->codec_context->gop_size = this->interface->fps*2;
+    this->codec_context->gop_size = this->options.fps*2;
 
     /// P-frames, generated by referencing data from prev and future frames.
     /// [Compression up, CPU usage up]
@@ -95,17 +96,22 @@ EncoderLibAV::EncoderLibAV(CameraInterface *interface, std::shared_ptr<libcamera
     av_opt_set(this->codec_context->priv_data, "preset", "ultrafast", 0);
     
     // std::string n_buffs = fmt::format("{}", );
-    av_opt_set_int(codec_context->priv_data, "num_capture_buffers", this->interface->buffer_count, 0);
+    av_opt_set_int(codec_context->priv_data, "num_capture_buffers", this->options.buffer_count, 0);
     av_opt_set(codec_context->priv_data, "input-io-mode", "dmabuf", 0);
 
     /// Compression rate (lower -> higher compression) compress to lower size, makes decoded image more noisy
     /// Range: [0; 51], sane range: [18; 26]. I used 35 as good compression/quality compromise. This option also critical for realtime encoding
     // std::string crf = fmt::format("{}", this->compression);
     // av_opt_set(this->codec_context->priv_data, "crf", crf.c_str(), 0);
-    av_opt_set_int(this->codec_context->priv_data, "crf", this->interface->compression, 0);
+    av_opt_set_int(this->codec_context->priv_data, "crf", this->options.compression, 0);
 
     av_opt_set_int(codec_context->priv_data, "forced-idr", 1, 0);
 
+    /// ROI qoffsets are ignored by x264 without adaptive quantization (ultrafast turns it off)
+    if (this->options.roi_enabled) {
+        av_opt_set(this->codec_context->priv_data, "aq-mode", "variance", 0);
+    }
+
     /// Change settings based upon the specifics of input
     /// [psnr, ssim, grain, zerolatency, fastdecode, animation]
     /// This option is most critical for realtime encoding, because it removes delay between 1th input frame and 1th output packet.
@@ -116,9 +122,9 @@ EncoderLibAV::EncoderLibAV(CameraInterface *interface, std::shared_ptr<libcamera
         std::cerr << "Can't get descriptor for pixel format for AV_PIX_FMT_YUV420P" << std::endl;
         return;
     }
-    this->interface->bytes_per_pixel = av_get_bits_per_pixel(desc) / 8;
+    int bytes_per_pixel = av_get_bits_per_pixel(desc) / 8;
     
-    std::cerr << CYAN << "Encoder initiated for " << this->interface->width << "x" << this->interface->height << " @ " << this->interface->fps << " fps" << "; BPP=" << this->interface->bytes_per_pixel << CLR << std::endl;
+    std::cerr << CYAN << "Encoder initiated for " << this->width << "x" << this->height << " @ " << this->options.fps << " fps" << "; BPP=" << bytes_per_pixel << CLR << std::endl;
 
     if(avcodec_open2(this->codec_context, this->codec, nullptr) < 0){
         std::cerr << "Could not open codec" << std::endl;
@@ -141,12 +147,45 @@ EncoderLibAV::EncoderLibAV(CameraInterface *interface, std::shared_ptr<libcamera
     }
 }
 
-void EncoderLibAV::encode(std::vector<AVBufferRef *> plane_buffers, std::vector<uint> plane_strides, int, uint, int64_t *frameIdx, long timestamp_ns, bool log) {
+// Drops the frame reference held by a plane AVBufferRef
+void releaseFrameRef(void *opaque, uint8_t *) {
+    delete static_cast<FramePtr *>(opaque);
+}
+
+void EncoderLibAV::encode(FramePtr frame, int64_t *frameIdx, long timestamp_ns, bool log) {
+
+    /// x264 copies the planes in avcodec_send_frame, that's the whole CPU read window
+    FrameHandle::CpuAccess cpu_access(*frame);
 
+    /// Each plane ref keeps the capture buffer alive for as long as libav holds it
     for (size_t i = 0; i < 3; ++i) {
-        this->frame_to_encode->buf[i] = plane_buffers[i];
+        this->frame_to_encode->buf[i] = av_buffer_create(frame->mapped->planes[i], frame->mapped->plane_sizes[i],
+                                                         releaseFrameRef, new FramePtr(frame), AV_BUFFER_FLAG_READONLY);
         this->frame_to_encode->data[i] = this->frame_to_encode->buf[i]->data;
-        this->frame_to_encode->linesize[i] = plane_strides[i];
+        this->frame_to_encode->linesize[i] = frame->mapped->strides[i];
+    }
+
+    /// Attach regions of interest, the frame is reused so drop the previous ones first
+    av_frame_remove_side_data(this->frame_to_encode, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+    {
+        std::lock_guard<std::mutex> lock(this->rois_mutex);
+        if (!this->rois.empty()) {
+            AVFrameSideData *side_data = av_frame_new_side_data(this->frame_to_encode, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+                                                                this->rois.size() * sizeof(AVRegionOfInterest));
+            if (side_data) {
+                AVRegionOfInterest *roi = reinterpret_cast<AVRegionOfInterest *>(side_data->data);
+                for (size_t i = 0; i < this->rois.size(); ++i) {
+                    roi[i].self_size = sizeof(AVRegionOfInterest);
+                    roi[i].left = this->rois[i].left;
+                    roi[i].top = this->rois[i].top;
+                    roi[i].right = this->rois[i].right;
+                    roi[i].bottom = this->rois[i].bottom;
+                    roi[i].qoffset = av_make_q(static_cast<int>(this->rois[i].qoffset * 1000.0f), 1000);
+                }
+            } else {
+                this->err("Failed to allocate ROI side data");
+            }
+        }
     }
 
     /// Set frame index in range: [1, fps]
@@ -166,22 +205,27 @@ void EncoderLibAV::encode(std::vector<AVBufferRef *> plane_buffers, std::vector<
             *frameIdx = ((*frameIdx) % this->codec_context->framerate.num) + 1;
             break;
         case AVERROR(EAGAIN):
-            this->interface->err("Error sending frame to encoder: AVERROR(EAGAIN)");
+            this->err("Error sending frame to encoder: AVERROR(EAGAIN)");
             break;
         case AVERROR_EOF:
-            this->interface->err("Error sending frame to encoder: AVERROR_EOF");
+            this->err("Error sending frame to encoder: AVERROR_EOF");
             break;
         case AVERROR(EINVAL):
-            this->interface->err("Error sending frame to encoder: AVERROR(EINVAL)");
+            this->err("Error sending frame to encoder: AVERROR(EINVAL)");
             break;
         case AVERROR(ENOMEM):
-            this->interface->err("Error sending frame to encoder: AVERROR(ENOMEM)");
+            this->err("Error sending frame to encoder: AVERROR(ENOMEM)");
             break;
         default:
-            this->interface->err("Error sending frame to encoder: Other error");
+            this->err("Error sending frame to encoder: Other error");
             break;
     }
 
+    for (size_t i = 0; i < 3; ++i) {
+        av_buffer_unref(&this->frame_to_encode->buf[i]);
+        this->frame_to_encode->data[i] = nullptr;
+    }
+
     // if (munmap(buf_base, total_size) == -1) {
     //     std::cerr << "munmap failed: " << strerror(errno) << std::endl;
     // }
@@ -198,33 +242,33 @@ void EncoderLibAV::encode(std::vector<AVBufferRef *> plane_buffers, std::vector<
             packet_ok = true;
             if (log) {
                 auto clr = this->encoded_packet->flags == 1 ? MAGENTA : YELLOW;
-                this->interface->log(clr, "PACKET ", this->encoded_packet->size,
+                this->log(clr, "PACKET ", this->encoded_packet->size,
                                      " / ", this->encoded_packet->buf->size,
                                      " pts=", this->encoded_packet->pts,
                                      " flags=", this->encoded_packet->flags);
             }
             break;
         case AVERROR(EAGAIN):
-            this->interface->err("Error receiving packet AVERROR(EAGAIN)");
+            this->err("Error receiving packet AVERROR(EAGAIN)");
             break;
         case AVERROR_EOF:
-            this->interface->err("Error receiving packet AVERROR_EOF");
+            this->err("Error receiving packet AVERROR_EOF");
             break;
         case AVERROR(EINVAL):
-            this->interface->err("Error receiving packet AVERROR(EINVAL)");
+            this->err("Error receiving packet AVERROR(EINVAL)");
             break;
         default:
-            this->interface->err("Error receiving packet");
+            this->err("Error receiving packet");
             break;
     }
 
     if (this->encoded_packet->flags & AV_PKT_FLAG_CORRUPT) {
-        this->interface->err("Packed flagged as corrupt");
+        this->err("Packed flagged as corrupt");
         return;
     }
 
     if (this->encoded_packet->flags != 0 && this->encoded_packet->flags != AV_PKT_FLAG_KEY) {
-        this->interface->err(MAGENTA, "Packed flags:", std::bitset<4>(this->encoded_packet->flags));
+        this->err(MAGENTA, "Packed flags:", std::bitset<4>(this->encoded_packet->flags));
     }
     
     if (packet_ok) {
@@ -232,7 +276,7 @@ void EncoderLibAV::encode(std::vector<AVBufferRef *> plane_buffers, std::vector<
                                     codec_context->time_base,
                                     AVRational{1, 90000});
         bool keyframe = !!(this->encoded_packet->flags & AV_PKT_FLAG_KEY);
-        this->interface->publishH264(this->encoded_packet->data, this->encoded_packet->size, keyframe, pts, timestamp_ns, log);
+        this->on_output(this->encoded_packet->data, this->encoded_packet->size, keyframe, pts, timestamp_ns, log);
     }
     
 }
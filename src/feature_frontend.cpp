@@ -0,0 +1,169 @@
+#include <algorithm>
+#include <cmath>
+
+#include "picam_ros2/feature_frontend.hpp"
+
+FeatureFrontend::FeatureFrontend(const FeatureOptions &options) {
+    this->options = options;
+    this->options.grid_cols = std::max(1u, options.grid_cols);
+    this->options.grid_rows = std::max(1u, options.grid_rows);
+    this->options.pyramid_levels = std::max(1u, options.pyramid_levels);
+    this->options.window_size = std::max(5u, options.window_size | 1u);
+    this->options.min_distance = std::max(1.0f, options.min_distance);
+
+    // descriptors from the full resolution image only, at the tracked positions
+    if (this->options.descriptors)
+        this->orb = cv::ORB::create(this->options.max_features, 1.2f, 1, 31, 0, 2, cv::ORB::HARRIS_SCORE, 31, this->options.fast_threshold);
+    this->border = this->options.descriptors ? 32 : 4;
+}
+
+void FeatureFrontend::reset() {
+    this->features.clear();
+    this->has_previous = false;
+    this->last_tracked = 0;
+}
+
+const std::vector<Feature> &FeatureFrontend::process(const cv::Mat &y) {
+    // level 0 is copied: the capture buffer is reused before the next frame is tracked against it
+    cv::Size window(this->options.window_size, this->options.window_size);
+    cv::buildOpticalFlowPyramid(y, this->pyramid, window, this->options.pyramid_levels - 1, false,
+                                cv::BORDER_REFLECT_101, cv::BORDER_CONSTANT, false);
+
+    this->track();
+    this->detect(y);
+    if (this->options.descriptors)
+        this->describe(y);
+
+    std::swap(this->pyramid, this->previous_pyramid);
+    this->has_previous = true;
+    return this->features;
+}
+
+void FeatureFrontend::track() {
+    this->last_tracked = 0;
+    if (!this->has_previous || this->features.empty()) {
+        this->features.clear();
+        return;
+    }
+
+    this->previous_points.resize(this->features.size());
+    for (size_t i = 0; i < this->features.size(); i++)
+        this->previous_points[i] = this->features[i].point;
+
+    cv::Size window(this->options.window_size, this->options.window_size);
+    cv::TermCriteria criteria(cv::TermCriteria::COUNT | cv::TermCriteria::EPS, 30, 0.01);
+    int max_level = this->options.pyramid_levels - 1;
+    cv::calcOpticalFlowPyrLK(this->previous_pyramid, this->pyramid, this->previous_points, this->points,
+                             this->status, this->errors, window, max_level, criteria);
+
+    bool fb_check = this->options.fb_threshold > 0.0f;
+    if (fb_check) {
+        // tracked back to where they came from, drifting features don't return
+        this->back_points = this->previous_points;
+        cv::calcOpticalFlowPyrLK(this->pyramid, this->previous_pyramid, this->points, this->back_points,
+                                 this->back_status, this->errors, window, max_level, criteria, cv::OPTFLOW_USE_INITIAL_FLOW);
+    }
+
+    cv::Size size = this->pyramid[0].size();
+    float fb_threshold_sq = this->options.fb_threshold * this->options.fb_threshold;
+    size_t kept = 0;
+    for (size_t i = 0; i < this->features.size(); i++) {
+        const cv::Point2f &point = this->points[i];
+        if (!this->status[i] || point.x < this->border || point.y < this->border
+            || point.x >= size.width - this->border || point.y >= size.height - this->border)
+            continue;
+        if (fb_check) {
+            cv::Point2f back = this->back_points[i] - this->previous_points[i];
+            if (!this->back_status[i] || back.dot(back) > fb_threshold_sq)
+                continue;
+        }
+        Feature &feature = this->features[kept++];
+        feature = this->features[i];
+        feature.point = point;
+        feature.age++;
+    }
+    this->features.resize(kept);
+    this->last_tracked = kept;
+}
+
+// Tops up the grid buckets left short with the strongest FAST corners away from existing features
+void FeatureFrontend::detect(const cv::Mat &y) {
+    uint cols = this->options.grid_cols, rows = this->options.grid_rows;
+    float bucket_width = (float) y.cols / cols, bucket_height = (float) y.rows / rows;
+    uint capacity = (this->options.max_features + cols * rows - 1) / (cols * rows);
+
+    float cell = this->options.min_distance;
+    int occupancy_cols = (int) std::ceil(y.cols / cell), occupancy_rows = (int) std::ceil(y.rows / cell);
+    this->occupancy.assign((size_t) occupancy_cols * occupancy_rows, 0);
+    auto occupied = [&](const cv::Point2f &p) {
+        int cx = (int) (p.x / cell), cy = (int) (p.y / cell);
+        for (int oy = std::max(0, cy - 1); oy <= std::min(occupancy_rows - 1, cy + 1); oy++)
+            for (int ox = std::max(0, cx - 1); ox <= std::min(occupancy_cols - 1, cx + 1); ox++)
+                if (this->occupancy[(size_t) oy * occupancy_cols + ox])
+                    return true;
+        return false;
+    };
+    auto occupy = [&](const cv::Point2f &p) {
+        this->occupancy[(size_t) (int) (p.y / cell) * occupancy_cols + (int) (p.x / cell)] = 1;
+    };
+    auto bucketOf = [&](const cv::Point2f &p) {
+        uint bx = std::min(cols - 1, (uint) (p.x / bucket_width)), by = std::min(rows - 1, (uint) (p.y / bucket_height));
+        return by * cols + bx;
+    };
+
+    // tracks that converged onto each other: the longest tracked one stays
+    std::stable_sort(this->features.begin(), this->features.end(), [](const Feature &a, const Feature &b) { return a.age > b.age; });
+    this->bucket_counts.assign(cols * rows, 0);
+    size_t kept = 0;
+    for (size_t i = 0; i < this->features.size(); i++) {
+        if (occupied(this->features[i].point))
+            continue;
+        occupy(this->features[i].point);
+        this->bucket_counts[bucketOf(this->features[i].point)]++;
+        this->features[kept++] = this->features[i];
+    }
+    this->features.resize(kept);
+    this->last_tracked = std::min<uint>(this->last_tracked, kept);
+
+    cv::Rect inner(this->border, this->border, y.cols - 2 * this->border, y.rows - 2 * this->border);
+    for (uint by = 0; by < rows; by++) {
+        for (uint bx = 0; bx < cols; bx++) {
+            if (this->features.size() >= this->options.max_features)
+                return;
+            uint &count = this->bucket_counts[by * cols + bx];
+            if (count >= capacity)
+                continue;
+            cv::Rect bucket = cv::Rect((int) (bx * bucket_width), (int) (by * bucket_height),
+                                       (int) bucket_width, (int) bucket_height) & inner;
+            if (bucket.area() <= 0)
+                continue;
+
+            cv::FAST(y(bucket), this->keypoints, this->options.fast_threshold, true);
+            std::sort(this->keypoints.begin(), this->keypoints.end(),
+                      [](const cv::KeyPoint &a, const cv::KeyPoint &b) { return a.response > b.response; });
+            for (auto &keypoint : this->keypoints) {
+                if (count >= capacity || this->features.size() >= this->options.max_features)
+                    break;
+                cv::Point2f point = keypoint.pt + cv::Point2f((float) bucket.x, (float) bucket.y);
+                if (occupied(point))
+                    continue;
+                occupy(point);
+                this->features.push_back({ this->next_id++, point, 0, keypoint.response });
+                count++;
+            }
+        }
+    }
+}
+
+void FeatureFrontend::describe(const cv::Mat &y) {
+    this->keypoints.resize(this->features.size());
+    for (size_t i = 0; i < this->features.size(); i++)
+        this->keypoints[i] = cv::KeyPoint(this->features[i].point, 31.0f, -1.0f, this->features[i].response, 0, (int) i);
+
+    // ORB may still drop some at the border, those keep a zero descriptor
+    this->orb->compute(y, this->keypoints, this->computed_rows);
+    this->descriptor_rows.create((int) this->features.size(), 32, CV_8U);
+    this->descriptor_rows.setTo(0);
+    for (size_t i = 0; i < this->keypoints.size(); i++)
+        this->computed_rows.row((int) i).copyTo(this->descriptor_rows.row(this->keypoints[i].class_id));
+}
@@ -0,0 +1,56 @@
+#include "picam_ros2/feature_worker.hpp"
+
+FeatureWorker::FeatureWorker(const FeatureOptions &options, ResultCallback on_result)
+    : frontend(options), on_result(on_result) {
+    this->thread = std::thread(&FeatureWorker::workerLoop, this);
+}
+
+FeatureWorker::~FeatureWorker() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->cond.notify_all();
+    this->thread.join();
+}
+
+bool FeatureWorker::submit(FramePtr frame, uint width, uint height, long timestamp_ns, uint64_t sensor_timestamp_ns) {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (this->frame)
+            return false;
+        this->frame = frame;
+        this->width = width;
+        this->height = height;
+        this->timestamp_ns = timestamp_ns;
+        this->sensor_timestamp_ns = sensor_timestamp_ns;
+    }
+    this->cond.notify_one();
+    return true;
+}
+
+void FeatureWorker::workerLoop() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (true) {
+        this->cond.wait(lock, [this] { return this->stopping || this->frame; });
+        if (this->stopping)
+            break;
+        FramePtr frame = this->frame;
+        uint width = this->width, height = this->height;
+        long timestamp_ns = this->timestamp_ns;
+        uint64_t sensor_timestamp_ns = this->sensor_timestamp_ns;
+        lock.unlock();
+
+        {
+            FrameHandle::CpuAccess cpu_access(*frame);
+            cv::Mat y((int) height, (int) width, CV_8UC1, frame->mapped->planes[0], frame->mapped->strides[0]);
+            auto &features = this->frontend.process(y);
+            this->on_result(this->frontend, features, timestamp_ns, sensor_timestamp_ns);
+        }
+        frame.reset();
+
+        lock.lock();
+        this->frame.reset(); // idle, the capture buffer goes back to the camera
+    }
+    this->frame.reset();
+}
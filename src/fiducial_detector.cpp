@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <map>
+
+#include "picam_ros2/fiducial_detector.hpp"
+
+int FiducialDetector::dictionaryId(const std::string &name) {
+    static const std::map<std::string, int> dictionaries = {
+        { "4x4_50", cv::aruco::DICT_4X4_50 }, { "4x4_100", cv::aruco::DICT_4X4_100 },
+        { "4x4_250", cv::aruco::DICT_4X4_250 }, { "4x4_1000", cv::aruco::DICT_4X4_1000 },
+        { "5x5_50", cv::aruco::DICT_5X5_50 }, { "5x5_100", cv::aruco::DICT_5X5_100 },
+        { "5x5_250", cv::aruco::DICT_5X5_250 }, { "5x5_1000", cv::aruco::DICT_5X5_1000 },
+        { "6x6_50", cv::aruco::DICT_6X6_50 }, { "6x6_100", cv::aruco::DICT_6X6_100 },
+        { "6x6_250", cv::aruco::DICT_6X6_250 }, { "6x6_1000", cv::aruco::DICT_6X6_1000 },
+        { "7x7_50", cv::aruco::DICT_7X7_50 }, { "7x7_100", cv::aruco::DICT_7X7_100 },
+        { "7x7_250", cv::aruco::DICT_7X7_250 }, { "7x7_1000", cv::aruco::DICT_7X7_1000 },
+        { "aruco_original", cv::aruco::DICT_ARUCO_ORIGINAL },
+        { "apriltag_16h5", cv::aruco::DICT_APRILTAG_16h5 }, { "apriltag_25h9", cv::aruco::DICT_APRILTAG_25h9 },
+        { "apriltag_36h10", cv::aruco::DICT_APRILTAG_36h10 }, { "apriltag_36h11", cv::aruco::DICT_APRILTAG_36h11 },
+    };
+    auto it = dictionaries.find(name);
+    return it == dictionaries.end() ? -1 : it->second;
+}
+
+FiducialDetector::FiducialDetector(const FiducialOptions &options) {
+    this->options = options;
+    this->options.full_search_interval = std::max(1u, options.full_search_interval);
+
+    int dictionary_id = dictionaryId(options.dictionary);
+    if (dictionary_id < 0)
+        throw std::runtime_error("Invalid fiducial dictionary '" + options.dictionary + "', use e.g. '4x4_50', '6x6_250', 'aruco_original' or 'apriltag_36h11'");
+    this->dictionary = cv::aruco::getPredefinedDictionary(dictionary_id);
+    this->parameters = cv::aruco::DetectorParameters::create();
+    this->parameters->cornerRefinementMethod = cv::aruco::CORNER_REFINE_SUBPIX; // for the poses
+}
+
+void FiducialDetector::setCameraModel(const cv::Mat &camera_matrix, const cv::Mat &dist_coeffs) {
+    this->camera_matrix = camera_matrix.clone();
+    this->dist_coeffs = dist_coeffs.clone();
+}
+
+const std::vector<FiducialDetection> &FiducialDetector::detect(const cv::Mat &y, bool &full_search) {
+    this->detections.clear();
+
+    full_search = this->tracks.empty() || ++this->frames_since_full_search >= this->options.full_search_interval;
+    if (full_search) {
+        this->frames_since_full_search = 0;
+        this->search(y, cv::Point(0, 0));
+    } else {
+        // views into the plane, nothing is copied
+        for (auto &window : this->searchWindows(y.size()))
+            this->search(y(window), window.tl());
+    }
+
+    this->updateTracks();
+    if (!this->camera_matrix.empty())
+        this->estimatePoses();
+    return this->detections;
+}
+
+// Around each track's predicted corners, overlapping windows merged so a marker is found once
+std::vector<cv::Rect> FiducialDetector::searchWindows(cv::Size size) const {
+    std::vector<cv::Rect> windows;
+    cv::Rect frame(cv::Point(0, 0), size);
+    for (auto &track : this->tracks) {
+        std::vector<cv::Point2f> predicted(4);
+        for (uint i = 0; i < 4; i++)
+            predicted[i] = track.last.corners[i] + track.velocity * (float) (track.misses + 1);
+        cv::Rect box = cv::boundingRect(predicted);
+        int margin = (int) (std::max(box.width, box.height) * this->options.roi_margin) + 8;
+        box = cv::Rect(box.x - margin, box.y - margin, box.width + 2 * margin, box.height + 2 * margin) & frame;
+        if (box.area() > 0)
+            windows.push_back(box);
+    }
+
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        for (size_t i = 0; i < windows.size() && !merged; i++) {
+            for (size_t j = i + 1; j < windows.size(); j++) {
+                if ((windows[i] & windows[j]).area() > 0) {
+                    windows[i] |= windows[j];
+                    windows.erase(windows.begin() + j);
+                    merged = true;
+                    break;
+                }
+            }
+        }
+    }
+    return windows;
+}
+
+void FiducialDetector::search(const cv::Mat &image, cv::Point offset) {
+    cv::aruco::detectMarkers(image, this->dictionary, this->found_corners, this->found_ids, this->parameters, this->rejected);
+    for (size_t i = 0; i < this->found_ids.size(); i++) {
+        FiducialDetection detection;
+        detection.id = this->found_ids[i];
+        for (uint c = 0; c < 4; c++)
+            detection.corners[c] = this->found_corners[i][c] + cv::Point2f((float) offset.x, (float) offset.y);
+        this->detections.push_back(detection);
+    }
+}
+
+static cv::Point2f markerCentre(const FiducialDetection &detection) {
+    return (detection.corners[0] + detection.corners[1] + detection.corners[2] + detection.corners[3]) * 0.25f;
+}
+
+// Each detection continues the nearest track with its id, the rest start new tracks
+void FiducialDetector::updateTracks() {
+    std::vector<bool> continued(this->tracks.size(), false);
+    for (auto &detection : this->detections) {
+        cv::Point2f centre = markerCentre(detection);
+        int nearest = -1;
+        float nearest_distance = 0.0f;
+        for (size_t i = 0; i < this->tracks.size(); i++) {
+            if (continued[i] || this->tracks[i].last.id != detection.id)
+                continue;
+            float distance = (float) cv::norm(markerCentre(this->tracks[i].last) - centre);
+            if (nearest < 0 || distance < nearest_distance) {
+                nearest = (int) i;
+                nearest_distance = distance;
+            }
+        }
+        if (nearest < 0) {
+            Track track;
+            track.last = detection;
+            track.velocity = cv::Point2f(0.0f, 0.0f);
+            this->tracks.push_back(track);
+            continued.push_back(true);
+            continue;
+        }
+        Track &track = this->tracks[nearest];
+        track.velocity = (centre - markerCentre(track.last)) * (1.0f / (float) (track.misses + 1));
+        track.last = detection;
+        track.misses = 0;
+        continued[nearest] = true;
+    }
+
+    for (size_t i = this->tracks.size(); i-- > 0;) {
+        if (!continued[i] && ++this->tracks[i].misses > this->options.max_misses)
+            this->tracks.erase(this->tracks.begin() + i);
+    }
+}
+
+// IPPE for squares, corners in the dictionary's order: top left, top right, bottom right, bottom left
+void FiducialDetector::estimatePoses() {
+    float half = (float) this->options.marker_size / 2.0f;
+    std::vector<cv::Point3f> object_points = {
+        { -half, half, 0.0f }, { half, half, 0.0f }, { half, -half, 0.0f }, { -half, -half, 0.0f }
+    };
+    for (auto &detection : this->detections) {
+        std::vector<cv::Point2f> image_points(detection.corners.begin(), detection.corners.end());
+        detection.pose_valid = cv::solvePnP(object_points, image_points, this->camera_matrix, this->dist_coeffs,
+                                            detection.rvec, detection.tvec, false, cv::SOLVEPNP_IPPE_SQUARE);
+    }
+}
+
+FiducialWorker::FiducialWorker(const FiducialOptions &options, ResultCallback on_result)
+    : detector(options), on_result(on_result) {
+    this->thread = std::thread(&FiducialWorker::workerLoop, this);
+}
+
+FiducialWorker::~FiducialWorker() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->cond.notify_all();
+    this->thread.join();
+}
+
+bool FiducialWorker::submit(FramePtr frame, uint width, uint height, long timestamp_ns) {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (this->frame)
+            return false;
+        this->frame = frame;
+        this->width = width;
+        this->height = height;
+        this->timestamp_ns = timestamp_ns;
+    }
+    this->cond.notify_one();
+    return true;
+}
+
+void FiducialWorker::setCameraModel(const cv::Mat &camera_matrix, const cv::Mat &dist_coeffs) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->camera_matrix = camera_matrix.clone();
+    this->dist_coeffs = dist_coeffs.clone();
+    this->camera_model_changed = true;
+}
+
+void FiducialWorker::workerLoop() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (true) {
+        this->cond.wait(lock, [this] { return this->stopping || this->frame; });
+        if (this->stopping)
+            break;
+        if (this->camera_model_changed) {
+            this->detector.setCameraModel(this->camera_matrix, this->dist_coeffs);
+            this->camera_model_changed = false;
+        }
+        FramePtr frame = this->frame;
+        uint width = this->width, height = this->height;
+        long timestamp_ns = this->timestamp_ns;
+        lock.unlock();
+
+        bool full_search;
+        {
+            FrameHandle::CpuAccess cpu_access(*frame);
+            cv::Mat y((int) height, (int) width, CV_8UC1, frame->mapped->planes[0], frame->mapped->strides[0]);
+            auto &detections = this->detector.detect(y, full_search);
+            this->on_result(detections, timestamp_ns, full_search);
+        }
+        frame.reset();
+
+        lock.lock();
+        this->frame.reset(); // idle, the capture buffer goes back to the camera
+    }
+    this->frame.reset();
+}
@@ -0,0 +1,70 @@
+#include <iostream>
+#include <sys/ioctl.h>
+#include <linux/dma-buf.h>
+#include <stdexcept>
+
+#include "picam_ros2/frame_handle.hpp"
+
+FrameHandle::FrameHandle(libcamera::Request *request, libcamera::FrameBuffer *buffer, const MappedBuffer *mapped,
+                         long timestamp_ns, std::function<void(libcamera::Request *)> release, DmaSyncStats *sync_stats) {
+    this->request = request;
+    this->buffer = buffer;
+    this->mapped = mapped;
+    this->timestamp_ns = timestamp_ns;
+    this->release = release;
+    this->sync_stats = sync_stats;
+}
+
+FrameHandle::~FrameHandle() {
+    if (this->sync_stats && !this->cpu_accessed)
+        this->sync_stats->skipped++;
+    if (this->release)
+        this->release(this->request);
+}
+
+bool FrameHandle::sync(uint64_t flags) {
+    struct dma_buf_sync dma_sync {};
+    dma_sync.flags = flags;
+    if (::ioctl(this->fd(), DMA_BUF_IOCTL_SYNC, &dma_sync) == 0)
+        return true;
+    if (this->sync_stats)
+        this->sync_stats->failed++;
+    return false;
+}
+
+// Throws with the window state unchanged, so an enclosing CpuAccess still ends what it began
+void FrameHandle::beginCpuAccess(bool write) {
+    std::lock_guard<std::mutex> lock(this->cpu_access_mutex);
+    uint64_t flags = write ? DMA_BUF_SYNC_RW : DMA_BUF_SYNC_READ;
+
+    if (this->cpu_access_depth > 0 && (this->cpu_access_flags & flags) != flags) {
+        // upgrade an open read window to read/write, reopened as it was if that fails
+        const uint64_t upgraded = this->cpu_access_flags | flags;
+        if (!this->sync(DMA_BUF_SYNC_END | this->cpu_access_flags))
+            throw std::runtime_error("Failed to sync dma buf");
+        if (!this->sync(DMA_BUF_SYNC_START | upgraded)) {
+            this->sync(DMA_BUF_SYNC_START | this->cpu_access_flags);
+            throw std::runtime_error("Failed to sync dma buf");
+        }
+        this->cpu_access_flags = upgraded;
+        if (this->sync_stats)
+            this->sync_stats->syncs++;
+    } else if (this->cpu_access_depth == 0) {
+        if (!this->sync(DMA_BUF_SYNC_START | flags))
+            throw std::runtime_error("Failed to sync dma buf");
+        this->cpu_access_flags = flags;
+        if (this->sync_stats)
+            this->sync_stats->syncs++;
+    }
+    this->cpu_access_depth++;
+    this->cpu_accessed = true;
+}
+
+// Runs from ~CpuAccess, so a failed END is counted and logged, never thrown
+void FrameHandle::endCpuAccess() {
+    std::lock_guard<std::mutex> lock(this->cpu_access_mutex);
+    if (this->cpu_access_depth == 0)
+        return;
+    if (--this->cpu_access_depth == 0 && !this->sync(DMA_BUF_SYNC_END | this->cpu_access_flags))
+        std::cerr << "Failed to end dma buf CPU access" << std::endl;
+}
@@ -0,0 +1,113 @@
+#include <cstring>
+
+#include "picam_ros2/image_output.hpp"
+
+using namespace picam_conv;
+
+void setCurrentStamp(builtin_interfaces::msg::Time *stamp, uint64_t timestamp_ns) {
+    // Split into seconds and nanoseconds
+    stamp->sec = static_cast<int32_t>(timestamp_ns / NS_TO_SEC);
+    stamp->nanosec = static_cast<uint32_t>(timestamp_ns % NS_TO_SEC);;
+}
+
+// One instantiation per colour matrix, in COLOR_MATRIX order
+#define CONVERT_FNS(Dst) { &convert<SrcI420, Dst, BT601Limited>, &convert<SrcI420, Dst, BT601Full>, \
+                           &convert<SrcI420, Dst, BT709Limited>, &convert<SrcI420, Dst, BT709Full> }
+
+static const ImageEncoding IMAGE_ENCODINGS[] = {
+    { IMAGE_OUTPUT_FORMAT::YUV420, 1, 3, 2, { nullptr, nullptr, nullptr, nullptr }, nullptr },
+    { IMAGE_OUTPUT_FORMAT::BGR8, 3, 1, 1, CONVERT_FNS(DstBGR8), &shuffleRgb<DstRGB8, DstBGR8> },
+    { IMAGE_OUTPUT_FORMAT::RGB8, 3, 1, 1, CONVERT_FNS(DstRGB8), &shuffleRgb<DstRGB8, DstRGB8> },
+    { IMAGE_OUTPUT_FORMAT::BGRA8, 4, 1, 1, CONVERT_FNS(DstBGRA8), &shuffleRgb<DstRGB8, DstBGRA8> },
+    { IMAGE_OUTPUT_FORMAT::RGBA8, 4, 1, 1, CONVERT_FNS(DstRGBA8), &shuffleRgb<DstRGB8, DstRGBA8> },
+    { IMAGE_OUTPUT_FORMAT::MONO8, 1, 1, 1, CONVERT_FNS(DstMono8), nullptr },
+    { IMAGE_OUTPUT_FORMAT::MONO16, 2, 1, 1, CONVERT_FNS(DstMono16), nullptr },
+    { IMAGE_OUTPUT_FORMAT::NV12, 1, 3, 2, CONVERT_FNS(DstNV12), nullptr },
+    { IMAGE_OUTPUT_FORMAT::YUV422_YUY2, 2, 1, 1, CONVERT_FNS(DstYUYV), nullptr },
+};
+
+#undef CONVERT_FNS
+
+const ImageEncoding *findImageEncoding(uint format) {
+    for (auto &encoding : IMAGE_ENCODINGS) {
+        if (encoding.format == format)
+            return &encoding;
+    }
+    return nullptr;
+}
+
+const ImageEncoding *findImageEncoding(const std::string &name) {
+    for (auto &it : IMAGE_OUTPUT_FORMAT_NAMES) {
+        if (it.second == name)
+            return findImageEncoding(it.first);
+    }
+    return nullptr;
+}
+
+bool packImage(uint format, uint color_matrix, const std::vector<uint8_t *>& planes, const std::vector<uint>& strides,
+               uint width, uint height, sensor_msgs::msg::Image &msg) {
+
+    const ImageEncoding *encoding = findImageEncoding(format);
+    if (!encoding || color_matrix >= COLOR_MATRIX::COLOR_MATRIX_COUNT)
+        return false;
+
+    ConvertFn convert_fn = encoding->convert[color_matrix];
+    if (!convert_fn) {
+        // the planes are contiguous in the capture buffer
+        size_t size = strides[0] * height + strides[1] * (height / 2) + strides[2] * (height / 2);
+        msg.data.assign(planes[0], planes[0] + size);
+        msg.step = strides[0];
+        return true;
+    }
+
+    msg.step = width * encoding->bytes_per_pixel;
+    msg.data.resize((size_t) msg.step * height * encoding->rows_num / encoding->rows_den);
+
+    YuvPlanes src = { planes[0], planes[1], planes[2], strides[0], strides[1], strides[2], width, height };
+    convert_fn(src, msg.data.data(), msg.step);
+
+    return true;
+}
+
+void ImageConversionGraph::pack(const std::vector<ImageOutput *> &outputs, uint color_matrix, const std::vector<uint8_t *>& planes,
+                                const std::vector<uint>& strides, uint width, uint height) {
+
+    // the RGB pass is only shared when more than one RGB family output is due
+    uint rgb_outputs = 0;
+    ImageOutput *rgb_source = nullptr; // an rgb8 output doubles as the intermediate
+    for (auto *output : outputs) {
+        const ImageEncoding *encoding = findImageEncoding(output->format);
+        if (encoding && encoding->from_rgb) {
+            rgb_outputs++;
+            if (output->format == IMAGE_OUTPUT_FORMAT::RGB8 && !rgb_source)
+                rgb_source = output;
+        }
+    }
+
+    const uint8_t *rgb_data = nullptr;
+    if (rgb_outputs > 1) {
+        if (rgb_source) {
+            packImage(IMAGE_OUTPUT_FORMAT::RGB8, color_matrix, planes, strides, width, height, rgb_source->msg);
+            rgb_data = rgb_source->msg.data.data();
+        } else {
+            YuvPlanes src = { planes[0], planes[1], planes[2], strides[0], strides[1], strides[2], width, height };
+            this->rgb.resize((size_t) width * height * 3);
+            findImageEncoding(IMAGE_OUTPUT_FORMAT::RGB8)->convert[color_matrix](src, this->rgb.data(), width * 3);
+            rgb_data = this->rgb.data();
+        }
+    }
+
+    for (auto *output : outputs) {
+        if (output == rgb_source && rgb_data)
+            continue; // packed above
+
+        const ImageEncoding *encoding = findImageEncoding(output->format);
+        if (rgb_data && encoding && encoding->from_rgb) {
+            output->msg.step = width * encoding->bytes_per_pixel;
+            output->msg.data.resize((size_t) output->msg.step * height);
+            encoding->from_rgb(rgb_data, width * 3, output->msg.data.data(), output->msg.step, width, height);
+        } else {
+            packImage(output->format, color_matrix, planes, strides, width, height, output->msg);
+        }
+    }
+}
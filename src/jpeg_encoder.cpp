@@ -0,0 +1,359 @@
+#include <algorithm>
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+
+#include <jpeglib.h>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "picam_ros2/jpeg_encoder.hpp"
+
+// Q14 rounding like vrshrq_n_s32, half up
+static inline int roundQ14(int32_t v) {
+    return (v + (1 << 13)) >> 14;
+}
+
+namespace jpeg_reference {
+
+void jpegLumaRow(const uint8_t *y, const uint8_t *cb, const uint8_t *cr, uint8_t *dst, uint count, const JpegRowCoeffs &k) {
+    for (uint x = 0; x < count; x++) {
+        int32_t v = k.y_y * (y[x] - k.y_offset) + k.y_cb * (cb[x / 2] - 128) + k.y_cr * (cr[x / 2] - 128);
+        dst[x] = (uint8_t) std::clamp(roundQ14(v), 0, 255);
+    }
+}
+
+void jpegChromaRow(const uint8_t *cb, const uint8_t *cr, uint8_t *dst_cb, uint8_t *dst_cr, uint count, const JpegRowCoeffs &k) {
+    for (uint x = 0; x < count; x++) {
+        int u = cb[x] - 128, v = cr[x] - 128;
+        dst_cb[x] = (uint8_t) std::clamp(roundQ14(k.cb_cb * u + k.cb_cr * v) + 128, 0, 255);
+        dst_cr[x] = (uint8_t) std::clamp(roundQ14(k.cr_cb * u + k.cr_cr * v) + 128, 0, 255);
+    }
+}
+
+}
+
+#if defined(__aarch64__)
+// a * wa + b * wb + c * wc of 8 lanes, Q14 rounded
+static inline int16x8_t dot3Q14(int16x8_t a, int16_t wa, int16x8_t b, int16_t wb, int16x8_t c, int16_t wc) {
+    int32x4_t lo = vmlal_n_s16(vmlal_n_s16(vmull_n_s16(vget_low_s16(a), wa), vget_low_s16(b), wb), vget_low_s16(c), wc);
+    int32x4_t hi = vmlal_n_s16(vmlal_n_s16(vmull_n_s16(vget_high_s16(a), wa), vget_high_s16(b), wb), vget_high_s16(c), wc);
+    return vcombine_s16(vmovn_s32(vrshrq_n_s32(lo, 14)), vmovn_s32(vrshrq_n_s32(hi, 14)));
+}
+
+static inline int16x8_t centered(uint8x8_t v, uint8_t center) {
+    return vreinterpretq_s16_u16(vsubl_u8(v, vdup_n_u8(center)));
+}
+#endif
+
+void jpegLumaRow(const uint8_t *y, const uint8_t *cb, const uint8_t *cr, uint8_t *dst, uint count, const JpegRowCoeffs &k) {
+    uint x = 0;
+#if defined(__aarch64__)
+    for (; x + 16 <= count; x += 16) {
+        uint8x16_t luma = vld1q_u8(y + x);
+        uint8x8x2_t u = vzip_u8(vld1_u8(cb + x / 2), vld1_u8(cb + x / 2)); // each chroma sample under 2 px
+        uint8x8x2_t v = vzip_u8(vld1_u8(cr + x / 2), vld1_u8(cr + x / 2));
+        int16x8_t lo = dot3Q14(centered(vget_low_u8(luma), (uint8_t) k.y_offset), k.y_y,
+                               centered(u.val[0], 128), k.y_cb, centered(v.val[0], 128), k.y_cr);
+        int16x8_t hi = dot3Q14(centered(vget_high_u8(luma), (uint8_t) k.y_offset), k.y_y,
+                               centered(u.val[1], 128), k.y_cb, centered(v.val[1], 128), k.y_cr);
+        vst1q_u8(dst + x, vcombine_u8(vqmovun_s16(lo), vqmovun_s16(hi)));
+    }
+#endif
+    jpeg_reference::jpegLumaRow(y + x, cb + x / 2, cr + x / 2, dst + x, count - x, k);
+}
+
+void jpegChromaRow(const uint8_t *cb, const uint8_t *cr, uint8_t *dst_cb, uint8_t *dst_cr, uint count, const JpegRowCoeffs &k) {
+    uint x = 0;
+#if defined(__aarch64__)
+    const int16x8_t center = vdupq_n_s16(128);
+    const int16x8_t zero = vdupq_n_s16(0);
+    for (; x + 8 <= count; x += 8) {
+        int16x8_t u = centered(vld1_u8(cb + x), 128), v = centered(vld1_u8(cr + x), 128);
+        vst1_u8(dst_cb + x, vqmovun_s16(vaddq_s16(dot3Q14(u, k.cb_cb, v, k.cb_cr, zero, 0), center)));
+        vst1_u8(dst_cr + x, vqmovun_s16(vaddq_s16(dot3Q14(u, k.cr_cb, v, k.cr_cr, zero, 0), center)));
+    }
+#endif
+    jpeg_reference::jpegChromaRow(cb + x, cr + x, dst_cb + x, dst_cr + x, count - x, k);
+}
+
+// libjpeg reports fatal errors through error_exit, which must not return
+struct JpegErrorManager {
+    jpeg_error_mgr pub;
+    jmp_buf jump;
+};
+
+static void jpegErrorExit(j_common_ptr cinfo) {
+    longjmp(((JpegErrorManager *) cinfo->err)->jump, 1);
+}
+
+struct JpegEncoder::Context {
+    jpeg_compress_struct cinfo;
+    JpegErrorManager err;
+    jpeg_destination_mgr dest;
+    Strip *strip = nullptr; // being written
+    std::vector<uint8_t> scratch; // 16 luma and 2 x 8 chroma rows when the planes can't be fed as they are
+
+    Context() {
+        this->cinfo.err = jpeg_std_error(&this->err.pub);
+        this->err.pub.error_exit = jpegErrorExit;
+        jpeg_create_compress(&this->cinfo);
+        this->cinfo.client_data = this;
+
+        // into the strip's buffer, kept between frames
+        this->dest.init_destination = [](j_compress_ptr cinfo) {
+            Strip &strip = *((Context *) cinfo->client_data)->strip;
+            if (strip.data.size() < 64 * 1024)
+                strip.data.resize(64 * 1024);
+            cinfo->dest->next_output_byte = strip.data.data();
+            cinfo->dest->free_in_buffer = strip.data.size();
+        };
+        this->dest.empty_output_buffer = [](j_compress_ptr cinfo) -> boolean {
+            Strip &strip = *((Context *) cinfo->client_data)->strip;
+            size_t used = strip.data.size();
+            strip.data.resize(used * 2);
+            cinfo->dest->next_output_byte = strip.data.data() + used;
+            cinfo->dest->free_in_buffer = strip.data.size() - used;
+            return TRUE;
+        };
+        this->dest.term_destination = [](j_compress_ptr cinfo) {
+            Strip &strip = *((Context *) cinfo->client_data)->strip;
+            strip.size = strip.data.size() - cinfo->dest->free_in_buffer;
+        };
+        this->cinfo.dest = &this->dest;
+    }
+
+    ~Context() {
+        jpeg_destroy_compress(&this->cinfo);
+    }
+};
+
+JpegEncoder::JpegEncoder(uint num_threads, int quality) : quality(std::clamp(quality, 1, 100)) {
+    if (num_threads == 0)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (uint i = 0; i < num_threads; i++)
+        this->contexts.push_back(std::make_unique<Context>());
+    for (uint i = 0; i + 1 < num_threads; i++)
+        this->threads.emplace_back(&JpegEncoder::workerLoop, this, i);
+}
+
+JpegEncoder::~JpegEncoder() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->start_cond.notify_all();
+    for (auto &thread : this->threads)
+        thread.join();
+}
+
+void JpegEncoder::workerLoop(uint index) {
+    uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->start_cond.wait(lock, [&] { return this->stopping || this->generation != seen; });
+            if (this->stopping)
+                break;
+            seen = this->generation;
+        }
+        this->runStrips(*this->contexts[index]);
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->workers_busy--;
+        }
+        this->done_cond.notify_one();
+    }
+}
+
+void JpegEncoder::runStrips(Context &ctx) {
+    uint i;
+    while ((i = this->next_strip.fetch_add(1)) < this->strips.size()) {
+        if (!this->encodeStrip(ctx, this->strips[i]))
+            this->strips[i].size = 0;
+    }
+}
+
+bool JpegEncoder::encodeStrip(Context &ctx, Strip &strip) {
+    const picam_conv::YuvPlanes &src = *this->src;
+    jpeg_compress_struct &cinfo = ctx.cinfo;
+    ctx.strip = &strip;
+    strip.size = 0;
+    if (setjmp(ctx.err.jump)) {
+        jpeg_abort_compress(&cinfo);
+        return false;
+    }
+
+    const uint first_row = strip.first_mcu_row * 16;
+    cinfo.image_width = src.width;
+    cinfo.image_height = std::min(strip.mcu_rows * 16, src.height - first_row);
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_YCbCr;
+    jpeg_set_defaults(&cinfo); // standard Huffman tables, the same in every strip
+    jpeg_set_quality(&cinfo, this->quality, TRUE);
+    cinfo.raw_data_in = TRUE;
+    cinfo.comp_info[0].h_samp_factor = 2;
+    cinfo.comp_info[0].v_samp_factor = 2;
+    for (uint c = 1; c < 3; c++) {
+        cinfo.comp_info[c].h_samp_factor = 1;
+        cinfo.comp_info[c].v_samp_factor = 1;
+    }
+    cinfo.restart_interval = this->restart_interval; // only strip 0's DRI is kept
+    jpeg_start_compress(&cinfo, TRUE);
+
+    // libjpeg reads whole blocks: rows are fed from the planes as they are when they are
+    // full range BT.601 and 16 px aligned, else converted into scratch rows with the edge
+    // pixel repeated
+    const JpegRowCoeffs &k = this->coeffs;
+    const uint chroma_width = (src.width + 1) / 2, chroma_height = (src.height + 1) / 2;
+    const uint luma_padded = (src.width + 15) & ~15u, chroma_padded = luma_padded / 2;
+    const bool direct = k.identity && luma_padded == src.width;
+    if (!direct && ctx.scratch.size() < (size_t) 16 * (luma_padded + chroma_padded))
+        ctx.scratch.resize((size_t) 16 * (luma_padded + chroma_padded));
+
+    auto pad = [](uint8_t *row, uint width, uint padded) {
+        memset(row + width, row[width - 1], padded - width);
+    };
+
+    JSAMPROW y_rows[16], u_rows[8], v_rows[8];
+    JSAMPARRAY rows[3] = { y_rows, u_rows, v_rows };
+    uint8_t *scratch_y = ctx.scratch.data();
+    uint8_t *scratch_u = scratch_y + (size_t) 16 * luma_padded;
+    uint8_t *scratch_v = scratch_u + (size_t) 8 * chroma_padded;
+    for (uint r = 0; r < strip.mcu_rows; r++) {
+        uint y0 = first_row + r * 16;
+        for (uint i = 0; i < 16; i++) { // rows past the bottom repeat the last one
+            uint y = std::min(y0 + i, src.height - 1);
+            const uint8_t *row = src.y + (size_t) y * src.y_stride;
+            if (direct) {
+                y_rows[i] = const_cast<JSAMPROW>(row);
+                continue;
+            }
+            y_rows[i] = scratch_y + i * luma_padded;
+            if (k.identity) {
+                memcpy(y_rows[i], row, src.width);
+            } else {
+                uint c = std::min(y / 2, chroma_height - 1); // luma takes the chroma of its 2x2 block
+                jpegLumaRow(row, src.u + (size_t) c * src.u_stride, src.v + (size_t) c * src.v_stride, y_rows[i], src.width, k);
+            }
+            pad(y_rows[i], src.width, luma_padded);
+        }
+        for (uint i = 0; i < 8; i++) {
+            uint y = std::min(y0 / 2 + i, chroma_height - 1);
+            const uint8_t *u = src.u + (size_t) y * src.u_stride, *v = src.v + (size_t) y * src.v_stride;
+            if (direct) {
+                u_rows[i] = const_cast<JSAMPROW>(u);
+                v_rows[i] = const_cast<JSAMPROW>(v);
+                continue;
+            }
+            u_rows[i] = scratch_u + i * chroma_padded;
+            v_rows[i] = scratch_v + i * chroma_padded;
+            if (k.identity) {
+                memcpy(u_rows[i], u, chroma_width);
+                memcpy(v_rows[i], v, chroma_width);
+            } else {
+                jpegChromaRow(u, v, u_rows[i], v_rows[i], chroma_width, k);
+            }
+            pad(u_rows[i], chroma_width, chroma_padded);
+            pad(v_rows[i], chroma_width, chroma_padded);
+        }
+        jpeg_write_raw_data(&cinfo, rows, 16);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    return strip.size > 0;
+}
+
+// Offsets in a strip JPEG (SOI, headers, SOS, entropy coded data, EOI): the baseline frame
+// header and the first byte after the scan header
+static bool parseStrip(const uint8_t *data, size_t size, size_t &sof, size_t &scan) {
+    if (size < 4 || data[0] != 0xff || data[1] != 0xd8 || data[size - 2] != 0xff || data[size - 1] != 0xd9)
+        return false;
+    sof = 0;
+    size_t p = 2;
+    while (p + 4 <= size && data[p] == 0xff) {
+        uint8_t marker = data[p + 1];
+        size_t length = (size_t) data[p + 2] << 8 | data[p + 3];
+        if (marker == 0xc0)
+            sof = p;
+        p += 2 + length;
+        if (marker == 0xda) {
+            scan = p;
+            return sof && p <= size - 2;
+        }
+    }
+    return false;
+}
+
+bool JpegEncoder::encode(const picam_conv::YuvPlanes &src, const JpegRowCoeffs &coeffs, std::vector<uint8_t> &out) {
+    if (!src.width || !src.height)
+        return false;
+
+    // about 4 strips per thread, none under 4 MCU rows; one strip per restart interval, which is 16 bit
+    const uint mcus_per_row = (src.width + 15) / 16, mcu_rows = (src.height + 15) / 16;
+    uint rows_per_strip = mcu_rows;
+    if (this->threadCount() > 1) {
+        rows_per_strip = std::max(4u, (mcu_rows + this->threadCount() * 4 - 1) / (this->threadCount() * 4));
+        rows_per_strip = std::min(rows_per_strip, std::max(1u, 65535 / mcus_per_row));
+    }
+    uint strip_count = (mcu_rows + rows_per_strip - 1) / rows_per_strip;
+    this->strips.resize(strip_count); // kept, with their buffers, for the next frame
+    for (uint i = 0; i < strip_count; i++) {
+        this->strips[i].first_mcu_row = i * rows_per_strip;
+        this->strips[i].mcu_rows = std::min(rows_per_strip, mcu_rows - i * rows_per_strip);
+    }
+    this->restart_interval = strip_count > 1 ? rows_per_strip * mcus_per_row : 0;
+    this->src = &src;
+    this->coeffs = coeffs;
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->next_strip = 0;
+        this->workers_busy = (uint) this->threads.size();
+        this->generation++;
+    }
+    this->start_cond.notify_all();
+    this->runStrips(*this->contexts.back());
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->done_cond.wait(lock, [&] { return this->workers_busy == 0; });
+    }
+    this->src = nullptr;
+
+    // strip 0's headers with the full height, each strip's entropy coded data, RSTn in between
+    size_t sof = 0, scan = 0, size = 0;
+    std::vector<std::pair<size_t, size_t>> entropy(strip_count); // begin, end
+    for (uint i = 0; i < strip_count; i++) {
+        const Strip &strip = this->strips[i];
+        size_t strip_sof, strip_scan;
+        if (!strip.size || !parseStrip(strip.data.data(), strip.size, strip_sof, strip_scan))
+            return false;
+        if (i == 0) {
+            sof = strip_sof;
+            scan = strip_scan;
+        }
+        entropy[i] = { strip_scan, strip.size - 2 };
+        size += strip.size - 2 - strip_scan;
+    }
+    out.resize(scan + size + 2 * (strip_count - 1) + 2);
+
+    uint8_t *p = out.data();
+    memcpy(p, this->strips[0].data.data(), scan);
+    p[sof + 5] = (uint8_t) (src.height >> 8); // SOF0: FF C0, length, precision, height, width
+    p[sof + 6] = (uint8_t) src.height;
+    p += scan;
+    for (uint i = 0; i < strip_count; i++) {
+        size_t length = entropy[i].second - entropy[i].first;
+        memcpy(p, this->strips[i].data.data() + entropy[i].first, length);
+        p += length;
+        if (i + 1 < strip_count) {
+            *p++ = 0xff;
+            *p++ = (uint8_t) (0xd0 + i % 8);
+        }
+    }
+    *p++ = 0xff;
+    *p++ = 0xd9;
+    return true;
+}
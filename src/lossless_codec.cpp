@@ -0,0 +1,317 @@
+#include <algorithm>
+#include <cstring>
+
+#include <zstd.h>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "picam_ros2/lossless_codec.hpp"
+
+namespace picam_lossless {
+
+// LOCO-I median edge detector: left, up, up-left; the median of a, b and the
+// gradient a + b - c is the gradient clamped to [min(a, b), max(a, b)]
+static inline int medPredict(int a, int b, int c) {
+    return std::clamp(a + b - c, std::min(a, b), std::max(a, b));
+}
+
+static inline uint8_t zigzag8(int d) {
+    int8_t s = (int8_t) d;
+    return (uint8_t) ((s << 1) ^ (s >> 7));
+}
+
+static inline int unzigzag(uint z) {
+    return (int) (z >> 1) ^ -(int) (z & 1);
+}
+
+namespace reference {
+
+void residualRow8(const uint8_t *row, const uint8_t *prev_row, uint8_t *dst, uint width, uint step) {
+    for (uint x = 0; x < width; x++) {
+        int pred;
+        if (x < step)
+            pred = prev_row ? prev_row[x] : 0;
+        else
+            pred = prev_row ? medPredict(row[x - step], prev_row[x], prev_row[x - step]) : row[x - step];
+        dst[x] = zigzag8(row[x] - pred);
+    }
+}
+
+}
+
+void residualRow8(const uint8_t *row, const uint8_t *prev_row, uint8_t *dst, uint width, uint step) {
+    if (!prev_row || width <= step) {
+        reference::residualRow8(row, prev_row, dst, width, step);
+        return;
+    }
+    reference::residualRow8(row, prev_row, dst, step, step); // no left neighbour
+    uint x = step;
+#if defined(__aarch64__)
+    // the neighbours come from the source, not the reconstruction, so 16 at a time
+    for (; x + 16 <= width; x += 16) {
+        uint8x16_t cur = vld1q_u8(row + x);
+        uint8x16_t a = vld1q_u8(row + x - step), b = vld1q_u8(prev_row + x), c = vld1q_u8(prev_row + x - step);
+        uint8x16_t mx = vmaxq_u8(a, b), mn = vminq_u8(a, b);
+        uint8x16_t gradient = vsubq_u8(vaddq_u8(a, b), c); // in [mn, mx] when used, wraps harmlessly otherwise
+        uint8x16_t pred = vbslq_u8(vcgeq_u8(c, mx), mn, vbslq_u8(vcleq_u8(c, mn), mx, gradient));
+        int8x16_t d = vreinterpretq_s8_u8(vsubq_u8(cur, pred));
+        vst1q_u8(dst + x, vreinterpretq_u8_s8(veorq_s8(vshlq_n_s8(d, 1), vshrq_n_s8(d, 7))));
+    }
+#endif
+    for (; x < width; x++)
+        dst[x] = zigzag8(row[x] - medPredict(row[x - step], prev_row[x], prev_row[x - step]));
+}
+
+void residualRow16(const uint16_t *row, const uint16_t *prev_row, uint8_t *dst_lo, uint8_t *dst_hi, uint width, uint step, uint shift) {
+    for (uint x = 0; x < width; x++) {
+        int pred;
+        if (x < step)
+            pred = prev_row ? prev_row[x] >> shift : 0;
+        else if (prev_row)
+            pred = medPredict(row[x - step] >> shift, prev_row[x] >> shift, prev_row[x - step] >> shift);
+        else
+            pred = row[x - step] >> shift;
+        int16_t d = (int16_t) ((row[x] >> shift) - pred);
+        uint16_t z = (uint16_t) ((d << 1) ^ (d >> 15));
+        dst_lo[x] = (uint8_t) z;
+        dst_hi[x] = (uint8_t) (z >> 8);
+    }
+}
+
+static size_t rowBytes(const PlaneView &plane) {
+    return (size_t) plane.width * plane.bytes_per_sample;
+}
+
+Encoder::Encoder(uint num_threads, int level) : level(level) {
+    if (num_threads == 0)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    this->main_cctx = ZSTD_createCCtx();
+    for (uint i = 1; i < num_threads; i++)
+        this->threads.emplace_back(&Encoder::workerLoop, this);
+}
+
+Encoder::~Encoder() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->start_cond.notify_all();
+    for (auto &thread : this->threads)
+        thread.join();
+    ZSTD_freeCCtx((ZSTD_CCtx *) this->main_cctx);
+}
+
+void Encoder::workerLoop() {
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->start_cond.wait(lock, [&] { return this->stopping || this->generation != seen; });
+            if (this->stopping)
+                break;
+            seen = this->generation;
+        }
+        this->runStrips(cctx);
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->workers_busy--;
+        }
+        this->done_cond.notify_one();
+    }
+    ZSTD_freeCCtx(cctx);
+}
+
+void Encoder::runStrips(void *cctx) {
+    uint i;
+    while ((i = this->next_strip.fetch_add(1)) < this->strips.size()) {
+        Strip &strip = this->strips[i];
+        const PlaneView &plane = (*this->planes)[strip.plane];
+        const size_t row_bytes = rowBytes(plane);
+        strip.residuals.resize(row_bytes * strip.rows);
+
+        for (uint r = 0; r < strip.rows; r++) {
+            const uint8_t *row = plane.data + (size_t) (strip.first_row + r) * plane.stride;
+            const uint8_t *prev_row = r >= plane.step ? row - (size_t) plane.step * plane.stride : nullptr;
+            if (plane.bytes_per_sample == 1) {
+                residualRow8(row, prev_row, strip.residuals.data() + r * row_bytes, plane.width, plane.step);
+            } else {
+                // low bytes of all rows, then the high bytes
+                uint8_t *lo = strip.residuals.data() + (size_t) r * plane.width;
+                residualRow16(reinterpret_cast<const uint16_t *>(row), reinterpret_cast<const uint16_t *>(prev_row),
+                              lo, lo + (size_t) strip.rows * plane.width, plane.width, plane.step, plane.shift);
+            }
+        }
+
+        size_t bound = ZSTD_compressBound(strip.residuals.size());
+        if (strip.compressed.size() < bound)
+            strip.compressed.resize(bound);
+        size_t size = ZSTD_compressCCtx((ZSTD_CCtx *) cctx, strip.compressed.data(), strip.compressed.size(),
+                                        strip.residuals.data(), strip.residuals.size(), this->level);
+        strip.size = ZSTD_isError(size) ? 0 : size;
+    }
+}
+
+bool Encoder::encode(const std::vector<PlaneView> &planes, std::vector<uint8_t> &out) {
+    if (planes.empty() || planes.size() > MAX_PLANES)
+        return false;
+
+    // about 4 strips per thread over the whole frame, none smaller than 64 KB
+    size_t total_bytes = 0;
+    for (auto &plane : planes)
+        total_bytes += rowBytes(plane) * plane.height;
+    size_t strip_bytes = std::max<size_t>(total_bytes / (this->threadCount() * 4), 64 * 1024);
+
+    uint strip_count = 0;
+    for (uint p = 0; p < planes.size(); p++) {
+        const PlaneView &plane = planes[p];
+        uint rows_per_strip = (uint) std::max<size_t>(1, strip_bytes / std::max<size_t>(1, rowBytes(plane)));
+        for (uint first_row = 0; first_row < plane.height; first_row += rows_per_strip) {
+            if (strip_count == this->strips.size())
+                this->strips.emplace_back(); // kept, with their buffers, for the next frame
+            Strip &strip = this->strips[strip_count++];
+            strip.plane = p;
+            strip.first_row = first_row;
+            strip.rows = std::min(rows_per_strip, plane.height - first_row);
+        }
+    }
+    this->strips.resize(strip_count);
+    this->planes = &planes;
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->next_strip = 0;
+        this->workers_busy = (uint) this->threads.size();
+        this->generation++;
+    }
+    this->start_cond.notify_all();
+    this->runStrips(this->main_cctx);
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->done_cond.wait(lock, [&] { return this->workers_busy == 0; });
+    }
+    this->planes = nullptr;
+
+    size_t size = sizeof(StreamHeader) + planes.size() * sizeof(PlaneHeader) + strip_count * sizeof(StripHeader);
+    for (auto &strip : this->strips) {
+        if (!strip.size)
+            return false;
+        size += strip.size;
+    }
+    out.resize(size);
+    uint8_t *p = out.data();
+
+    StreamHeader stream = { STREAM_MAGIC, STREAM_VERSION, (uint16_t) planes.size(), strip_count };
+    memcpy(p, &stream, sizeof(stream));
+    p += sizeof(stream);
+    for (auto &plane : planes) {
+        PlaneHeader header = { plane.width, plane.height, (uint8_t) plane.bytes_per_sample, (uint8_t) plane.shift, (uint8_t) plane.step, 0 };
+        memcpy(p, &header, sizeof(header));
+        p += sizeof(header);
+    }
+    for (auto &strip : this->strips) {
+        StripHeader header = { (uint16_t) strip.plane, 0, strip.first_row, strip.rows, (uint32_t) strip.size };
+        memcpy(p, &header, sizeof(header));
+        p += sizeof(header);
+    }
+    for (auto &strip : this->strips) {
+        memcpy(p, strip.compressed.data(), strip.size);
+        p += strip.size;
+    }
+    return true;
+}
+
+// Undoes the prediction of one strip, in place of the packed plane rows
+static void reconstructStrip(const uint8_t *residuals, DecodedPlane &plane, const PlaneHeader &header, uint first_row, uint rows) {
+    const uint width = plane.width, step = header.step;
+    const size_t row_bytes = (size_t) width * plane.bytes_per_sample;
+
+    for (uint r = 0; r < rows; r++) {
+        uint8_t *row = plane.data.data() + (first_row + r) * row_bytes;
+        const uint8_t *prev_row = r >= step ? row - step * row_bytes : nullptr;
+
+        if (plane.bytes_per_sample == 1) {
+            const uint8_t *z = residuals + r * row_bytes;
+            for (uint x = 0; x < width; x++) {
+                int pred;
+                if (x < step)
+                    pred = prev_row ? prev_row[x] : 0;
+                else
+                    pred = prev_row ? medPredict(row[x - step], prev_row[x], prev_row[x - step]) : row[x - step];
+                row[x] = (uint8_t) (pred + unzigzag(z[x]));
+            }
+        } else {
+            const uint8_t *lo = residuals + (size_t) r * width;
+            const uint8_t *hi = lo + (size_t) rows * width;
+            uint16_t *row16 = reinterpret_cast<uint16_t *>(row);
+            const uint16_t *prev16 = reinterpret_cast<const uint16_t *>(prev_row);
+            const uint shift = header.shift;
+            for (uint x = 0; x < width; x++) {
+                int pred;
+                if (x < step)
+                    pred = prev16 ? prev16[x] >> shift : 0;
+                else if (prev16)
+                    pred = medPredict(row16[x - step] >> shift, prev16[x] >> shift, prev16[x - step] >> shift);
+                else
+                    pred = row16[x - step] >> shift;
+                uint16_t value = (uint16_t) (pred + unzigzag(lo[x] | (hi[x] << 8)));
+                row16[x] = (uint16_t) (value << shift);
+            }
+        }
+    }
+}
+
+bool decode(const uint8_t *data, size_t size, std::vector<DecodedPlane> &planes) {
+    StreamHeader stream;
+    if (size < sizeof(stream))
+        return false;
+    memcpy(&stream, data, sizeof(stream));
+    if (stream.magic != STREAM_MAGIC || stream.version != STREAM_VERSION || stream.plane_count == 0 || stream.plane_count > MAX_PLANES)
+        return false;
+
+    size_t offset = sizeof(stream);
+    if (size < offset + stream.plane_count * sizeof(PlaneHeader) + (size_t) stream.strip_count * sizeof(StripHeader))
+        return false;
+
+    std::vector<PlaneHeader> plane_headers(stream.plane_count);
+    planes.resize(stream.plane_count);
+    for (uint p = 0; p < stream.plane_count; p++) {
+        PlaneHeader &header = plane_headers[p];
+        memcpy(&header, data + offset, sizeof(header));
+        offset += sizeof(header);
+        if ((header.bytes_per_sample != 1 && header.bytes_per_sample != 2) || header.step == 0 || header.shift > 15)
+            return false;
+        planes[p].width = header.width;
+        planes[p].height = header.height;
+        planes[p].bytes_per_sample = header.bytes_per_sample;
+        planes[p].data.assign((size_t) header.width * header.height * header.bytes_per_sample, 0);
+    }
+
+    std::vector<StripHeader> strips(stream.strip_count);
+    for (auto &strip : strips) {
+        memcpy(&strip, data + offset, sizeof(strip));
+        offset += sizeof(strip);
+    }
+
+    std::vector<uint8_t> residuals;
+    for (auto &strip : strips) {
+        if (strip.plane >= stream.plane_count || offset + strip.size > size)
+            return false;
+        const PlaneHeader &header = plane_headers[strip.plane];
+        if ((size_t) strip.first_row + strip.rows > header.height)
+            return false;
+
+        residuals.resize((size_t) strip.rows * header.width * header.bytes_per_sample);
+        size_t decoded = ZSTD_decompress(residuals.data(), residuals.size(), data + offset, strip.size);
+        if (ZSTD_isError(decoded) || decoded != residuals.size())
+            return false;
+        offset += strip.size;
+
+        reconstructStrip(residuals.data(), planes[strip.plane], header, strip.first_row, strip.rows);
+    }
+    return true;
+}
+
+} // namespace picam_lossless
@@ -0,0 +1,76 @@
+// Republishes lossless CompressedImage topics (publish_lossless / raw_lossless) as Image
+// Usage: ros2 run picam_ros2 picam_lossless_decode --ros-args -p input:=/picam_ros2/camera_0/model_lossless
+//        (output defaults to <input>/decoded)
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "rclcpp/rclcpp.hpp"
+#include "sensor_msgs/msg/compressed_image.hpp"
+#include "sensor_msgs/msg/image.hpp"
+
+#include "picam_ros2/lossless_codec.hpp"
+
+class LosslessDecoder : public rclcpp::Node {
+    public:
+        LosslessDecoder() : Node("picam_lossless_decode") {
+            this->declare_parameter("input", "");
+            this->declare_parameter("output", ""); // "" = <input>/decoded
+            std::string input = this->get_parameter("input").as_string();
+            std::string output = this->get_parameter("output").as_string();
+            if (input.empty())
+                throw std::runtime_error("Set the input topic, e.g. -p input:=/picam_ros2/camera_0/model_lossless");
+            if (output.empty())
+                output = input + "/decoded";
+
+            auto qos = rclcpp::QoS(1);
+            qos.reliable();
+            qos.durability_volatile();
+            this->publisher = this->create_publisher<sensor_msgs::msg::Image>(output, qos);
+            this->subscription = this->create_subscription<sensor_msgs::msg::CompressedImage>(input, qos,
+                std::bind(&LosslessDecoder::decode, this, std::placeholders::_1));
+            RCLCPP_INFO(this->get_logger(), "Decoding %s to %s", input.c_str(), output.c_str());
+        }
+
+    private:
+        rclcpp::Subscription<sensor_msgs::msg::CompressedImage>::SharedPtr subscription;
+        rclcpp::Publisher<sensor_msgs::msg::Image>::SharedPtr publisher;
+        std::vector<picam_lossless::DecodedPlane> planes;
+
+        void decode(const sensor_msgs::msg::CompressedImage::SharedPtr msg) {
+            size_t suffix = msg->format.rfind(picam_lossless::FORMAT_SUFFIX);
+            if (suffix == std::string::npos) {
+                RCLCPP_WARN_ONCE(this->get_logger(), "Unsupported format '%s'", msg->format.c_str());
+                return;
+            }
+            if (!picam_lossless::decode(msg->data.data(), msg->data.size(), this->planes)) {
+                RCLCPP_WARN(this->get_logger(), "Malformed lossless frame");
+                return;
+            }
+
+            // planes back to back with packed rows, like the node's own yuv420 Image output
+            auto image = std::make_unique<sensor_msgs::msg::Image>();
+            image->header = msg->header;
+            image->encoding = msg->format.substr(0, suffix);
+            image->width = this->planes[0].width;
+            image->height = this->planes[0].height;
+            image->step = this->planes[0].width * this->planes[0].bytes_per_sample;
+            image->is_bigendian = false;
+            size_t size = 0;
+            for (auto &plane : this->planes)
+                size += plane.data.size();
+            image->data.reserve(size);
+            for (auto &plane : this->planes)
+                image->data.insert(image->data.end(), plane.data.begin(), plane.data.end());
+
+            this->publisher->publish(std::move(image));
+        }
+};
+
+int main(int argc, char *argv[]) {
+    rclcpp::init(argc, argv);
+    rclcpp::spin(std::make_shared<LosslessDecoder>());
+    rclcpp::shutdown();
+    return 0;
+}
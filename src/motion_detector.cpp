@@ -0,0 +1,143 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "picam_ros2/motion_detector.hpp"
+
+namespace motion_reference {
+
+void downsampleRow8(const uint8_t *src, uint8_t *dst, uint dst_width) {
+    for (uint x = 0; x < dst_width; x++) {
+        uint sum = 0;
+        for (uint i = 0; i < 8; i++)
+            sum += src[x * 8 + i];
+        dst[x] = (uint8_t) ((sum + 4) >> 3);
+    }
+}
+
+void absDiffRow(const uint8_t *a, const uint8_t *b, uint8_t *dst, uint width) {
+    for (uint x = 0; x < width; x++)
+        dst[x] = (uint8_t) std::abs(a[x] - b[x]);
+}
+
+}
+
+void downsampleRow8(const uint8_t *src, uint8_t *dst, uint dst_width) {
+    uint x = 0;
+#if defined(__aarch64__)
+    // 64 pixels in, 8 out: pairwise adds 2 -> 4 -> 8
+    for (; x + 8 <= dst_width; x += 8) {
+        const uint8_t *s = src + x * 8;
+        uint16x8_t a = vpaddlq_u8(vld1q_u8(s));
+        uint16x8_t b = vpaddlq_u8(vld1q_u8(s + 16));
+        uint16x8_t c = vpaddlq_u8(vld1q_u8(s + 32));
+        uint16x8_t d = vpaddlq_u8(vld1q_u8(s + 48));
+        uint16x8_t sums = vpaddq_u16(vpaddq_u16(a, b), vpaddq_u16(c, d));
+        vst1_u8(dst + x, vrshrn_n_u16(sums, 3));
+    }
+#endif
+    motion_reference::downsampleRow8(src + x * 8, dst + x, dst_width - x);
+}
+
+void absDiffRow(const uint8_t *a, const uint8_t *b, uint8_t *dst, uint width) {
+    uint x = 0;
+#if defined(__aarch64__)
+    for (; x + 16 <= width; x += 16)
+        vst1q_u8(dst + x, vabdq_u8(vld1q_u8(a + x), vld1q_u8(b + x)));
+#endif
+    motion_reference::absDiffRow(a + x, b + x, dst + x, width - x);
+}
+
+void MotionDetector::configure(uint cell_size, float threshold, uint min_cells, float scene_change_fraction, uint background_frames) {
+    this->configured_cell_thumbs = std::max(1u, (cell_size + SCALE / 2) / SCALE);
+    this->threshold = std::max(0.0f, threshold);
+    this->min_cells = std::max(1u, min_cells);
+    this->scene_change_fraction = std::clamp(scene_change_fraction, 0.0f, 1.0f);
+    this->decay = (uint32_t) std::clamp(std::lround(65536.0 / std::max(1u, background_frames)), 1l, 65536l);
+    this->width = 0; // regrid on the next frame
+    this->background_valid = false;
+}
+
+MotionResult MotionDetector::process(const uint8_t *y, uint stride, uint width, uint height) {
+    MotionResult result;
+
+    if (this->width != width || this->height != height) {
+        this->width = width;
+        this->height = height;
+        // partial cells at the right and bottom edges are left out
+        this->thumb_width = width / SCALE;
+        this->thumb_height = height / SCALE;
+        this->cell_thumbs = std::min({ this->configured_cell_thumbs, std::max(1u, this->thumb_width), std::max(1u, this->thumb_height) });
+        this->grid_width = this->thumb_width / this->cell_thumbs;
+        this->grid_height = this->thumb_height / this->cell_thumbs;
+        this->thumb.assign((size_t) this->thumb_width * this->thumb_height, 0);
+        this->background.assign(this->thumb.size(), 0);
+        this->background8.assign(this->thumb.size(), 0);
+        this->diff_row.assign(this->thumb_width, 0);
+        this->cell_sad.assign((size_t) this->grid_width * this->grid_height, 0);
+        this->mask.assign(this->cell_sad.size(), 0);
+        this->background_valid = false;
+    }
+    if (this->grid_width == 0 || this->grid_height == 0)
+        return result;
+
+    // one row from the middle of every 8, the horizontal average keeps the noise down
+    for (uint ty = 0; ty < this->thumb_height; ty++)
+        downsampleRow8(y + (size_t) (ty * SCALE + SCALE / 2) * stride, this->thumb.data() + (size_t) ty * this->thumb_width, this->thumb_width);
+
+    if (!this->background_valid) {
+        for (size_t i = 0; i < this->thumb.size(); i++) {
+            this->background[i] = (uint16_t) (this->thumb[i] << 8);
+            this->background8[i] = this->thumb[i];
+        }
+        std::fill(this->mask.begin(), this->mask.end(), 0);
+        this->background_valid = true;
+        result.scene_change = true;
+        result.motion = true;
+        return result;
+    }
+
+    std::fill(this->cell_sad.begin(), this->cell_sad.end(), 0);
+    uint used_width = this->grid_width * this->cell_thumbs;
+    for (uint ty = 0; ty < this->grid_height * this->cell_thumbs; ty++) {
+        size_t row = (size_t) ty * this->thumb_width;
+        absDiffRow(this->thumb.data() + row, this->background8.data() + row, this->diff_row.data(), used_width);
+        uint32_t *sad = this->cell_sad.data() + (size_t) (ty / this->cell_thumbs) * this->grid_width;
+        const uint8_t *diff = this->diff_row.data();
+        for (uint cx = 0; cx < this->grid_width; cx++) {
+            uint32_t sum = 0;
+            for (uint i = 0; i < this->cell_thumbs; i++)
+                sum += *diff++;
+            sad[cx] += sum;
+        }
+    }
+
+    uint32_t limit = (uint32_t) (this->threshold * this->cell_thumbs * this->cell_thumbs);
+    for (size_t i = 0; i < this->cell_sad.size(); i++) {
+        bool moving = this->cell_sad[i] > limit;
+        this->mask[i] = moving ? 255 : 0;
+        result.moving_cells += moving;
+    }
+    result.motion = result.moving_cells >= this->min_cells;
+    result.scene_change = result.moving_cells >= this->scene_change_fraction * this->cell_sad.size();
+
+    if (result.scene_change) {
+        // lights, exposure or a new view: start over from this frame instead of fading in
+        for (size_t i = 0; i < this->thumb.size(); i++) {
+            this->background[i] = (uint16_t) (this->thumb[i] << 8);
+            this->background8[i] = this->thumb[i];
+        }
+    } else {
+        for (size_t i = 0; i < this->thumb.size(); i++) {
+            int32_t delta = ((int32_t) this->thumb[i] << 8) - this->background[i];
+            this->background[i] = (uint16_t) (this->background[i] + (int32_t) (((int64_t) delta * this->decay) >> 16)); // |delta| 65280 x decay 65536 > int32
+            this->background8[i] = (uint8_t) ((this->background[i] + 128) >> 8);
+        }
+    }
+
+    return result;
+}
@@ -0,0 +1,85 @@
+#include <algorithm>
+#include <cmath>
+
+#include "picam_ros2/output_schedule.hpp"
+
+uint OutputSchedule::divisorFor(double rate, uint fps) {
+    if (rate <= 0.0 || fps == 0)
+        return 1;
+    return (uint) std::max(1L, std::lround(fps / rate));
+}
+
+void OutputClock::reset(uint fps) {
+    this->period_ns = fps > 0 ? 1e9 / fps : 0.0;
+    this->anchored = false;
+}
+
+uint64_t OutputClock::tick(uint sequence, uint64_t sensor_timestamp_ns) {
+    if (this->period_ns <= 0.0)
+        return sequence;
+    // frames within half a period of a tick get it, whichever camera took them
+    double clock_tick = (double) sensor_timestamp_ns / this->period_ns;
+    if (!this->anchored || std::fabs(clock_tick - (double) ((int64_t) sequence + this->offset)) > MAX_DRIFT) {
+        this->offset = std::llround(clock_tick) - (int64_t) sequence;
+        this->anchored = true;
+    }
+    return (uint64_t) ((int64_t) sequence + this->offset);
+}
+
+OutputPhaseAllocator &OutputPhaseAllocator::instance() {
+    static OutputPhaseAllocator allocator;
+    return allocator;
+}
+
+void OutputPhaseAllocator::addLoad(uint divisor, uint phase, int64_t weight) {
+    for (uint tick = phase; tick < PERIOD; tick += divisor)
+        this->load[tick] += weight;
+}
+
+uint OutputPhaseAllocator::allocate(int group, uint divisor, uint64_t weight) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    if (divisor <= 1)
+        return 0; // every frame, nothing to stagger
+
+    for (auto &allocation : this->allocations) {
+        if (allocation.group == group && allocation.divisor == divisor) {
+            allocation.weight += weight;
+            this->addLoad(divisor, allocation.phase, weight);
+            return allocation.phase;
+        }
+    }
+
+    // least loaded phase: lowest peak, then lowest total over its ticks
+    uint best_phase = 0;
+    uint64_t best_peak = UINT64_MAX, best_total = UINT64_MAX;
+    for (uint phase = 0; phase < std::min(divisor, PERIOD); phase++) {
+        uint64_t peak = 0, total = 0;
+        for (uint tick = phase; tick < PERIOD; tick += divisor) {
+            peak = std::max(peak, this->load[tick]);
+            total += this->load[tick];
+        }
+        if (peak < best_peak || (peak == best_peak && total < best_total)) {
+            best_phase = phase;
+            best_peak = peak;
+            best_total = total;
+        }
+    }
+
+    this->addLoad(divisor, best_phase, weight);
+    this->allocations.push_back({ group, divisor, best_phase, weight });
+    return best_phase;
+}
+
+void OutputPhaseAllocator::release(int group) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    for (auto it = this->allocations.begin(); it != this->allocations.end();) {
+        if (it->group == group) {
+            this->addLoad(it->divisor, it->phase, -(int64_t) it->weight);
+            it = this->allocations.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
@@ -0,0 +1,86 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#include "picam_ros2/phase_lock.hpp"
+
+void PhaseLockController::reset() {
+    this->pending.clear();
+    this->phase_error = 0;
+    this->frames_in_tolerance = 0;
+    this->is_locked = false;
+}
+
+int64_t PhaseLockController::update(uint64_t timestamp_ns, uint64_t leader_timestamp_ns, int64_t period_ns) {
+    if (period_ns <= 0)
+        return 0;
+
+    // offset from the nearest leader frame start, in [-period/2, period/2)
+    int64_t offset = (int64_t) (timestamp_ns - leader_timestamp_ns) % period_ns;
+    if (offset < -period_ns / 2)
+        offset += period_ns;
+    else if (offset >= period_ns / 2)
+        offset -= period_ns;
+    this->phase_error = offset;
+
+    if (std::llabs(offset) <= this->options.tolerance_ns) {
+        if (++this->frames_in_tolerance >= this->options.lock_frames)
+            this->is_locked = true;
+    } else {
+        this->frames_in_tolerance = 0;
+        if (std::llabs(offset) > 2 * this->options.tolerance_ns)
+            this->is_locked = false;
+    }
+
+    // a longer frame moves all following starts later, corrections still in flight will too
+    int64_t predicted = offset;
+    for (int64_t correction : this->pending)
+        predicted += correction;
+
+    // once locked only the slow drift between the sensor clocks is followed
+    double gain = this->is_locked ? this->options.gain * 0.25 : this->options.gain;
+    int64_t max_step = (int64_t) (period_ns * this->options.max_step);
+    int64_t correction = std::clamp<int64_t>((int64_t) std::llround(-gain * predicted), -max_step, max_step);
+
+    int64_t quantum = std::max<int64_t>(1, this->options.quantum_ns);
+    int64_t duration = (period_ns + correction + quantum / 2) / quantum * quantum;
+
+    this->pending.push_back(duration - period_ns);
+    while (this->pending.size() > this->options.control_delay)
+        this->pending.pop_front();
+    return duration;
+}
+
+std::shared_ptr<PhaseLockGroup> PhaseLockGroup::get(const std::string &name) {
+    static std::mutex groups_mutex;
+    static std::map<std::string, std::weak_ptr<PhaseLockGroup>> groups;
+
+    std::lock_guard<std::mutex> lock(groups_mutex);
+    auto group = groups[name].lock();
+    if (!group) {
+        group = std::make_shared<PhaseLockGroup>();
+        groups[name] = group;
+    }
+    return group;
+}
+
+void PhaseLockGroup::leaderFrame(uint64_t timestamp_ns) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->last_timestamp_ns) {
+        int64_t period = (int64_t) (timestamp_ns - this->last_timestamp_ns);
+        if (this->period_ns == 0)
+            this->period_ns = period;
+        else if (period < this->period_ns * 3 / 2) // skip gaps from dropped frames
+            this->period_ns += (period - this->period_ns) / 8;
+    }
+    this->last_timestamp_ns = timestamp_ns;
+}
+
+bool PhaseLockGroup::leaderReference(uint64_t &timestamp_ns, int64_t &period_ns) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (!this->period_ns)
+        return false;
+    timestamp_ns = this->last_timestamp_ns;
+    period_ns = this->period_ns;
+    return true;
+}
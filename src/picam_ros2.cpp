@@ -18,6 +18,8 @@
 
 #include "picam_ros2/picam_ros2.hpp"
 #include "picam_ros2/camera_interface.hpp"
+#include "picam_ros2/stereo_pipeline.hpp"
+#include "picam_ros2/composite_mixer.hpp"
 #include "picam_ros2/const.hpp"
 
 using namespace libcamera;
@@ -32,6 +34,12 @@ PicamROS2::PicamROS2(std::string node_name) : Node(node_name), count_(0)
     this->declare_parameter("calibration_pattern_size", std::vector<int>{ 9, 6 });
     this->declare_parameter("calibration_square_size_m", 0.019f);
     this->declare_parameter("calibration_files", "/calibration/");
+    this->declare_parameter("calibration_threads", 2); // corner detection workers per calibrating camera
+    this->declare_parameter("calibration_detector", "classic"); // classic or sb (findChessboardCornersSB)
+    this->declare_parameter("calibration_detect_width", 1280); // the board is searched on a pyramid level about this wide
+    this->declare_parameter("calibration_min_sharpness", 30.0); // Laplacian variance, blurrier samples are rejected
+    this->declare_parameter("stereo_pairs", std::vector<std::string>{}); // each configured in /stereo_<name>
+    this->declare_parameter("composites", std::vector<std::string>{}); // each configured in /composite_<name>
 }
 
 void reloadUdevRules() {
@@ -134,6 +142,66 @@ int main(int argc, char * argv[])
 
         auto cam_interface = std::make_shared<CameraInterface>(camera, location, rotation, model, node);
         camera_interfaces.push_back(cam_interface);
+    }
+
+    // stereo pairs get the frames of both their cameras, attached before the captures start
+    std::vector<std::shared_ptr<StereoPipeline>> stereo_pipelines;
+    for (auto &name : node->get_parameter("stereo_pairs").as_string_array()) {
+        auto config = StereoPipeline::readConfig(node, name);
+        std::shared_ptr<CameraInterface> left, right;
+        for (auto &cam_interface : camera_interfaces) {
+            if (cam_interface->getLocation() == config.left_location)
+                left = cam_interface;
+            if (cam_interface->getLocation() == config.right_location)
+                right = cam_interface;
+        }
+        if (!left || !right) {
+            std::cerr << RED << "Stereo pair " << name << ": camera at location " << (left ? config.right_location : config.left_location)
+                      << " not found or disabled; pair disabled" << CLR << std::endl;
+            continue;
+        }
+        try {
+            auto pipeline = std::make_shared<StereoPipeline>(node, config);
+            left->attachStereo(pipeline, StereoPipeline::LEFT);
+            right->attachStereo(pipeline, StereoPipeline::RIGHT);
+            stereo_pipelines.push_back(pipeline);
+        } catch (const std::runtime_error &e) {
+            std::cerr << RED << "Stereo pair " << name << ": " << e.what() << "; pair disabled" << CLR << std::endl;
+        }
+    }
+
+    // composites tile the frames of their cameras into one H.264 stream, encoded by the first camera
+    std::vector<std::shared_ptr<CompositeMixer>> composite_mixers;
+    for (auto &name : node->get_parameter("composites").as_string_array()) {
+        try {
+            auto config = CompositeMixer::readConfig(node, name);
+            std::vector<std::shared_ptr<CameraInterface>> members(config.locations.size());
+            for (auto &cam_interface : camera_interfaces) {
+                for (uint i = 0; i < config.locations.size(); i++) {
+                    if (cam_interface->getLocation() == config.locations[i])
+                        members[i] = cam_interface;
+                }
+            }
+            if (!members[0]) {
+                std::cerr << RED << "Composite " << name << ": camera at location " << config.locations[0]
+                          << " not found or disabled; composite disabled" << CLR << std::endl;
+                continue;
+            }
+            auto mixer = std::make_shared<CompositeMixer>(node, config);
+            for (uint i = 0; i < members.size(); i++) {
+                if (members[i])
+                    members[i]->attachComposite(mixer, i);
+                else
+                    std::cerr << YELLOW << "Composite " << name << ": camera at location " << config.locations[i]
+                              << " not found or disabled; its tile stays black" << CLR << std::endl;
+            }
+            composite_mixers.push_back(mixer);
+        } catch (const std::runtime_error &e) {
+            std::cerr << RED << "Composite " << name << ": " << e.what() << "; composite disabled" << CLR << std::endl;
+        }
+    }
+
+    for (auto &cam_interface : camera_interfaces) {
         cam_interface->start();
     }
 
@@ -146,6 +214,8 @@ int main(int argc, char * argv[])
     }
 
     camera_interfaces.clear();
+    stereo_pipelines.clear();
+    composite_mixers.clear();
 
     cm->stop();
     rclcpp::shutdown();
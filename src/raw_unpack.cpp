@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "picam_ros2/raw_unpack.hpp"
+
+RawFormat parseRawFormat(const std::string &pixel_format) {
+    RawFormat format;
+
+    // PiSP compressed, e.g. RGGB_PISP_COMP1
+    if (pixel_format.find("_PISP_COMP") != std::string::npos) {
+        format.order = pixel_format.substr(0, 4);
+        format.bits = 8;
+        format.compressed = true;
+        return format;
+    }
+
+    // S<order><bits>[_CSI2P]
+    if (pixel_format.size() < 6 || pixel_format[0] != 'S')
+        return format;
+    format.order = pixel_format.substr(1, 4);
+    size_t pos = 5;
+    while (pos < pixel_format.size() && isdigit(pixel_format[pos])) {
+        format.bits = format.bits * 10 + (pixel_format[pos] - '0');
+        pos++;
+    }
+    format.csi2_packed = pixel_format.compare(pos, std::string::npos, "_CSI2P") == 0;
+    return format;
+}
+
+bool RawFormat::supported() const {
+    if (this->compressed || this->order.size() != 4)
+        return false;
+    if (this->csi2_packed)
+        return this->bits == 10 || this->bits == 12;
+    return this->bits >= 8 && this->bits <= 16;
+}
+
+std::string RawFormat::encoding(bool out16) const {
+    std::string order = this->order;
+    std::transform(order.begin(), order.end(), order.begin(), ::tolower);
+    return "bayer_" + order + (out16 ? "16" : "8");
+}
+
+namespace raw_reference {
+
+void unpackRaw10Row16(const uint8_t *src, uint16_t *dst, uint width) {
+    for (uint x = 0; x < width; x++) {
+        const uint8_t *group = src + (x / 4) * 5;
+        uint lsb = (group[4] >> ((x % 4) * 2)) & 0x3;
+        dst[x] = (uint16_t) (((group[x % 4] << 2) | lsb) << 6);
+    }
+}
+
+void unpackRaw12Row16(const uint8_t *src, uint16_t *dst, uint width) {
+    for (uint x = 0; x < width; x++) {
+        const uint8_t *group = src + (x / 2) * 3;
+        uint lsb = (group[2] >> ((x % 2) * 4)) & 0xF;
+        dst[x] = (uint16_t) (((group[x % 2] << 4) | lsb) << 4);
+    }
+}
+
+void unpackRaw10Row8(const uint8_t *src, uint8_t *dst, uint width) {
+    for (uint x = 0; x < width; x++)
+        dst[x] = src[(x / 4) * 5 + x % 4];
+}
+
+void unpackRaw12Row8(const uint8_t *src, uint8_t *dst, uint width) {
+    for (uint x = 0; x < width; x++)
+        dst[x] = src[(x / 2) * 3 + x % 2];
+}
+
+}
+
+// The NEON loops take 8 samples per iteration and read 16 bytes at a time, so they stop
+// while a full vector load is still within the row; the scalar code finishes the tail.
+
+void unpackRaw10Row16(const uint8_t *src, uint16_t *dst, uint width) {
+    uint x = 0;
+#if defined(__aarch64__)
+    const uint8x8_t msb_idx = { 0, 1, 2, 3, 5, 6, 7, 8 };
+    const uint8x8_t lsb_idx = { 4, 4, 4, 4, 9, 9, 9, 9 };
+    const int16x8_t lsb_shift = { 0, -2, -4, -6, 0, -2, -4, -6 };
+    const uint16x8_t lsb_mask = vdupq_n_u16(0x3);
+    for (; x + 16 <= width; x += 8) {
+        uint8x16_t in = vld1q_u8(src + (x / 8) * 10);
+        uint16x8_t msb = vshll_n_u8(vqtbl1_u8(in, msb_idx), 8);
+        uint16x8_t lsb = vandq_u16(vshlq_u16(vmovl_u8(vqtbl1_u8(in, lsb_idx)), lsb_shift), lsb_mask);
+        vst1q_u16(dst + x, vorrq_u16(msb, vshlq_n_u16(lsb, 6)));
+    }
+#endif
+    raw_reference::unpackRaw10Row16(src + (x / 4) * 5, dst + x, width - x);
+}
+
+void unpackRaw12Row16(const uint8_t *src, uint16_t *dst, uint width) {
+    uint x = 0;
+#if defined(__aarch64__)
+    const uint8x8_t msb_idx = { 0, 1, 3, 4, 6, 7, 9, 10 };
+    const uint8x8_t lsb_idx = { 2, 2, 5, 5, 8, 8, 11, 11 };
+    const int16x8_t lsb_shift = { 0, -4, 0, -4, 0, -4, 0, -4 };
+    const uint16x8_t lsb_mask = vdupq_n_u16(0xF);
+    for (; x + 16 <= width; x += 8) {
+        uint8x16_t in = vld1q_u8(src + (x / 8) * 12);
+        uint16x8_t msb = vshll_n_u8(vqtbl1_u8(in, msb_idx), 8);
+        uint16x8_t lsb = vandq_u16(vshlq_u16(vmovl_u8(vqtbl1_u8(in, lsb_idx)), lsb_shift), lsb_mask);
+        vst1q_u16(dst + x, vorrq_u16(msb, vshlq_n_u16(lsb, 4)));
+    }
+#endif
+    raw_reference::unpackRaw12Row16(src + (x / 2) * 3, dst + x, width - x);
+}
+
+void unpackRaw10Row8(const uint8_t *src, uint8_t *dst, uint width) {
+    uint x = 0;
+#if defined(__aarch64__)
+    const uint8x8_t msb_idx = { 0, 1, 2, 3, 5, 6, 7, 8 };
+    for (; x + 16 <= width; x += 8)
+        vst1_u8(dst + x, vqtbl1_u8(vld1q_u8(src + (x / 8) * 10), msb_idx));
+#endif
+    raw_reference::unpackRaw10Row8(src + (x / 4) * 5, dst + x, width - x);
+}
+
+void unpackRaw12Row8(const uint8_t *src, uint8_t *dst, uint width) {
+    uint x = 0;
+#if defined(__aarch64__)
+    const uint8x8_t msb_idx = { 0, 1, 3, 4, 6, 7, 9, 10 };
+    for (; x + 16 <= width; x += 8)
+        vst1_u8(dst + x, vqtbl1_u8(vld1q_u8(src + (x / 8) * 12), msb_idx));
+#endif
+    raw_reference::unpackRaw12Row8(src + (x / 2) * 3, dst + x, width - x);
+}
+
+// unpacked samples are LSB aligned in little endian 16-bit words (8-bit ones in bytes)
+static void unpackPlainRow(const uint8_t *src, uint8_t *dst, uint width, uint bits, bool out16) {
+    if (bits == 8) {
+        if (!out16) {
+            memcpy(dst, src, width);
+            return;
+        }
+        uint16_t *dst16 = reinterpret_cast<uint16_t *>(dst);
+        for (uint x = 0; x < width; x++)
+            dst16[x] = (uint16_t) (src[x] << 8);
+        return;
+    }
+
+    const uint16_t *src16 = reinterpret_cast<const uint16_t *>(src);
+    if (out16) {
+        uint16_t *dst16 = reinterpret_cast<uint16_t *>(dst);
+        for (uint x = 0; x < width; x++)
+            dst16[x] = (uint16_t) (src16[x] << (16 - bits));
+    } else {
+        for (uint x = 0; x < width; x++)
+            dst[x] = (uint8_t) (src16[x] >> (bits - 8));
+    }
+}
+
+bool unpackRawFrame(const RawFormat &format, bool out16, const uint8_t *src, uint src_stride,
+                    uint width, uint height, uint8_t *dst, uint dst_step) {
+
+    if (!format.supported())
+        return false;
+
+    for (uint y = 0; y < height; y++) {
+        const uint8_t *src_row = src + (size_t) y * src_stride;
+        uint8_t *dst_row = dst + (size_t) y * dst_step;
+
+        if (!format.csi2_packed) {
+            unpackPlainRow(src_row, dst_row, width, format.bits, out16);
+        } else if (format.bits == 10) {
+            if (out16)
+                unpackRaw10Row16(src_row, reinterpret_cast<uint16_t *>(dst_row), width);
+            else
+                unpackRaw10Row8(src_row, dst_row, width);
+        } else {
+            if (out16)
+                unpackRaw12Row16(src_row, reinterpret_cast<uint16_t *>(dst_row), width);
+            else
+                unpackRaw12Row8(src_row, dst_row, width);
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,165 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <fstream>
+
+#include "picam_ros2/rectify.hpp"
+
+static const char RECTIFY_CACHE_MAGIC[8] = { 'P', 'C', 'R', 'E', 'C', 'T', '0', '1' };
+
+struct RectifyCacheHeader {
+    char magic[8];
+    uint32_t width, height;
+    uint64_t calibration_hash;
+    double new_camera_matrix[9];
+};
+
+RectifyMaps::~RectifyMaps() {
+    if (this->mapping)
+        munmap(this->mapping, this->mapping_size);
+}
+
+uint64_t RectifyMaps::calibrationHash(const cv::Mat &camera_matrix, const cv::Mat &dist_coeffs, cv::Size size) {
+    // FNV-1a over the intrinsics, distortion and frame size
+    uint64_t hash = 14695981039346656037ull;
+    auto add = [&](const void *data, size_t len) {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        for (size_t i = 0; i < len; i++) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ull;
+        }
+    };
+    for (const cv::Mat *m : { &camera_matrix, &dist_coeffs }) {
+        cv::Mat values;
+        m->convertTo(values, CV_64F);
+        for (auto it = values.begin<double>(); it != values.end<double>(); ++it)
+            add(&*it, sizeof(double));
+    }
+    add(&size.width, sizeof(size.width));
+    add(&size.height, sizeof(size.height));
+    return hash;
+}
+
+std::shared_ptr<RectifyMaps> RectifyMaps::build(const cv::Mat &camera_matrix, const cv::Mat &dist_coeffs, cv::Size size) {
+    auto maps = std::make_shared<RectifyMaps>();
+    maps->size = size;
+    maps->calibration_hash = calibrationHash(camera_matrix, dist_coeffs, size);
+    maps->new_camera_matrix = cv::getOptimalNewCameraMatrix(camera_matrix, dist_coeffs, size, 0.0);
+
+    cv::initUndistortRectifyMap(camera_matrix, dist_coeffs, cv::Mat(), maps->new_camera_matrix, size, CV_16SC2, maps->y_map1, maps->y_map2);
+
+    // chroma planes sample pixel centres at half resolution
+    auto halve = [](const cv::Mat &m) {
+        cv::Mat half = m.clone();
+        half.at<double>(0, 0) *= 0.5;
+        half.at<double>(1, 1) *= 0.5;
+        half.at<double>(0, 2) = (half.at<double>(0, 2) + 0.5) * 0.5 - 0.5;
+        half.at<double>(1, 2) = (half.at<double>(1, 2) + 0.5) * 0.5 - 0.5;
+        return half;
+    };
+    cv::Mat k;
+    camera_matrix.convertTo(k, CV_64F);
+    cv::initUndistortRectifyMap(halve(k), dist_coeffs, cv::Mat(), halve(maps->new_camera_matrix), cv::Size(size.width / 2, size.height / 2),
+                                CV_16SC2, maps->uv_map1, maps->uv_map2);
+    return maps;
+}
+
+std::shared_ptr<RectifyMaps> RectifyMaps::load(const std::string &cache_file, const cv::Mat &camera_matrix, const cv::Mat &dist_coeffs, cv::Size size) {
+    int fd = open(cache_file.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat st;
+    size_t y_pixels = (size_t) size.width * size.height, uv_pixels = y_pixels / 4;
+    size_t expected_size = sizeof(RectifyCacheHeader) + y_pixels * 6 + uv_pixels * 6;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size != expected_size) {
+        close(fd);
+        return nullptr;
+    }
+
+    void *mapping = mmap(nullptr, expected_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return nullptr;
+
+    const RectifyCacheHeader *header = static_cast<const RectifyCacheHeader *>(mapping);
+    if (memcmp(header->magic, RECTIFY_CACHE_MAGIC, sizeof(RECTIFY_CACHE_MAGIC)) != 0
+        || (int) header->width != size.width || (int) header->height != size.height
+        || header->calibration_hash != calibrationHash(camera_matrix, dist_coeffs, size)) {
+        munmap(mapping, expected_size);
+        return nullptr; // stale
+    }
+
+    auto maps = std::make_shared<RectifyMaps>();
+    maps->mapping = mapping;
+    maps->mapping_size = expected_size;
+    maps->size = size;
+    maps->calibration_hash = header->calibration_hash;
+    maps->new_camera_matrix = cv::Mat(3, 3, CV_64F, const_cast<double *>(header->new_camera_matrix)).clone();
+
+    // the maps are only ever read
+    uint8_t *data = static_cast<uint8_t *>(mapping) + sizeof(RectifyCacheHeader);
+    cv::Size uv_size(size.width / 2, size.height / 2);
+    maps->y_map1 = cv::Mat(size, CV_16SC2, data);
+    data += y_pixels * 4;
+    maps->y_map2 = cv::Mat(size, CV_16UC1, data);
+    data += y_pixels * 2;
+    maps->uv_map1 = cv::Mat(uv_size, CV_16SC2, data);
+    data += uv_pixels * 4;
+    maps->uv_map2 = cv::Mat(uv_size, CV_16UC1, data);
+    return maps;
+}
+
+bool RectifyMaps::save(const std::string &cache_file) const {
+    RectifyCacheHeader header {};
+    memcpy(header.magic, RECTIFY_CACHE_MAGIC, sizeof(RECTIFY_CACHE_MAGIC));
+    header.width = this->size.width;
+    header.height = this->size.height;
+    header.calibration_hash = this->calibration_hash;
+    for (int i = 0; i < 9; i++)
+        header.new_camera_matrix[i] = this->new_camera_matrix.at<double>(i / 3, i % 3);
+
+    // written aside and renamed, a running node may have the old file mapped
+    std::string tmp_file = cache_file + ".tmp";
+    {
+        std::ofstream out(tmp_file, std::ios::binary | std::ios::trunc);
+        if (!out.is_open())
+            return false;
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        for (const cv::Mat *map : { &this->y_map1, &this->y_map2, &this->uv_map1, &this->uv_map2 }) {
+            cv::Mat continuous = map->isContinuous() ? *map : map->clone();
+            out.write(reinterpret_cast<const char *>(continuous.data), continuous.total() * continuous.elemSize());
+        }
+        if (!out.good())
+            return false;
+    }
+    return rename(tmp_file.c_str(), cache_file.c_str()) == 0;
+}
+
+static void remapTiled(const cv::Mat &src, cv::Mat &dst, const cv::Mat &map1, const cv::Mat &map2, uint8_t border) {
+    const int tile_rows = 32;
+    int tiles = (dst.rows + tile_rows - 1) / tile_rows;
+    cv::parallel_for_(cv::Range(0, tiles), [&](const cv::Range &range) {
+        for (int tile = range.start; tile < range.end; tile++) {
+            cv::Range rows(tile * tile_rows, std::min(dst.rows, (tile + 1) * tile_rows));
+            cv::Mat dst_tile = dst.rowRange(rows);
+            cv::remap(src, dst_tile, map1.rowRange(rows), map2.rowRange(rows), cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar(border));
+        }
+    });
+}
+
+void RectifyMaps::remap(const std::vector<uint8_t *> &planes, const std::vector<uint> &strides,
+                        const std::vector<uint8_t *> &dst_planes, const std::vector<uint> &dst_strides) const {
+    cv::Size uv_size(this->size.width / 2, this->size.height / 2);
+    for (uint j = 0; j < 3; j++) {
+        cv::Size plane_size = j == 0 ? this->size : uv_size;
+        cv::Mat src(plane_size, CV_8UC1, planes[j], strides[j]);
+        cv::Mat dst(plane_size, CV_8UC1, dst_planes[j], dst_strides[j]);
+        if (j == 0)
+            remapTiled(src, dst, this->y_map1, this->y_map2, 0);
+        else
+            remapTiled(src, dst, this->uv_map1, this->uv_map2, 128);
+    }
+}
@@ -0,0 +1,96 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+
+#include "picam_ros2/shm_frame_ring.hpp"
+
+namespace picam_shm {
+
+FrameReader::FrameReader(const std::string &name) {
+    this->fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (this->fd < 0)
+        return;
+
+    struct stat st;
+    if (fstat(this->fd, &st) < 0 || (size_t) st.st_size < RING_HEADER_SIZE)
+        return;
+
+    void *memory = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, this->fd, 0);
+    if (memory == MAP_FAILED)
+        return;
+    this->memory = static_cast<uint8_t *>(memory);
+    this->mapped_size = st.st_size;
+
+    const RingHeader *header = reinterpret_cast<const RingHeader *>(this->memory);
+    if (header->magic != RING_MAGIC || header->version != RING_VERSION
+        || RING_HEADER_SIZE + header->slot_count * header->slot_size > this->mapped_size)
+        return;
+    this->header = header;
+}
+
+FrameReader::~FrameReader() {
+    if (this->memory)
+        munmap(this->memory, this->mapped_size);
+    if (this->fd >= 0)
+        close(this->fd);
+}
+
+uint64_t FrameReader::latestFrameNumber() const {
+    if (!this->header)
+        return 0;
+    return this->header->frames_written.load(std::memory_order_acquire);
+}
+
+bool FrameReader::beginRead(uint64_t after_frame_number, FrameView &view, uint64_t &seq) const {
+    uint64_t latest = this->latestFrameNumber();
+    if (latest == 0 || latest <= after_frame_number)
+        return false;
+
+    const uint8_t *slot = this->memory + RING_HEADER_SIZE + ((latest - 1) % this->header->slot_count) * this->header->slot_size;
+    const SlotHeader *slot_header = reinterpret_cast<const SlotHeader *>(slot);
+
+    seq = slot_header->seqlock.load(std::memory_order_acquire);
+    if (seq & 1) // being written
+        return false;
+
+    view.frame_number = slot_header->frame_number;
+    view.timestamp_ns = slot_header->timestamp_ns;
+    view.sensor_timestamp_ns = slot_header->sensor_timestamp_ns;
+    view.sequence = slot_header->sequence;
+    view.width = this->header->width;
+    view.height = this->header->height;
+    view.format = std::string(this->header->format, strnlen(this->header->format, sizeof(this->header->format)));
+    view.plane_count = this->header->plane_count;
+    for (uint32_t i = 0; i < view.plane_count && i < MAX_PLANES; i++) {
+        view.planes[i] = slot + SLOT_HEADER_SIZE + this->header->plane_offsets[i];
+        view.strides[i] = this->header->strides[i];
+        view.plane_sizes[i] = this->header->plane_sizes[i];
+    }
+    return view.frame_number > after_frame_number;
+}
+
+bool FrameReader::endRead(const FrameView &view, uint64_t seq) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const uint8_t *slot = this->memory + RING_HEADER_SIZE + ((view.frame_number - 1) % this->header->slot_count) * this->header->slot_size;
+    const SlotHeader *slot_header = reinterpret_cast<const SlotHeader *>(slot);
+    return slot_header->seqlock.load(std::memory_order_relaxed) == seq;
+}
+
+bool FrameReader::copyLatest(uint64_t after_frame_number, FrameView &meta, std::vector<uint8_t> &data) const {
+    return this->readLatest(after_frame_number, [&](const FrameView &view) {
+        size_t total = 0;
+        for (uint32_t i = 0; i < view.plane_count; i++)
+            total += view.plane_sizes[i];
+        data.resize(total);
+        size_t offset = 0;
+        for (uint32_t i = 0; i < view.plane_count; i++) {
+            memcpy(data.data() + offset, view.planes[i], view.plane_sizes[i]);
+            offset += view.plane_sizes[i];
+        }
+        meta = view;
+    });
+}
+
+} // namespace picam_shm
@@ -0,0 +1,89 @@
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+#include "picam_ros2/shm_frame_writer.hpp"
+
+ShmFrameWriter::ShmFrameWriter(const std::string &name, const MappedBuffer &layout, uint width, uint height,
+                               const std::string &format, const std::string &frame_id, uint slot_count) {
+    this->name = name;
+
+    uint plane_count = std::min<size_t>(layout.planes.size(), picam_shm::MAX_PLANES);
+    size_t data_size = 0;
+    for (uint i = 0; i < plane_count; i++)
+        data_size += layout.plane_sizes[i];
+    size_t slot_size = (picam_shm::SLOT_HEADER_SIZE + data_size + 4095) & ~size_t(4095);
+    this->mapped_size = picam_shm::RING_HEADER_SIZE + slot_count * slot_size;
+
+    // replace whatever a previous run left behind, readers holding it keep their mapping
+    shm_unlink(name.c_str());
+    this->fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (this->fd < 0)
+        throw std::runtime_error("Failed to create shared memory " + name);
+    if (ftruncate(this->fd, this->mapped_size) < 0)
+        throw std::runtime_error("Failed to size shared memory " + name);
+
+    void *memory = mmap(NULL, this->mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+    if (memory == MAP_FAILED)
+        throw std::runtime_error("Failed to map shared memory " + name);
+    this->memory = static_cast<uint8_t *>(memory);
+
+    // fresh pages are zeroed, so frames_written and all seqlocks start at 0
+    this->header = new (this->memory) picam_shm::RingHeader();
+    this->header->version = picam_shm::RING_VERSION;
+    this->header->slot_count = slot_count;
+    this->header->slot_size = slot_size;
+    this->header->width = width;
+    this->header->height = height;
+    this->header->plane_count = plane_count;
+    uint offset = 0;
+    for (uint i = 0; i < plane_count; i++) {
+        this->header->strides[i] = layout.strides[i];
+        this->header->plane_offsets[i] = offset;
+        this->header->plane_sizes[i] = layout.plane_sizes[i];
+        offset += layout.plane_sizes[i];
+    }
+    strncpy(this->header->format, format.c_str(), sizeof(this->header->format) - 1);
+    strncpy(this->header->frame_id, frame_id.c_str(), sizeof(this->header->frame_id) - 1);
+    this->header->frames_written.store(0, std::memory_order_relaxed);
+    for (uint i = 0; i < slot_count; i++)
+        new (this->memory + picam_shm::RING_HEADER_SIZE + i * slot_size) picam_shm::SlotHeader();
+
+    // magic last, readers check it before trusting the rest
+    std::atomic_thread_fence(std::memory_order_release);
+    this->header->magic = picam_shm::RING_MAGIC;
+}
+
+ShmFrameWriter::~ShmFrameWriter() {
+    if (this->memory)
+        munmap(this->memory, this->mapped_size);
+    if (this->fd >= 0) {
+        close(this->fd);
+        shm_unlink(this->name.c_str());
+    }
+}
+
+void ShmFrameWriter::write(const FrameHandle &frame, int64_t sensor_timestamp_ns, uint32_t sequence) {
+    uint64_t frame_number = this->header->frames_written.load(std::memory_order_relaxed) + 1;
+    uint8_t *slot = this->memory + picam_shm::RING_HEADER_SIZE + ((frame_number - 1) % this->header->slot_count) * this->header->slot_size;
+    picam_shm::SlotHeader *slot_header = reinterpret_cast<picam_shm::SlotHeader *>(slot);
+
+    // odd = writing
+    uint64_t seq = slot_header->seqlock.load(std::memory_order_relaxed);
+    slot_header->seqlock.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot_header->frame_number = frame_number;
+    slot_header->timestamp_ns = frame.timestamp_ns;
+    slot_header->sensor_timestamp_ns = sensor_timestamp_ns;
+    slot_header->sequence = sequence;
+    for (uint i = 0; i < this->header->plane_count; i++)
+        memcpy(slot + picam_shm::SLOT_HEADER_SIZE + this->header->plane_offsets[i], frame.mapped->planes[i], this->header->plane_sizes[i]);
+
+    slot_header->seqlock.store(seq + 2, std::memory_order_release);
+    this->header->frames_written.store(frame_number, std::memory_order_release);
+}
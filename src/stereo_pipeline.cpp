@@ -0,0 +1,322 @@
+#include <cstring>
+
+#include "picam_ros2/stereo_pipeline.hpp"
+#include "picam_ros2/image_output.hpp"
+
+using namespace std::chrono_literals;
+
+template<typename T>
+static void declareParameter(std::shared_ptr<PicamROS2> node, const std::string &name, const T &default_value) {
+    if (!node->has_parameter(name))
+        node->declare_parameter(name, default_value);
+}
+
+StereoConfig StereoPipeline::readConfig(std::shared_ptr<PicamROS2> node, const std::string &name) {
+    auto prefix = GetConfigPrefix(name);
+    StereoConfig config;
+    config.name = name;
+
+    declareParameter(node, prefix + "left_location", -1);
+    declareParameter(node, prefix + "right_location", -1);
+    config.left_location = node->get_parameter(prefix + "left_location").as_int();
+    config.right_location = node->get_parameter(prefix + "right_location").as_int();
+    if (config.left_location < 0 || config.right_location < 0 || config.left_location == config.right_location)
+        throw std::runtime_error(fmt::format("Stereo pair {} needs two different camera locations in left_location and right_location", name));
+
+    declareParameter(node, prefix + "sync_tolerance_ms", 5.0);
+    config.sync_tolerance_ns = (long) (node->get_parameter(prefix + "sync_tolerance_ms").as_double() * 1e6);
+
+    declareParameter(node, prefix + "algorithm", "bm");
+    auto algorithm = node->get_parameter(prefix + "algorithm").as_string();
+    if (algorithm != "bm" && algorithm != "sgbm")
+        throw std::runtime_error(fmt::format("Invalid stereo algorithm '{}' for {}, use bm or sgbm", algorithm, name));
+    config.use_sgbm = algorithm == "sgbm";
+
+    declareParameter(node, prefix + "num_disparities", 64);
+    declareParameter(node, prefix + "block_size", config.use_sgbm ? 5 : 15);
+    config.num_disparities = node->get_parameter(prefix + "num_disparities").as_int();
+    config.block_size = node->get_parameter(prefix + "block_size").as_int();
+    if (config.num_disparities <= 0 || config.num_disparities % 16 != 0)
+        throw std::runtime_error(fmt::format("num_disparities of {} must be a positive multiple of 16", name));
+    if (config.block_size < 1 || config.block_size % 2 == 0)
+        throw std::runtime_error(fmt::format("block_size of {} must be odd", name));
+
+    declareParameter(node, prefix + "threads", 2);
+    config.threads = (uint) std::max<int64_t>(1, node->get_parameter(prefix + "threads").as_int());
+
+    auto calibration_files = node->get_parameter("calibration_files").as_string();
+    if (!calibration_files.empty() && calibration_files.back() != '/')
+        calibration_files += '/';
+    declareParameter(node, prefix + "calibration_file", fmt::format("{}stereo-{}.json", calibration_files, name));
+    config.calibration_file = node->get_parameter(prefix + "calibration_file").as_string();
+
+    declareParameter(node, prefix + "topic_prefix", fmt::format("/picam_ros2/stereo_{}/", name));
+    config.topic_prefix = node->get_parameter(prefix + "topic_prefix").as_string();
+    declareParameter(node, prefix + "left_frame_id", fmt::format("{}_left_optical_frame", name));
+    declareParameter(node, prefix + "right_frame_id", fmt::format("{}_right_optical_frame", name));
+    config.left_frame_id = node->get_parameter(prefix + "left_frame_id").as_string();
+    config.right_frame_id = node->get_parameter(prefix + "right_frame_id").as_string();
+
+    return config;
+}
+
+StereoPipeline::StereoPipeline(std::shared_ptr<PicamROS2> node, const StereoConfig &config) {
+    this->node = node;
+    this->config = config;
+
+    if (!readStereoCalibration(config.calibration_file, this->calibration))
+        throw std::runtime_error(fmt::format("Failed to load stereo calibration {}", config.calibration_file));
+
+    // both images rectified into a common plane with the principal points aligned
+    auto &c = this->calibration;
+    cv::Mat left_rotation, right_rotation, left_projection, right_projection, disparity_to_depth;
+    cv::Rect left_valid, right_valid;
+    cv::stereoRectify(c.left_camera_matrix, c.left_dist_coeffs, c.right_camera_matrix, c.right_dist_coeffs, c.size,
+                      c.rotation, c.translation, left_rotation, right_rotation, left_projection, right_projection, disparity_to_depth,
+                      cv::CALIB_ZERO_DISPARITY, 0.0, c.size, &left_valid, &right_valid);
+    cv::initUndistortRectifyMap(c.left_camera_matrix, c.left_dist_coeffs, left_rotation, left_projection, c.size, CV_16SC2,
+                                this->left_map1, this->left_map2);
+    cv::initUndistortRectifyMap(c.right_camera_matrix, c.right_dist_coeffs, right_rotation, right_projection, c.size, CV_16SC2,
+                                this->right_map1, this->right_map2);
+    this->valid_disparity = cv::getValidDisparityROI(left_valid, right_valid, 0, config.num_disparities, config.block_size);
+    this->focal_length = (float) left_projection.at<double>(0, 0);
+    this->baseline = (float) (-right_projection.at<double>(0, 3) / right_projection.at<double>(0, 0));
+    this->left_info_msg = this->rectifiedInfo(c.left_camera_matrix, c.left_dist_coeffs, left_rotation, left_projection, config.left_frame_id);
+    this->right_info_msg = this->rectifiedInfo(c.right_camera_matrix, c.right_dist_coeffs, right_rotation, right_projection, config.right_frame_id);
+
+    auto qos = rclcpp::QoS(1);
+    qos.reliable();
+    qos.durability_volatile();
+    this->left_publisher = node->create_publisher<sensor_msgs::msg::Image>(config.topic_prefix + "left/image_rect", qos);
+    this->right_publisher = node->create_publisher<sensor_msgs::msg::Image>(config.topic_prefix + "right/image_rect", qos);
+    this->left_info_publisher = node->create_publisher<sensor_msgs::msg::CameraInfo>(config.topic_prefix + "left/camera_info", qos);
+    this->right_info_publisher = node->create_publisher<sensor_msgs::msg::CameraInfo>(config.topic_prefix + "right/camera_info", qos);
+    this->disparity_publisher = node->create_publisher<stereo_msgs::msg::DisparityImage>(config.topic_prefix + "disparity", qos);
+
+    this->rings[LEFT] = std::make_unique<SpscRing<Frame>>(RING_CAPACITY);
+    this->rings[RIGHT] = std::make_unique<SpscRing<Frame>>(RING_CAPACITY);
+    for (uint i = 0; i < config.threads; i++)
+        this->workers.emplace_back(&StereoPipeline::workerLoop, this);
+    this->match_thread = std::thread(&StereoPipeline::matchLoop, this);
+
+    RCLCPP_INFO(rclcpp::get_logger("rclcpp"), "Stereo pair %s: cameras %d (left) and %d (right), baseline %.3f m, publishing on %s",
+                config.name.c_str(), config.left_location, config.right_location, this->baseline, config.topic_prefix.c_str());
+}
+
+StereoPipeline::~StereoPipeline() {
+    this->stopping = true;
+    this->wake_cond.notify_all();
+    if (this->match_thread.joinable())
+        this->match_thread.join();
+    {
+        std::lock_guard<std::mutex> lock(this->queue_mutex);
+        this->queue.clear();
+    }
+    this->queue_cond.notify_all();
+    for (auto &worker : this->workers)
+        worker.join();
+
+    RCLCPP_INFO(rclcpp::get_logger("rclcpp"), "Stereo pair %s: %lu pairs published, %lu dropped while busy, %lu frames without a partner",
+                this->config.name.c_str(), (unsigned long) this->pairs_published, (unsigned long) this->pairs_dropped, (unsigned long) this->frames_unmatched);
+}
+
+sensor_msgs::msg::CameraInfo StereoPipeline::rectifiedInfo(const cv::Mat &camera_matrix, const cv::Mat &dist_coeffs, const cv::Mat &rotation,
+                                                           const cv::Mat &projection, const std::string &frame_id) {
+    sensor_msgs::msg::CameraInfo info;
+    info.header.frame_id = frame_id;
+    info.width = this->calibration.size.width;
+    info.height = this->calibration.size.height;
+    applyCalibration(camera_matrix, dist_coeffs, info);
+    for (int i = 0; i < 9; i++)
+        info.r[i] = rotation.at<double>(i / 3, i % 3);
+    for (int i = 0; i < 12; i++)
+        info.p[i] = projection.at<double>(i / 4, i % 4);
+    return info;
+}
+
+void StereoPipeline::pushFrame(Side side, const uint8_t *y, uint stride, uint width, uint height, uint64_t sensor_timestamp_ns, long timestamp_ns) {
+    if ((int) width != this->calibration.size.width || (int) height != this->calibration.size.height) {
+        if (!this->size_mismatch_logged.exchange(true))
+            RCLCPP_ERROR(rclcpp::get_logger("rclcpp"), "Stereo pair %s is calibrated for %dx%d, camera delivers %ux%u; not processing",
+                         this->config.name.c_str(), this->calibration.size.width, this->calibration.size.height, width, height);
+        return;
+    }
+
+    Frame *slot = this->rings[side]->beginWrite();
+    if (!slot) {
+        this->frames_unmatched++; // matcher behind
+        return;
+    }
+    slot->y.resize((size_t) width * height);
+    for (uint row = 0; row < height; row++)
+        memcpy(slot->y.data() + (size_t) row * width, y + (size_t) row * stride, width);
+    slot->sensor_timestamp_ns = sensor_timestamp_ns;
+    slot->timestamp_ns = timestamp_ns;
+    this->rings[side]->endWrite();
+    this->wake_cond.notify_one();
+}
+
+std::vector<uint8_t> StereoPipeline::takeBuffer() {
+    std::lock_guard<std::mutex> lock(this->buffers_mutex);
+    if (this->spare_buffers.empty())
+        return {}; // sized by the next capture thread that fills it
+    std::vector<uint8_t> buffer = std::move(this->spare_buffers.back());
+    this->spare_buffers.pop_back();
+    return buffer;
+}
+
+void StereoPipeline::returnBuffer(std::vector<uint8_t> &&buffer) {
+    std::lock_guard<std::mutex> lock(this->buffers_mutex);
+    this->spare_buffers.push_back(std::move(buffer));
+}
+
+void StereoPipeline::matchLoop() {
+    auto &left_ring = *this->rings[LEFT];
+    auto &right_ring = *this->rings[RIGHT];
+
+    while (!this->stopping) {
+        {
+            std::unique_lock<std::mutex> lock(this->wake_mutex);
+            this->wake_cond.wait_for(lock, 10ms, [&] { return this->stopping || (left_ring.front() && right_ring.front()); });
+        }
+
+        Frame *left, *right;
+        while ((left = left_ring.front()) && (right = right_ring.front())) {
+            // the older frame of a pair too far apart has lost its partner
+            int64_t dt = (int64_t) (left->sensor_timestamp_ns - right->sensor_timestamp_ns);
+            if (dt > this->config.sync_tolerance_ns) {
+                right_ring.pop();
+                this->frames_unmatched++;
+                continue;
+            }
+            if (dt < -this->config.sync_tolerance_ns) {
+                left_ring.pop();
+                this->frames_unmatched++;
+                continue;
+            }
+
+            // the frame copies move to the worker, the slots get recycled buffers
+            bool queued = false;
+            {
+                std::lock_guard<std::mutex> lock(this->queue_mutex);
+                if (this->queue.size() < this->workers.size()) {
+                    Pair pair;
+                    pair.left.y = this->takeBuffer();
+                    pair.left.y.swap(left->y);
+                    pair.left.sensor_timestamp_ns = left->sensor_timestamp_ns;
+                    pair.left.timestamp_ns = left->timestamp_ns;
+                    pair.right.y = this->takeBuffer();
+                    pair.right.y.swap(right->y);
+                    pair.right.sensor_timestamp_ns = right->sensor_timestamp_ns;
+                    pair.right.timestamp_ns = right->timestamp_ns;
+                    this->queue.push_back(std::move(pair));
+                    queued = true;
+                }
+            }
+            left_ring.pop();
+            right_ring.pop();
+            if (queued)
+                this->queue_cond.notify_one();
+            else
+                this->pairs_dropped++;
+        }
+    }
+}
+
+void StereoPipeline::initWorker(Worker &worker) {
+    int block = this->config.block_size;
+    if (this->config.use_sgbm)
+        worker.matcher = cv::StereoSGBM::create(0, this->config.num_disparities, block, 8 * block * block, 32 * block * block,
+                                                1, 0, 10, 100, 2, cv::StereoSGBM::MODE_SGBM_3WAY);
+    else
+        worker.matcher = cv::StereoBM::create(this->config.num_disparities, block);
+
+    const cv::Size size = this->calibration.size;
+    worker.disparity_fixed.create(size, CV_16SC1);
+    for (auto *msg : { &worker.left_msg, &worker.right_msg }) {
+        msg->width = size.width;
+        msg->height = size.height;
+        msg->encoding = "mono8";
+        msg->is_bigendian = false;
+        msg->step = size.width;
+        msg->data.resize((size_t) size.area());
+    }
+    worker.left_msg.header.frame_id = this->config.left_frame_id;
+    worker.right_msg.header.frame_id = this->config.right_frame_id;
+
+    auto &disparity_msg = worker.disparity_msg;
+    disparity_msg.header.frame_id = this->config.left_frame_id;
+    disparity_msg.image.header.frame_id = this->config.left_frame_id;
+    disparity_msg.image.width = size.width;
+    disparity_msg.image.height = size.height;
+    disparity_msg.image.encoding = "32FC1";
+    disparity_msg.image.is_bigendian = false;
+    disparity_msg.image.step = size.width * sizeof(float);
+    disparity_msg.image.data.resize((size_t) disparity_msg.image.step * size.height);
+    disparity_msg.f = this->focal_length;
+    disparity_msg.t = this->baseline;
+    disparity_msg.valid_window.x_offset = this->valid_disparity.x;
+    disparity_msg.valid_window.y_offset = this->valid_disparity.y;
+    disparity_msg.valid_window.width = this->valid_disparity.width;
+    disparity_msg.valid_window.height = this->valid_disparity.height;
+    disparity_msg.min_disparity = 0.0f;
+    disparity_msg.max_disparity = (float) (this->config.num_disparities - 1);
+    disparity_msg.delta_d = 1.0f / 16.0f;
+
+    worker.left_info = this->left_info_msg;
+    worker.right_info = this->right_info_msg;
+}
+
+void StereoPipeline::workerLoop() {
+    Worker worker;
+    this->initWorker(worker);
+
+    while (true) {
+        Pair pair;
+        {
+            std::unique_lock<std::mutex> lock(this->queue_mutex);
+            this->queue_cond.wait(lock, [this] { return this->stopping || !this->queue.empty(); });
+            if (this->stopping)
+                return;
+            pair = std::move(this->queue.front());
+            this->queue.pop_front();
+        }
+        this->process(pair, worker);
+        this->returnBuffer(std::move(pair.left.y));
+        this->returnBuffer(std::move(pair.right.y));
+    }
+}
+
+void StereoPipeline::process(Pair &pair, Worker &worker) {
+    const cv::Size size = this->calibration.size;
+
+    // rectified straight into the message buffers, all sized in initWorker
+    auto &left_msg = worker.left_msg, &right_msg = worker.right_msg;
+    setCurrentStamp(&left_msg.header.stamp, pair.left.timestamp_ns);
+    right_msg.header.stamp = left_msg.header.stamp;
+
+    cv::Mat left(size, CV_8UC1, pair.left.y.data()), right(size, CV_8UC1, pair.right.y.data());
+    cv::Mat left_rect(size, CV_8UC1, left_msg.data.data()), right_rect(size, CV_8UC1, right_msg.data.data());
+    cv::remap(left, left_rect, this->left_map1, this->left_map2, cv::INTER_LINEAR);
+    cv::remap(right, right_rect, this->right_map1, this->right_map2, cv::INTER_LINEAR);
+
+    worker.matcher->compute(left_rect, right_rect, worker.disparity_fixed);
+
+    auto &disparity_msg = worker.disparity_msg;
+    disparity_msg.header.stamp = left_msg.header.stamp;
+    disparity_msg.image.header.stamp = left_msg.header.stamp;
+    cv::Mat disparity(size, CV_32FC1, disparity_msg.image.data.data());
+    worker.disparity_fixed.convertTo(disparity, CV_32F, 1.0 / 16.0); // invalid pixels end up below min_disparity
+
+    worker.left_info.header.stamp = left_msg.header.stamp;
+    worker.right_info.header.stamp = left_msg.header.stamp;
+
+    if (rclcpp::ok()) {
+        this->left_publisher->publish(left_msg);
+        this->right_publisher->publish(right_msg);
+        this->left_info_publisher->publish(worker.left_info);
+        this->right_info_publisher->publish(worker.right_info);
+        this->disparity_publisher->publish(disparity_msg);
+    }
+    this->pairs_published++;
+}
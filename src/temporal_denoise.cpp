@@ -0,0 +1,80 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "picam_ros2/temporal_denoise.hpp"
+
+namespace denoise_reference {
+
+void denoiseRow(uint8_t *cur, uint8_t *prev, uint width, uint8_t base_weight, uint8_t threshold) {
+    for (uint x = 0; x < width; x++) {
+        int diff = std::abs(cur[x] - prev[x]);
+        uint weight = std::min(16, base_weight + std::max(0, diff - threshold));
+        uint8_t out = (uint8_t) ((prev[x] * (16 - weight) + cur[x] * weight + 8) >> 4);
+        cur[x] = out;
+        prev[x] = out;
+    }
+}
+
+}
+
+void denoiseRow(uint8_t *cur, uint8_t *prev, uint width, uint8_t base_weight, uint8_t threshold) {
+    uint x = 0;
+#if defined(__aarch64__)
+    const uint8x16_t base_v = vdupq_n_u8(base_weight);
+    const uint8x16_t threshold_v = vdupq_n_u8(threshold);
+    const uint8x16_t full_v = vdupq_n_u8(16);
+    for (; x + 16 <= width; x += 16) {
+        uint8x16_t c = vld1q_u8(cur + x);
+        uint8x16_t p = vld1q_u8(prev + x);
+        uint8x16_t weight = vminq_u8(vqaddq_u8(base_v, vqsubq_u8(vabdq_u8(c, p), threshold_v)), full_v);
+        uint8x16_t inv_weight = vsubq_u8(full_v, weight);
+        uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(p), vget_low_u8(inv_weight)), vget_low_u8(c), vget_low_u8(weight));
+        uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(p), vget_high_u8(inv_weight)), vget_high_u8(c), vget_high_u8(weight));
+        uint8x16_t out = vcombine_u8(vrshrn_n_u16(lo, 4), vrshrn_n_u16(hi, 4));
+        vst1q_u8(cur + x, out);
+        vst1q_u8(prev + x, out);
+    }
+#endif
+    denoise_reference::denoiseRow(cur + x, prev + x, width - x, base_weight, threshold);
+}
+
+void TemporalDenoiser::configure(float strength, uint threshold) {
+    strength = std::clamp(strength, 0.0f, 1.0f);
+    this->base_weight = (uint8_t) std::clamp((int) std::lround(16.0f * (1.0f - strength)), 1, 16);
+    this->threshold = (uint8_t) std::min(threshold, 255u);
+}
+
+void TemporalDenoiser::process(const std::vector<uint8_t *> &planes, const std::vector<uint> &strides, uint width, uint height) {
+
+    if (this->base_weight >= 16)
+        return; // strength 0
+
+    if (this->history_width != width || this->history_height != height) {
+        this->history.resize((size_t) width * height * 3 / 2);
+        this->history_width = width;
+        this->history_height = height;
+        this->history_valid = false;
+    }
+
+    uint8_t *history_plane = this->history.data();
+    for (uint j = 0; j < 3; j++) {
+        uint plane_width = j == 0 ? width : width / 2;
+        uint plane_height = j == 0 ? height : height / 2;
+        for (uint y = 0; y < plane_height; y++) {
+            uint8_t *row = planes[j] + (size_t) y * strides[j];
+            uint8_t *history_row = history_plane + (size_t) y * plane_width;
+            if (this->history_valid)
+                denoiseRow(row, history_row, plane_width, this->base_weight, this->threshold);
+            else
+                memcpy(history_row, row, plane_width); // first frame seeds the history
+        }
+        history_plane += (size_t) plane_width * plane_height;
+    }
+
+    this->history_valid = true;
+}
@@ -0,0 +1,344 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "picam_ros2/tensor_packer.hpp"
+
+namespace tensor_reference {
+
+// round to nearest even, like the hardware conversion
+uint16_t floatToHalf(float value) {
+    uint32_t x;
+    memcpy(&x, &value, sizeof(x));
+    uint16_t sign = (uint16_t) ((x >> 16) & 0x8000);
+    x &= 0x7fffffff;
+
+    if (x >= 0x7f800000) // inf, nan
+        return sign | 0x7c00 | (x > 0x7f800000 ? 0x200 : 0);
+    if (x >= 0x477ff000) // rounds above 65504
+        return sign | 0x7c00;
+
+    if (x < 0x38800000) { // half subnormals, 2^-24 units
+        if (x < 0x33000000)
+            return sign;
+        uint32_t mantissa = (x & 0x7fffff) | 0x800000;
+        uint shift = 126 - (x >> 23);
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1)))
+            half++;
+        return sign | (uint16_t) half;
+    }
+
+    uint32_t half = (x >> 13) - ((127 - 15) << 10);
+    uint32_t rest = x & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++;
+    return sign | (uint16_t) half;
+}
+
+void tensorNormalizeRow(const float *y, const float *u, const float *v, uint width, const TensorRowCoeffs &k,
+                        float *c0, float *c1, float *c2) {
+    const TensorRowCoeffs c = k; // the stores can't alias a local copy
+    for (uint x = 0; x < width; x++) {
+        const float luma = (y[x] - c.y_offset) * c.y_scale;
+        const float cu = u[x] - 128.0f, cv = v[x] - 128.0f;
+        c0[x] = std::min(std::max(luma + c.u[0] * cu + c.v[0] * cv, 0.0f), 255.0f) * c.gain[0] + c.bias[0];
+        c1[x] = std::min(std::max(luma + c.u[1] * cu + c.v[1] * cv, 0.0f), 255.0f) * c.gain[1] + c.bias[1];
+        c2[x] = std::min(std::max(luma + c.u[2] * cu + c.v[2] * cv, 0.0f), 255.0f) * c.gain[2] + c.bias[2];
+    }
+}
+
+void interleave3Row(const float *c0, const float *c1, const float *c2, float *dst, uint width) {
+    for (uint x = 0; x < width; x++) {
+        dst[x * 3] = c0[x];
+        dst[x * 3 + 1] = c1[x];
+        dst[x * 3 + 2] = c2[x];
+    }
+}
+
+void floatToHalfRow(const float *src, uint16_t *dst, uint count) {
+    for (uint i = 0; i < count; i++)
+        dst[i] = floatToHalf(src[i]);
+}
+
+void saturateRowS8(const float *src, int8_t *dst, uint count) {
+    for (uint i = 0; i < count; i++)
+        dst[i] = (int8_t) std::clamp(std::nearbyint(src[i]), -128.0f, 127.0f);
+}
+
+void saturateRowU8(const float *src, uint8_t *dst, uint count) {
+    for (uint i = 0; i < count; i++)
+        dst[i] = (uint8_t) std::clamp(std::nearbyint(src[i]), 0.0f, 255.0f);
+}
+
+}
+
+void tensorNormalizeRow(const float *y, const float *u, const float *v, uint width, const TensorRowCoeffs &k,
+                        float *c0, float *c1, float *c2) {
+    uint x = 0;
+#if defined(__aarch64__)
+    const float32x4_t y_offset = vdupq_n_f32(k.y_offset), c_offset = vdupq_n_f32(128.0f);
+    const float32x4_t lo = vdupq_n_f32(0.0f), hi = vdupq_n_f32(255.0f);
+    float *out[3] = { c0, c1, c2 };
+    for (; x + 4 <= width; x += 4) {
+        float32x4_t luma = vmulq_n_f32(vsubq_f32(vld1q_f32(y + x), y_offset), k.y_scale);
+        float32x4_t cu = vsubq_f32(vld1q_f32(u + x), c_offset);
+        float32x4_t cv = vsubq_f32(vld1q_f32(v + x), c_offset);
+        for (uint c = 0; c < 3; c++) {
+            float32x4_t value = vminq_f32(vmaxq_f32(vmlaq_n_f32(vmlaq_n_f32(luma, cu, k.u[c]), cv, k.v[c]), lo), hi);
+            vst1q_f32(out[c] + x, vmlaq_n_f32(vdupq_n_f32(k.bias[c]), value, k.gain[c]));
+        }
+    }
+#endif
+    tensor_reference::tensorNormalizeRow(y + x, u + x, v + x, width - x, k, c0 + x, c1 + x, c2 + x);
+}
+
+void interleave3Row(const float *c0, const float *c1, const float *c2, float *dst, uint width) {
+    uint x = 0;
+#if defined(__aarch64__)
+    for (; x + 4 <= width; x += 4) {
+        float32x4x3_t px = { { vld1q_f32(c0 + x), vld1q_f32(c1 + x), vld1q_f32(c2 + x) } };
+        vst3q_f32(dst + x * 3, px);
+    }
+#endif
+    tensor_reference::interleave3Row(c0 + x, c1 + x, c2 + x, dst + x * 3, width - x);
+}
+
+void floatToHalfRow(const float *src, uint16_t *dst, uint count) {
+    uint i = 0;
+#if defined(__aarch64__)
+    for (; i + 4 <= count; i += 4)
+        vst1_u16(dst + i, vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(src + i))));
+#endif
+    tensor_reference::floatToHalfRow(src + i, dst + i, count - i);
+}
+
+void saturateRowS8(const float *src, int8_t *dst, uint count) {
+    uint i = 0;
+#if defined(__aarch64__)
+    for (; i + 8 <= count; i += 8) {
+        int16x8_t q = vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(vld1q_f32(src + i))),
+                                   vqmovn_s32(vcvtnq_s32_f32(vld1q_f32(src + i + 4))));
+        vst1_s8(dst + i, vqmovn_s16(q));
+    }
+#endif
+    tensor_reference::saturateRowS8(src + i, dst + i, count - i);
+}
+
+void saturateRowU8(const float *src, uint8_t *dst, uint count) {
+    uint i = 0;
+#if defined(__aarch64__)
+    for (; i + 8 <= count; i += 8) {
+        int16x8_t q = vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(vld1q_f32(src + i))),
+                                   vqmovn_s32(vcvtnq_s32_f32(vld1q_f32(src + i + 4))));
+        vst1_u8(dst + i, vqmovun_s16(q));
+    }
+#endif
+    tensor_reference::saturateRowU8(src + i, dst + i, count - i);
+}
+
+// chroma weights of R, G and B
+template <class M>
+static void yuvCoefficients(TensorRowCoeffs &k, float u[3], float v[3]) {
+    k.y_offset = (float) M::y_offset;
+    k.y_scale = (float) M::y_scale;
+    u[0] = 0.0f;
+    v[0] = (float) (2.0 * (1.0 - M::kr) * M::c_scale);
+    u[1] = (float) (-2.0 * (1.0 - M::kb) * M::kb / M::kg * M::c_scale);
+    v[1] = (float) (-2.0 * (1.0 - M::kr) * M::kr / M::kg * M::c_scale);
+    u[2] = (float) (2.0 * (1.0 - M::kb) * M::c_scale);
+    v[2] = 0.0f;
+}
+
+// bilinear taps with pixel centers aligned, dst_size samples over src_size
+static void bilinearTaps(uint dst_size, uint src_size, std::vector<uint32_t> &i0, std::vector<uint32_t> &i1, std::vector<float> &f) {
+    i0.resize(dst_size);
+    i1.resize(dst_size);
+    f.resize(dst_size);
+    const double step = (double) src_size / dst_size;
+    for (uint i = 0; i < dst_size; i++) {
+        double s = std::clamp((i + 0.5) * step - 0.5, 0.0, (double) src_size - 1.0);
+        i0[i] = (uint32_t) s;
+        i1[i] = std::min(i0[i] + 1, src_size - 1);
+        f[i] = (float) (s - i0[i]);
+    }
+}
+
+uint TensorPacker::elementSize(uint dtype) {
+    switch (dtype) {
+        case TENSOR_DTYPE::FLOAT32: return 4;
+        case TENSOR_DTYPE::FLOAT16: return 2;
+        default: return 1;
+    }
+}
+
+void TensorPacker::configure(const TensorSpec &spec, uint src_width, uint src_height, uint color_matrix) {
+    this->spec = spec;
+    this->src_width = src_width;
+    this->src_height = src_height;
+
+    if (spec.letterbox) {
+        double scale = std::min((double) spec.width / src_width, (double) spec.height / src_height);
+        this->content_width = std::clamp((uint) std::lround(src_width * scale), 1u, spec.width);
+        this->content_height = std::clamp((uint) std::lround(src_height * scale), 1u, spec.height);
+    } else {
+        this->content_width = spec.width;
+        this->content_height = spec.height;
+    }
+    this->content_x = (spec.width - this->content_width) / 2;
+    this->content_y = (spec.height - this->content_height) / 2;
+
+    bilinearTaps(this->content_width, src_width, this->x0, this->x1, this->fx);
+    bilinearTaps(this->content_width, (src_width + 1) / 2, this->cx0, this->cx1, this->cfx);
+    bilinearTaps(this->content_height, src_height, this->y0, this->y1, this->fy);
+    bilinearTaps(this->content_height, (src_height + 1) / 2, this->cy0, this->cy1, this->cfy);
+
+    float rgb_u[3], rgb_v[3];
+    switch (color_matrix) {
+        case COLOR_MATRIX::BT601_FULL: yuvCoefficients<picam_conv::BT601Full>(this->coeffs, rgb_u, rgb_v); break;
+        case COLOR_MATRIX::BT709_LIMITED: yuvCoefficients<picam_conv::BT709Limited>(this->coeffs, rgb_u, rgb_v); break;
+        case COLOR_MATRIX::BT709_FULL: yuvCoefficients<picam_conv::BT709Full>(this->coeffs, rgb_u, rgb_v); break;
+        default: yuvCoefficients<picam_conv::BT601Limited>(this->coeffs, rgb_u, rgb_v); break;
+    }
+
+    // v = (rgb / 255 - mean) / std, quantized q = v / scale + zero point
+    const bool quantized = spec.dtype == TENSOR_DTYPE::INT8 || spec.dtype == TENSOR_DTYPE::UINT8;
+    const float q_gain = quantized ? 1.0f / spec.quant_scale : 1.0f;
+    const float q_bias = quantized ? (float) spec.quant_zero_point : 0.0f;
+    for (uint c = 0; c < 3; c++) {
+        uint source = spec.bgr ? 2 - c : c;
+        this->coeffs.u[c] = rgb_u[source];
+        this->coeffs.v[c] = rgb_v[source];
+        this->coeffs.gain[c] = q_gain / (255.0f * spec.std[source]);
+        this->coeffs.bias[c] = q_gain * (-spec.mean[source] / spec.std[source]) + q_bias;
+    }
+
+    this->row_y.resize(this->content_width);
+    this->row_u.resize(this->content_width);
+    this->row_v.resize(this->content_width);
+    for (auto &row : this->row_c)
+        row.resize(this->content_width);
+    this->row_interleaved.resize(spec.layout == TENSOR_LAYOUT::NHWC ? this->content_width * 3 : 0);
+}
+
+size_t TensorPacker::size() const {
+    return (size_t) this->spec.width * this->spec.height * 3 * elementSize(this->spec.dtype);
+}
+
+void TensorPacker::store(const float *src, uint8_t *dst, size_t count) const {
+    switch (this->spec.dtype) {
+        case TENSOR_DTYPE::FLOAT32: memcpy(dst, src, count * sizeof(float)); break;
+        case TENSOR_DTYPE::FLOAT16: floatToHalfRow(src, reinterpret_cast<uint16_t *>(dst), count); break;
+        case TENSOR_DTYPE::INT8: saturateRowS8(src, reinterpret_cast<int8_t *>(dst), count); break;
+        default: saturateRowU8(src, dst, count); break;
+    }
+}
+
+void TensorPacker::fillPadding(uint8_t *dst) const {
+    const uint w = this->spec.width, h = this->spec.height;
+    if (this->content_width == w && this->content_height == h)
+        return;
+    const uint esize = elementSize(this->spec.dtype);
+    const uint right = this->content_x + this->content_width;
+
+    float pad[3];
+    for (uint c = 0; c < 3; c++)
+        pad[c] = std::clamp((float) this->spec.pad, 0.0f, 255.0f) * this->coeffs.gain[c] + this->coeffs.bias[c];
+
+    // [begin, end) columns of a row, everything outside the content area
+    auto spans = [&](uint row, auto &&fill) {
+        if (row < this->content_y || row >= this->content_y + this->content_height) {
+            fill(0, w);
+            return;
+        }
+        fill(0, this->content_x);
+        fill(right, w);
+    };
+
+    if (this->spec.layout == TENSOR_LAYOUT::NHWC) {
+        std::vector<float> row((size_t) w * 3);
+        for (uint x = 0; x < w; x++)
+            std::copy(pad, pad + 3, row.begin() + x * 3);
+        for (uint y = 0; y < h; y++) {
+            spans(y, [&](uint begin, uint end) {
+                if (end > begin)
+                    this->store(row.data(), dst + ((size_t) y * w + begin) * 3 * esize, (size_t) (end - begin) * 3);
+            });
+        }
+        return;
+    }
+
+    std::vector<float> row(w);
+    for (uint c = 0; c < 3; c++) {
+        std::fill(row.begin(), row.end(), pad[c]);
+        uint8_t *plane = dst + (size_t) c * w * h * esize;
+        for (uint y = 0; y < h; y++) {
+            spans(y, [&](uint begin, uint end) {
+                if (end > begin)
+                    this->store(row.data(), plane + ((size_t) y * w + begin) * esize, end - begin);
+            });
+        }
+    }
+}
+
+void TensorPacker::sampleRow(const picam_conv::YuvPlanes &src, uint row) {
+    const uint8_t *ya = src.y + (size_t) this->y0[row] * src.y_stride;
+    const uint8_t *yb = src.y + (size_t) this->y1[row] * src.y_stride;
+    const uint8_t *ua = src.u + (size_t) this->cy0[row] * src.u_stride;
+    const uint8_t *ub = src.u + (size_t) this->cy1[row] * src.u_stride;
+    const uint8_t *va = src.v + (size_t) this->cy0[row] * src.v_stride;
+    const uint8_t *vb = src.v + (size_t) this->cy1[row] * src.v_stride;
+    const float wy = this->fy[row], wc = this->cfy[row];
+
+    for (uint i = 0; i < this->content_width; i++) {
+        const uint32_t xa = this->x0[i], xb = this->x1[i];
+        const float w = this->fx[i];
+        const float top = ya[xa] + (ya[xb] - ya[xa]) * w;
+        const float bottom = yb[xa] + (yb[xb] - yb[xa]) * w;
+        this->row_y[i] = top + (bottom - top) * wy;
+
+        const uint32_t ca = this->cx0[i], cb = this->cx1[i];
+        const float cw = this->cfx[i];
+        const float u_top = ua[ca] + (ua[cb] - ua[ca]) * cw;
+        const float u_bottom = ub[ca] + (ub[cb] - ub[ca]) * cw;
+        this->row_u[i] = u_top + (u_bottom - u_top) * wc;
+        const float v_top = va[ca] + (va[cb] - va[ca]) * cw;
+        const float v_bottom = vb[ca] + (vb[cb] - vb[ca]) * cw;
+        this->row_v[i] = v_top + (v_bottom - v_top) * wc;
+    }
+}
+
+void TensorPacker::pack(const picam_conv::YuvPlanes &src, uint8_t *dst) {
+    const uint w = this->spec.width;
+    const size_t plane = (size_t) w * this->spec.height;
+    const uint esize = elementSize(this->spec.dtype);
+    const bool planar = this->spec.layout == TENSOR_LAYOUT::NCHW;
+    const bool direct = planar && this->spec.dtype == TENSOR_DTYPE::FLOAT32; // normalized straight into the planes
+    const uint n = this->content_width;
+
+    for (uint row = 0; row < this->content_height; row++) {
+        this->sampleRow(src, row);
+        const size_t offset = (size_t) (this->content_y + row) * w + this->content_x; // elements, of one plane
+
+        float *c[3];
+        for (uint ch = 0; ch < 3; ch++)
+            c[ch] = direct ? reinterpret_cast<float *>(dst) + ch * plane + offset : this->row_c[ch].data();
+        tensorNormalizeRow(this->row_y.data(), this->row_u.data(), this->row_v.data(), n, this->coeffs, c[0], c[1], c[2]);
+        if (direct)
+            continue;
+
+        if (planar) {
+            for (uint ch = 0; ch < 3; ch++)
+                this->store(c[ch], dst + (ch * plane + offset) * esize, n);
+        } else {
+            interleave3Row(c[0], c[1], c[2], this->row_interleaved.data(), n);
+            this->store(this->row_interleaved.data(), dst + offset * 3 * esize, (size_t) n * 3);
+        }
+    }
+}
@@ -0,0 +1,86 @@
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <filesystem>
+#include <linux/videodev2.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "picam_ros2/v4l2_m2m.hpp"
+
+const std::vector<V4L2Codec> V4L2_CODECS = {
+	{ "h264", V4L2_PIX_FMT_H264, "h.264", true },
+	{ "hevc", V4L2_PIX_FMT_HEVC, "hevc", true },
+	{ "fwht", V4L2_PIX_FMT_FWHT, "fwht", false }, // the kernel's vicodec, for testing without hardware
+};
+
+const V4L2Codec *findV4L2Codec(const std::string &name)
+{
+	for (const auto &codec : V4L2_CODECS) {
+		if (codec.name == name)
+			return &codec;
+	}
+	return nullptr;
+}
+
+int xioctl(int fd, unsigned long ctl, void *arg)
+{
+	int ret, num_tries = 10;
+	do
+	{
+		ret = ioctl(fd, ctl, arg);
+	} while (ret == -1 && errno == EINTR && num_tries-- > 0);
+	return ret;
+}
+
+bool isM2MEncoder(int fd, uint32_t pixel_format)
+{
+	v4l2_capability caps = {};
+	if (xioctl(fd, VIDIOC_QUERYCAP, &caps) < 0)
+		return false;
+	uint32_t device_caps = (caps.capabilities & V4L2_CAP_DEVICE_CAPS) ? caps.device_caps : caps.capabilities;
+	if (!(device_caps & V4L2_CAP_VIDEO_M2M_MPLANE) || !(device_caps & V4L2_CAP_STREAMING))
+		return false;
+
+	auto hasFormat = [fd](v4l2_buf_type type, uint32_t format) {
+		v4l2_fmtdesc desc = {};
+		desc.type = type;
+		for (desc.index = 0; xioctl(fd, VIDIOC_ENUM_FMT, &desc) == 0; desc.index++) {
+			if (desc.pixelformat == format)
+				return true;
+		}
+		return false;
+	};
+	return hasFormat(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, pixel_format)
+		&& hasFormat(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, V4L2_PIX_FMT_YUV420);
+}
+
+int openEncoderDevice(const std::string &device_path, uint32_t pixel_format, std::string &opened_path)
+{
+	std::vector<std::string> candidates;
+	if (!device_path.empty()) {
+		candidates.push_back(device_path);
+	} else {
+		std::error_code ec;
+		for (const auto &entry : std::filesystem::directory_iterator("/dev", ec)) {
+			if (entry.path().filename().string().rfind("video", 0) == 0)
+				candidates.push_back(entry.path().string());
+		}
+		// natural order, so that /dev/video2 comes before /dev/video10
+		std::sort(candidates.begin(), candidates.end(), [](const std::string &a, const std::string &b) {
+			return a.size() != b.size() ? a.size() < b.size() : a < b;
+		});
+	}
+
+	for (const auto &path : candidates) {
+		int fd = open(path.c_str(), O_RDWR, 0);
+		if (fd < 0)
+			continue;
+		if (isM2MEncoder(fd, pixel_format)) {
+			opened_path = path;
+			return fd;
+		}
+		close(fd);
+	}
+	return -1;
+}
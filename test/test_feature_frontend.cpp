@@ -0,0 +1,97 @@
+// Feature frontend on a synthetic panning texture: tracks keep their ids and follow the
+// known motion, new features respect the spacing and the budget
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <map>
+#include <set>
+
+#include "picam_ros2/feature_frontend.hpp"
+
+static const cv::Point2f STEP(1.5f, 0.7f); // px per frame
+
+// Blurred noise texture translated by STEP per frame
+static std::vector<cv::Mat> panningSequence(int frames) {
+    cv::Mat texture(600, 800, CV_8UC1);
+    cv::RNG rng(7);
+    rng.fill(texture, cv::RNG::UNIFORM, 0, 256);
+    cv::GaussianBlur(texture, texture, cv::Size(0, 0), 2.0);
+    cv::normalize(texture, texture, 0, 255, cv::NORM_MINMAX);
+
+    std::vector<cv::Mat> sequence;
+    for (int i = 0; i < frames; i++) {
+        cv::Mat shift = (cv::Mat_<double>(2, 3) << 1, 0, -40 + STEP.x * i, 0, 1, -40 + STEP.y * i);
+        cv::Mat frame;
+        cv::warpAffine(texture, frame, shift, cv::Size(640, 480), cv::INTER_LINEAR);
+        sequence.push_back(frame);
+    }
+    return sequence;
+}
+
+TEST(FeatureFrontend, TracksFollowMotion) {
+    FeatureOptions options;
+    FeatureFrontend frontend(options);
+    auto sequence = panningSequence(12);
+
+    std::map<uint64_t, cv::Point2f> previous;
+    for (size_t i = 0; i < sequence.size(); i++) {
+        auto &features = frontend.process(sequence[i]);
+        ASSERT_LE(features.size(), options.max_features);
+        ASSERT_GE(features.size(), options.max_features / 2) << "frame " << i;
+
+        std::set<uint64_t> ids;
+        std::vector<float> errors;
+        std::map<uint64_t, cv::Point2f> current;
+        for (auto &feature : features) {
+            ASSERT_TRUE(ids.insert(feature.id).second) << "duplicate id " << feature.id;
+            current[feature.id] = feature.point;
+            auto before = previous.find(feature.id);
+            if (feature.age > 0) {
+                ASSERT_TRUE(before != previous.end()) << "tracked feature " << feature.id << " wasn't in the last frame";
+                errors.push_back((float) cv::norm(feature.point - before->second - STEP));
+            } else {
+                EXPECT_TRUE(before == previous.end()) << "new feature reused id " << feature.id;
+            }
+        }
+
+        if (i > 0) {
+            EXPECT_GE(frontend.tracked(), previous.size() * 8 / 10) << "frame " << i;
+            ASSERT_FALSE(errors.empty());
+            std::nth_element(errors.begin(), errors.begin() + errors.size() / 2, errors.end());
+            EXPECT_LT(errors[errors.size() / 2], 0.2f) << "median tracking error, frame " << i;
+        }
+        previous.swap(current);
+    }
+}
+
+TEST(FeatureFrontend, SpacingAndDescriptors) {
+    FeatureOptions options;
+    FeatureFrontend frontend(options);
+    auto sequence = panningSequence(3);
+    for (auto &frame : sequence) {
+        auto &features = frontend.process(frame);
+        for (size_t a = 0; a < features.size(); a++)
+            for (size_t b = a + 1; b < features.size(); b++)
+                ASSERT_GE(cv::norm(features[a].point - features[b].point), options.min_distance * 0.99);
+        ASSERT_EQ(frontend.descriptors().rows, (int) features.size());
+        ASSERT_EQ(frontend.descriptors().cols, 32);
+        EXPECT_GT(cv::countNonZero(frontend.descriptors().col(0)) + cv::countNonZero(frontend.descriptors().col(1)), 0);
+    }
+}
+
+TEST(FeatureFrontend, ResetStartsOver) {
+    FeatureOptions options;
+    options.descriptors = false;
+    FeatureFrontend frontend(options);
+    auto sequence = panningSequence(3);
+    frontend.process(sequence[0]);
+    frontend.process(sequence[1]);
+    EXPECT_GT(frontend.tracked(), 0u);
+    EXPECT_TRUE(frontend.descriptors().empty());
+
+    frontend.reset();
+    auto &features = frontend.process(sequence[2]);
+    EXPECT_EQ(frontend.tracked(), 0u);
+    for (auto &feature : features)
+        EXPECT_EQ(feature.age, 0u);
+}
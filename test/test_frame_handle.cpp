@@ -0,0 +1,194 @@
+// Frame lifetime across consumer threads: the release callback runs exactly once per frame,
+// only after the last holder (capture, readers, an encoder queue) dropped its reference and
+// never inside a CpuAccess window. The windows need a dma-buf, from /dev/dma_heap/system.
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <linux/dma-heap.h>
+#include <mutex>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "picam_ros2/frame_handle.hpp"
+
+static constexpr uint FRAMES = 300;
+static constexpr uint READERS = 3; // publishers, calibration and the like, each on its own thread
+static constexpr uint ENCODER_DEPTH = 3; // frames an encoder keeps queued to the hardware
+static constexpr size_t BUFFER_SIZE = 64 << 10;
+
+struct FrameProbe {
+    std::atomic<int> released { 0 };
+    std::atomic<int> holders { 0 }; // references handed out and not dropped yet
+    std::atomic<int> windows { 0 }; // CpuAccess windows open
+    std::atomic<bool> early { false }; // released while held or accessed
+    std::atomic<bool> wrong_request { false };
+};
+
+// Holders give up their count before the reference, so the last one sees zero when it releases
+static void drop(FramePtr &frame, FrameProbe &probe) {
+    probe.holders--;
+    frame.reset();
+}
+
+static void readFrame(FramePtr frame, FrameProbe &probe, uint seed, bool cpu_access) {
+    if (cpu_access) {
+        FrameHandle::CpuAccess outer(*frame);
+        probe.windows++;
+        {
+            FrameHandle::CpuAccess inner(*frame, seed % 2); // a write upgrade half of the time
+            probe.windows++;
+            volatile uint8_t pixel = frame->mapped->memory[seed % frame->mapped->size];
+            (void) pixel;
+            std::this_thread::yield();
+            probe.windows--;
+        }
+        probe.windows--;
+    }
+    std::this_thread::yield();
+    drop(frame, probe);
+}
+
+// Takes frames off a queue like the encoder thread, keeps the last few in flight
+struct TestEncoder {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::pair<FramePtr, FrameProbe *>> queue;
+    bool stop = false;
+    std::thread thread;
+
+    TestEncoder(bool cpu_access) : thread(&TestEncoder::run, this, cpu_access) {}
+
+    void push(FramePtr frame, FrameProbe *probe) {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->queue.emplace_back(std::move(frame), probe);
+        this->cv.notify_one();
+    }
+
+    void finish() {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stop = true;
+            this->cv.notify_one();
+        }
+        this->thread.join();
+    }
+
+    void run(bool cpu_access) {
+        std::deque<std::pair<FramePtr, FrameProbe *>> in_flight;
+        while (true) {
+            std::pair<FramePtr, FrameProbe *> item;
+            {
+                std::unique_lock<std::mutex> lock(this->mutex);
+                this->cv.wait(lock, [this] { return this->stop || !this->queue.empty(); });
+                if (this->queue.empty())
+                    break;
+                item = std::move(this->queue.front());
+                this->queue.pop_front();
+            }
+            if (cpu_access) {
+                FrameHandle::CpuAccess access(*item.first);
+                item.second->windows++;
+                std::this_thread::yield();
+                item.second->windows--;
+            }
+            in_flight.push_back(std::move(item));
+            if (in_flight.size() > ENCODER_DEPTH) {
+                drop(in_flight.front().first, *in_flight.front().second);
+                in_flight.pop_front();
+            }
+        }
+        for (auto &item : in_flight)
+            drop(item.first, *item.second);
+    }
+};
+
+static void runConsumers(libcamera::FrameBuffer &buffer, const MappedBuffer &mapped, bool cpu_access) {
+    std::vector<FrameProbe> probes(FRAMES);
+    DmaSyncStats stats;
+    TestEncoder encoder(cpu_access);
+    std::vector<std::thread> readers;
+
+    for (uint n = 0; n < FRAMES; n++) {
+        FrameProbe &probe = probes[n];
+        // the request pointer is only handed back, never used
+        auto *request = reinterpret_cast<libcamera::Request *>(&probe);
+        auto release = [&probe, request](libcamera::Request *released) {
+            if (probe.holders > 0 || probe.windows > 0)
+                probe.early = true;
+            if (released != request)
+                probe.wrong_request = true;
+            probe.released++;
+        };
+        FramePtr frame = std::make_shared<FrameHandle>(request, &buffer, &mapped, (long) n, release, &stats);
+
+        // capture thread, readers and the encoder
+        probe.holders = 1 + READERS + 1;
+        for (uint i = 0; i < READERS; i++)
+            readers.emplace_back(readFrame, frame, std::ref(probe), n * READERS + i, cpu_access);
+        encoder.push(frame, &probe);
+        drop(frame, probe);
+
+        if (readers.size() >= 4 * READERS) {
+            for (auto &reader : readers)
+                reader.join();
+            readers.clear();
+        }
+    }
+    for (auto &reader : readers)
+        reader.join();
+    encoder.finish();
+
+    for (uint n = 0; n < FRAMES; n++) {
+        ASSERT_EQ(probes[n].released, 1) << "frame " << n;
+        ASSERT_FALSE(probes[n].early) << "frame " << n << " released while still in use";
+        ASSERT_FALSE(probes[n].wrong_request) << "frame " << n;
+    }
+    EXPECT_EQ(stats.failed, 0u);
+    if (cpu_access) {
+        EXPECT_EQ(stats.skipped, 0u);
+        EXPECT_GE(stats.syncs, FRAMES);
+    } else {
+        EXPECT_EQ(stats.skipped, FRAMES);
+        EXPECT_EQ(stats.syncs, 0u);
+    }
+}
+
+TEST(FrameHandle, ReleasedOnceByTheLastHolder) {
+    libcamera::FrameBuffer buffer({ libcamera::FrameBuffer::Plane() });
+    std::vector<uint8_t> memory(BUFFER_SIZE);
+    MappedBuffer mapped;
+    mapped.memory = memory.data();
+    mapped.size = memory.size();
+    runConsumers(buffer, mapped, false);
+}
+
+TEST(FrameHandle, NeverReleasedInsideCpuAccess) {
+    int heap = open("/dev/dma_heap/system", O_RDWR | O_CLOEXEC);
+    if (heap < 0)
+        GTEST_SKIP() << "no /dev/dma_heap/system to allocate the frame from";
+    dma_heap_allocation_data alloc = {};
+    alloc.len = BUFFER_SIZE;
+    alloc.fd_flags = O_RDWR | O_CLOEXEC;
+    int ret = ioctl(heap, DMA_HEAP_IOCTL_ALLOC, &alloc);
+    close(heap);
+    ASSERT_EQ(ret, 0);
+
+    libcamera::FrameBuffer::Plane plane;
+    plane.fd = libcamera::SharedFD(libcamera::UniqueFD((int) alloc.fd));
+    plane.length = BUFFER_SIZE;
+    libcamera::FrameBuffer buffer({ plane });
+    void *memory = mmap(nullptr, BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, plane.fd.get(), 0);
+    ASSERT_NE(memory, MAP_FAILED);
+    MappedBuffer mapped;
+    mapped.memory = static_cast<uint8_t *>(memory);
+    mapped.size = BUFFER_SIZE;
+
+    runConsumers(buffer, mapped, true);
+    munmap(memory, BUFFER_SIZE);
+}
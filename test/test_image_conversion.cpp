@@ -0,0 +1,193 @@
+// picam_conv kernels against a floating point reference, every source layout,
+// destination layout and colour matrix, odd sizes and padded strides
+
+#include <gtest/gtest.h>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "picam_ros2/image_conversion.hpp"
+
+using namespace picam_conv;
+
+// Random frame in I420 or NV12 layout, strides padded like libcamera's
+struct TestYuv {
+    uint width, height;
+    std::vector<uint8_t> y, u, v;
+    YuvPlanes planes;
+
+    TestYuv(uint width, uint height, bool nv12, uint seed = 1) : width(width), height(height) {
+        std::mt19937 rng(seed);
+        uint y_stride = (width + 63) & ~63u;
+        uint c_height = (height + 1) / 2;
+        uint c_stride = nv12 ? y_stride : y_stride / 2;
+        this->y.resize((size_t) y_stride * height);
+        this->u.resize((size_t) c_stride * c_height);
+        this->v.resize((size_t) c_stride * c_height);
+        for (auto *plane : { &this->y, &this->u, &this->v })
+            for (auto &sample : *plane)
+                sample = (uint8_t) rng();
+        this->planes = { this->y.data(), this->u.data(), nv12 ? nullptr : this->v.data(),
+                         y_stride, c_stride, nv12 ? 0 : c_stride, width, height };
+    }
+
+    template <class Src> uint8_t Y(uint x, uint y) const { return this->planes.y[y * this->planes.y_stride + x]; }
+    template <class Src> uint8_t U(uint x, uint y) const { return Src::uRow(this->planes, y)[(x / 2) * Src::chroma_step]; }
+    template <class Src> uint8_t V(uint x, uint y) const { return Src::vRow(this->planes, y)[(x / 2) * Src::chroma_step]; }
+};
+
+// Y'CbCr -> R'G'B' in doubles
+static void referenceRgb(int Y, int U, int V, double kr, double kb, bool full_range, double rgb[3]) {
+    double kg = 1.0 - kr - kb;
+    double y = full_range ? Y : (Y - 16) * 255.0 / 219.0;
+    double c_scale = full_range ? 1.0 : 255.0 / 224.0;
+    double u = (U - 128) * c_scale, v = (V - 128) * c_scale;
+    rgb[0] = y + 2.0 * (1.0 - kr) * v;
+    rgb[1] = y - 2.0 * (1.0 - kb) * kb / kg * u - 2.0 * (1.0 - kr) * kr / kg * v;
+    rgb[2] = y + 2.0 * (1.0 - kb) * u;
+    for (int c = 0; c < 3; c++)
+        rgb[c] = std::clamp(rgb[c], 0.0, 255.0);
+}
+
+template <class Src, class Dst, class M>
+static void checkRgb(bool nv12, uint width, uint height) {
+    SCOPED_TRACE(::testing::Message() << width << "x" << height << (nv12 ? " nv12" : " i420") << " kr " << M::kr
+                 << (M::y_offset ? " limited" : " full") << " channels " << Dst::channels);
+    TestYuv frame(width, height, nv12);
+    uint dst_step = width * Dst::channels + 5; // padded rows must be left alone
+    std::vector<uint8_t> dst((size_t) dst_step * height, 0xab);
+    convert<Src, Dst, M>(frame.planes, dst.data(), dst_step);
+
+    for (uint y = 0; y < height; y++) {
+        for (uint x = 0; x < width; x++) {
+            double rgb[3];
+            referenceRgb(frame.Y<Src>(x, y), frame.U<Src>(x, y), frame.V<Src>(x, y), M::kr, M::kb, M::y_offset == 0, rgb);
+            const uint8_t *px = dst.data() + y * dst_step + x * Dst::channels;
+            ASSERT_NEAR(px[Dst::r], rgb[0], 1.0) << "R at " << x << "," << y;
+            ASSERT_NEAR(px[Dst::g], rgb[1], 1.0) << "G at " << x << "," << y;
+            ASSERT_NEAR(px[Dst::b], rgb[2], 1.0) << "B at " << x << "," << y;
+            if constexpr (Dst::a >= 0) {
+                ASSERT_EQ(px[Dst::a], 255);
+            }
+        }
+        for (uint x = width * Dst::channels; x < dst_step; x++)
+            ASSERT_EQ(dst[y * dst_step + x], 0xab) << "row padding overwritten";
+    }
+}
+
+template <class Src, class M>
+static void checkAllRgb(bool nv12) {
+    for (auto size : { std::pair<uint, uint>(64, 48), std::pair<uint, uint>(37, 23) }) {
+        checkRgb<Src, DstRGB8, M>(nv12, size.first, size.second);
+        checkRgb<Src, DstBGR8, M>(nv12, size.first, size.second);
+        checkRgb<Src, DstRGBA8, M>(nv12, size.first, size.second);
+        checkRgb<Src, DstBGRA8, M>(nv12, size.first, size.second);
+    }
+}
+
+TEST(ImageConversion, RgbFamilyI420) {
+    checkAllRgb<SrcI420, BT601Limited>(false);
+    checkAllRgb<SrcI420, BT601Full>(false);
+    checkAllRgb<SrcI420, BT709Limited>(false);
+    checkAllRgb<SrcI420, BT709Full>(false);
+}
+
+TEST(ImageConversion, RgbFamilyNV12) {
+    checkAllRgb<SrcNV12, BT601Limited>(true);
+    checkAllRgb<SrcNV12, BT601Full>(true);
+    checkAllRgb<SrcNV12, BT709Limited>(true);
+    checkAllRgb<SrcNV12, BT709Full>(true);
+}
+
+TEST(ImageConversion, Mono8CopiesLuma) {
+    TestYuv frame(37, 23, false);
+    std::vector<uint8_t> dst(37 * 23);
+    convert<SrcI420, DstMono8, BT601Limited>(frame.planes, dst.data(), 37);
+    for (uint y = 0; y < 23; y++)
+        for (uint x = 0; x < 37; x++)
+            ASSERT_EQ(dst[y * 37 + x], frame.Y<SrcI420>(x, y));
+}
+
+template <class M>
+static void checkMono16() {
+    TestYuv frame(37, 23, false);
+    std::vector<uint8_t> dst(37 * 23 * 2);
+    convert<SrcI420, DstMono16, M>(frame.planes, dst.data(), 37 * 2);
+    for (uint y = 0; y < 23; y++) {
+        for (uint x = 0; x < 37; x++) {
+            int Y = frame.Y<SrcI420>(x, y);
+            double expected = std::clamp(M::y_offset ? (Y - 16) * 255.0 / 219.0 : (double) Y, 0.0, 255.0);
+            uint16_t value = (uint16_t) (dst[(y * 37 + x) * 2] | dst[(y * 37 + x) * 2 + 1] << 8);
+            ASSERT_EQ(value % 257, 0) << "not scaled by 257";
+            ASSERT_NEAR(value / 257, expected, 1.0) << "at " << x << "," << y;
+        }
+    }
+}
+
+TEST(ImageConversion, Mono16ExpandsRange) {
+    checkMono16<BT601Limited>();
+    checkMono16<BT601Full>();
+    checkMono16<BT709Limited>();
+    checkMono16<BT709Full>();
+}
+
+template <class Src>
+static void checkNV12(bool nv12) {
+    TestYuv frame(64, 48, nv12);
+    std::vector<uint8_t> dst(64 * 48 * 3 / 2);
+    convert<Src, DstNV12, BT601Limited>(frame.planes, dst.data(), 64);
+    for (uint y = 0; y < 48; y++)
+        for (uint x = 0; x < 64; x++)
+            ASSERT_EQ(dst[y * 64 + x], frame.Y<Src>(x, y));
+    const uint8_t *uv = dst.data() + 64 * 48;
+    for (uint y = 0; y < 48; y += 2) {
+        for (uint x = 0; x < 64; x += 2) {
+            ASSERT_EQ(uv[(y / 2) * 64 + x], frame.U<Src>(x, y));
+            ASSERT_EQ(uv[(y / 2) * 64 + x + 1], frame.V<Src>(x, y));
+        }
+    }
+}
+
+TEST(ImageConversion, NV12Interleaves) {
+    checkNV12<SrcI420>(false);
+    checkNV12<SrcNV12>(true);
+}
+
+template <class Src>
+static void checkYUYV(bool nv12) {
+    TestYuv frame(64, 47, nv12);
+    std::vector<uint8_t> dst(64 * 47 * 2);
+    convert<Src, DstYUYV, BT601Limited>(frame.planes, dst.data(), 128);
+    for (uint y = 0; y < 47; y++) {
+        for (uint x = 0; x < 64; x += 2) {
+            const uint8_t *d = dst.data() + y * 128 + x * 2;
+            ASSERT_EQ(d[0], frame.Y<Src>(x, y));
+            ASSERT_EQ(d[1], frame.U<Src>(x, y));
+            ASSERT_EQ(d[2], frame.Y<Src>(x + 1, y));
+            ASSERT_EQ(d[3], frame.V<Src>(x, y));
+        }
+    }
+}
+
+TEST(ImageConversion, YUYVRepeatsChroma) {
+    checkYUYV<SrcI420>(false);
+    checkYUYV<SrcNV12>(true);
+}
+
+TEST(ImageConversion, ShuffleRgb) {
+    TestYuv frame(37, 23, false);
+    std::vector<uint8_t> rgb(37 * 23 * 3), bgra(37 * 23 * 4), rgb_again(37 * 23 * 3);
+    convert<SrcI420, DstRGB8, BT709Limited>(frame.planes, rgb.data(), 37 * 3);
+    shuffleRgb<DstRGB8, DstBGRA8>(rgb.data(), 37 * 3, bgra.data(), 37 * 4, 37, 23);
+    shuffleRgb<DstBGRA8, DstRGB8>(bgra.data(), 37 * 4, rgb_again.data(), 37 * 3, 37, 23);
+    EXPECT_EQ(rgb, rgb_again);
+    for (uint i = 0; i < 37 * 23; i++) {
+        ASSERT_EQ(bgra[i * 4], rgb[i * 3 + 2]);
+        ASSERT_EQ(bgra[i * 4 + 3], 255);
+    }
+
+    // the shared rgb8 intermediate gives the same pixels as a direct conversion
+    std::vector<uint8_t> direct(37 * 23 * 4);
+    convert<SrcI420, DstBGRA8, BT709Limited>(frame.planes, direct.data(), 37 * 4);
+    EXPECT_EQ(bgra, direct);
+}
@@ -0,0 +1,100 @@
+// packImage and ImageConversionGraph, the message side of the image outputs
+
+#include <gtest/gtest.h>
+#include <vector>
+
+#include "picam_ros2/image_output.hpp"
+
+// Capture buffer layout as libcamera hands it out: padded strides, contiguous planes
+struct TestFrame {
+    uint width, height;
+    std::vector<uint8_t> memory;
+    std::vector<uint8_t *> planes;
+    std::vector<uint> strides;
+
+    TestFrame(uint width, uint height) : width(width), height(height) {
+        uint y_stride = (width + 63) & ~63u;
+        uint c_stride = y_stride / 2;
+        this->strides = { y_stride, c_stride, c_stride };
+        this->memory.resize(y_stride * height + c_stride * height);
+        for (size_t i = 0; i < this->memory.size(); i++)
+            this->memory[i] = static_cast<uint8_t>(i * 7 + (i >> 9));
+        uint8_t *p = this->memory.data();
+        this->planes = { p, p + y_stride * height, p + y_stride * height + c_stride * (height / 2) };
+    }
+};
+
+TEST(ImageOutput, Yuv420KeepsCaptureLayout) {
+    TestFrame frame(100, 60);
+    sensor_msgs::msg::Image msg;
+    ASSERT_TRUE(packImage(IMAGE_OUTPUT_FORMAT::YUV420, COLOR_MATRIX::BT601_LIMITED, frame.planes, frame.strides, 100, 60, msg));
+    EXPECT_EQ(msg.step, frame.strides[0]);
+    ASSERT_EQ(msg.data.size(), frame.memory.size());
+    EXPECT_TRUE(std::equal(msg.data.begin(), msg.data.end(), frame.memory.begin()));
+}
+
+TEST(ImageOutput, Mono8DropsStridePadding) {
+    TestFrame frame(100, 60);
+    sensor_msgs::msg::Image msg;
+    ASSERT_TRUE(packImage(IMAGE_OUTPUT_FORMAT::MONO8, COLOR_MATRIX::BT601_LIMITED, frame.planes, frame.strides, 100, 60, msg));
+    EXPECT_EQ(msg.step, 100u);
+    ASSERT_EQ(msg.data.size(), 100u * 60);
+    for (uint y = 0; y < 60; y++)
+        for (uint x = 0; x < 100; x++)
+            ASSERT_EQ(msg.data[y * 100 + x], frame.planes[0][y * frame.strides[0] + x]);
+}
+
+TEST(ImageOutput, Bgr8MatchesKernel) {
+    TestFrame frame(100, 60);
+    picam_conv::YuvPlanes src = { frame.planes[0], frame.planes[1], frame.planes[2],
+                                  frame.strides[0], frame.strides[1], frame.strides[2], 100, 60 };
+    for (uint matrix = 0; matrix < COLOR_MATRIX::COLOR_MATRIX_COUNT; matrix++) {
+        sensor_msgs::msg::Image msg;
+        ASSERT_TRUE(packImage(IMAGE_OUTPUT_FORMAT::BGR8, matrix, frame.planes, frame.strides, 100, 60, msg));
+        EXPECT_EQ(msg.step, 300u);
+        std::vector<uint8_t> expected(300 * 60);
+        findImageEncoding(IMAGE_OUTPUT_FORMAT::BGR8)->convert[matrix](src, expected.data(), 300);
+        EXPECT_EQ(msg.data, expected) << "matrix " << matrix;
+    }
+}
+
+TEST(ImageOutput, UnknownFormatRejected) {
+    TestFrame frame(64, 48);
+    sensor_msgs::msg::Image msg;
+    EXPECT_FALSE(packImage(999, COLOR_MATRIX::BT601_LIMITED, frame.planes, frame.strides, 64, 48, msg));
+    EXPECT_FALSE(packImage(IMAGE_OUTPUT_FORMAT::BGR8, COLOR_MATRIX::COLOR_MATRIX_COUNT, frame.planes, frame.strides, 64, 48, msg));
+    EXPECT_EQ(findImageEncoding("not_an_encoding"), nullptr);
+}
+
+// shared rgb8 intermediate vs every output packed on its own
+TEST(ImageOutput, GraphMatchesSeparatePacking) {
+    TestFrame frame(100, 60);
+    std::vector<uint> formats = { IMAGE_OUTPUT_FORMAT::BGR8, IMAGE_OUTPUT_FORMAT::RGBA8, IMAGE_OUTPUT_FORMAT::MONO8,
+                                  IMAGE_OUTPUT_FORMAT::BGRA8 };
+    for (bool with_rgb8 : { false, true }) {
+        if (with_rgb8)
+            formats.push_back(IMAGE_OUTPUT_FORMAT::RGB8);
+        std::vector<ImageOutput> outputs(formats.size());
+        std::vector<ImageOutput *> due;
+        for (size_t i = 0; i < formats.size(); i++) {
+            outputs[i].format = formats[i];
+            due.push_back(&outputs[i]);
+        }
+        ImageConversionGraph graph;
+        graph.pack(due, COLOR_MATRIX::BT709_LIMITED, frame.planes, frame.strides, 100, 60);
+
+        for (auto &output : outputs) {
+            sensor_msgs::msg::Image expected;
+            packImage(output.format, COLOR_MATRIX::BT709_LIMITED, frame.planes, frame.strides, 100, 60, expected);
+            EXPECT_EQ(output.msg.step, expected.step) << IMAGE_OUTPUT_FORMAT_NAMES.at(output.format);
+            EXPECT_EQ(output.msg.data, expected.data) << IMAGE_OUTPUT_FORMAT_NAMES.at(output.format);
+        }
+    }
+}
+
+TEST(ImageOutput, StampSplitsNanoseconds) {
+    builtin_interfaces::msg::Time stamp;
+    setCurrentStamp(&stamp, 1700000000123456789ull);
+    EXPECT_EQ(stamp.sec, 1700000000);
+    EXPECT_EQ(stamp.nanosec, 123456789u);
+}
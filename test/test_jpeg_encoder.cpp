@@ -0,0 +1,221 @@
+// JPEG from the capture planes: strips stitched with restart markers must decode to the
+// same image as a single pass encode, with no decoder warnings; colour is converted to what
+// a JFIF decoder assumes for every matrix; the row kernels against the scalar reference
+
+#include <cmath>
+#include <csetjmp>
+#include <cstdio>
+#include <gtest/gtest.h>
+#include <jpeglib.h>
+#include <random>
+#include <vector>
+
+#include "picam_ros2/jpeg_encoder.hpp"
+
+struct TestFrame {
+    uint width, height, y_stride, c_stride;
+    std::vector<uint8_t> y, u, v;
+
+    // smooth gradients with a little texture, a sharp edge and a colour patch
+    TestFrame(uint width, uint height, uint8_t black = 0, uint8_t white = 255)
+        : width(width), height(height), y_stride((width + 63) & ~63u), c_stride(((width + 1) / 2 + 31) & ~31u) {
+        const uint cw = (width + 1) / 2, ch = (height + 1) / 2;
+        y.assign((size_t) y_stride * height, 0);
+        u.assign((size_t) c_stride * ch, 0);
+        v.assign((size_t) c_stride * ch, 0);
+        auto range = [&](double t) { return (uint8_t) std::lround(black + (white - black) * std::clamp(t, 0.0, 1.0)); };
+        for (uint r = 0; r < height; r++)
+            for (uint x = 0; x < width; x++)
+                y[(size_t) r * y_stride + x] = range(0.5 + 0.35 * std::sin(x * 0.021) * std::cos(r * 0.017) + ((x * 7 + r * 3) % 5) * 0.004 + (x > width / 2 ? 0.08 : 0.0));
+        for (uint r = 0; r < ch; r++) {
+            for (uint x = 0; x < cw; x++) {
+                u[(size_t) r * c_stride + x] = (uint8_t) std::lround(128 + 40 * std::sin(x * 0.03));
+                v[(size_t) r * c_stride + x] = (uint8_t) std::lround(128 + 40 * std::cos(r * 0.025));
+            }
+        }
+    }
+
+    picam_conv::YuvPlanes planes() const {
+        return { y.data(), u.data(), v.data(), y_stride, c_stride, c_stride, width, height };
+    }
+};
+
+struct Decoded {
+    uint width = 0, height = 0;
+    long warnings = 0;
+    std::vector<uint8_t> pixels; // 3 components per pixel
+};
+
+struct DecodeError {
+    jpeg_error_mgr pub;
+    jmp_buf jump;
+};
+
+// Decodes into Y'CbCr (no colour conversion) or RGB; false on a fatal libjpeg error
+static bool decodeJpeg(const std::vector<uint8_t> &jpeg, J_COLOR_SPACE space, Decoded &out) {
+    jpeg_decompress_struct cinfo;
+    DecodeError err;
+    cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = [](j_common_ptr cinfo) { longjmp(((DecodeError *) cinfo->err)->jump, 1); };
+    err.pub.output_message = [](j_common_ptr) {}; // counted in num_warnings
+    jpeg_create_decompress(&cinfo);
+    if (setjmp(err.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    jpeg_mem_src(&cinfo, jpeg.data(), jpeg.size());
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = space;
+    jpeg_start_decompress(&cinfo);
+    out.width = cinfo.output_width;
+    out.height = cinfo.output_height;
+    out.pixels.resize((size_t) out.width * out.height * 3);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = out.pixels.data() + (size_t) cinfo.output_scanline * out.width * 3;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    out.warnings = err.pub.num_warnings;
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+
+// const.hpp's COLOR_MATRIX can't be used next to jpeglib.h (UINT8), so the matrices by hand
+struct Matrix {
+    const char *name;
+    bool bt709, full;
+    JpegRowCoeffs coeffs;
+};
+
+static const Matrix BT601_FULL = { "BT.601 full", false, true, JpegRowCoeffs::from<picam_conv::BT601Full>() };
+static const Matrix BT709_LIMITED = { "BT.709 limited", true, false, JpegRowCoeffs::from<picam_conv::BT709Limited>() };
+static const Matrix MATRICES[] = {
+    { "BT.601 limited", false, false, JpegRowCoeffs::from<picam_conv::BT601Limited>() },
+    BT601_FULL,
+    BT709_LIMITED,
+    { "BT.709 full", true, true, JpegRowCoeffs::from<picam_conv::BT709Full>() },
+};
+
+// Source Y'CbCr -> R'G'B' in 0..255, in double
+static void sourceRgb(const Matrix &m, double y, double cb, double cr, double rgb[3]) {
+    const bool full = m.full;
+    double kr = m.bt709 ? 0.2126 : 0.299, kb = m.bt709 ? 0.0722 : 0.114, kg = 1.0 - kr - kb;
+    double luma = full ? y : (y - 16) * 255.0 / 219.0;
+    double u = (cb - 128) * (full ? 1.0 : 255.0 / 224.0), v = (cr - 128) * (full ? 1.0 : 255.0 / 224.0);
+    rgb[0] = luma + 2.0 * (1.0 - kr) * v;
+    rgb[2] = luma + 2.0 * (1.0 - kb) * u;
+    rgb[1] = (luma - kr * rgb[0] - kb * rgb[2]) / kg;
+}
+
+TEST(JpegKernels, RowsMatchReference) {
+    std::mt19937 rng(3);
+    for (const Matrix &matrix : MATRICES) {
+        const JpegRowCoeffs &k = matrix.coeffs;
+        for (uint count = 1; count <= 70; count++) {
+            std::vector<uint8_t> y(count), cb((count + 1) / 2), cr((count + 1) / 2);
+            for (auto &s : y) s = (uint8_t) rng();
+            for (auto &s : cb) s = (uint8_t) rng();
+            for (auto &s : cr) s = (uint8_t) rng();
+            std::vector<uint8_t> got(count + 1, 0x77), want(count + 1, 0x77);
+            jpegLumaRow(y.data(), cb.data(), cr.data(), got.data(), count, k);
+            jpeg_reference::jpegLumaRow(y.data(), cb.data(), cr.data(), want.data(), count, k);
+            ASSERT_EQ(got, want) << "luma, " << matrix.name << " count " << count;
+
+            std::vector<uint8_t> got_cb(count + 1, 0x77), got_cr(count + 1, 0x77), want_cb(count + 1, 0x77), want_cr(count + 1, 0x77);
+            jpegChromaRow(y.data(), y.data(), got_cb.data(), got_cr.data(), count, k);
+            jpeg_reference::jpegChromaRow(y.data(), y.data(), want_cb.data(), want_cr.data(), count, k);
+            ASSERT_EQ(got_cb, want_cb) << "cb, " << matrix.name << " count " << count;
+            ASSERT_EQ(got_cr, want_cr) << "cr, " << matrix.name << " count " << count;
+        }
+    }
+}
+
+// The converted samples, read as full range BT.601, are the source's colours
+TEST(JpegKernels, ConvertsToJfif) {
+    EXPECT_TRUE(BT601_FULL.coeffs.identity);
+    for (const Matrix &matrix : MATRICES) {
+        const JpegRowCoeffs &k = matrix.coeffs;
+        const bool full = matrix.full;
+        uint lo = full ? 0 : 16;
+        double worst = 0.0;
+        for (uint y = lo; y <= (full ? 255u : 235u); y += 7) {
+            for (uint cb = lo; cb <= (full ? 255u : 240u); cb += 9) {
+                for (uint cr = lo; cr <= (full ? 255u : 240u); cr += 9) {
+                    double want[3];
+                    sourceRgb(matrix, y, cb, cr, want);
+                    if (*std::min_element(want, want + 3) < 0.0 || *std::max_element(want, want + 3) > 255.0)
+                        continue; // out of gamut, clipped differently
+                    uint8_t sy = (uint8_t) y, scb = (uint8_t) cb, scr = (uint8_t) cr, jy, jcb, jcr;
+                    jpeg_reference::jpegLumaRow(&sy, &scb, &scr, &jy, 1, k);
+                    jpeg_reference::jpegChromaRow(&scb, &scr, &jcb, &jcr, 1, k);
+                    double got[3];
+                    sourceRgb(BT601_FULL, jy, jcb, jcr, got);
+                    for (uint c = 0; c < 3; c++)
+                        worst = std::max(worst, std::fabs(got[c] - want[c]));
+                }
+            }
+        }
+        EXPECT_LT(worst, 2.5) << matrix.name; // 8-bit rounding of Y, Cb and Cr
+    }
+}
+
+// Strips encode in parallel with DRI = one strip; the stitched stream must decode warning
+// free to exactly the pixels of the single strip encode, for aligned and unaligned sizes
+TEST(JpegEncoder, StitchedStripsMatchSinglePass) {
+    JpegEncoder single(1, 85), pooled(8, 85);
+    for (auto [w, h] : { std::pair<uint, uint> { 16, 16 }, { 33, 17 }, { 640, 480 }, { 1279, 721 }, { 1920, 1080 }, { 4056, 3040 } }) {
+        for (const Matrix *matrix : { &BT601_FULL, &BT709_LIMITED }) {
+            SCOPED_TRACE(std::to_string(w) + "x" + std::to_string(h) + " " + matrix->name);
+            TestFrame frame(w, h);
+            std::vector<uint8_t> one, many;
+            ASSERT_TRUE(single.encode(frame.planes(), matrix->coeffs, one));
+            ASSERT_TRUE(pooled.encode(frame.planes(), matrix->coeffs, many));
+            ASSERT_TRUE(pooled.encode(frame.planes(), matrix->coeffs, many)); // strips reused
+
+            Decoded a, b;
+            ASSERT_TRUE(decodeJpeg(one, JCS_YCbCr, a));
+            ASSERT_TRUE(decodeJpeg(many, JCS_YCbCr, b));
+            EXPECT_EQ(a.warnings, 0);
+            EXPECT_EQ(b.warnings, 0);
+            ASSERT_EQ(b.width, w);
+            ASSERT_EQ(b.height, h);
+            ASSERT_EQ(a.pixels, b.pixels);
+        }
+    }
+}
+
+// What a viewer shows (libjpeg's BT.601 JFIF decode to RGB) is the source's colour, for
+// every matrix and range; the threshold is JPEG's loss on this smooth content
+TEST(JpegEncoder, DecodesToSourceColours) {
+    JpegEncoder encoder(4, 95);
+    for (const Matrix &matrix : MATRICES) {
+        SCOPED_TRACE(matrix.name);
+        const bool full = matrix.full;
+        TestFrame frame(320, 240, full ? 0 : 16, full ? 255 : 235);
+        std::vector<uint8_t> jpeg;
+        ASSERT_TRUE(encoder.encode(frame.planes(), matrix.coeffs, jpeg));
+        Decoded rgb;
+        ASSERT_TRUE(decodeJpeg(jpeg, JCS_RGB, rgb));
+
+        double error[3] = {};
+        for (uint y = 0; y < frame.height; y++) {
+            for (uint x = 0; x < frame.width; x++) {
+                double want[3];
+                sourceRgb(matrix, frame.y[y * frame.y_stride + x], frame.u[y / 2 * frame.c_stride + x / 2], frame.v[y / 2 * frame.c_stride + x / 2], want);
+                for (uint c = 0; c < 3; c++)
+                    error[c] += std::fabs(rgb.pixels[((size_t) y * rgb.width + x) * 3 + c] - std::clamp(want[c], 0.0, 255.0));
+            }
+        }
+        for (uint c = 0; c < 3; c++)
+            EXPECT_LT(error[c] / (frame.width * frame.height), 2.0) << "channel " << c;
+    }
+}
+
+TEST(JpegEncoder, RejectsEmptyFrames) {
+    JpegEncoder encoder(2, 80);
+    TestFrame frame(16, 16);
+    picam_conv::YuvPlanes src = frame.planes();
+    src.height = 0;
+    std::vector<uint8_t> out;
+    EXPECT_FALSE(encoder.encode(src, BT601_FULL.coeffs, out));
+}
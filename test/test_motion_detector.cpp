@@ -0,0 +1,96 @@
+// Motion detector: the row kernels against the scalar reference, moving cells found where
+// the frame changed, and the cell grid following frame size changes both ways
+
+#include <gtest/gtest.h>
+#include <random>
+#include <vector>
+
+#include "picam_ros2/motion_detector.hpp"
+
+TEST(MotionKernels, RowsMatchReference) {
+    std::mt19937 rng(11);
+    for (uint width = 1; width <= 100; width++) {
+        std::vector<uint8_t> src(width * 8), a(width), b(width);
+        for (auto &s : src) s = (uint8_t) rng();
+        for (auto &s : a) s = (uint8_t) rng();
+        for (auto &s : b) s = (uint8_t) rng();
+
+        std::vector<uint8_t> got(width + 1, 0x33), want(width + 1, 0x33);
+        downsampleRow8(src.data(), got.data(), width);
+        motion_reference::downsampleRow8(src.data(), want.data(), width);
+        ASSERT_EQ(got, want) << "downsample, width " << width;
+
+        std::fill(got.begin(), got.end(), 0x33);
+        std::fill(want.begin(), want.end(), 0x33);
+        absDiffRow(a.data(), b.data(), got.data(), width);
+        motion_reference::absDiffRow(a.data(), b.data(), want.data(), width);
+        ASSERT_EQ(got, want) << "abs diff, width " << width;
+    }
+
+    // rounding at the extremes
+    std::vector<uint8_t> white(64, 255), out(8);
+    downsampleRow8(white.data(), out.data(), 8);
+    EXPECT_EQ(out, std::vector<uint8_t>(8, 255));
+}
+
+struct TestFrame {
+    uint width, height, stride;
+    std::vector<uint8_t> y;
+
+    TestFrame(uint width, uint height) : width(width), height(height), stride((width + 63) & ~63u) {
+        y.assign((size_t) stride * height, 0xcd); // padding must not be read
+        std::mt19937 rng(width);
+        std::uniform_int_distribution<int> noise(-2, 2);
+        for (uint r = 0; r < height; r++)
+            for (uint x = 0; x < width; x++)
+                y[(size_t) r * stride + x] = (uint8_t) (100 + (x + r) % 40 + noise(rng));
+    }
+
+    void fill(uint left, uint top, uint w, uint h, uint8_t value) {
+        for (uint r = top; r < top + h; r++)
+            for (uint x = left; x < left + w; x++)
+                y[(size_t) r * stride + x] = value;
+    }
+};
+
+TEST(MotionDetector, FindsTheMovingCells) {
+    MotionDetector detector;
+    detector.configure(64, 6.0f, 1, 0.6f, 150);
+    TestFrame frame(640, 480);
+
+    MotionResult first = detector.process(frame.y.data(), frame.stride, frame.width, frame.height);
+    EXPECT_TRUE(first.scene_change); // seeds the background
+    ASSERT_EQ(detector.gridWidth(), 10u);
+    ASSERT_EQ(detector.gridHeight(), 7u);
+
+    MotionResult still = detector.process(frame.y.data(), frame.stride, frame.width, frame.height);
+    EXPECT_FALSE(still.motion);
+    EXPECT_EQ(still.moving_cells, 0u);
+
+    // a bright block covering cell (3, 2) exactly
+    frame.fill(192, 128, 64, 64, 250);
+    MotionResult moved = detector.process(frame.y.data(), frame.stride, frame.width, frame.height);
+    EXPECT_TRUE(moved.motion);
+    EXPECT_FALSE(moved.scene_change);
+    EXPECT_EQ(moved.moving_cells, 1u);
+    EXPECT_EQ(detector.cellMask()[2 * detector.gridWidth() + 3], 255);
+
+    // most of the frame at once is a scene change
+    frame.fill(0, 0, 640, 480, 20);
+    EXPECT_TRUE(detector.process(frame.y.data(), frame.stride, frame.width, frame.height).scene_change);
+}
+
+// A small frame limits the cells to its size; a larger one afterwards gets the configured cells back
+TEST(MotionDetector, RegridsForEachFrameSize) {
+    MotionDetector detector;
+    detector.configure(64, 6.0f, 1, 0.6f, 150);
+    TestFrame small(40, 32), large(1920, 1080);
+
+    detector.process(small.y.data(), small.stride, small.width, small.height);
+    EXPECT_EQ(detector.gridWidth(), 1u);
+    EXPECT_EQ(detector.gridHeight(), 1u);
+
+    detector.process(large.y.data(), large.stride, large.width, large.height);
+    EXPECT_EQ(detector.gridWidth(), 30u);
+    EXPECT_EQ(detector.gridHeight(), 16u);
+}
@@ -0,0 +1,90 @@
+// Output staggering across cameras: decimated outputs with different phases must land on
+// different frames even when the cameras' sequence numbers started apart, and the ticks
+// must follow the sensor clock when a camera's frame rate drifts against it
+
+#include <cmath>
+#include <gtest/gtest.h>
+#include <random>
+#include <vector>
+
+#include "picam_ros2/output_schedule.hpp"
+
+static constexpr uint FPS = 30;
+static constexpr double PERIOD_NS = 1e9 / FPS;
+
+struct SimCamera {
+    OutputClock clock;
+    OutputSchedule schedule;
+    uint sequence;
+    double start_ns; // sensor timestamp of the first frame
+    double period_ns;
+
+    uint64_t timestampOf(uint frame, double jitter_ns) const {
+        return (uint64_t) std::llround(this->start_ns + frame * this->period_ns + jitter_ns);
+    }
+};
+
+TEST(OutputSchedule, StaggersAcrossCameras) {
+    auto &allocator = OutputPhaseAllocator::instance();
+    std::mt19937 rng(5);
+    std::normal_distribution<double> jitter(0.0, 20e3); // 20 us
+
+    // same output on both cameras, but the sequences started 1000 frames apart and the
+    // sensors free run a fraction of a frame apart
+    for (double skew : { 0.0, 0.2, 0.45, -0.45 }) {
+        SCOPED_TRACE("skew " + std::to_string(skew));
+        SimCamera cameras[2] = {
+            { {}, { 3, 0 }, 0, 5e12, PERIOD_NS },
+            { {}, { 3, 0 }, 1000, 5e12 + skew * PERIOD_NS, PERIOD_NS },
+        };
+        for (int i = 0; i < 2; i++) {
+            cameras[i].clock.reset(FPS);
+            cameras[i].schedule.phase = allocator.allocate(100 + i, 3, 1000);
+        }
+        EXPECT_NE(cameras[0].schedule.phase, cameras[1].schedule.phase);
+
+        uint published[2] = {}, collisions = 0;
+        for (uint frame = 0; frame < 3000; frame++) {
+            bool due[2];
+            for (int i = 0; i < 2; i++) {
+                auto &camera = cameras[i];
+                due[i] = camera.schedule.due(camera.clock.tick(camera.sequence + frame, camera.timestampOf(frame, jitter(rng))));
+                published[i] += due[i];
+            }
+            collisions += due[0] && due[1];
+        }
+        EXPECT_EQ(collisions, 0u);
+        EXPECT_EQ(published[0], 1000u);
+        EXPECT_EQ(published[1], 1000u);
+        allocator.release(100);
+        allocator.release(101);
+    }
+}
+
+// A sensor running 0.1% slow drifts a whole frame in ~33 s; its ticks stay on the shared clock
+TEST(OutputSchedule, FollowsSensorClockDrift) {
+    SimCamera camera = { {}, { 4, 1 }, 7, 1e12, PERIOD_NS * 1.001 };
+    camera.clock.reset(FPS);
+    uint published = 0;
+    uint64_t last_tick = 0;
+    const uint frames = 10000;
+    for (uint frame = 0; frame < frames; frame++) {
+        uint64_t timestamp = camera.timestampOf(frame, 0.0);
+        uint64_t tick = camera.clock.tick(camera.sequence + frame, timestamp);
+        EXPECT_LE(std::fabs((double) tick - timestamp / PERIOD_NS), 0.75) << "frame " << frame;
+        if (frame > 0) {
+            ASSERT_GE(tick, last_tick);
+        }
+        last_tick = tick;
+        published += camera.schedule.due(tick);
+    }
+    EXPECT_NEAR(published, frames / 4.0, 5.0);
+}
+
+TEST(OutputSchedule, FallsBackToSequenceWithoutFramerate) {
+    OutputClock clock;
+    clock.reset(0);
+    EXPECT_EQ(clock.tick(42, 123456789), 42u);
+    EXPECT_EQ(OutputSchedule::divisorFor(10.0, 30), 3u);
+    EXPECT_EQ(OutputSchedule::divisorFor(0.0, 30), 1u);
+}
@@ -0,0 +1,116 @@
+// Phase lock loop against simulated free running sensors: lock within a bounded number of
+// frames from any starting offset, then stay within tolerance despite clock skew
+
+#include <gtest/gtest.h>
+#include <cmath>
+#include <deque>
+
+#include "picam_ros2/phase_lock.hpp"
+
+// Sensor whose frame durations take effect control_delay frames after being requested,
+// with a clock running skew faster than nominal
+struct SimulatedSensor {
+    double timestamp_ns, skew;
+    std::deque<double> durations; // requested, not applied yet
+
+    SimulatedSensor(double start_ns, double period_ns, double skew, uint delay)
+        : timestamp_ns(start_ns), skew(skew), durations(delay, period_ns) {}
+
+    uint64_t frame(double requested_duration_ns) {
+        uint64_t timestamp = (uint64_t) this->timestamp_ns;
+        this->durations.push_back(requested_duration_ns);
+        this->timestamp_ns += this->durations.front() * (1.0 + this->skew);
+        this->durations.pop_front();
+        return timestamp;
+    }
+};
+
+struct LockRun {
+    int locked_at = -1; // frame
+    double max_error_after_lock_ns = 0.0; // true offset of the frame starts
+    double max_step = 0.0; // largest requested change from the period, fraction
+    bool lost_lock = false;
+};
+
+static LockRun runLock(double offset, double skew, uint delay, int frames = 600) {
+    const double period_ns = 1e9 / 30.0;
+    SimulatedSensor leader(period_ns, period_ns, 0.0, delay), follower(period_ns + offset * period_ns, period_ns, skew, delay);
+    PhaseLockOptions options;
+    options.control_delay = delay;
+    PhaseLockController controller(options);
+    PhaseLockGroup group;
+    int64_t duration = (int64_t) period_ns;
+    LockRun run;
+    for (int n = 0; n < frames; n++) {
+        uint64_t leader_timestamp_now = leader.frame(period_ns);
+        group.leaderFrame(leader_timestamp_now);
+        uint64_t follower_timestamp = follower.frame(duration);
+        uint64_t leader_timestamp;
+        int64_t leader_period;
+        if (group.leaderReference(leader_timestamp, leader_period)) {
+            duration = controller.update(follower_timestamp, leader_timestamp, leader_period);
+            run.max_step = std::max(run.max_step, std::abs(duration - period_ns) / period_ns);
+        }
+        if (run.locked_at >= 0) {
+            double error = std::remainder((double) follower_timestamp - (double) leader_timestamp_now, period_ns);
+            run.max_error_after_lock_ns = std::max(run.max_error_after_lock_ns, std::abs(error));
+            if (!controller.locked())
+                run.lost_lock = true;
+        } else if (controller.locked()) {
+            run.locked_at = n;
+        }
+    }
+    return run;
+}
+
+TEST(PhaseLock, ConvergesFromAnyOffset) {
+    for (uint delay : { 2u, 6u }) {
+        for (double offset : { 0.5, 0.25, -0.25, -0.45, 0.05 }) {
+            SCOPED_TRACE(::testing::Message() << "offset " << offset << " frames, delay " << delay);
+            LockRun run = runLock(offset, 50e-6, delay);
+            ASSERT_GE(run.locked_at, 0) << "never locked";
+            EXPECT_LE(run.locked_at, 90) << "slower than 3 s at 30 fps";
+        }
+    }
+}
+
+TEST(PhaseLock, StaysWithinToleranceOnceLocked) {
+    PhaseLockOptions defaults;
+    for (double skew : { 50e-6, -50e-6, 200e-6 }) {
+        SCOPED_TRACE(::testing::Message() << "skew " << skew * 1e6 << " ppm");
+        LockRun run = runLock(0.5, skew, 2);
+        ASSERT_GE(run.locked_at, 0);
+        EXPECT_FALSE(run.lost_lock);
+        EXPECT_LE(run.max_error_after_lock_ns, (double) defaults.tolerance_ns);
+    }
+}
+
+TEST(PhaseLock, CorrectionsStayBounded) {
+    PhaseLockOptions defaults;
+    LockRun run = runLock(0.5, 50e-6, 2);
+    EXPECT_LE(run.max_step, defaults.max_step + 1e-3); // + the duration quantum
+}
+
+TEST(PhaseLock, ResetUnlocks) {
+    const double period_ns = 1e9 / 30.0;
+    PhaseLockController controller;
+    for (int n = 1; n < 100; n++)
+        controller.update((uint64_t) (n * period_ns), (uint64_t) (n * period_ns), (int64_t) period_ns);
+    ASSERT_TRUE(controller.locked());
+    controller.reset();
+    EXPECT_FALSE(controller.locked());
+    EXPECT_EQ(controller.phaseError(), 0);
+}
+
+TEST(PhaseLock, GroupNeedsTwoLeaderFrames) {
+    PhaseLockGroup group;
+    uint64_t timestamp;
+    int64_t period;
+    EXPECT_FALSE(group.leaderReference(timestamp, period));
+    group.leaderFrame(1000000000);
+    EXPECT_FALSE(group.leaderReference(timestamp, period));
+    group.leaderFrame(1033333333);
+    ASSERT_TRUE(group.leaderReference(timestamp, period));
+    EXPECT_EQ(timestamp, 1033333333u);
+    EXPECT_EQ(period, 33333333);
+}
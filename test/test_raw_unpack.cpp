@@ -0,0 +1,151 @@
+// CSI-2 raw unpacking: the NEON row unpackers against the scalar reference over every
+// width up to a few vectors, so each tail length is covered, and the reference against
+// the packing spec
+
+#include <gtest/gtest.h>
+#include <random>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+#include "picam_ros2/raw_unpack.hpp"
+
+// Packs samples like the CSI-2 receiver: 4 MSB bytes + 1 LSB byte (10-bit), 2 + 1 (12-bit)
+static std::vector<uint8_t> packCsi2(const std::vector<uint16_t> &samples, uint bits) {
+    uint group = bits == 10 ? 4 : 2;
+    std::vector<uint8_t> packed((samples.size() + group - 1) / group * (group + 1), 0);
+    for (size_t x = 0; x < samples.size(); x++) {
+        uint8_t *g = packed.data() + (x / group) * (group + 1);
+        g[x % group] = (uint8_t) (samples[x] >> (bits - 8));
+        g[group] |= (uint8_t) ((samples[x] & ((1 << (bits - 8)) - 1)) << ((x % group) * (bits - 8)));
+    }
+    return packed;
+}
+
+// Source bytes that end right at a PROT_NONE page, reading past the row faults
+class GuardedRow {
+    public:
+        explicit GuardedRow(const std::vector<uint8_t> &bytes) {
+            this->page = sysconf(_SC_PAGESIZE);
+            this->mapped = (this->page + bytes.size() + this->page - 1) / this->page * this->page;
+            this->base = (uint8_t *) mmap(nullptr, this->mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            mprotect(this->base + this->mapped - this->page, this->page, PROT_NONE);
+            this->data = this->base + this->mapped - this->page - bytes.size();
+            std::copy(bytes.begin(), bytes.end(), this->data);
+        }
+        ~GuardedRow() { munmap(this->base, this->mapped); }
+        uint8_t *data;
+
+    private:
+        uint8_t *base;
+        size_t page, mapped;
+};
+
+static std::vector<uint16_t> randomSamples(uint width, uint bits, uint seed) {
+    std::mt19937 rng(seed);
+    std::vector<uint16_t> samples(width);
+    for (auto &s : samples)
+        s = (uint16_t) (rng() & ((1u << bits) - 1));
+    return samples;
+}
+
+TEST(RawUnpack, ReferenceFollowsPacking) {
+    for (uint bits : { 10u, 12u }) {
+        auto samples = randomSamples(37, bits, bits);
+        auto packed = packCsi2(samples, bits);
+        std::vector<uint16_t> out16(37);
+        std::vector<uint8_t> out8(37);
+        if (bits == 10) {
+            raw_reference::unpackRaw10Row16(packed.data(), out16.data(), 37);
+            raw_reference::unpackRaw10Row8(packed.data(), out8.data(), 37);
+        } else {
+            raw_reference::unpackRaw12Row16(packed.data(), out16.data(), 37);
+            raw_reference::unpackRaw12Row8(packed.data(), out8.data(), 37);
+        }
+        for (uint x = 0; x < 37; x++) {
+            ASSERT_EQ(out16[x], samples[x] << (16 - bits)) << bits << "-bit at " << x;
+            ASSERT_EQ(out8[x], samples[x] >> (bits - 8)) << bits << "-bit at " << x;
+        }
+    }
+}
+
+typedef void (*Row16Fn)(const uint8_t *, uint16_t *, uint);
+typedef void (*Row8Fn)(const uint8_t *, uint8_t *, uint);
+
+static void checkRows(uint bits, Row16Fn simd16, Row16Fn ref16, Row8Fn simd8, Row8Fn ref8) {
+    for (uint width = 1; width <= 100; width++) {
+        SCOPED_TRACE(::testing::Message() << bits << "-bit, width " << width);
+        GuardedRow src(packCsi2(randomSamples(width, bits, width), bits));
+
+        // one sentinel past the row, the tail must not write beyond width
+        std::vector<uint16_t> out16(width + 1, 0xbeef), expected16(width + 1, 0xbeef);
+        simd16(src.data, out16.data(), width);
+        ref16(src.data, expected16.data(), width);
+        ASSERT_EQ(out16, expected16);
+
+        std::vector<uint8_t> out8(width + 1, 0xa5), expected8(width + 1, 0xa5);
+        simd8(src.data, out8.data(), width);
+        ref8(src.data, expected8.data(), width);
+        ASSERT_EQ(out8, expected8);
+    }
+}
+
+TEST(RawUnpack, Raw10MatchesReference) {
+    checkRows(10, &unpackRaw10Row16, &raw_reference::unpackRaw10Row16, &unpackRaw10Row8, &raw_reference::unpackRaw10Row8);
+}
+
+TEST(RawUnpack, Raw12MatchesReference) {
+    checkRows(12, &unpackRaw12Row16, &raw_reference::unpackRaw12Row16, &unpackRaw12Row8, &raw_reference::unpackRaw12Row8);
+}
+
+TEST(RawUnpack, FrameWithStride) {
+    const uint width = 4056 / 8 + 3, height = 5; // odd tail
+    for (uint bits : { 10u, 12u }) {
+        RawFormat format = parseRawFormat(bits == 10 ? "SRGGB10_CSI2P" : "SBGGR12_CSI2P");
+        ASSERT_TRUE(format.supported());
+        std::vector<std::vector<uint16_t>> rows;
+        std::vector<uint8_t> src;
+        uint stride = 0;
+        for (uint y = 0; y < height; y++) {
+            rows.push_back(randomSamples(width, bits, y + bits));
+            auto packed = packCsi2(rows.back(), bits);
+            stride = (packed.size() + 31) & ~31u;
+            packed.resize(stride, 0xff);
+            src.insert(src.end(), packed.begin(), packed.end());
+        }
+        std::vector<uint16_t> dst(width * height);
+        ASSERT_TRUE(unpackRawFrame(format, true, src.data(), stride, width, height, (uint8_t *) dst.data(), width * 2));
+        for (uint y = 0; y < height; y++)
+            for (uint x = 0; x < width; x++)
+                ASSERT_EQ(dst[y * width + x], rows[y][x] << (16 - bits)) << bits << "-bit at " << x << "," << y;
+    }
+}
+
+TEST(RawUnpack, PlainSixteenBit) {
+    RawFormat format = parseRawFormat("SGRBG16");
+    ASSERT_TRUE(format.supported());
+    EXPECT_FALSE(format.csi2_packed);
+    EXPECT_EQ(format.bits, 16u);
+    std::vector<uint16_t> src = { 0x1234, 0xfedc, 0x0001 };
+    std::vector<uint16_t> out16(3);
+    std::vector<uint8_t> out8(3);
+    ASSERT_TRUE(unpackRawFrame(format, true, (const uint8_t *) src.data(), 6, 3, 1, (uint8_t *) out16.data(), 6));
+    ASSERT_TRUE(unpackRawFrame(format, false, (const uint8_t *) src.data(), 6, 3, 1, out8.data(), 3));
+    EXPECT_EQ(out16, src);
+    EXPECT_EQ(out8, (std::vector<uint8_t> { 0x12, 0xfe, 0x00 }));
+}
+
+TEST(RawUnpack, ParseFormats) {
+    RawFormat packed = parseRawFormat("SRGGB10_CSI2P");
+    EXPECT_EQ(packed.order, "RGGB");
+    EXPECT_EQ(packed.bits, 10u);
+    EXPECT_TRUE(packed.csi2_packed);
+    EXPECT_EQ(packed.encoding(true), "bayer_rggb16");
+    EXPECT_EQ(packed.encoding(false), "bayer_rggb8");
+
+    RawFormat compressed = parseRawFormat("RGGB_PISP_COMP1");
+    EXPECT_TRUE(compressed.compressed);
+    EXPECT_FALSE(compressed.supported());
+    EXPECT_FALSE(parseRawFormat("YUV420").supported());
+    EXPECT_FALSE(parseRawFormat("SRGGB14_CSI2P").supported());
+}
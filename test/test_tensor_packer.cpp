@@ -0,0 +1,311 @@
+// Tensor packing: the row kernels against the scalar reference over odd widths, the half
+// conversion against the compiler's, and whole tensors against an independent double
+// precision resample + convert, across layouts, element types and letterboxing
+
+#include <cmath>
+#include <cstring>
+#include <gtest/gtest.h>
+#include <random>
+#include <vector>
+
+#include "picam_ros2/tensor_packer.hpp"
+
+// Padded strides like the capture buffers (64B aligned), U and V strides differ to catch
+// a mixup; the padding is garbage that must never be sampled
+struct TestFrame {
+    uint width, height, y_stride, u_stride, v_stride;
+    std::vector<uint8_t> y, u, v;
+
+    TestFrame(uint width, uint height, uint seed)
+        : width(width), height(height), y_stride((width + 63) & ~63u), u_stride((((width + 1) / 2) + 31) & ~31u), v_stride(u_stride + 32) {
+        std::mt19937 rng(seed);
+        std::uniform_int_distribution<int> sample(0, 255);
+        const uint c_width = (width + 1) / 2, c_height = (height + 1) / 2;
+        y.resize((size_t) y_stride * height);
+        u.resize((size_t) u_stride * c_height);
+        v.resize((size_t) v_stride * c_height);
+        auto fill = [&](std::vector<uint8_t> &plane, uint stride, uint w) {
+            for (size_t i = 0; i < plane.size(); i++)
+                plane[i] = i % stride < w ? (uint8_t) sample(rng) : (uint8_t) (i % 2 ? 0 : 255);
+        };
+        fill(y, y_stride, width);
+        fill(u, u_stride, c_width);
+        fill(v, v_stride, c_width);
+    }
+
+    picam_conv::YuvPlanes planes() const {
+        return { this->y.data(), this->u.data(), this->v.data(), this->y_stride, this->u_stride, this->v_stride, this->width, this->height };
+    }
+};
+
+// Bilinear sample of a plane at output index i of dst_size, pixel centers aligned
+static double sampleAxis(uint i, uint dst_size, uint src_size, uint &i0, uint &i1) {
+    double s = std::clamp((i + 0.5) * src_size / dst_size - 0.5, 0.0, (double) src_size - 1.0);
+    i0 = (uint) s;
+    i1 = std::min(i0 + 1, src_size - 1);
+    return s - i0;
+}
+
+static double samplePlane(const uint8_t *plane, uint stride, uint w, uint h, uint x, uint y, uint dst_w, uint dst_h) {
+    uint x0, x1, y0, y1;
+    double fx = sampleAxis(x, dst_w, w, x0, x1);
+    double fy = sampleAxis(y, dst_h, h, y0, y1);
+    double top = plane[y0 * stride + x0] * (1 - fx) + plane[y0 * stride + x1] * fx;
+    double bottom = plane[y1 * stride + x0] * (1 - fx) + plane[y1 * stride + x1] * fx;
+    return top * (1 - fy) + bottom * fy;
+}
+
+// Expected normalized RGB of one content pixel, full range BT.601, before quantization
+static void expectedPixel(const TestFrame &f, const TensorSpec &spec, uint cw, uint ch, uint x, uint y, double out[3]) {
+    const uint c_w = (f.width + 1) / 2, c_h = (f.height + 1) / 2;
+    double luma = samplePlane(f.y.data(), f.y_stride, f.width, f.height, x, y, cw, ch);
+    double cb = samplePlane(f.u.data(), f.u_stride, c_w, c_h, x, y, cw, ch) - 128.0;
+    double cr = samplePlane(f.v.data(), f.v_stride, c_w, c_h, x, y, cw, ch) - 128.0;
+    const double kr = 0.299, kb = 0.114, kg = 1.0 - kr - kb;
+    double rgb[3] = {
+        luma + 2.0 * (1.0 - kr) * cr,
+        luma - 2.0 * (1.0 - kb) * kb / kg * cb - 2.0 * (1.0 - kr) * kr / kg * cr,
+        luma + 2.0 * (1.0 - kb) * cb,
+    };
+    for (uint c = 0; c < 3; c++) {
+        uint source = spec.bgr ? 2 - c : c;
+        double value = std::clamp(rgb[source], 0.0, 255.0) / 255.0;
+        out[c] = (value - spec.mean[source]) / spec.std[source];
+    }
+}
+
+static std::vector<float> randomFloats(size_t count, float lo, float hi, uint seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> dist(lo, hi);
+    std::vector<float> values(count);
+    for (auto &v : values) v = dist(rng);
+    return values;
+}
+
+TEST(TensorKernels, NormalizeRowMatchesReference) {
+    TensorRowCoeffs k = { 16.0f, 255.0f / 219.0f, { 0.0f, -0.39f, 2.02f }, { 1.6f, -0.81f, 0.0f },
+                          { 1.0f / 255.0f, 0.5f, 2.0f }, { -0.4f, 3.0f, -7.0f } };
+    for (uint width = 1; width <= 37; width++) {
+        auto y = randomFloats(width, 0.0f, 255.0f, width);
+        auto u = randomFloats(width, 0.0f, 255.0f, width + 100);
+        auto v = randomFloats(width, 0.0f, 255.0f, width + 200);
+        std::vector<float> got[3], want[3];
+        for (uint c = 0; c < 3; c++) {
+            got[c].assign(width + 1, -1.0f);
+            want[c].assign(width + 1, -1.0f);
+        }
+        tensorNormalizeRow(y.data(), u.data(), v.data(), width, k, got[0].data(), got[1].data(), got[2].data());
+        tensor_reference::tensorNormalizeRow(y.data(), u.data(), v.data(), width, k, want[0].data(), want[1].data(), want[2].data());
+        for (uint c = 0; c < 3; c++) {
+            for (uint x = 0; x < width; x++)
+                ASSERT_NEAR(got[c][x], want[c][x], 1e-4f * (1.0f + std::fabs(want[c][x]))) << "width " << width << " c " << c << " x " << x;
+            ASSERT_EQ(got[c][width], -1.0f) << "wrote past width " << width;
+        }
+    }
+}
+
+TEST(TensorKernels, InterleaveMatchesReference) {
+    for (uint width = 1; width <= 37; width++) {
+        auto c0 = randomFloats(width, -1.0f, 1.0f, width);
+        auto c1 = randomFloats(width, -1.0f, 1.0f, width + 1);
+        auto c2 = randomFloats(width, -1.0f, 1.0f, width + 2);
+        std::vector<float> got(width * 3 + 1, 9.0f), want(width * 3 + 1, 9.0f);
+        interleave3Row(c0.data(), c1.data(), c2.data(), got.data(), width);
+        tensor_reference::interleave3Row(c0.data(), c1.data(), c2.data(), want.data(), width);
+        ASSERT_EQ(got, want) << "width " << width;
+    }
+}
+
+TEST(TensorKernels, HalfMatchesCompilerConversion) {
+    std::vector<float> values = { 0.0f, -0.0f, 1.0f, -1.0f, 0.1f, 65504.0f, 65519.0f, 65520.0f, 1e6f, -1e6f,
+                                  6.1035156e-05f, 6.0e-05f, 5.9604645e-08f, 2.9802322e-08f, 2.98e-08f, 1e-9f,
+                                  INFINITY, -INFINITY, 1.00048828125f, 1.00146484375f, 2049.0f, 2051.0f };
+    auto random = randomFloats(4096, -70000.0f, 70000.0f, 1);
+    values.insert(values.end(), random.begin(), random.end());
+    auto small = randomFloats(4096, -1e-4f, 1e-4f, 2);
+    values.insert(values.end(), small.begin(), small.end());
+
+    for (float value : values) {
+        _Float16 h = (_Float16) value;
+        uint16_t want;
+        memcpy(&want, &h, sizeof(want));
+        ASSERT_EQ(tensor_reference::floatToHalf(value), want) << value;
+    }
+    EXPECT_EQ(tensor_reference::floatToHalf(NAN) & 0x7e00, 0x7e00);
+
+    for (uint count = 1; count <= 37; count++) {
+        auto src = randomFloats(count, -300.0f, 300.0f, count);
+        std::vector<uint16_t> got(count + 1, 0xdead), want(count + 1, 0xdead);
+        floatToHalfRow(src.data(), got.data(), count);
+        tensor_reference::floatToHalfRow(src.data(), want.data(), count);
+        ASSERT_EQ(got, want) << "count " << count;
+    }
+}
+
+TEST(TensorKernels, SaturateMatchesReference) {
+    std::vector<float> edges = { -1000.0f, -128.5f, -127.5f, -0.5f, 0.5f, 1.5f, 2.5f, 126.5f, 127.5f, 254.5f, 255.5f, 1000.0f };
+    for (uint count = 1; count <= 37; count++) {
+        auto src = randomFloats(count, -300.0f, 300.0f, count);
+        for (uint i = 0; i < count && i < edges.size(); i++)
+            src[i] = edges[i];
+        std::vector<int8_t> s_got(count + 1, 42), s_want(count + 1, 42);
+        std::vector<uint8_t> u_got(count + 1, 42), u_want(count + 1, 42);
+        saturateRowS8(src.data(), s_got.data(), count);
+        tensor_reference::saturateRowS8(src.data(), s_want.data(), count);
+        saturateRowU8(src.data(), u_got.data(), count);
+        tensor_reference::saturateRowU8(src.data(), u_want.data(), count);
+        ASSERT_EQ(s_got, s_want) << "count " << count;
+        ASSERT_EQ(u_got, u_want) << "count " << count;
+    }
+    // round half to even, saturated
+    float halves[] = { 0.5f, 1.5f, 2.5f, -0.5f, -1.5f, 200.0f, -200.0f };
+    int8_t s[7];
+    uint8_t u[7];
+    tensor_reference::saturateRowS8(halves, s, 7);
+    tensor_reference::saturateRowU8(halves, u, 7);
+    EXPECT_EQ(std::vector<int>(s, s + 7), (std::vector<int> { 0, 2, 2, 0, -2, 127, -128 }));
+    EXPECT_EQ(std::vector<int>(u, u + 7), (std::vector<int> { 0, 2, 2, 0, 0, 200, 0 }));
+}
+
+TEST(TensorPacker, LetterboxGeometry) {
+    TensorPacker packer;
+    TensorSpec spec;
+    packer.configure(spec, 1280, 720, COLOR_MATRIX::BT601_LIMITED);
+    EXPECT_EQ(packer.offsetX(), 0u);
+    EXPECT_EQ(packer.offsetY(), 140u);
+    EXPECT_FLOAT_EQ(packer.scaleX(), 0.5f);
+    EXPECT_FLOAT_EQ(packer.scaleY(), 0.5f);
+    EXPECT_EQ(packer.size(), 640u * 640u * 3u * 4u);
+
+    spec.letterbox = false;
+    spec.dtype = TENSOR_DTYPE::FLOAT16;
+    packer.configure(spec, 1280, 720, COLOR_MATRIX::BT601_LIMITED);
+    EXPECT_EQ(packer.offsetY(), 0u);
+    EXPECT_FLOAT_EQ(packer.scaleY(), 640.0f / 720.0f);
+    EXPECT_EQ(packer.size(), 640u * 640u * 3u * 2u);
+}
+
+// Packs a frame as float32 NCHW and checks every element against the double precision reference
+static void checkFloatTensor(uint src_w, uint src_h, const TensorSpec &spec) {
+    TestFrame frame(src_w, src_h, src_w * 31 + src_h);
+    TensorPacker packer;
+    packer.configure(spec, src_w, src_h, COLOR_MATRIX::BT601_FULL);
+    std::vector<uint8_t> bytes(packer.size());
+    packer.fillPadding(bytes.data());
+    packer.pack(frame.planes(), bytes.data());
+    const float *tensor = reinterpret_cast<const float *>(bytes.data());
+
+    const uint cw = (uint) std::lround(packer.scaleX() * src_w), ch = (uint) std::lround(packer.scaleY() * src_h);
+    const uint ox = packer.offsetX(), oy = packer.offsetY();
+    const size_t plane = (size_t) spec.width * spec.height;
+    for (uint y = 0; y < spec.height; y++) {
+        for (uint x = 0; x < spec.width; x++) {
+            double want[3];
+            bool content = x >= ox && x < ox + cw && y >= oy && y < oy + ch;
+            if (content) {
+                expectedPixel(frame, spec, cw, ch, x - ox, y - oy, want);
+            } else {
+                for (uint c = 0; c < 3; c++) {
+                    uint source = spec.bgr ? 2 - c : c;
+                    want[c] = (spec.pad / 255.0 - spec.mean[source]) / spec.std[source];
+                }
+            }
+            for (uint c = 0; c < 3; c++) {
+                ASSERT_NEAR(tensor[c * plane + (size_t) y * spec.width + x], want[c], 2e-3 / spec.std[spec.bgr ? 2 - c : c])
+                    << src_w << "x" << src_h << " at " << x << "," << y << " c " << c << (content ? " content" : " pad");
+            }
+        }
+    }
+}
+
+TEST(TensorPacker, Float32MatchesReference) {
+    TensorSpec spec;
+    spec.width = 64;
+    spec.height = 48;
+    checkFloatTensor(64, 48, spec); // same size, chroma upsampled
+    checkFloatTensor(160, 90, spec); // letterboxed top and bottom
+    checkFloatTensor(37, 61, spec); // odd source, bars left and right
+
+    spec.letterbox = false;
+    spec.bgr = true;
+    spec.mean[0] = 0.485f; spec.mean[1] = 0.456f; spec.mean[2] = 0.406f;
+    spec.std[0] = 0.229f; spec.std[1] = 0.224f; spec.std[2] = 0.225f;
+    checkFloatTensor(99, 51, spec);
+}
+
+// Every layout and element type is the float32 NCHW tensor permuted, converted or quantized
+TEST(TensorPacker, LayoutsAndTypesAgree) {
+    TestFrame frame(123, 77, 5);
+    TensorSpec spec;
+    spec.width = 48;
+    spec.height = 40;
+    spec.quant_scale = 1.0f / 127.0f;
+    spec.quant_zero_point = -3;
+
+    TensorPacker packer;
+    packer.configure(spec, frame.width, frame.height, COLOR_MATRIX::BT709_LIMITED);
+    std::vector<uint8_t> base(packer.size());
+    packer.fillPadding(base.data());
+    packer.pack(frame.planes(), base.data());
+    const float *ref = reinterpret_cast<const float *>(base.data());
+    const size_t plane = (size_t) spec.width * spec.height;
+
+    for (uint layout : { TENSOR_LAYOUT::NCHW, TENSOR_LAYOUT::NHWC }) {
+        for (uint dtype : { TENSOR_DTYPE::FLOAT32, TENSOR_DTYPE::FLOAT16, TENSOR_DTYPE::INT8, TENSOR_DTYPE::UINT8 }) {
+            spec.layout = layout;
+            spec.dtype = dtype;
+            packer.configure(spec, frame.width, frame.height, COLOR_MATRIX::BT709_LIMITED);
+            std::vector<uint8_t> out(packer.size(), 0xcd);
+            packer.fillPadding(out.data());
+            packer.pack(frame.planes(), out.data());
+
+            for (size_t p = 0; p < plane; p++) {
+                for (uint c = 0; c < 3; c++) {
+                    const float value = ref[c * plane + p];
+                    const size_t i = layout == TENSOR_LAYOUT::NCHW ? c * plane + p : p * 3 + c;
+                    const float q = value / spec.quant_scale + spec.quant_zero_point;
+                    switch (dtype) {
+                        case TENSOR_DTYPE::FLOAT32: {
+                            float got;
+                            memcpy(&got, out.data() + i * 4, 4);
+                            ASSERT_FLOAT_EQ(got, value) << "layout " << layout << " at " << p;
+                            break;
+                        }
+                        case TENSOR_DTYPE::FLOAT16: {
+                            uint16_t got;
+                            memcpy(&got, out.data() + i * 2, 2);
+                            ASSERT_EQ(got, tensor_reference::floatToHalf(value)) << "layout " << layout << " at " << p;
+                            break;
+                        }
+                        case TENSOR_DTYPE::INT8:
+                            ASSERT_NEAR((int8_t) out[i], std::clamp(std::nearbyint(q), -128.0f, 127.0f), 1.0f) << "layout " << layout << " at " << p;
+                            break;
+                        default:
+                            ASSERT_NEAR(out[i], std::clamp(std::nearbyint(q), 0.0f, 255.0f), 1.0f) << "layout " << layout << " at " << p;
+                            break;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// The content area of a letterboxed tensor is untouched by fillPadding, so it can run once
+TEST(TensorPacker, PaddingLeavesContent) {
+    TensorSpec spec;
+    spec.width = 32;
+    spec.height = 32;
+    spec.dtype = TENSOR_DTYPE::UINT8;
+    spec.layout = TENSOR_LAYOUT::NHWC;
+    spec.quant_scale = 1.0f / 255.0f;
+
+    TensorPacker packer;
+    packer.configure(spec, 64, 32, COLOR_MATRIX::BT601_FULL);
+    std::vector<uint8_t> out(packer.size(), 0xcd);
+    packer.fillPadding(out.data());
+    for (uint y = 0; y < spec.height; y++) {
+        bool bar = y < packer.offsetY() || y >= packer.offsetY() + 16;
+        for (uint x = 0; x < spec.width * 3; x++)
+            ASSERT_EQ(out[y * spec.width * 3 + x], bar ? spec.pad : 0xcd) << x << "," << y;
+    }
+}
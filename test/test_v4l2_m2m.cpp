@@ -0,0 +1,153 @@
+// V4L2 M2M encoding: codec lookup, non encoders rejected, and EncoderHW driving the kernel's
+// virtual codec (dma-buf frames in, packets with their timestamps and pts out, frames released,
+// the last packets drained on destruction). Without hardware: sudo modprobe vicodec multiplanar=1.
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <linux/dma-heap.h>
+#include <linux/videodev2.h>
+#include <mutex>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+
+#include "picam_ros2/encoder_hw.hpp"
+#include "picam_ros2/v4l2_m2m.hpp"
+
+TEST(V4L2M2M, FindsCodecsByName) {
+    const V4L2Codec *h264 = findV4L2Codec("h264");
+    ASSERT_NE(h264, nullptr);
+    EXPECT_EQ(h264->pixel_format, (uint32_t) V4L2_PIX_FMT_H264);
+    EXPECT_EQ(h264->encoding, "h.264");
+    EXPECT_TRUE(h264->inline_headers);
+    ASSERT_NE(findV4L2Codec("hevc"), nullptr);
+    EXPECT_EQ(findV4L2Codec("hevc")->pixel_format, (uint32_t) V4L2_PIX_FMT_HEVC);
+    ASSERT_NE(findV4L2Codec("fwht"), nullptr);
+    EXPECT_EQ(findV4L2Codec("fwht")->pixel_format, (uint32_t) V4L2_PIX_FMT_FWHT);
+    EXPECT_EQ(findV4L2Codec("H264"), nullptr);
+    EXPECT_EQ(findV4L2Codec(""), nullptr);
+}
+
+TEST(V4L2M2M, RejectsOtherDevices) {
+    std::string opened = "unchanged";
+    EXPECT_EQ(openEncoderDevice("/dev/null", V4L2_PIX_FMT_H264, opened), -1);
+    EXPECT_EQ(openEncoderDevice("/dev/does-not-exist", V4L2_PIX_FMT_H264, opened), -1);
+    EXPECT_EQ(opened, "unchanged");
+}
+
+// -1 without a heap to allocate from
+static int allocDmaBuf(size_t size) {
+    int heap = open("/dev/dma_heap/system", O_RDWR | O_CLOEXEC);
+    if (heap < 0)
+        return -1;
+    dma_heap_allocation_data alloc = {};
+    alloc.len = size;
+    alloc.fd_flags = O_RDWR | O_CLOEXEC;
+    int ret = ioctl(heap, DMA_HEAP_IOCTL_ALLOC, &alloc);
+    close(heap);
+    return ret < 0 ? -1 : (int) alloc.fd;
+}
+
+struct Packet {
+    std::vector<uint8_t> data;
+    bool keyframe;
+    uint64_t pts;
+    long timestamp_ns;
+};
+
+TEST(EncoderHW, EncodesFramesWithVicodec) {
+    const uint width = 640, height = 480, size = width * height * 3 / 2, frames = 4;
+    std::string device;
+    int probe = openEncoderDevice("", V4L2_PIX_FMT_FWHT, device);
+    if (probe < 0)
+        GTEST_SKIP() << "no FWHT encoder, load vicodec with multiplanar=1";
+    close(probe);
+    int frame_fd = allocDmaBuf(size);
+    if (frame_fd < 0)
+        GTEST_SKIP() << "no /dev/dma_heap/system to allocate the frames from";
+
+    // a gradient in Y, grey chroma, wrapped the way capture buffers are
+    uint8_t *memory = (uint8_t *) mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, frame_fd, 0);
+    ASSERT_NE(memory, MAP_FAILED);
+    for (uint y = 0; y < height; y++)
+        for (uint x = 0; x < width; x++)
+            memory[y * width + x] = (uint8_t) (x + y);
+    memset(memory + width * height, 128, width * height / 2);
+    libcamera::FrameBuffer::Plane plane;
+    plane.fd = libcamera::SharedFD(libcamera::UniqueFD(frame_fd));
+    plane.offset = 0;
+    plane.length = size;
+    libcamera::FrameBuffer buffer({ plane });
+    MappedBuffer mapped;
+    mapped.memory = memory;
+    mapped.size = size;
+
+    std::mutex mutex;
+    std::vector<Packet> packets;
+    std::vector<std::string> errors;
+    std::atomic<uint> released { 0 };
+    auto on_output = [&](unsigned char *data, int size, bool keyframe, uint64_t pts, long timestamp_ns, bool) {
+        std::lock_guard<std::mutex> lock(mutex);
+        packets.push_back({ std::vector<uint8_t>(data, data + size), keyframe, pts, timestamp_ns });
+    };
+    auto on_log = [&](bool error, const std::string &message) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (error)
+            errors.push_back(message);
+    };
+    auto packetCount = [&]() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return packets.size();
+    };
+
+    EncoderOptions options;
+    options.fps = 30;
+    options.buffer_count = 2;
+    options.hw_encoder_device = device;
+    options.hw_encoder_codec = "fwht";
+    long timestamps[frames];
+    {
+        EncoderHW encoder(options, on_output, on_log, width, height);
+        EXPECT_EQ(encoder.encoding(), findV4L2Codec("fwht")->encoding);
+        EXPECT_FALSE(encoder.readsFromCpu());
+
+        int64_t frame_idx = 1;
+        for (uint i = 0; i < frames; i++) {
+            timestamps[i] = 12345678000L + i * 33333000L; // distinct in us, which the encoder matches by
+            auto frame = std::make_shared<FrameHandle>(nullptr, &buffer, &mapped, timestamps[i],
+                                                       [&](libcamera::Request *) { released++; });
+            encoder.encode(frame, &frame_idx, timestamps[i], false);
+            frame.reset();
+            if (i + 1 == frames)
+                break; // the last one is left to the drain
+
+            // the input buffer comes back for the next frame
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+            while ((packetCount() <= i || released <= i) && std::chrono::steady_clock::now() < deadline)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            ASSERT_EQ(packetCount(), i + 1) << "no packet for frame " << i << " from " << device;
+            ASSERT_EQ(released, i + 1) << "frame " << i << " still held by the encoder";
+        }
+    }
+
+    EXPECT_EQ(released, frames);
+    EXPECT_TRUE(errors.empty()) << errors.front();
+    ASSERT_EQ(packets.size(), frames) << "the last frame was not drained";
+    for (uint i = 0; i < frames; i++) {
+        SCOPED_TRACE("packet " + std::to_string(i));
+        EXPECT_EQ(packets[i].timestamp_ns, timestamps[i]);
+        EXPECT_EQ(packets[i].pts, (i + 1) * 90000u / options.fps);
+        ASSERT_GT(packets[i].data.size(), 8u);
+        EXPECT_LT(packets[i].data.size(), size); // compressed
+        uint32_t magic;
+        memcpy(&magic, packets[i].data.data(), sizeof(magic));
+        EXPECT_EQ(magic, 0x4f4f4f4fu); // FWHT_MAGIC1 of the frame header
+    }
+    EXPECT_TRUE(packets[0].keyframe);
+
+    munmap(memory, size);
+}